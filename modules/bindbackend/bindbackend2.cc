@@ -492,6 +492,14 @@ void Bind2Backend::insertRecord(BB2DomainInfo& bb2, const DNSName &qname, const
   bdr.qtype=qtype.getCode();
   bdr.content=content; 
   bdr.nsec3hash = hashed;
+
+  if(bdr.qtype) { // not for empty non-terminals
+    DNSResourceRecord rr;
+    rr.qtype=bdr.qtype;
+    rr.content=content;
+    if(rr.parseContent())
+      bdr.parsed=rr.parsed;
+  }
   
   if (auth) // Set auth on empty non-terminals
     bdr.auth=*auth;
@@ -1170,6 +1178,7 @@ bool Bind2Backend::handle::get_normal(DNSResourceRecord &r)
   r.qname=qname.empty() ? domain : (qname+domain);
   r.domain_id=id;
   r.content=(d_iter)->content;
+  r.parsed=(d_iter)->parsed;
   //  r.domain_id=(d_iter)->domain_id;
   r.qtype=(d_iter)->qtype;
   r.ttl=(d_iter)->ttl;
@@ -1202,12 +1211,19 @@ bool Bind2Backend::list(const DNSName& target, int id, bool include_disabled)
   return true;
 }
 
+// our records are kept in canonical order already
+bool Bind2Backend::listCanonical(const DNSName& target, int id)
+{
+  return list(target, id);
+}
+
 bool Bind2Backend::handle::get_list(DNSResourceRecord &r)
 {
   if(d_qname_iter!=d_qname_end) {
     r.qname=d_qname_iter->qname.empty() ? domain : (d_qname_iter->qname+domain);
     r.domain_id=id;
     r.content=(d_qname_iter)->content;
+    r.parsed=(d_qname_iter)->parsed;
     r.qtype=(d_qname_iter)->qtype;
     r.ttl=(d_qname_iter)->ttl;
     r.auth = d_qname_iter->auth;
@@ -57,6 +57,7 @@ struct Bind2DNSRecord
 {
   DNSName qname;
   string content;
+  shared_ptr<const DNSResourceRecord::ParsedContent> parsed; //!< content, parsed once at load time
   string nsec3hash;
   uint32_t ttl;
   uint16_t qtype;
@@ -191,6 +192,7 @@ public:
   virtual bool getBeforeAndAfterNamesAbsolute(uint32_t id, const string& qname, DNSName& unhashed, string& before, string& after);
   void lookup(const QType &, const DNSName &qdomain, DNSPacket *p=0, int zoneId=-1);
   bool list(const DNSName &target, int id, bool include_disabled=false);
+  bool listCanonical(const DNSName &target, int id);
   bool get(DNSResourceRecord &);
   void getAllDomains(vector<DomainInfo> *domains, bool include_disabled=false);
 
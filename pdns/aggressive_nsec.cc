@@ -0,0 +1,341 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "aggressive_nsec.hh"
+#include "base32.hh"
+#include "cachecleaner.hh"
+#include "dnssecinfra.hh"
+#include "misc.hh"
+
+static DNSName getCommonAncestor(const DNSName& a, const DNSName& b)
+{
+  DNSName ret(a);
+  while(!b.isPartOf(ret) && ret.chopOff())
+    ;
+  return ret;
+}
+
+static void addProof(uint32_t now, uint32_t ttd, const DNSRecord& record, const vector<DNSRecord>& signatures, vector<DNSRecord>& proof)
+{
+  DNSRecord dr(record);
+  dr.d_ttl = ttd - now;
+  dr.d_place = DNSResourceRecord::AUTHORITY;
+  proof.push_back(dr);
+  for(const auto& signature : signatures) {
+    dr = signature;
+    dr.d_ttl = ttd - now;
+    dr.d_place = DNSResourceRecord::AUTHORITY;
+    proof.push_back(dr);
+  }
+}
+
+/* QTYPEs and meta types (RFC 6895 section 3.1) never appear in a type bitmap, nor do our own ADDR and ALIAS */
+static bool isMetaType(uint16_t qtype)
+{
+  return (qtype >= 128 && qtype <= 255) || qtype == QType::OPT || qtype == QType::ADDR || qtype == QType::ALIAS;
+}
+
+/* what an NSEC or NSEC3 matching the name says about qtype, if anything */
+static bool deniesType(const std::set<uint16_t>& types, const QType& qtype)
+{
+  // the name exists, so whatever ANY or ADDR would match has to come from the record cache
+  if(isMetaType(qtype.getCode()))
+    return false;
+  if(types.count(qtype.getCode()) || types.count(QType::CNAME))
+    return false;
+  // the parent side of a delegation, only authoritative for the DS
+  if(qtype.getCode() != QType::DS && types.count(QType::NS) && !types.count(QType::SOA))
+    return false;
+  return true;
+}
+
+/* true if names below the owner are not part of this zone, or are redirected */
+static bool isCut(const std::set<uint16_t>& types)
+{
+  return types.count(QType::DNAME) || (types.count(QType::NS) && !types.count(QType::SOA));
+}
+
+void AggressiveNSECCache::insert(const DNSName& zone, const DNSRecord& record, const vector<DNSRecord>& signatures, uint32_t ttd)
+{
+  if(!record.d_name.isPartOf(zone))
+    return;
+
+  if(record.d_type == QType::NSEC) {
+    auto content = getRR<NSECRecordContent>(record);
+    if(!content || !content->d_next.isPartOf(zone))
+      return;
+
+    NSECEntry entry;
+    entry.d_zone = zone;
+    entry.d_owner = record.d_name;
+    entry.d_nsec = content;
+    entry.d_record = record;
+    entry.d_signatures = signatures;
+    entry.d_ttd = ttd;
+    auto pos = replacing_insert(d_nsec, entry).first;
+    moveCacheItemToBack(d_nsec, pos);
+  }
+  else if(record.d_type == QType::NSEC3) {
+    auto content = getRR<NSEC3RecordContent>(record);
+    if(!content || content->d_algorithm != 1)
+      return;
+
+    // the owner is the base32hex encoded hash, right below the apex
+    DNSName apex(record.d_name);
+    if(!apex.chopOff() || apex != zone)
+      return;
+    string hash = fromBase32Hex(record.d_name.getRawLabels()[0]);
+    if(hash.empty() || hash.size() != content->d_nexthash.size())
+      return;
+
+    NSEC3Entry entry;
+    entry.d_zone = zone;
+    entry.d_hash = hash;
+    entry.d_nsec3 = content;
+    entry.d_record = record;
+    entry.d_signatures = signatures;
+    entry.d_ttd = ttd;
+    auto pos = replacing_insert(d_nsec3, entry).first;
+    moveCacheItemToBack(d_nsec3, pos);
+  }
+}
+
+bool AggressiveNSECCache::getDenial(time_t now, const DNSName& qname, const QType& qtype, int& res, DNSName& zone, uint32_t& ttd, vector<DNSRecord>& proof)
+{
+  if(d_nsec.empty() && d_nsec3.empty())
+    return false;
+
+  // the DS of a zone is denied by its parent
+  zone = qname;
+  if(qtype.getCode() == QType::DS && !zone.chopOff())
+    return false;
+
+  do {
+    auto nsec = d_nsec.lower_bound(boost::make_tuple(zone));
+    if(nsec != d_nsec.end() && nsec->d_zone == zone)
+      return getNSECDenial(now, zone, qname, qtype, res, ttd, proof);
+
+    auto nsec3 = d_nsec3.lower_bound(boost::make_tuple(zone));
+    if(nsec3 != d_nsec3.end() && nsec3->d_zone == zone)
+      return getNSEC3Denial(now, zone, qname, qtype, res, ttd, proof);
+  }
+  while(zone.chopOff());
+
+  return false;
+}
+
+/* the NSEC with the highest owner name not above name in canonical order, if it has not expired */
+AggressiveNSECCache::nsec_t::iterator AggressiveNSECCache::findNSEC(uint32_t now, const DNSName& zone, const DNSName& name)
+{
+  auto iter = d_nsec.upper_bound(boost::make_tuple(zone, name));
+  if(iter == d_nsec.begin())
+    return d_nsec.end();
+  --iter;
+  if(iter->d_zone != zone)
+    return d_nsec.end();
+  if(iter->d_ttd <= now) {
+    moveCacheItemToFront(d_nsec, iter);
+    return d_nsec.end();
+  }
+  return iter;
+}
+
+static bool nsecCovers(const DNSName& zone, const DNSName& owner, const DNSName& next, const DNSName& name)
+{
+  if(!owner.canonCompare(name))
+    return false;
+  // the last NSEC of the zone points back to the apex
+  return next == zone || name.canonCompare(next);
+}
+
+bool AggressiveNSECCache::getNSECDenial(uint32_t now, const DNSName& zone, const DNSName& qname, const QType& qtype, int& res, uint32_t& ttd, vector<DNSRecord>& proof)
+{
+  auto iter = findNSEC(now, zone, qname);
+  if(iter == d_nsec.end())
+    return false;
+
+  const auto& types = iter->d_nsec->d_set;
+  const DNSName& next = iter->d_nsec->d_next;
+
+  if(iter->d_owner == qname) {
+    if(!deniesType(types, qtype))
+      return false;
+    res = RCode::NoError;
+    ttd = iter->d_ttd;
+    addProof(now, ttd, iter->d_record, iter->d_signatures, proof);
+    moveCacheItemToBack(d_nsec, iter);
+    return true;
+  }
+
+  if(!nsecCovers(zone, iter->d_owner, next, qname))
+    return false;
+  if(qname.isPartOf(iter->d_owner) && isCut(types))
+    return false;
+
+  // names exist below qname, so it is an empty non-terminal
+  if(next.isPartOf(qname)) {
+    if(qtype.getCode() == QType::DS)
+      return false;
+    res = RCode::NoError;
+    ttd = iter->d_ttd;
+    addProof(now, ttd, iter->d_record, iter->d_signatures, proof);
+    moveCacheItemToBack(d_nsec, iter);
+    return true;
+  }
+
+  // the closest encloser is the longest name both qname and one of the ends of the NSEC are part of
+  DNSName closestEncloser = getCommonAncestor(qname, iter->d_owner);
+  DNSName other = getCommonAncestor(qname, next);
+  if(other.countLabels() > closestEncloser.countLabels())
+    closestEncloser = other;
+
+  DNSName wildcard = DNSName("*") + closestEncloser;
+  auto wcIter = findNSEC(now, zone, wildcard);
+  if(wcIter == d_nsec.end() || !nsecCovers(zone, wcIter->d_owner, wcIter->d_nsec->d_next, wildcard))
+    return false;
+
+  res = RCode::NXDomain;
+  ttd = std::min(iter->d_ttd, wcIter->d_ttd);
+  addProof(now, ttd, iter->d_record, iter->d_signatures, proof);
+  moveCacheItemToBack(d_nsec, iter);
+  if(wcIter != iter) {
+    addProof(now, ttd, wcIter->d_record, wcIter->d_signatures, proof);
+    moveCacheItemToBack(d_nsec, wcIter);
+  }
+  return true;
+}
+
+/* the NSEC3 with the highest hash not above hash, or the last one of the zone, which wraps around */
+AggressiveNSECCache::nsec3_t::iterator AggressiveNSECCache::findNSEC3(uint32_t now, const DNSName& zone, const std::string& hash)
+{
+  auto iter = d_nsec3.upper_bound(boost::make_tuple(zone, hash));
+  if(iter == d_nsec3.begin() || boost::prior(iter)->d_zone != zone)
+    iter = d_nsec3.upper_bound(boost::make_tuple(zone));
+  if(iter == d_nsec3.begin())
+    return d_nsec3.end();
+  --iter;
+  if(iter->d_zone != zone)
+    return d_nsec3.end();
+  if(iter->d_ttd <= now) {
+    moveCacheItemToFront(d_nsec3, iter);
+    return d_nsec3.end();
+  }
+  return iter;
+}
+
+static bool nsec3Covers(const std::string& owner, const std::string& next, const std::string& hash)
+{
+  if(owner < next)
+    return owner < hash && hash < next;
+  // the last NSEC3 of the chain
+  return hash > owner || hash < next;
+}
+
+bool AggressiveNSECCache::getNSEC3Denial(uint32_t now, const DNSName& zone, const DNSName& qname, const QType& qtype, int& res, uint32_t& ttd, vector<DNSRecord>& proof)
+{
+  auto first = d_nsec3.lower_bound(boost::make_tuple(zone));
+  NSEC3PARAMRecordContent params;
+  params.d_algorithm = 1;
+  params.d_iterations = first->d_nsec3->d_iterations;
+  params.d_salt = first->d_nsec3->d_salt;
+  if(params.d_iterations > s_maxNSEC3Iterations)
+    return false;
+
+  // entries left over from a previous chain of the zone hash names differently
+  auto sameChain = [&params](const NSEC3Entry& entry) {
+    return entry.d_nsec3->d_iterations == params.d_iterations && entry.d_nsec3->d_salt == params.d_salt;
+  };
+
+  string hash = hashQNameWithSalt(params, qname);
+  auto iter = findNSEC3(now, zone, hash);
+  if(iter == d_nsec3.end() || !sameChain(*iter))
+    return false;
+
+  if(iter->d_hash == hash) {
+    if(!deniesType(iter->d_nsec3->d_set, qtype))
+      return false;
+    res = RCode::NoError;
+    ttd = iter->d_ttd;
+    addProof(now, ttd, iter->d_record, iter->d_signatures, proof);
+    moveCacheItemToBack(d_nsec3, iter);
+    return true;
+  }
+
+  // closest encloser proof (RFC 5155 section 7.2.1): the longest existing ancestor of qname, and a denial of the next closer name
+  DNSName closestEncloser(qname), nextCloser(qname);
+  auto ceIter = d_nsec3.end();
+  while(closestEncloser.chopOff() && closestEncloser.isPartOf(zone)) {
+    hash = hashQNameWithSalt(params, closestEncloser);
+    auto candidate = findNSEC3(now, zone, hash);
+    if(candidate != d_nsec3.end() && candidate->d_hash == hash) {
+      ceIter = candidate;
+      break;
+    }
+    nextCloser = closestEncloser;
+  }
+  if(ceIter == d_nsec3.end() || !sameChain(*ceIter) || isCut(ceIter->d_nsec3->d_set))
+    return false;
+
+  hash = hashQNameWithSalt(params, nextCloser);
+  auto ncIter = findNSEC3(now, zone, hash);
+  // an opt-out range might hide an insecure delegation
+  if(ncIter == d_nsec3.end() || !sameChain(*ncIter) || !nsec3Covers(ncIter->d_hash, ncIter->d_nsec3->d_nexthash, hash) || (ncIter->d_nsec3->d_flags & 1))
+    return false;
+
+  hash = hashQNameWithSalt(params, DNSName("*") + closestEncloser);
+  auto wcIter = findNSEC3(now, zone, hash);
+  if(wcIter == d_nsec3.end() || !sameChain(*wcIter) || !nsec3Covers(wcIter->d_hash, wcIter->d_nsec3->d_nexthash, hash))
+    return false;
+
+  res = RCode::NXDomain;
+  ttd = std::min(ceIter->d_ttd, std::min(ncIter->d_ttd, wcIter->d_ttd));
+  addProof(now, ttd, ceIter->d_record, ceIter->d_signatures, proof);
+  moveCacheItemToBack(d_nsec3, ceIter);
+  if(ncIter != ceIter) {
+    addProof(now, ttd, ncIter->d_record, ncIter->d_signatures, proof);
+    moveCacheItemToBack(d_nsec3, ncIter);
+  }
+  if(wcIter != ceIter && wcIter != ncIter) {
+    addProof(now, ttd, wcIter->d_record, wcIter->d_signatures, proof);
+    moveCacheItemToBack(d_nsec3, wcIter);
+  }
+  return true;
+}
+
+void AggressiveNSECCache::prune(unsigned int maxEntries)
+{
+  // NSEC and NSEC3 zones share the budget
+  pruneCollection(d_nsec, maxEntries > d_nsec3.size() ? maxEntries - d_nsec3.size() : 0, 200);
+  pruneCollection(d_nsec3, maxEntries > d_nsec.size() ? maxEntries - d_nsec.size() : 0, 200);
+}
+
+uint64_t AggressiveNSECCache::wipe(const DNSName& name, bool subtree)
+{
+  uint64_t count = 0;
+  if(!subtree) {
+    auto range = d_nsec.equal_range(boost::make_tuple(name));
+    count += std::distance(range.first, range.second);
+    d_nsec.erase(range.first, range.second);
+    auto range3 = d_nsec3.equal_range(boost::make_tuple(name));
+    count += std::distance(range3.first, range3.second);
+    d_nsec3.erase(range3.first, range3.second);
+    return count;
+  }
+
+  for(auto iter = d_nsec.lower_bound(boost::make_tuple(name)); iter != d_nsec.end() && iter->d_zone.isPartOf(name); ++count)
+    d_nsec.erase(iter++);
+  for(auto iter = d_nsec3.lower_bound(boost::make_tuple(name)); iter != d_nsec3.end() && iter->d_zone.isPartOf(name); ++count)
+    d_nsec3.erase(iter++);
+  return count;
+}
+
+void AggressiveNSECCache::clear()
+{
+  d_nsec.clear();
+  d_nsec3.clear();
+}
+
+uint64_t AggressiveNSECCache::size() const
+{
+  return d_nsec.size() + d_nsec3.size();
+}
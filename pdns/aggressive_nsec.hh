@@ -0,0 +1,112 @@
+#ifndef PDNS_AGGRESSIVE_NSEC_HH
+#define PDNS_AGGRESSIVE_NSEC_HH
+#include <string>
+#include <vector>
+#include "dnsname.hh"
+#include "dnsparser.hh"
+#include "dnsrecords.hh"
+#include "qtype.hh"
+#include <boost/utility.hpp>
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/tuple/tuple_comparison.hpp>
+#include <boost/multi_index/key_extractors.hpp>
+#include <boost/multi_index/composite_key.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+#include "namespaces.hh"
+
+using namespace ::boost::multi_index;
+
+/* Validated NSEC and NSEC3 records, kept per zone in canonical (NSEC) or hash (NSEC3) order, so that
+   the record covering any name of the zone is a single lookup away. This lets us synthesize NXDOMAIN
+   and NODATA answers for names we never asked about, as described in RFC 8198.
+   Only records whose validation succeeded may be inserted, the cache does not check signatures itself.
+   Denials relying on an opt-out NSEC3, on a wildcard that exists or on a name below a delegation or DNAME
+   are never synthesized. Not threadsafe, like the negative cache it complements. */
+class AggressiveNSECCache : public boost::noncopyable
+{
+public:
+  /* record is an NSEC or NSEC3 record of zone, signatures the RRSIGs covering it. The entry is used until ttd */
+  void insert(const DNSName& zone, const DNSRecord& record, const vector<DNSRecord>& signatures, uint32_t ttd);
+  /* On success res is RCode::NXDomain or RCode::NoError, zone is the zone the denial comes from, ttd is the
+     time until which it holds and proof receives the NSEC(3) records and their RRSIGs, with their remaining TTLs */
+  bool getDenial(time_t now, const DNSName& qname, const QType& qtype, int& res, DNSName& zone, uint32_t& ttd, vector<DNSRecord>& proof);
+
+  void prune(unsigned int maxEntries);
+  /* removes the records of the zone name, or of name and all zones below it */
+  uint64_t wipe(const DNSName& name, bool subtree);
+  void clear();
+  uint64_t size() const;
+
+  /* hashing names is what NSEC3 denials cost us, zones using more iterations are not worth it (see RFC 9276) */
+  static const uint16_t s_maxNSEC3Iterations = 150;
+
+private:
+  struct NSECEntry
+  {
+    DNSName d_zone;
+    DNSName d_owner;
+    std::shared_ptr<NSECRecordContent> d_nsec;
+    DNSRecord d_record;
+    vector<DNSRecord> d_signatures;
+    uint32_t d_ttd;
+    uint32_t getTTD() const
+    {
+      return d_ttd;
+    }
+  };
+
+  struct NSEC3Entry
+  {
+    DNSName d_zone;
+    std::string d_hash; // raw owner hash, not base32 encoded
+    std::shared_ptr<NSEC3RecordContent> d_nsec3;
+    DNSRecord d_record;
+    vector<DNSRecord> d_signatures;
+    uint32_t d_ttd;
+    uint32_t getTTD() const
+    {
+      return d_ttd;
+    }
+  };
+
+  typedef multi_index_container <
+    NSECEntry,
+    indexed_by <
+      ordered_unique<
+        composite_key<
+          NSECEntry,
+          member<NSECEntry, DNSName, &NSECEntry::d_zone>,
+          member<NSECEntry, DNSName, &NSECEntry::d_owner>
+        >,
+        composite_key_compare<CanonDNSNameCompare, CanonDNSNameCompare>
+      >,
+      sequenced<>
+    >
+  > nsec_t;
+
+  typedef multi_index_container <
+    NSEC3Entry,
+    indexed_by <
+      ordered_unique<
+        composite_key<
+          NSEC3Entry,
+          member<NSEC3Entry, DNSName, &NSEC3Entry::d_zone>,
+          member<NSEC3Entry, std::string, &NSEC3Entry::d_hash>
+        >,
+        composite_key_compare<CanonDNSNameCompare, std::less<std::string> >
+      >,
+      sequenced<>
+    >
+  > nsec3_t;
+
+  bool getNSECDenial(uint32_t now, const DNSName& zone, const DNSName& qname, const QType& qtype, int& res, uint32_t& ttd, vector<DNSRecord>& proof);
+  bool getNSEC3Denial(uint32_t now, const DNSName& zone, const DNSName& qname, const QType& qtype, int& res, uint32_t& ttd, vector<DNSRecord>& proof);
+  nsec_t::iterator findNSEC(uint32_t now, const DNSName& zone, const DNSName& name);
+  nsec3_t::iterator findNSEC3(uint32_t now, const DNSName& zone, const std::string& hash);
+
+  nsec_t d_nsec;
+  nsec3_t d_nsec3;
+};
+
+#endif
@@ -153,6 +153,8 @@ void declareArguments()
 
   ::arg().set("default-ttl","Seconds a result is valid if not set otherwise")="3600";
   ::arg().set("max-tcp-connections","Maximum number of TCP connections")="10";
+  ::arg().set("tcp-worker-threads","Number of threads handling TCP connections")="2";
+  ::arg().set("tcp-idle-timeout","Close TCP connections that have been idle for this many seconds")="5";
   ::arg().setSwitch("no-shuffle","Set this to prevent random shuffling of answers - for regression testing")="off";
 
   ::arg().set("setuid","If set, change user id to this uid for more security")="";
@@ -219,6 +221,26 @@ catch(PDNSException& e)
   return 0;
 }
 
+static uint64_t getQueueStats(const std::string& str)
+{
+  static const std::map<string, int> waits{{"queue-wait-0-1", 0}, {"queue-wait-1-10", 1}, {"queue-wait-10-100", 2}, {"queue-wait-100-1000", 3}, {"queue-wait-slow", 4}};
+
+  uint64_t ret=0;
+  for(DNSDistributor* d :  g_distributors) {
+    if(!d)
+      continue;
+    for(const auto& stats : d->getThreadStats()) {
+      if(str == "qsize-q-max")
+        ret = std::max(ret, (uint64_t)stats.queued);
+      else if(str == "queue-steals")
+        ret += stats.stolen;
+      else
+        ret += stats.waits[waits.at(str)];
+    }
+  }
+  return ret;
+}
+
 static uint64_t getLatency(const std::string& str) 
 {
   return avg_latency;
@@ -244,6 +266,10 @@ void declareStats(void)
   S.declare("recursing-questions","Number of questions sent to recursor");
   S.declare("corrupt-packets","Number of corrupt packets received");
   S.declare("signatures", "Number of DNSSEC signatures made");
+  S.declare("signatures-presigned", "Number of DNSSEC signatures made in advance for next week");
+  S.declare("signature-cache-hits", "Number of signatures found in the signature cache");
+  S.declare("signature-cache-misses", "Number of signatures not found in the signature cache");
+  S.declare("signature-cache-evictions", "Number of signatures removed from a full signature cache");
   S.declare("tcp-queries","Number of TCP queries received");
   S.declare("tcp-answers","Number of answers sent out over TCP");
   S.declare("tcp-answers-bytes","Total size of answers sent out over TCP");
@@ -258,6 +284,13 @@ void declareStats(void)
     
 
   S.declare("qsize-q","Number of questions waiting for database attention", getQCount);
+  S.declare("qsize-q-max","Largest number of questions waiting for a single backend thread", getQueueStats);
+  S.declare("queue-steals","Number of questions answered by another backend thread than the one they were queued for", getQueueStats);
+  S.declare("queue-wait-0-1","Number of questions that waited less than 1 millisecond for a backend thread", getQueueStats);
+  S.declare("queue-wait-1-10","Number of questions that waited 1-10 milliseconds for a backend thread", getQueueStats);
+  S.declare("queue-wait-10-100","Number of questions that waited 10-100 milliseconds for a backend thread", getQueueStats);
+  S.declare("queue-wait-100-1000","Number of questions that waited 100-1000 milliseconds for a backend thread", getQueueStats);
+  S.declare("queue-wait-slow","Number of questions that waited over 1 second for a backend thread", getQueueStats);
 
   S.declare("deferred-cache-inserts","Amount of cache inserts that were deferred because of maintenance");
   S.declare("deferred-cache-lookup","Amount of cache lookups that were deferred because of maintenance");
@@ -291,11 +324,11 @@ void declareStats(void)
   S.declare("latency","Average number of microseconds needed to answer a question", getLatency);
   S.declare("timedout-packets","Number of packets which weren't answered within timeout set");
   S.declare("security-status", "Security status based on regular polling");
-  S.declareRing("queries","UDP Queries Received");
-  S.declareRing("nxdomain-queries","Queries for non-existent records within existent domains");
-  S.declareRing("noerror-queries","Queries for existing records, but for type we don't have");
-  S.declareRing("servfail-queries","Queries that could not be answered due to backend errors");
-  S.declareRing("unauth-queries","Queries for domains that we are not authoritative for");
+  S.declareQuestionRing("queries","UDP Queries Received");
+  S.declareQuestionRing("nxdomain-queries","Queries for non-existent records within existent domains");
+  S.declareQuestionRing("noerror-queries","Queries for existing records, but for type we don't have");
+  S.declareQuestionRing("servfail-queries","Queries that could not be answered due to backend errors");
+  S.declareQuestionRing("unauth-queries","Queries for domains that we are not authoritative for");
   S.declareRing("logmessages","Log Messages");
   S.declareComboRing("remotes","Remote server IP addresses");
   S.declareComboRing("remotes-unauth","Remote hosts querying domains for which we are not auth");
@@ -338,6 +371,9 @@ void *qthread(void *number)
 
   AtomicCounter &numreceived6=*S.getPointer("udp6-queries");
 
+  ThreadStatRing<SQuestion>* queriesRing = S.getQuestionRing("queries");
+  ThreadStatRing<SComboAddress>* remotesRing = S.getComboRing("remotes");
+
   int diff;
   bool logDNSQueries = ::arg().mustDo("log-dns-queries");
   bool doRecursion = ::arg().mustDo("recursor");
@@ -373,8 +409,10 @@ void *qthread(void *number)
      if(P->d.qr)
        continue;
 
-    S.ringAccount("queries", P->qdomain.toString()+"/"+P->qtype.getName());
-    S.ringAccount("remotes",P->d_remote);
+    if(S.ringsEnabled()) {
+      queriesRing->account(SQuestion(P->qdomain, P->qtype.getCode()));
+      remotesRing->account(P->d_remote);
+    }
     if(logDNSQueries) {
       string remote;
       if(P->hasEDNSSubnet()) 
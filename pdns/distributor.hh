@@ -35,7 +35,12 @@
 #include "pdnsexception.hh"
 #include "arguments.hh"
 #include <atomic>
+#include <memory>
 #include "statbag.hh"
+#include "mpmcqueue.hh"
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 extern StatBag S;
 
@@ -48,6 +53,13 @@ extern StatBag S;
     it will cycle the backend but drop the query that was active during the exception.
 */
 
+struct DistributorThreadStats
+{
+  size_t queued{0};   //!< questions waiting in the queue of this thread
+  uint64_t waits[5]{};  //!< questions that waited less than 1, 10, 100, 1000 and more milliseconds before this thread got to them
+  uint64_t stolen{0}; //!< questions this thread took from the queue of another one
+};
+
 template<class Answer, class Question, class Backend> class Distributor
 {
 public:
@@ -56,6 +68,10 @@ public:
   virtual int question(Question *, callback_t callback) =0; //!< Submit a question to the Distributor
   virtual int getQueueSize() =0; //!< Returns length of question queue
   virtual bool isOverloaded() =0;
+  virtual std::vector<DistributorThreadStats> getThreadStats() //!< One entry per backend thread, if we have any
+  {
+    return std::vector<DistributorThreadStats>();
+  }
 };
 
 template<class Answer, class Question, class Backend> class SingleThreadDistributor
@@ -81,6 +97,11 @@ private:
   Backend *b{0};
 };
 
+/* Each backend thread has its own lock-free queue. Questions go to a thread that is idle if
+   there is one, and threads that run out of work take questions from the queues of the others
+   before going to sleep, so a slow query only holds up the questions that nobody else can get to.
+   Sleeping threads are woken through an eventfd (a pipe where we don't have those), which is the
+   only system call left in the handoff, and it is only needed when a thread had nothing to do. */
 template<class Answer, class Question, class Backend> class MultiThreadDistributor
     : public Distributor<Answer, Question, Backend>
 {
@@ -104,14 +125,64 @@ public:
   {
     return d_overloaded;
   }
+
+  std::vector<DistributorThreadStats> getThreadStats() override;
   
 private:
+  struct BackendThread
+  {
+    explicit BackendThread(size_t capacity) : queue(capacity)
+    {
+#ifdef __linux__
+      fds[0] = fds[1] = eventfd(0, 0);
+      if(fds[0] < 0)
+        unixDie("Creating eventfd");
+#else
+      if(pipe(fds) < 0)
+        unixDie("Creating pipe");
+#endif
+    }
+
+    void wakeup()
+    {
+#ifdef __linux__
+      uint64_t one = 1;
+      if(write(fds[1], &one, sizeof(one)) != sizeof(one))
+        unixDie("write");
+#else
+      char c = 0;
+      if(write(fds[1], &c, sizeof(c)) != sizeof(c))
+        unixDie("write");
+#endif
+    }
+
+    void waitForWakeup()
+    {
+#ifdef __linux__
+      uint64_t value;
+#else
+      char value;
+#endif
+      if(read(fds[0], &value, sizeof(value)) != sizeof(value))
+        unixDie("read");
+    }
+
+    MPMCQueue<QuestionData*> queue;
+    std::atomic<bool> parked{false};
+    std::atomic<uint64_t> waits[5]{};
+    std::atomic<uint64_t> stolen{0};
+    int fds[2];
+  };
+
+  QuestionData* nextQuestion(unsigned int ournum);
+  bool steal(unsigned int ournum, QuestionData*& QD);
+
   bool d_overloaded;
   int nextid;
   time_t d_last_started;
   int d_num_threads;
   std::atomic<unsigned int> d_queued{0}, d_running{0};
-  std::vector<std::pair<int,int>> d_pipes;
+  std::vector<std::unique_ptr<BackendThread>> d_threads;
 };
 
 //template<class Answer, class Question, class Backend>::nextid;
@@ -139,13 +210,10 @@ template<class Answer, class Question, class Backend>MultiThreadDistributor<Answ
 
   pthread_t tid;
   
-
-  for(int i=0; i < n; ++i) {
-    int fds[2];
-    if(pipe(fds) < 0)
-      unixDie("Creating pipe");
-    d_pipes.push_back({fds[0],fds[1]});
-  }
+  /* any single queue can hold all the questions we accept, beyond that max-queue-length makes us give up anyhow */
+  size_t capacity = ::arg().asNum("max-queue-length") + 1;
+  for(int i=0; i < n; ++i)
+    d_threads.push_back(std::unique_ptr<BackendThread>(new BackendThread(capacity)));
   
   if (n<1) {
     L<<Logger::Error<<"Asked for fewer than 1 threads, nothing to do"<<endl;
@@ -174,13 +242,24 @@ template<class Answer, class Question, class Backend>void *MultiThreadDistributo
 
     for(;;) {
     
-      QuestionData* QD;
-      if(read(us->d_pipes[ournum].first, &QD, sizeof(QD)) != sizeof(QD))
-	unixDie("read");
+      QuestionData* QD = us->nextQuestion(ournum);
       --us->d_queued;
       Answer *a; 
 
-      if(queuetimeout && QD->Q->d_dt.udiff()>queuetimeout*1000) {
+      int waited = QD->Q->d_dt.udiff();
+      auto& waits = us->d_threads[ournum]->waits;
+      if(waited < 1000)
+        waits[0]++;
+      else if(waited < 10000)
+        waits[1]++;
+      else if(waited < 100000)
+        waits[2]++;
+      else if(waited < 1000000)
+        waits[3]++;
+      else
+        waits[4]++;
+
+      if(queuetimeout && waited>queuetimeout*1000) {
         delete QD->Q;
 	delete QD;
         S.inc("timedout-packets");
@@ -199,7 +278,7 @@ template<class Answer, class Question, class Backend>void *MultiThreadDistributo
 
         a->setRcode(RCode::ServFail);
         S.inc("servfail-packets");
-        S.ringAccount("servfail-queries",QD->Q->qdomain.toString());
+        S.ringAccount("servfail-queries",QD->Q->qdomain);
 
 	delete QD->Q;
 	QD->callback(a);
@@ -214,7 +293,7 @@ template<class Answer, class Question, class Backend>void *MultiThreadDistributo
 	
         a->setRcode(RCode::ServFail);
         S.inc("servfail-packets");
-        S.ringAccount("servfail-queries",QD->Q->qdomain.toString());
+        S.ringAccount("servfail-queries",QD->Q->qdomain);
 	delete QD->Q;
       }
 
@@ -234,6 +313,54 @@ template<class Answer, class Question, class Backend>void *MultiThreadDistributo
   return 0;
 }
 
+template<class Answer, class Question, class Backend>typename MultiThreadDistributor<Answer,Question,Backend>::QuestionData* MultiThreadDistributor<Answer,Question,Backend>::nextQuestion(unsigned int ournum)
+{
+  BackendThread& us = *d_threads[ournum];
+  QuestionData* QD;
+  for(;;) {
+    if(us.queue.pop(QD) || steal(ournum, QD))
+      return QD;
+
+    /* nothing to do. We say we are going to sleep before looking one last time, so that a question
+       queued meanwhile is either seen here, or followed by a wakeup */
+    us.parked.store(true);
+    /* without a full fence, the loads in pop() may be done before our store is visible, and question()
+       may see us not parked while we miss its question, then we sleep with a question in the queue */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(us.queue.pop(QD) || steal(ournum, QD)) {
+      if(!us.parked.exchange(false))
+        us.waitForWakeup(); // somebody beat us to it, don't leave the wakeup for the next time we sleep
+      return QD;
+    }
+    us.waitForWakeup(); // whoever woke us up also cleared 'parked'
+  }
+}
+
+template<class Answer, class Question, class Backend>bool MultiThreadDistributor<Answer,Question,Backend>::steal(unsigned int ournum, QuestionData*& QD)
+{
+  for(size_t n = 1; n < d_threads.size(); ++n) {
+    if(d_threads[(ournum + n) % d_threads.size()]->queue.pop(QD)) {
+      d_threads[ournum]->stolen++;
+      return true;
+    }
+  }
+  return false;
+}
+
+template<class Answer, class Question, class Backend>std::vector<DistributorThreadStats> MultiThreadDistributor<Answer,Question,Backend>::getThreadStats()
+{
+  std::vector<DistributorThreadStats> ret;
+  for(const auto& thread : d_threads) {
+    DistributorThreadStats stats;
+    stats.queued = thread->queue.size();
+    for(size_t n = 0; n < 5; ++n)
+      stats.waits[n] = thread->waits[n];
+    stats.stolen = thread->stolen;
+    ret.push_back(stats);
+  }
+  return ret;
+}
+
 template<class Answer, class Question, class Backend>int SingleThreadDistributor<Answer,Question,Backend>::question(Question* q, callback_t callback)
 {
   Answer *a;
@@ -247,7 +374,7 @@ template<class Answer, class Question, class Backend>int SingleThreadDistributor
     a=q->replyPacket();
     a->setRcode(RCode::ServFail);
     S.inc("servfail-packets");
-    S.ringAccount("servfail-queries",q->qdomain.toString());
+    S.ringAccount("servfail-queries",q->qdomain);
     callback(a);
     throw;
   }
@@ -258,7 +385,7 @@ template<class Answer, class Question, class Backend>int SingleThreadDistributor
     a=q->replyPacket();
     a->setRcode(RCode::ServFail);
     S.inc("servfail-packets");
-    S.ringAccount("servfail-queries",q->qdomain.toString());
+    S.ringAccount("servfail-queries",q->qdomain);
   }
   callback(a);
   return 0;
@@ -270,16 +397,38 @@ template<class Answer, class Question, class Backend>int MultiThreadDistributor<
 {
   q=new Question(*q);
 
-  // this is passed to other process over pipe and released there
+  // this is passed to a backend thread and released there
   auto QD=new QuestionData();
   QD->Q=q;
-  auto ret = QD->id = nextid++; // might be deleted after write!
+  auto ret = QD->id = nextid++; // might be deleted after push!
   QD->callback=callback;
-  
-  if(write(d_pipes[QD->id % d_pipes.size()].second, &QD, sizeof(QD)) != sizeof(QD))
-    unixDie("write");
+
+  // prefer a thread that has nothing to do, so the question does not wait behind a slow one
+  size_t target = ret % d_threads.size();
+  for(size_t n = 0; n < d_threads.size(); ++n) {
+    size_t idx = (ret + n) % d_threads.size();
+    if(d_threads[idx]->parked.load()) {
+      target = idx;
+      break;
+    }
+  }
 
   d_queued++;
+  size_t tries = 0;
+  while(!d_threads[target]->queue.push(QD)) {
+    if(++tries == d_threads.size()) {
+      d_queued--;
+      delete QD->Q;
+      delete QD;
+      L<<Logger::Error<<"All backend queues are full, respawning"<<endl;
+      throw DistributorFatal();
+    }
+    target = (target + 1) % d_threads.size();
+  }
+  // pairs with the fence in nextQuestion(): either we see it parked, or it sees the question
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(d_threads[target]->parked.load() && d_threads[target]->parked.exchange(false))
+    d_threads[target]->wakeup();
   
   static unsigned int overloadQueueLength=::arg().asNum("overload-queue-length");
   static unsigned int maxQueueLength=::arg().asNum("max-queue-length");
@@ -33,6 +33,7 @@
 #include <sys/types.h>
 class DNSBackend;
 class DNSName; // FIXME400
+class DNSRecordContent;
 
 struct SOAData
 {
@@ -81,11 +82,22 @@ public:
 
   void setContent(const string& content);
   string getZoneRepresentation(bool noDot=false) const;
+  bool parseContent(); //!< fills parsed from content, returns false if content could not be parsed
+  shared_ptr<DNSRecordContent> getParsedContent() const; //!< the parsed form of content, if there is one that is still current
 
   // data
   DNSName qname; //!< the name of this record, for example: www.powerdns.com
   DNSName wildcardname;
   string content; //!< what this record points to. Example: 10.1.2.3
+  /* Content as parsed by a backend or the query cache, so DNSPacket::wrapup() does not have to parse it again.
+     It remembers the text it was parsed from and is ignored once content no longer matches that, so code
+     rewriting content, like SOA-EDIT, does not need to know about it. */
+  struct ParsedContent
+  {
+    string content;
+    shared_ptr<DNSRecordContent> drc;
+  };
+  shared_ptr<const ParsedContent> parsed;
 
   // Aligned on 8-byte boundries on systems where time_t is 8 bytes and int
   // is 4 bytes, aka modern linux on x86_64
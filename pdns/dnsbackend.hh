@@ -121,6 +121,15 @@ public:
   */
   virtual bool list(const DNSName &target, int domain_id, bool include_disabled=false)=0;
 
+  //! Initiates a list like list() does, but with the records in DNSSEC canonical order
+  /** All records of a name have to come out together, and a name never before its ancestors.
+      Return false if the records can not be listed that way, the caller will use list() then.
+  */
+  virtual bool listCanonical(const DNSName &target, int domain_id)
+  {
+    return false;
+  }
+
   virtual ~DNSBackend(){};
 
   //! fills the soadata struct with the SOA details. Returns false if there is no SOA.
@@ -0,0 +1,328 @@
+#include "dolog.hh"
+#include "dnsparser.hh"
+#include "dnsdist-cache.hh"
+
+DNSDistPacketCache::DNSDistPacketCache(size_t maxEntries, uint32_t maxTTL, uint32_t minTTL, uint32_t servFailTTL, unsigned int shardCount): d_shards(shardCount ? shardCount : 1), d_maxEntries(maxEntries), d_shardCount(shardCount ? shardCount : 1), d_maxTTL(maxTTL), d_servFailTTL(servFailTTL), d_minTTL(minTTL)
+{
+  d_maxEntriesPerShard = d_maxEntries / d_shardCount;
+  if(d_maxEntriesPerShard == 0)
+    d_maxEntriesPerShard = 1;
+
+  /* we reserve maxEntries + 1 to avoid rehashing from occurring
+     when we get to maxEntries, as it means a load factor of 1 */
+  for(auto& shard : d_shards) {
+    shard.d_map.reserve(d_maxEntriesPerShard + 1);
+  }
+}
+
+void DNSDistPacketCache::insert(const CacheKey& key, const DNSName& qname, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen)
+{
+  if(responseLen < sizeof(dnsheader))
+    return;
+
+  uint32_t minTTL;
+  const struct dnsheader* dh = reinterpret_cast<const struct dnsheader*>(response);
+  if(dh->rcode == RCode::ServFail || dh->rcode == RCode::Refused) {
+    minTTL = d_servFailTTL;
+  }
+  else {
+    try {
+      minTTL = getDNSPacketMinTTL(response, responseLen);
+    }
+    catch(const std::exception& e) {
+      vinfolog("Not caching response for %s|%s: %s", qname.toString(), QType(qtype).getName(), e.what());
+      return;
+    }
+
+    /* no records (a NODATA without SOA, for example), nothing to go on */
+    if(minTTL == std::numeric_limits<uint32_t>::max())
+      return;
+
+    if(minTTL > d_maxTTL)
+      minTTL = d_maxTTL;
+  }
+
+  if(minTTL == 0 || minTTL < d_minTTL)
+    return;
+
+  CacheShard& shard = d_shards.at(getShardIndex(key.key));
+  time_t now = time(nullptr);
+
+  TryWriteLock w(&shard.d_lock);
+  if(!w.gotIt()) {
+    d_deferredInserts++;
+    return;
+  }
+
+  auto it = shard.d_map.find(key.key);
+  if(it != shard.d_map.end()) {
+    CacheValue& value = it->second;
+    /* an entry for a different question hashing to the same key, leave it alone until it expires */
+    if(!cachedValueMatches(value, key, qname, qtype, qclass) && value.validity > now) {
+      d_insertCollisions++;
+      return;
+    }
+    value.qname = qname;
+    value.qtype = qtype;
+    value.qclass = qclass;
+    value.additionalHash = key.additionalHash;
+    value.flags = key.flags;
+    value.added = now;
+    value.validity = now + minTTL;
+    value.value.assign(response, responseLen);
+    return;
+  }
+
+  if(shard.d_map.size() >= d_maxEntriesPerShard) {
+    /* make room, preferably by dropping expired entries */
+    if(removeExpired(shard, now, 1) == 0) {
+      shard.d_map.erase(shard.d_map.begin());
+      shard.d_entriesCount--;
+      d_evictions++;
+    }
+  }
+
+  CacheValue& value = shard.d_map[key.key];
+  value.qname = qname;
+  value.qtype = qtype;
+  value.qclass = qclass;
+  value.additionalHash = key.additionalHash;
+  value.flags = key.flags;
+  value.added = now;
+  value.validity = now + minTTL;
+  value.value.assign(response, responseLen);
+  shard.d_entriesCount++;
+}
+
+bool DNSDistPacketCache::get(const char* query, uint16_t queryLen, const DNSName& qname, uint16_t qtype, uint16_t qclass, unsigned int consumed, char* response, uint16_t* responseLen, CacheKey* keyOut, bool skipAging)
+{
+  const unsigned char* packet = reinterpret_cast<const unsigned char*>(query);
+  CacheKey key;
+  key.key = getKey(qname, consumed, packet, queryLen);
+  key.additionalHash = getAdditionalHash(consumed, packet, queryLen);
+  key.flags = getFlags(consumed, packet, queryLen);
+  if(keyOut)
+    *keyOut = key;
+
+  /* 'response' is allowed to be the query buffer itself, so save what we need from the query first */
+  uint16_t queryId;
+  char queryQName[256];
+  if(queryLen < sizeof(dnsheader) + consumed || consumed > sizeof(queryQName)) {
+    d_misses++;
+    return false;
+  }
+  memcpy(&queryId, query, sizeof(queryId));
+  memcpy(queryQName, query + sizeof(dnsheader), consumed);
+
+  CacheShard& shard = d_shards.at(getShardIndex(key.key));
+  time_t now = time(nullptr);
+  time_t age;
+  std::string agedResponse;
+  {
+    TryReadLock r(&shard.d_lock);
+    if(!r.gotIt()) {
+      d_deferredLookups++;
+      return false;
+    }
+
+    auto it = shard.d_map.find(key.key);
+    if(it == shard.d_map.end()) {
+      d_misses++;
+      return false;
+    }
+
+    const CacheValue& value = it->second;
+    if(value.validity < now) {
+      d_misses++;
+      return false;
+    }
+
+    if(value.value.size() > *responseLen || value.value.size() < sizeof(dnsheader)) {
+      d_misses++;
+      return false;
+    }
+
+    /* check for collisions */
+    if(!cachedValueMatches(value, key, qname, qtype, qclass)) {
+      d_lookupCollisions++;
+      return false;
+    }
+
+    age = now - value.added;
+    if(skipAging || age == 0) {
+      memcpy(response, value.value.c_str(), value.value.size());
+      *responseLen = value.value.size();
+    }
+    else {
+      agedResponse = value.value;
+    }
+  }
+
+  if(!agedResponse.empty()) {
+    ageDNSPacket(agedResponse, age);
+    memcpy(response, agedResponse.c_str(), agedResponse.size());
+    *responseLen = agedResponse.size();
+  }
+
+  /* the ID and the case of the qname are those of whoever populated the entry */
+  memcpy(response, &queryId, sizeof(queryId));
+  if(sizeof(dnsheader) + consumed <= *responseLen)
+    memcpy(response + sizeof(dnsheader), queryQName, consumed);
+
+  d_hits++;
+  return true;
+}
+
+/* removes up to toRemove expired entries (all of them if toRemove is 0) from a shard we hold the write lock of */
+size_t DNSDistPacketCache::removeExpired(CacheShard& shard, time_t now, size_t toRemove)
+{
+  size_t removed = 0;
+  for(auto it = shard.d_map.begin(); it != shard.d_map.end(); ) {
+    if(it->second.validity < now) {
+      it = shard.d_map.erase(it);
+      shard.d_entriesCount--;
+      removed++;
+      if(toRemove && removed >= toRemove)
+        break;
+    }
+    else {
+      ++it;
+    }
+  }
+  return removed;
+}
+
+/* Remove expired entries, until the cache has at most
+   upTo entries in it.
+*/
+void DNSDistPacketCache::purgeExpired(size_t upTo)
+{
+  time_t now = time(nullptr);
+  uint64_t size = getSize();
+
+  if(size <= upTo)
+    return;
+
+  size_t toRemove = size - upTo;
+  for(auto& shard : d_shards) {
+    if(toRemove == 0)
+      break;
+
+    WriteLock w(&shard.d_lock);
+    toRemove -= removeExpired(shard, now, toRemove);
+  }
+}
+
+/* Remove all entries, keeping only upTo
+   entries in the cache */
+void DNSDistPacketCache::expunge(size_t upTo)
+{
+  const uint64_t size = getSize();
+
+  if(upTo >= size)
+    return;
+
+  size_t toRemove = size - upTo;
+  for(auto& shard : d_shards) {
+    if(toRemove == 0)
+      break;
+
+    WriteLock w(&shard.d_lock);
+    while(toRemove > 0 && !shard.d_map.empty()) {
+      shard.d_map.erase(shard.d_map.begin());
+      shard.d_entriesCount--;
+      toRemove--;
+    }
+  }
+}
+
+void DNSDistPacketCache::expungeByName(const DNSName& name, uint16_t qtype)
+{
+  for(auto& shard : d_shards) {
+    WriteLock w(&shard.d_lock);
+
+    for(auto it = shard.d_map.begin(); it != shard.d_map.end(); ) {
+      const CacheValue& value = it->second;
+      if(value.qname == name && (qtype == QType::ANY || qtype == value.qtype)) {
+        it = shard.d_map.erase(it);
+        shard.d_entriesCount--;
+      }
+      else {
+        ++it;
+      }
+    }
+  }
+}
+
+bool DNSDistPacketCache::isFull()
+{
+  return (getSize() >= d_maxEntries);
+}
+
+uint64_t DNSDistPacketCache::getSize() const
+{
+  uint64_t count = 0;
+
+  for(const auto& shard : d_shards) {
+    count += shard.d_entriesCount;
+  }
+
+  return count;
+}
+
+bool DNSDistPacketCache::cachedValueMatches(const CacheValue& cachedValue, const CacheKey& key, const DNSName& qname, uint16_t qtype, uint16_t qclass)
+{
+  return cachedValue.qtype == qtype && cachedValue.qclass == qclass && cachedValue.flags == key.flags &&
+    cachedValue.additionalHash == key.additionalHash && cachedValue.qname == qname;
+}
+
+/* The qname part is hashed case-insensitively, everything after it (qtype, qclass and any
+   additional records, EDNS included) byte for byte. The ID and most of the header are left out,
+   except for the RD and CD bits which change what a backend will answer. */
+uint32_t DNSDistPacketCache::getKey(const DNSName& qname, unsigned int consumed, const unsigned char* packet, uint16_t packetLen)
+{
+  uint32_t result = qname.hash();
+  const size_t questionEnd = sizeof(dnsheader) + consumed;
+  if(packetLen > questionEnd) {
+    result = burtle(packet + questionEnd, packetLen - questionEnd, result);
+  }
+  if(packetLen >= sizeof(dnsheader)) {
+    const struct dnsheader* dh = reinterpret_cast<const struct dnsheader*>(packet);
+    const unsigned char bits = (dh->rd ? 1 : 0) | (dh->cd ? 2 : 0);
+    result = burtle(&bits, sizeof(bits), result);
+  }
+  return result;
+}
+
+/* Everything after the qtype and qclass, with another seed than the key, so that a collision on
+   the key is very unlikely to collide on this one as well */
+uint32_t DNSDistPacketCache::getAdditionalHash(unsigned int consumed, const unsigned char* packet, uint16_t packetLen)
+{
+  const size_t additionalStart = sizeof(dnsheader) + consumed + 4;
+  if(packetLen <= additionalStart)
+    return 0;
+  return burtle(packet + additionalStart, packetLen - additionalStart, 0x5eed);
+}
+
+/* The RD and CD bits of the header, and the DO bit of the OPT record if the query has one and nothing else
+   after its question. An OPT record is: root name (1), type (2), buffer size (2), extended rcode (1),
+   version (1), flags (2), rdata length (2) */
+uint8_t DNSDistPacketCache::getFlags(unsigned int consumed, const unsigned char* packet, uint16_t packetLen)
+{
+  if(packetLen < sizeof(dnsheader))
+    return 0;
+  const struct dnsheader* dh = reinterpret_cast<const struct dnsheader*>(packet);
+  uint8_t flags = (dh->rd ? 1 : 0) | (dh->cd ? 2 : 0);
+
+  const size_t pos = sizeof(dnsheader) + consumed + 4;
+  if(!dh->ancount && !dh->nscount && ntohs(dh->arcount) == 1 && packetLen >= pos + 11 &&
+     packet[pos] == 0 && packet[pos+1] == 0 && packet[pos+2] == QType::OPT && (packet[pos+7] & 0x80)) {
+    flags |= 4;
+  }
+  return flags;
+}
+
+string DNSDistPacketCache::toString()
+{
+  return std::to_string(getSize()) + "/" + std::to_string(d_maxEntries);
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "iputils.hh"
+#include "lock.hh"
+#include "dnsname.hh"
+#include "qtype.hh"
+#include <atomic>
+#include <unordered_map>
+
+/* Response cache for dnsdist. A cache is attached to a server pool (see ServerPool in dnsdist.hh) and
+   can be shared by several of them. Entries are keyed on a hash of the (case-insensitive) qname, the rest
+   of the question and additional sections as received on the wire, and the RD and CD header bits, so two
+   queries only share an entry if a backend would have been asked the exact same thing. As the key is only
+   a hash, the entry also keeps the question, the RD, CD and DO bits and a second hash of the additional
+   section, which a hit has to match.
+
+   Storage is split over a number of shards, each with its own lock. Lookups only try to get the lock,
+   and count as a miss ("deferred lookup") if it is not available right away, so that UDP client threads
+   never wait on each other. The same goes for insertions. */
+class DNSDistPacketCache : public boost::noncopyable
+{
+public:
+  DNSDistPacketCache(size_t maxEntries, uint32_t maxTTL=86400, uint32_t minTTL=0, uint32_t servFailTTL=60, unsigned int shardCount=20);
+
+  /* what get() found out about a query, for a later insert() of its response */
+  struct CacheKey
+  {
+    uint32_t key{0};
+    uint32_t additionalHash{0};
+    uint8_t flags{0}; /* RD, CD and DO */
+  };
+
+  void insert(const CacheKey& key, const DNSName& qname, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen);
+  /* on a hit, the cached response is copied into 'response' (of size *responseLen), with its ID set to the one of the query,
+     the qname rewritten to the case used in the query and the TTLs decreased by the time spent in the cache.
+     'response' may point to the query buffer. The key is returned in keyOut even on a miss, for a later insert() */
+  bool get(const char* query, uint16_t queryLen, const DNSName& qname, uint16_t qtype, uint16_t qclass, unsigned int consumed, char* response, uint16_t* responseLen, CacheKey* keyOut, bool skipAging=false);
+  void purgeExpired(size_t upTo=0);
+  void expunge(size_t upTo=0);
+  void expungeByName(const DNSName& name, uint16_t qtype=QType::ANY);
+  bool isFull();
+  string toString();
+  uint64_t getSize() const;
+  uint64_t getHits() const { return d_hits; }
+  uint64_t getMisses() const { return d_misses; }
+  uint64_t getDeferredLookups() const { return d_deferredLookups; }
+  uint64_t getDeferredInserts() const { return d_deferredInserts; }
+  uint64_t getLookupCollisions() const { return d_lookupCollisions; }
+  uint64_t getInsertCollisions() const { return d_insertCollisions; }
+  uint64_t getEvictions() const { return d_evictions; }
+  uint64_t getMaxEntries() const { return d_maxEntries; }
+
+  static uint32_t getKey(const DNSName& qname, unsigned int consumed, const unsigned char* packet, uint16_t packetLen);
+  static uint32_t getAdditionalHash(unsigned int consumed, const unsigned char* packet, uint16_t packetLen);
+  static uint8_t getFlags(unsigned int consumed, const unsigned char* packet, uint16_t packetLen);
+
+private:
+
+  struct CacheValue
+  {
+    time_t getTTD() const { return validity; }
+    std::string value;
+    DNSName qname;
+    uint32_t additionalHash{0};
+    uint16_t qtype{0};
+    uint16_t qclass{0};
+    uint8_t flags{0};
+    time_t added{0};
+    time_t validity{0};
+  };
+
+  struct CacheShard
+  {
+    CacheShard()
+    {
+      pthread_rwlock_init(&d_lock, 0);
+    }
+    ~CacheShard()
+    {
+      pthread_rwlock_destroy(&d_lock);
+    }
+
+    std::unordered_map<uint32_t,CacheValue> d_map;
+    pthread_rwlock_t d_lock;
+    std::atomic<uint64_t> d_entriesCount{0};
+  };
+
+  static bool cachedValueMatches(const CacheValue& cachedValue, const CacheKey& key, const DNSName& qname, uint16_t qtype, uint16_t qclass);
+  uint32_t getShardIndex(uint32_t key) const
+  {
+    return key % d_shardCount;
+  }
+  size_t removeExpired(CacheShard& shard, time_t now, size_t toRemove);
+
+  std::vector<CacheShard> d_shards;
+
+  std::atomic<uint64_t> d_deferredLookups{0};
+  std::atomic<uint64_t> d_deferredInserts{0};
+  std::atomic<uint64_t> d_hits{0};
+  std::atomic<uint64_t> d_misses{0};
+  std::atomic<uint64_t> d_insertCollisions{0};
+  std::atomic<uint64_t> d_lookupCollisions{0};
+  std::atomic<uint64_t> d_evictions{0};
+
+  size_t d_maxEntries;
+  size_t d_maxEntriesPerShard;
+  uint32_t d_shardCount;
+  uint32_t d_maxTTL;
+  uint32_t d_servFailTTL;
+  uint32_t d_minTTL;
+};
@@ -64,6 +64,7 @@ try
         str<<base<<"queries" << ' ' << s->queries.load() << " " << now << "\r\n";
         str<<base<<"drops" << ' ' << s->reuseds.load() << " " << now << "\r\n";
         str<<base<<"latency" << ' ' << s->latencyUsec/1000.0 << " " << now << "\r\n";
+        str<<base<<"checklatency" << ' ' << s->checkLatencyUsec/1000.0 << " " << now << "\r\n";
         str<<base<<"senderrors" << ' ' << s->sendErrors.load() << " " << now << "\r\n";
         str<<base<<"outstanding" << ' ' << s->outstanding.load() << " " << now << "\r\n";
       }
@@ -75,6 +76,27 @@ try
         boost::replace_all(frontName, ".", "_");
         const string base = "dnsdist." + hostname + ".main.frontends." + frontName + ".";
         str<<base<<"queries" << ' ' << front->queries.load() << " " << now << "\r\n";
+        if (front->udpFD >= 0 && front->udpBatchSize > 1)
+          str<<base<<"batches" << ' ' << front->udpBatches.load() << " " << now << "\r\n";
+      }
+      const auto localPools = g_pools.getCopy();
+      for(const auto& entry : localPools) {
+        const auto cache = entry.second->getCache();
+        if (!cache)
+          continue;
+
+        string poolName = entry.first.empty() ? "_default_" : entry.first;
+        boost::replace_all(poolName, ".", "_");
+        const string base = "dnsdist." + hostname + ".main.pools." + poolName + ".cache-";
+        str<<base<<"size" << ' ' << cache->getMaxEntries() << " " << now << "\r\n";
+        str<<base<<"entries" << ' ' << cache->getSize() << " " << now << "\r\n";
+        str<<base<<"hits" << ' ' << cache->getHits() << " " << now << "\r\n";
+        str<<base<<"misses" << ' ' << cache->getMisses() << " " << now << "\r\n";
+        str<<base<<"deferred-inserts" << ' ' << cache->getDeferredInserts() << " " << now << "\r\n";
+        str<<base<<"deferred-lookups" << ' ' << cache->getDeferredLookups() << " " << now << "\r\n";
+        str<<base<<"lookup-collisions" << ' ' << cache->getLookupCollisions() << " " << now << "\r\n";
+        str<<base<<"insert-collisions" << ' ' << cache->getInsertCollisions() << " " << now << "\r\n";
+        str<<base<<"evictions" << ' ' << cache->getEvictions() << " " << now << "\r\n";
       }
       const string msg = str.str();
 
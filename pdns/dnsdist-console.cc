@@ -182,30 +182,31 @@ char* my_generator(const char* text, int state)
   vector<string> words{"addACL(", "addAction(", "addAnyTCRule()", "addDelay(",
       "addDisableValidationRule(", "addDNSCryptBind(", "addDomainBlock(",
       "addDomainSpoof(", "addDynBlocks(", "addLocal(", "addLuaAction(",
+      "addLuaActionPerThread(",
       "addNoRecurseRule(", "addPoolRule(", "addQPSLimit(", "addQPSPoolRule(",
       "AllRule(", "AndRule(",
       "benchRule(",
       "carbonServer(", "controlSocket(", "clearDynBlocks()",
       "DelayAction(", "delta()", "DisableValidationAction(", "DropAction(",
-      "dumpStats()",
+      "dumpStats()", "exceedTalkersRate(",
       "firstAvailable", "fixupCase(",
-      "generateDNSCryptCertificate(", "generateDNSCryptProviderKeys(", "getPoolServers(", "getResponseRing(",
-      "getServer(", "getServers()", "grepq(",
+      "generateDNSCryptCertificate(", "generateDNSCryptProviderKeys(", "getPool(", "getPoolServers(",
+      "getResponseRing(", "getServer(", "getServers()", "getTopTalkers(", "grepq(",
       "leastOutstanding", "LogAction(",
       "makeKey()", "MaxQPSIPRule(", "MaxQPSRule(", "mvRule(",
-      "newDNSName(", "newQPSLimiter(", "newServer(", "newServerPolicy(",
-      "newSuffixMatchNode(", "NoRecurseAction(",
+      "newDNSName(", "newPacketCache(", "newQPSLimiter(", "newServer(",
+      "newServerPolicy(", "newSuffixMatchNode(", "NoRecurseAction(",
       "PoolAction(",
       "RegexRule(", "rmRule(", "rmServer(", "roundrobin",
       "QTypeRule(",
-      "setACL(", "setDNSSECPool(", "setDynBlockNMG(", "setECSOverride(",
-      "setECSSourcePrefixV4(", "setECSSourcePrefixV6(", "setKey(", "setLocal(",
-      "setMaxTCPClientThreads(", "setMaxUDPOutstanding(", "setServerPolicy(", "setServerPolicyLua(",
-      "setTCPRecvTimeout(", "setTCPSendTimeout(", "show(", "showACL()",
+      "setACL(", "setBlockFilterPerThread(", "setCacheCleaningDelay(", "setDNSSECPool(",
+      "setDynBlockNMG(", "setECSOverride(", "setECSSourcePrefixV4(", "setECSSourcePrefixV6(",
+      "setKey(", "setLocal(", "setMaxTCPClientThreads(", "setMaxUDPOutstanding(", "setRingBuffersSize(",
+      "setServerPolicy(", "setServerPolicyLua(", "setServerPolicyLuaPerThread(", "setTCPRecvTimeout(", "setTCPSendTimeout(", "setTopTalkersParameters(", "show(", "showACL()",
       "showDNSCryptBinds()", "showDynBlocks()", "showResponseLatency()", "showRules()",
       "showServerPolicy()", "showServers()", "shutdown()", "SpoofAction(",
       "TCAction(", "testCrypto()", "topBandwidth(", "topClients(",
-      "topQueries(", "topResponses(", "topRule()", "truncateTC(",
+      "topQueries(", "topResponses(", "topRule()", "topTalkers(", "truncateTC(",
       "webserver(", "whashed", "wrandom" };
   static int s_counter=0;
   int counter=0;
@@ -21,6 +21,7 @@ public:
 
   Action operator()(const ComboAddress& remote, const DNSName& qname, uint16_t qtype, dnsheader* dh, uint16_t& len, string* ruleresult) const override
   {
+    std::lock_guard<std::mutex> lock(g_luamutex);
     auto ret = d_func(remote, qname, qtype, dh, len);
     if(ruleresult)
       *ruleresult=std::get<1>(ret);
@@ -36,6 +37,31 @@ private:
   func_t d_func;
 };
 
+class LuaPerThreadAction : public DNSAction
+{
+public:
+  LuaPerThreadAction(const std::string& code) : d_func(code)
+  {
+    d_func.prepare();
+  }
+
+  Action operator()(const ComboAddress& remote, const DNSName& qname, uint16_t qtype, dnsheader* dh, uint16_t& len, string* ruleresult) const override
+  {
+    auto ret = d_func(remote, qname, qtype, dh, len);
+    if(ruleresult)
+      *ruleresult=std::get<1>(ret);
+    return (Action)std::get<0>(ret);
+  }
+
+  string toString() const 
+  {
+    return "per-thread Lua script";
+  }
+
+private:
+  PerThreadLuaFunction<std::tuple<int, string>(const ComboAddress& remote, const DNSName& qname, uint16_t qtype, dnsheader* dh, int len)> d_func;
+};
+
 typedef boost::variant<string,vector<pair<int, string>>, std::shared_ptr<DNSRule> > luadnsrule_t;
 std::shared_ptr<DNSRule> makeRule(const luadnsrule_t& var)
 {
@@ -65,12 +91,11 @@ std::shared_ptr<DNSRule> makeRule(const luadnsrule_t& var)
     return std::make_shared<NetmaskGroupRule>(nmg);
 }
 
-vector<std::function<void(void)>> setupLua(bool client, const std::string& config)
+/* The types and helpers needed to write blockFilter, server policy and action functions. These are available
+   in g_lua as well as in the per-thread contexts, which get nothing else. */
+void setupLuaBindings(LuaContext& luaCtx)
 {
-  g_launchWork= new vector<std::function<void(void)>>();
-  typedef std::unordered_map<std::string, boost::variant<bool, std::string, vector<pair<int, std::string> > > > newserver_t;
-
-  g_lua.writeVariable("DNSAction", std::unordered_map<string,int>{
+  luaCtx.writeVariable("DNSAction", std::unordered_map<string,int>{
       {"Drop", (int)DNSAction::Action::Drop}, 
       {"Nxdomain", (int)DNSAction::Action::Nxdomain}, 
       {"Spoof", (int)DNSAction::Action::Spoof}, 
@@ -80,7 +105,105 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
       {"None",(int)DNSAction::Action::None},
       {"Delay", (int)DNSAction::Action::Delay}}
     );
+
+  luaCtx.registerFunction("isUp", &DownstreamState::isUp);
+  luaCtx.registerMember("upStatus", &DownstreamState::upStatus);
+  luaCtx.registerMember("weight", &DownstreamState::weight);
+  luaCtx.registerMember("order", &DownstreamState::order);
   
+  luaCtx.writeFunction("infolog", [](const string& arg) {
+      infolog("%s", arg);
+    });
+  luaCtx.writeFunction("errlog", [](const string& arg) {
+      errlog("%s", arg);
+    });
+  luaCtx.writeFunction("warnlog", [](const string& arg) {
+      warnlog("%s", arg);
+    });
+
+  luaCtx.registerFunction<void(dnsheader::*)(bool)>("setRD", [](dnsheader& dh, bool v) {
+      dh.rd=v;
+    });
+
+  luaCtx.registerFunction<bool(dnsheader::*)()>("getRD", [](dnsheader& dh) {
+      return (bool)dh.rd;
+    });
+
+  luaCtx.registerFunction<void(dnsheader::*)(bool)>("setCD", [](dnsheader& dh, bool v) {
+      dh.cd=v;
+    });
+
+  luaCtx.registerFunction<bool(dnsheader::*)()>("getCD", [](dnsheader& dh) {
+      return (bool)dh.cd;
+    });
+
+
+  luaCtx.registerFunction<void(dnsheader::*)(bool)>("setTC", [](dnsheader& dh, bool v) {
+      dh.tc=v;
+      if(v) dh.ra = dh.rd; // you'll always need this, otherwise TC=1 gets ignored
+    });
+
+  luaCtx.registerFunction<void(dnsheader::*)(bool)>("setQR", [](dnsheader& dh, bool v) {
+      dh.qr=v;
+    });
+
+
+  luaCtx.registerFunction("tostring", &ComboAddress::toString);
+
+  luaCtx.registerFunction("isPartOf", &DNSName::isPartOf);
+  luaCtx.registerFunction<string(DNSName::*)()>("tostring", [](const DNSName&dn ) { return dn.toString(); });
+  luaCtx.writeFunction("newDNSName", [](const std::string& name) { return DNSName(name); });
+  luaCtx.writeFunction("newSuffixMatchNode", []() { return SuffixMatchNode(); });
+
+  luaCtx.registerFunction("add",(void (SuffixMatchNode::*)(const DNSName&)) &SuffixMatchNode::add);
+  luaCtx.registerFunction("check",(bool (SuffixMatchNode::*)(const DNSName&) const) &SuffixMatchNode::check);
+
+  luaCtx.writeFunction("newQPSLimiter", [](int rate, int burst) { return QPSLimiter(rate, burst); });
+  luaCtx.registerFunction("check", &QPSLimiter::check);
+  luaCtx.writeFunction("newCA", [](const std::string& name) { return ComboAddress(name); });
+
+  luaCtx.registerMember("name", &ServerPolicy::name);
+  luaCtx.registerMember("policy", &ServerPolicy::policy);
+  luaCtx.writeVariable("firstAvailable", ServerPolicy{"firstAvailable", firstAvailable});
+  luaCtx.writeVariable("roundrobin", ServerPolicy{"roundrobin", roundrobin});
+  luaCtx.writeVariable("wrandom", ServerPolicy{"wrandom", wrandom});
+  luaCtx.writeVariable("whashed", ServerPolicy{"whashed", whashed});
+  luaCtx.writeVariable("leastOutstanding", ServerPolicy{"leastOutstanding", leastOutstanding});
+
+  luaCtx.writeFunction("getPoolServers", [](string pool) {
+      return getDownstreamCandidates(g_dstates.getCopy(), pool);
+    });
+}
+
+std::atomic<uint64_t> g_perThreadLuaFunctionIds{0};
+
+PerThreadLuaContext::PerThreadLuaContext()
+{
+  setupLuaBindings(d_lua);
+}
+
+PerThreadLuaContext& PerThreadLuaContext::get()
+{
+  static thread_local PerThreadLuaContext s_context;
+  return s_context;
+}
+
+/* the exception is turned into a Lua error by LuaWrapper */
+static int getRangedParameter(const std::string& name, const std::string& value, int minimum, int maximum)
+{
+  int ret=std::stoi(value);
+  if(ret < minimum || ret > maximum)
+    throw std::runtime_error("Invalid value "+value+" for "+name+", should be between "+std::to_string(minimum)+" and "+std::to_string(maximum));
+  return ret;
+}
+
+vector<std::function<void(void)>> setupLua(bool client, const std::string& config)
+{
+  g_launchWork= new vector<std::function<void(void)>>();
+  typedef std::unordered_map<std::string, boost::variant<bool, std::string, vector<pair<int, std::string> > > > newserver_t;
+
+  setupLuaBindings(g_lua);
+
   g_lua.writeFunction("newServer", 
 		      [client](boost::variant<string,newserver_t> pvars, boost::optional<int> qps)
 		      { 
@@ -183,6 +306,18 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 			  ret->mustResolve=boost::get<bool>(vars["mustResolve"]);
 			}
 
+			if(vars.count("checkInterval")) {
+			  ret->checkInterval=getRangedParameter("checkInterval", boost::get<string>(vars["checkInterval"]), 1, std::numeric_limits<uint8_t>::max());
+			}
+
+			if(vars.count("checkTimeout")) {
+			  ret->checkTimeout=getRangedParameter("checkTimeout", boost::get<string>(vars["checkTimeout"]), 1, std::numeric_limits<uint16_t>::max());
+			}
+
+			if(vars.count("maxCheckFailures")) {
+			  ret->maxCheckFailures=getRangedParameter("maxCheckFailures", boost::get<string>(vars["maxCheckFailures"]), 1, std::numeric_limits<uint8_t>::max());
+			}
+
 			if(vars.count("useClientSubnet")) {
 			  ret->useECS=boost::get<bool>(vars["useClientSubnet"]);
 			}
@@ -274,7 +409,14 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
     });
   g_lua.writeFunction("setServerPolicyLua", [](string name, policy_t policy)  {
       setLuaSideEffect();
-      g_policy.setState(ServerPolicy{name, policy});
+      g_policy.setState(ServerPolicy{name, policy, true});
+    });
+
+  g_lua.writeFunction("setServerPolicyLuaPerThread", [](string name, string code)  {
+      setLuaSideEffect();
+      PerThreadLuaFunction<std::shared_ptr<DownstreamState>(const NumberedServerVector&, const ComboAddress&, const DNSName&, uint16_t, dnsheader*)> policy(code);
+      policy.prepare();
+      g_policy.setState(ServerPolicy{name, policy, false});
     });
 
   g_lua.writeFunction("showServerPolicy", []() {
@@ -285,20 +427,13 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
   g_lua.writeFunction("truncateTC", [](bool tc) { setLuaSideEffect(); g_truncateTC=tc; });
   g_lua.writeFunction("fixupCase", [](bool fu) { setLuaSideEffect(); g_fixupCase=fu; });
 
-  g_lua.registerMember("name", &ServerPolicy::name);
-  g_lua.registerMember("policy", &ServerPolicy::policy);
-  g_lua.writeFunction("newServerPolicy", [](string name, policy_t policy) { return ServerPolicy{name, policy};});
-  g_lua.writeVariable("firstAvailable", ServerPolicy{"firstAvailable", firstAvailable});
-  g_lua.writeVariable("roundrobin", ServerPolicy{"roundrobin", roundrobin});
-  g_lua.writeVariable("wrandom", ServerPolicy{"wrandom", wrandom});
-  g_lua.writeVariable("whashed", ServerPolicy{"whashed", whashed});
-  g_lua.writeVariable("leastOutstanding", ServerPolicy{"leastOutstanding", leastOutstanding});
+  g_lua.writeFunction("newServerPolicy", [](string name, policy_t policy) { return ServerPolicy{name, policy, true};});
   g_lua.writeFunction("addACL", [](const std::string& domain) {
       setLuaSideEffect();
       g_ACL.modify([domain](NetmaskGroup& nmg) { nmg.addMask(domain); });
     });
 
-  g_lua.writeFunction("setLocal", [client](const std::string& addr, boost::optional<bool> doTCP) {
+  g_lua.writeFunction("setLocal", [client](const std::string& addr, boost::optional<bool> doTCP, boost::optional<int> udpBatchSize) {
       setLuaSideEffect();
       if(client)
 	return;
@@ -309,14 +444,14 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
       try {
 	ComboAddress loc(addr, 53);
 	g_locals.clear();
-	g_locals.push_back({loc, doTCP ? *doTCP : true}); /// only works pre-startup, so no sync necessary
+	g_locals.push_back(std::make_tuple(loc, doTCP ? *doTCP : true, udpBatchSize && *udpBatchSize > 0 ? *udpBatchSize : 0)); /// only works pre-startup, so no sync necessary
       }
       catch(std::exception& e) {
 	g_outputBuffer="Error: "+string(e.what())+"\n";
       }
     });
 
-  g_lua.writeFunction("addLocal", [client](const std::string& addr, boost::optional<bool> doTCP) {
+  g_lua.writeFunction("addLocal", [client](const std::string& addr, boost::optional<bool> doTCP, boost::optional<int> udpBatchSize) {
       setLuaSideEffect();
       if(client)
 	return;
@@ -326,7 +461,7 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
       }
       try {
 	ComboAddress loc(addr, 53);
-	g_locals.push_back({loc, doTCP ? *doTCP : true}); /// only works pre-startup, so no sync necessary
+	g_locals.push_back(std::make_tuple(loc, doTCP ? *doTCP : true, udpBatchSize && *udpBatchSize > 0 ? *udpBatchSize : 0)); /// only works pre-startup, so no sync necessary
       }
       catch(std::exception& e) {
 	g_outputBuffer="Error: "+string(e.what())+"\n";
@@ -421,6 +556,28 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 			  });
 		      });
 
+  g_lua.writeFunction("addLuaActionPerThread", [](luadnsrule_t var, string code)
+		      {
+                        setLuaSideEffect();
+			auto rule=makeRule(var);
+			auto action=std::make_shared<LuaPerThreadAction>(code);
+			g_rulactions.modify([rule,action](decltype(g_rulactions)::value_type& rulactions){
+			    rulactions.push_back({rule, action});
+			  });
+		      });
+
+  g_lua.writeFunction("setBlockFilterPerThread", [](string code)
+		      {
+                        setLuaSideEffect();
+			if(code.empty()) {
+			  g_perThreadBlockFilter.setState(blockfilter_t());
+			  return;
+			}
+			PerThreadLuaFunction<bool(ComboAddress, DNSName, uint16_t, dnsheader*)> blockFilter(code);
+			blockFilter.prepare();
+			g_perThreadBlockFilter.setState(blockFilter);
+		      });
+
 
   g_lua.writeFunction("NoRecurseAction", []() {
       return std::shared_ptr<DNSAction>(new NoRecurseAction);
@@ -662,10 +819,6 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
       return ret;
     });
 
-  g_lua.writeFunction("getPoolServers", [](string pool) {
-      return getDownstreamCandidates(g_dstates.getCopy(), pool);
-    });
-
   g_lua.writeFunction("getServer", [client](int i) {
       if (client)
         return std::make_shared<DownstreamState>(ComboAddress());
@@ -679,67 +832,15 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
   g_lua.registerFunction<void(DownstreamState::*)()>("getOutstanding", [](const DownstreamState& s) { g_outputBuffer=std::to_string(s.outstanding.load()); });
 
 
-  g_lua.registerFunction("isUp", &DownstreamState::isUp);
   g_lua.registerFunction("setDown", &DownstreamState::setDown);
   g_lua.registerFunction("setUp", &DownstreamState::setUp);
   g_lua.registerFunction("setAuto", &DownstreamState::setAuto);
-  g_lua.registerMember("upStatus", &DownstreamState::upStatus);
-  g_lua.registerMember("weight", &DownstreamState::weight);
-  g_lua.registerMember("order", &DownstreamState::order);
-  
-  g_lua.writeFunction("infolog", [](const string& arg) {
-      infolog("%s", arg);
-    });
-  g_lua.writeFunction("errlog", [](const string& arg) {
-      errlog("%s", arg);
-    });
-  g_lua.writeFunction("warnlog", [](const string& arg) {
-      warnlog("%s", arg);
-    });
-
 
   g_lua.writeFunction("show", [](const string& arg) {
       g_outputBuffer+=arg;
       g_outputBuffer+="\n";
     });
 
-  g_lua.registerFunction<void(dnsheader::*)(bool)>("setRD", [](dnsheader& dh, bool v) {
-      dh.rd=v;
-    });
-
-  g_lua.registerFunction<bool(dnsheader::*)()>("getRD", [](dnsheader& dh) {
-      return (bool)dh.rd;
-    });
-
-  g_lua.registerFunction<void(dnsheader::*)(bool)>("setCD", [](dnsheader& dh, bool v) {
-      dh.cd=v;
-    });
-
-  g_lua.registerFunction<bool(dnsheader::*)()>("getCD", [](dnsheader& dh) {
-      return (bool)dh.cd;
-    });
-
-
-  g_lua.registerFunction<void(dnsheader::*)(bool)>("setTC", [](dnsheader& dh, bool v) {
-      dh.tc=v;
-      if(v) dh.ra = dh.rd; // you'll always need this, otherwise TC=1 gets ignored
-    });
-
-  g_lua.registerFunction<void(dnsheader::*)(bool)>("setQR", [](dnsheader& dh, bool v) {
-      dh.qr=v;
-    });
-
-
-  g_lua.registerFunction("tostring", &ComboAddress::toString);
-
-  g_lua.registerFunction("isPartOf", &DNSName::isPartOf);
-  g_lua.registerFunction<string(DNSName::*)()>("tostring", [](const DNSName&dn ) { return dn.toString(); });
-  g_lua.writeFunction("newDNSName", [](const std::string& name) { return DNSName(name); });
-  g_lua.writeFunction("newSuffixMatchNode", []() { return SuffixMatchNode(); });
-
-  g_lua.registerFunction("add",(void (SuffixMatchNode::*)(const DNSName&)) &SuffixMatchNode::add);
-  g_lua.registerFunction("check",(bool (SuffixMatchNode::*)(const DNSName&) const) &SuffixMatchNode::check);
-
   g_lua.writeFunction("carbonServer", [](const std::string& address, boost::optional<string> ourName,
 					 boost::optional<int> interval) {
                         setLuaSideEffect();
@@ -813,9 +914,9 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
       auto top = top_.get_value_or(10);
       map<ComboAddress, int,ComboAddress::addressOnlyLessThan > counts;
       unsigned int total=0;
-      {
-        ReadLock rl(&g_rings.queryLock);
-        for(const auto& c : g_rings.queryRing) {
+      for(const auto& shard : g_rings.d_shards) {
+        std::lock_guard<std::mutex> rl(shard->queryLock);
+        for(const auto& c : shard->queryRing) {
           counts[c.requestor]++;
           total++;
         }
@@ -844,20 +945,21 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
       setLuaNoSideEffect();
       map<DNSName, int> counts;
       unsigned int total=0;
-      if(!labels) {
-	ReadLock rl(&g_rings.queryLock);
-	for(const auto& a : g_rings.queryRing) {
-	  counts[a.name]++;
-	  total++;
+      for(const auto& shard : g_rings.d_shards) {
+	std::lock_guard<std::mutex> rl(shard->queryLock);
+	if(!labels) {
+	  for(const auto& a : shard->queryRing) {
+	    counts[a.name]++;
+	    total++;
+	  }
 	}
-      }
-      else {
-	unsigned int lab = *labels;
-	ReadLock rl(&g_rings.queryLock);
-	for(auto a : g_rings.queryRing) {
-	  a.name.trimToLabels(lab);
-	  counts[a.name]++;
-	  total++;
+	else {
+	  unsigned int lab = *labels;
+	  for(auto a : shard->queryRing) {
+	    a.name.trimToLabels(lab);
+	    counts[a.name]++;
+	    total++;
+	  }
 	}
       }
       // cout<<"Looked at "<<total<<" queries, "<<counts.size()<<" different ones"<<endl;
@@ -890,11 +992,10 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 
   g_lua.writeFunction("getResponseRing", []() {
       setLuaNoSideEffect();
-      decltype(g_rings.respRing) ring;
-      {
-	std::lock_guard<std::mutex> lock(g_rings.respMutex);
-	ring = g_rings.respRing;
-      }
+      auto ring = g_rings.getResponses();
+      sort(ring.begin(), ring.end(), [](const decltype(ring)::value_type& a, const decltype(ring)::value_type& b) {
+        return a.when < b.when;
+      });
       vector<std::unordered_map<string, boost::variant<string, unsigned int> > > ret;
       ret.reserve(ring.size());
       decltype(ret)::value_type item;
@@ -912,10 +1013,10 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
       setLuaNoSideEffect();
       map<DNSName, int> counts;
       unsigned int total=0;
-      {
-	std::lock_guard<std::mutex> lock(g_rings.respMutex);
+      for(const auto& shard : g_rings.d_shards) {
+	std::lock_guard<std::mutex> rl(shard->respLock);
 	if(!labels) {
-	  for(const auto& a : g_rings.respRing) {
+	  for(const auto& a : shard->respRing) {
 	    if(a.dh.rcode!=kind)
 	      continue;
 	    counts[a.name]++;
@@ -924,7 +1025,7 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 	}
 	else {
 	  unsigned int lab = *labels;
-	  for(auto a : g_rings.respRing) {
+	  for(auto a : shard->respRing) {
 	    if(a.dh.rcode!=kind)
 	      continue;
 
@@ -973,9 +1074,9 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 
       double totlat=0;
       int size=0;
-      {
-	std::lock_guard<std::mutex> lock(g_rings.respMutex);
-	for(const auto& r : g_rings.respRing) {
+      for(const auto& shard : g_rings.d_shards) {
+	std::lock_guard<std::mutex> rl(shard->respLock);
+	for(const auto& r : shard->respRing) {
 	  ++size;
 	  auto iter = histo.lower_bound(r.usec);
 	  if(iter != histo.end())
@@ -1014,9 +1115,6 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
       }
     });
 
-  g_lua.writeFunction("newQPSLimiter", [](int rate, int burst) { return QPSLimiter(rate, burst); });
-  g_lua.registerFunction("check", &QPSLimiter::check);
-
 
   g_lua.writeFunction("makeKey", []() {
       setLuaNoSideEffect();
@@ -1086,6 +1184,14 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 
   g_lua.writeFunction("setMaxTCPClientThreads", [](uint64_t max) { g_maxTCPClientThreads = max; });
 
+  g_lua.writeFunction("setUDPBatchSize", [](unsigned int size) {
+      if (!g_configurationDone) {
+        g_udpBatchSize = size > 0 ? size : 1;
+      } else {
+        g_outputBuffer="UDP batch size cannot be altered at runtime!\n";
+      }
+    });
+
   g_lua.writeFunction("setECSSourcePrefixV4", [](uint16_t prefix) { g_ECSSourcePrefixV4=prefix; });
 
   g_lua.writeFunction("setECSSourcePrefixV6", [](uint16_t prefix) { g_ECSSourcePrefixV6=prefix; });
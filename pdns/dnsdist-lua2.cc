@@ -62,15 +62,18 @@ map<ComboAddress,int> exceedRespGen(int rate, int seconds, std::function<void(co
   cutoff = mintime = now;
   cutoff.tv_sec -= seconds;
   
-  for(const auto& c : g_rings.respRing) {
-    if(seconds && c.when < cutoff)
-      continue;
-    if(now < c.when)
-      continue;
-
-    T(counts, c);
-    if(c.when < mintime)
-      mintime = c.when;
+  for(const auto& shard : g_rings.d_shards) {
+    std::lock_guard<std::mutex> rl(shard->respLock);
+    for(const auto& c : shard->respRing) {
+      if(seconds && c.when < cutoff)
+        continue;
+      if(now < c.when)
+        continue;
+
+      T(counts, c);
+      if(c.when < mintime)
+        mintime = c.when;
+    }
   }
   double delta = seconds ? seconds : DiffTime(now, mintime);
   return filterScore(counts, delta, rate);
@@ -84,15 +87,17 @@ map<ComboAddress,int> exceedQueryGen(int rate, int seconds, std::function<void(c
   cutoff = mintime = now;
   cutoff.tv_sec -= seconds;
 
-  ReadLock rl(&g_rings.queryLock);
-  for(const auto& c : g_rings.queryRing) {
-    if(seconds && c.when < cutoff)
-      continue;
-    if(now < c.when)
-      continue;
-    T(counts, c);
-    if(c.when < mintime)
-      mintime = c.when;
+  for(const auto& shard : g_rings.d_shards) {
+    std::lock_guard<std::mutex> rl(shard->queryLock);
+    for(const auto& c : shard->queryRing) {
+      if(seconds && c.when < cutoff)
+        continue;
+      if(now < c.when)
+        continue;
+      T(counts, c);
+      if(c.when < mintime)
+        mintime = c.when;
+    }
   }
   double delta = seconds ? seconds : DiffTime(now, mintime);
   return filterScore(counts, delta, rate);
@@ -116,11 +121,35 @@ map<ComboAddress,int> exceedRespByterate(int rate, int seconds)
 		   });
 }
 
+static bool parseTopTalkersKind(const std::string& name, TopTalkersAggregator::Kind& kind)
+{
+  if(name == "queries")
+    kind = TopTalkersAggregator::Kind::Queries;
+  else if(name == "bandwidth")
+    kind = TopTalkersAggregator::Kind::Bandwidth;
+  else if(name == "rcode")
+    kind = TopTalkersAggregator::Kind::RCode;
+  else if(name == "qtype")
+    kind = TopTalkersAggregator::Kind::QType;
+  else {
+    g_outputBuffer="Unknown kind '"+name+"', expected one of 'queries', 'bandwidth', 'rcode' or 'qtype'\n";
+    return false;
+  }
+  return true;
+}
+
+/* the window can not be longer than what the aggregates keep */
+static unsigned int getTopTalkersSeconds(int seconds)
+{
+  if(seconds <= 0 || (size_t) seconds > g_rings.getTopTalkersWindow())
+    return g_rings.getTopTalkersWindow();
+  return seconds;
+}
+
 
 void moreLua()
 {
   typedef NetmaskTree<DynBlock> nmts_t;
-  g_lua.writeFunction("newCA", [](const std::string& name) { return ComboAddress(name); });
   g_lua.writeFunction("newNMG", []() { return nmts_t(); });
   g_lua.registerFunction<void(nmts_t::*)(const ComboAddress&, const std::string&, boost::optional<int> seconds)>("add", 
 														 [](nmts_t& s, const ComboAddress& ca, const std::string& msg, boost::optional<int> seconds) 
@@ -211,6 +240,61 @@ void moreLua()
 
     });
 
+  g_lua.writeFunction("getTopTalkers", [](const std::string& kindName, unsigned int top, int seconds, boost::optional<uint16_t> value) {
+      setLuaNoSideEffect();
+      std::unordered_map<int, vector<boost::variant<string,double>>> ret;
+      TopTalkersAggregator::Kind kind;
+      if(!parseTopTalkersKind(kindName, kind))
+        return ret;
+
+      unsigned int actualSeconds = getTopTalkersSeconds(seconds);
+      auto counts = g_rings.getTopTalkers(kind, value ? *value : 0, actualSeconds);
+      vector<pair<uint64_t, ComboAddress>> rcounts;
+      rcounts.reserve(counts.size());
+      for(const auto& c : counts)
+        rcounts.push_back(make_pair(c.second, c.first));
+
+      top = rcounts.size() < top ? rcounts.size() : top;
+      partial_sort(rcounts.begin(), rcounts.begin() + top, rcounts.end(), [](const decltype(rcounts)::value_type& a,
+                                                                           const decltype(rcounts)::value_type& b) {
+                     return b.first < a.first;
+                   });
+
+      for(unsigned int count = 0; count < top; count++) {
+        const auto& rc = rcounts.at(count);
+        ret.insert({count + 1, {rc.second.toString(), (double) rc.first, 1.0 * rc.first / actualSeconds}});
+      }
+      return ret;
+    });
+
+  g_lua.executeCode(R"(function topTalkers(kind, top, seconds, value) top = top or 10; seconds = seconds or 0; for k,v in ipairs(getTopTalkers(kind, top, seconds, value)) do show(string.format("%4d  %-40s %10d %10.1f/s",k,v[1],v[2],v[3])) end end)");
+
+  g_lua.writeFunction("exceedTalkersRate", [](const std::string& kindName, unsigned int rate, int seconds, boost::optional<uint16_t> value) {
+      setLuaNoSideEffect();
+      map<ComboAddress,int> ret;
+      TopTalkersAggregator::Kind kind;
+      if(!parseTopTalkersKind(kindName, kind))
+        return ret;
+
+      unsigned int actualSeconds = getTopTalkersSeconds(seconds);
+      const double limit = 1.0 * rate * actualSeconds;
+      for(const auto& c : g_rings.getTopTalkers(kind, value ? *value : 0, actualSeconds)) {
+        if(c.second > limit)
+          ret[c.first] = c.second;
+      }
+      return ret;
+    });
+
+  g_lua.writeFunction("setTopTalkersParameters", [](size_t topKSize, size_t seconds) {
+      setLuaSideEffect();
+      if (g_configurationDone) {
+        errlog("setTopTalkersParameters() cannot be used at runtime!");
+        g_outputBuffer="setTopTalkersParameters() cannot be used at runtime!\n";
+        return;
+      }
+      g_rings.setTopTalkersParameters(topKSize, seconds);
+    });
+
   g_lua.writeFunction("topBandwidth", [](unsigned int top) {
       setLuaNoSideEffect();
       auto res = g_rings.getTopBandwidth(top);
@@ -249,20 +333,11 @@ void moreLua()
           }
       }
 
-      decltype(g_rings.queryRing) qr;
-      decltype(g_rings.respRing) rr;
-      {
-        ReadLock rl(&g_rings.queryLock);
-        qr=g_rings.queryRing;
-      }
+      auto qr = g_rings.getQueries();
       sort(qr.begin(), qr.end(), [](const decltype(qr)::value_type& a, const decltype(qr)::value_type& b) {
         return b.when < a.when;
       });
-      {
-	std::lock_guard<std::mutex> lock(g_rings.respMutex);
-        rr=g_rings.respRing;
-      }
-
+      auto rr = g_rings.getResponses();
       sort(rr.begin(), rr.end(), [](const decltype(rr)::value_type& a, const decltype(rr)::value_type& b) {
         return b.when < a.when;
       });
@@ -308,6 +383,16 @@ void moreLua()
       }
     });
 
+  g_lua.writeFunction("setRingBuffersSize", [](size_t capacity, boost::optional<size_t> numberOfShards) {
+      setLuaSideEffect();
+      if (g_configurationDone) {
+        errlog("setRingBuffersSize() cannot be used at runtime!");
+        g_outputBuffer="setRingBuffersSize() cannot be used at runtime!\n";
+        return;
+      }
+      g_rings.setCapacity(capacity, numberOfShards ? *numberOfShards : g_rings.getNumberOfShards());
+    });
+
   g_lua.writeFunction("addDNSCryptBind", [](const std::string& addr, const std::string& providerName, const std::string& certFile, const std::string keyFile) {
       if (g_configurationDone) {
         g_outputBuffer="addDNSCryptBind cannot be used at runtime!\n";
@@ -422,4 +507,56 @@ void moreLua()
 #endif
     });
 
+    g_lua.writeFunction("newPacketCache", [](size_t maxEntries, boost::optional<uint32_t> maxTTL, boost::optional<uint32_t> minTTL, boost::optional<uint32_t> servFailTTL) {
+        return std::make_shared<DNSDistPacketCache>(maxEntries, maxTTL ? *maxTTL : 86400, minTTL ? *minTTL : 0, servFailTTL ? *servFailTTL : 60);
+      });
+    g_lua.registerFunction("toString", &DNSDistPacketCache::toString);
+    g_lua.registerFunction("isFull", &DNSDistPacketCache::isFull);
+    g_lua.registerFunction("purgeExpired", &DNSDistPacketCache::purgeExpired);
+    g_lua.registerFunction("expunge", &DNSDistPacketCache::expunge);
+    g_lua.registerFunction<void(std::shared_ptr<DNSDistPacketCache>::*)(const DNSName& dname, boost::optional<uint16_t> qtype)>("expungeByName", [](std::shared_ptr<DNSDistPacketCache> cache, const DNSName& dname, boost::optional<uint16_t> qtype) {
+        if (cache) {
+          cache->expungeByName(dname, qtype ? *qtype : QType::ANY);
+        }
+      });
+    g_lua.registerFunction<void(std::shared_ptr<DNSDistPacketCache>::*)()>("printStats", [](const std::shared_ptr<DNSDistPacketCache> cache) {
+        if (cache) {
+          const uint64_t hits = cache->getHits();
+          const uint64_t misses = cache->getMisses();
+          g_outputBuffer="Entries: " + std::to_string(cache->getSize()) + "/" + std::to_string(cache->getMaxEntries()) + "\n";
+          g_outputBuffer+="Hits: " + std::to_string(hits) + "\n";
+          g_outputBuffer+="Misses: " + std::to_string(misses) + "\n";
+          g_outputBuffer+="Hit ratio: " + std::to_string(hits + misses ? 100.0 * hits / (hits + misses) : 0.0) + "%\n";
+          g_outputBuffer+="Deferred inserts: " + std::to_string(cache->getDeferredInserts()) + "\n";
+          g_outputBuffer+="Deferred lookups: " + std::to_string(cache->getDeferredLookups()) + "\n";
+          g_outputBuffer+="Lookup Collisions: " + std::to_string(cache->getLookupCollisions()) + "\n";
+          g_outputBuffer+="Insert Collisions: " + std::to_string(cache->getInsertCollisions()) + "\n";
+          g_outputBuffer+="Evictions: " + std::to_string(cache->getEvictions()) + "\n";
+        }
+      });
+
+    g_lua.writeFunction("getPool", [](const string& poolName) {
+        auto localPools = g_pools.getCopy();
+        std::shared_ptr<ServerPool> pool = createPoolIfNotExists(localPools, poolName);
+        g_pools.setState(localPools);
+        return pool;
+      });
+    g_lua.registerFunction<void(std::shared_ptr<ServerPool>::*)(std::shared_ptr<DNSDistPacketCache>)>("setCache", [](std::shared_ptr<ServerPool> pool, std::shared_ptr<DNSDistPacketCache> cache) {
+        if (pool) {
+          pool->setCache(cache);
+        }
+      });
+    g_lua.registerFunction<std::shared_ptr<DNSDistPacketCache>(std::shared_ptr<ServerPool>::*)()>("getCache", [](const std::shared_ptr<ServerPool> pool) {
+        std::shared_ptr<DNSDistPacketCache> cache;
+        if (pool) {
+          cache = pool->getCache();
+        }
+        return cache;
+      });
+    g_lua.registerFunction<void(std::shared_ptr<ServerPool>::*)()>("unsetCache", [](std::shared_ptr<ServerPool> pool) {
+        if (pool) {
+          pool->setCache(nullptr);
+        }
+      });
+    g_lua.writeFunction("setCacheCleaningDelay", [](uint32_t delay) { g_cacheCleaningInterval = delay ? delay : 1; });
 }
@@ -1,28 +1,102 @@
 #include "dnsdist.hh"
 #include "lock.hh"
 
+void Rings::setCapacity(size_t capacity, size_t numberOfShards)
+{
+  if(numberOfShards == 0)
+    numberOfShards = 1;
+
+  vector<std::unique_ptr<Shard> > shards;
+  shards.reserve(numberOfShards);
+  for(size_t idx = 0; idx < numberOfShards; idx++) {
+    std::unique_ptr<Shard> shard(new Shard(d_topKSize, d_numberOfBuckets));
+    shard->queryRing.set_capacity(capacity);
+    shard->respRing.set_capacity(capacity);
+    shards.push_back(std::move(shard));
+  }
+  d_shards = std::move(shards);
+  d_capacity = capacity;
+}
+
+void Rings::setTopTalkersParameters(size_t topKSize, size_t numberOfBuckets)
+{
+  d_topKSize = topKSize;
+  d_numberOfBuckets = numberOfBuckets ? numberOfBuckets : 1;
+  setCapacity(d_capacity, d_shards.size());
+}
+
+TopTalkersAggregator::counts_t Rings::getTopTalkers(TopTalkersAggregator::Kind kind, uint16_t value, unsigned int seconds)
+{
+  TopTalkersAggregator::counts_t counts;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  for(const auto& shard : d_shards) {
+    if(kind != TopTalkersAggregator::Kind::RCode) {
+      std::lock_guard<std::mutex> rl(shard->queryLock);
+      shard->queryTalkers.merge(kind, value, now.tv_sec, seconds, counts);
+    }
+    if(kind == TopTalkersAggregator::Kind::RCode || kind == TopTalkersAggregator::Kind::Bandwidth) {
+      std::lock_guard<std::mutex> rl(shard->respLock);
+      shard->respTalkers.merge(kind, value, now.tv_sec, seconds, counts);
+    }
+  }
+  return counts;
+}
+
+/* each thread sticks to the shard it got the first time it inserted something */
+Rings::Shard& Rings::getOwnShard()
+{
+  static thread_local size_t t_shardIndex = d_nextShard++;
+  return *d_shards[t_shardIndex % d_shards.size()];
+}
+
+vector<Rings::Query> Rings::getQueries()
+{
+  vector<Query> ret;
+  for(const auto& shard : d_shards) {
+    std::lock_guard<std::mutex> rl(shard->queryLock);
+    ret.insert(ret.end(), shard->queryRing.begin(), shard->queryRing.end());
+  }
+  return ret;
+}
+
+vector<Rings::Response> Rings::getResponses()
+{
+  vector<Response> ret;
+  for(const auto& shard : d_shards) {
+    std::lock_guard<std::mutex> rl(shard->respLock);
+    ret.insert(ret.end(), shard->respRing.begin(), shard->respRing.end());
+  }
+  return ret;
+}
+
 unsigned int Rings::numDistinctRequestors()
 {
   std::set<ComboAddress, ComboAddress::addressOnlyLessThan> s;
-  WriteLock wl(&queryLock);
-  for(const auto& q : queryRing)
-    s.insert(q.requestor);
+  for(const auto& shard : d_shards) {
+    std::lock_guard<std::mutex> rl(shard->queryLock);
+    for(const auto& q : shard->queryRing)
+      s.insert(q.requestor);
+  }
   return s.size();
 }
 
 vector<pair<unsigned int,ComboAddress> > Rings::getTopBandwidth(unsigned int numentries)
 {
   map<ComboAddress, unsigned int, ComboAddress::addressOnlyLessThan> counts;
-  {
-    WriteLock wl(&queryLock);
-    for(const auto& q : queryRing)
-      counts[q.requestor]+=q.size;
-  }
+  for(const auto& shard : d_shards) {
+    {
+      std::lock_guard<std::mutex> rl(shard->queryLock);
+      for(const auto& q : shard->queryRing)
+        counts[q.requestor]+=q.size;
+    }
 
-  {
-    std::lock_guard<std::mutex> lock(respMutex);
-    for(const auto& r : respRing)
-      counts[r.requestor]+=r.size;
+    {
+      std::lock_guard<std::mutex> rl(shard->respLock);
+      for(const auto& r : shard->respRing)
+        counts[r.requestor]+=r.size;
+    }
   }
 
   typedef vector<pair<unsigned int, ComboAddress>> ret_t;
@@ -113,7 +113,6 @@ void* tcpClientThread(int pipefd)
   /* we get launched with a pipe on which we receive file descriptors from clients that we own
      from that point on */
      
-  typedef std::function<bool(ComboAddress, DNSName, uint16_t, dnsheader*)> blockfilter_t;
   blockfilter_t blockFilter = 0;
   
   {
@@ -126,6 +125,7 @@ void* tcpClientThread(int pipefd)
   auto localPolicy = g_policy.getLocal();
   auto localRulactions = g_rulactions.getLocal();
   auto localDynBlockNMG = g_dynblockNMG.getLocal();
+  auto localPerThreadBlockFilter = g_perThreadBlockFilter.getLocal();
 
   map<ComboAddress,int> sockets;
   for(;;) {
@@ -193,10 +193,7 @@ void* tcpClientThread(int pipefd)
 	struct timespec now;
 	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	{
-	  WriteLock wl(&g_rings.queryLock);
-	  g_rings.queryRing.push_back({now,ci.remote,qname,queryLen,qtype,*dh});
-	}
+	g_rings.insertQuery(now, ci.remote, qname, qtype, queryLen, *dh);
 
 	g_stats.queries++;
 	if (ci.cs) {
@@ -228,6 +225,17 @@ void* tcpClientThread(int pipefd)
             dh->qr=false;
           }
         }
+
+        if(*localPerThreadBlockFilter) {
+          if((*localPerThreadBlockFilter)(ci.remote, qname, qtype, dh)) {
+            g_stats.blockFilter++;
+            goto drop;
+          }
+          if(dh->tc && dh->qr) { // don't truncate on TCP/IP!
+            dh->tc=false;
+            dh->qr=false;
+          }
+        }
 	
 	DNSAction::Action action=DNSAction::Action::None;
 	for(const auto& lr : *localRulactions) {
@@ -271,10 +279,13 @@ void* tcpClientThread(int pipefd)
 	  goto drop;
 	}
 
-	{
+	if(localPolicy->needsLock) {
 	  std::lock_guard<std::mutex> lock(g_luamutex);
 	  ds = localPolicy->policy(getDownstreamCandidates(g_dstates.getCopy(), pool), ci.remote, qname, qtype, dh);
 	}
+	else {
+	  ds = localPolicy->policy(getDownstreamCandidates(g_dstates.getCopy(), pool), ci.remote, qname, qtype, dh);
+	}
 	int dsock;
 	if(!ds) {
 	  g_stats.noPolicy++;
@@ -427,10 +438,7 @@ void* tcpClientThread(int pipefd)
         struct timespec answertime;
         clock_gettime(CLOCK_MONOTONIC, &answertime);
         unsigned int udiff = 1000000.0*DiffTime(now,answertime);
-        {
-          std::lock_guard<std::mutex> lock(g_rings.respMutex);
-          g_rings.respRing.push_back({answertime,  ci.remote, qname, qtype, (unsigned int)udiff, (unsigned int)responseLen, *dh});
-        }
+        g_rings.insertResponse(answertime, ci.remote, qname, qtype, (unsigned int)udiff, (unsigned int)responseLen, *dh);
 
         largerQuery.clear();
         rewrittenResponse.clear();
@@ -0,0 +1,87 @@
+#include "dns.hh"
+#include "dnsdist-topk.hh"
+
+TopTalkersAggregator::TopTalkersAggregator(size_t topKSize, size_t numberOfBuckets): d_buckets(numberOfBuckets ? numberOfBuckets : 1), d_topKSize(topKSize)
+{
+  for(auto& bucket : d_buckets) {
+    bucket.queries.setCapacity(d_topKSize);
+    bucket.bandwidth.setCapacity(d_topKSize);
+  }
+}
+
+TopTalkersAggregator::Bucket& TopTalkersAggregator::getBucket(time_t now)
+{
+  Bucket& bucket = d_buckets[now % d_buckets.size()];
+  if(bucket.second != now) {
+    /* last used numberOfBuckets seconds ago (or more), start over */
+    bucket.second = now;
+    bucket.queries.clear();
+    bucket.bandwidth.clear();
+    bucket.rcodes.clear();
+    bucket.qtypes.clear();
+  }
+  return bucket;
+}
+
+void TopTalkersAggregator::addToSummaries(std::map<uint16_t, summary_t>& summaries, uint16_t value, const ComboAddress& requestor)
+{
+  auto it = summaries.find(value);
+  if(it == summaries.end()) {
+    if(summaries.size() >= s_maxValuesPerBucket)
+      return;
+    it = summaries.insert({value, summary_t(d_topKSize)}).first;
+  }
+  it->second.add(requestor);
+}
+
+void TopTalkersAggregator::addQuery(time_t now, const ComboAddress& requestor, uint16_t qtype, unsigned int size)
+{
+  Bucket& bucket = getBucket(now);
+  bucket.queries.add(requestor);
+  bucket.bandwidth.add(requestor, size);
+  addToSummaries(bucket.qtypes, qtype, requestor);
+}
+
+void TopTalkersAggregator::addResponse(time_t now, const ComboAddress& requestor, uint8_t rcode, unsigned int size)
+{
+  Bucket& bucket = getBucket(now);
+  bucket.bandwidth.add(requestor, size);
+  if(rcode != RCode::NoError)
+    addToSummaries(bucket.rcodes, rcode, requestor);
+}
+
+void TopTalkersAggregator::mergeSummary(const summary_t& summary, counts_t& counts)
+{
+  for(const auto& entry : summary.getEntries()) {
+    counts[entry.key] += entry.count;
+  }
+}
+
+void TopTalkersAggregator::merge(Kind kind, uint16_t value, time_t now, unsigned int seconds, counts_t& counts) const
+{
+  for(const auto& bucket : d_buckets) {
+    if(bucket.second > now || bucket.second + seconds <= now)
+      continue;
+
+    switch(kind) {
+    case Kind::Queries:
+      mergeSummary(bucket.queries, counts);
+      break;
+    case Kind::Bandwidth:
+      mergeSummary(bucket.bandwidth, counts);
+      break;
+    case Kind::RCode: {
+      auto it = bucket.rcodes.find(value);
+      if(it != bucket.rcodes.end())
+        mergeSummary(it->second, counts);
+      break;
+    }
+    case Kind::QType: {
+      auto it = bucket.qtypes.find(value);
+      if(it != bucket.qtypes.end())
+        mergeSummary(it->second, counts);
+      break;
+    }
+    }
+  }
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "iputils.hh"
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+/* Space-Saving summary (Metwally, Agrawal, El Abbadi): keeps at most 'capacity' counters. A key that
+   is not tracked yet takes the place of the one with the lowest count, and inherits that count as its
+   'error'. Counts are therefore upper bounds, off by at most 'error', and any key that accounts for more
+   than 1/capacity of the total weight is guaranteed to be tracked. The counters are kept in a min-heap,
+   so that weighted updates (bytes, not only hits) cost O(log capacity). */
+template<typename T, class Hash=std::hash<T>, class Equal=std::equal_to<T> >
+class SpaceSavingTopK
+{
+public:
+  struct Entry
+  {
+    T key;
+    uint64_t count;
+    uint64_t error;
+  };
+
+  SpaceSavingTopK(size_t capacity=0): d_capacity(capacity)
+  {
+  }
+
+  void add(const T& key, uint64_t weight=1)
+  {
+    if(d_capacity == 0)
+      return;
+
+    auto it = d_positions.find(key);
+    if(it != d_positions.end()) {
+      d_heap[it->second].count += weight;
+      siftDown(it->second);
+      return;
+    }
+
+    if(d_heap.size() < d_capacity) {
+      d_heap.push_back({key, weight, 0});
+      d_positions[key] = d_heap.size() - 1;
+      siftUp(d_heap.size() - 1);
+      return;
+    }
+
+    Entry& smallest = d_heap[0];
+    d_positions.erase(smallest.key);
+    smallest.key = key;
+    smallest.error = smallest.count;
+    smallest.count += weight;
+    d_positions[key] = 0;
+    siftDown(0);
+  }
+
+  void clear()
+  {
+    d_heap.clear();
+    d_positions.clear();
+  }
+
+  void setCapacity(size_t capacity)
+  {
+    clear();
+    d_capacity = capacity;
+  }
+
+  /* in heap order, not sorted */
+  const std::vector<Entry>& getEntries() const
+  {
+    return d_heap;
+  }
+
+  size_t size() const
+  {
+    return d_heap.size();
+  }
+
+private:
+  void swapEntries(size_t a, size_t b)
+  {
+    std::swap(d_heap[a], d_heap[b]);
+    d_positions[d_heap[a].key] = a;
+    d_positions[d_heap[b].key] = b;
+  }
+
+  void siftUp(size_t idx)
+  {
+    while(idx > 0) {
+      size_t parent = (idx - 1) / 2;
+      if(d_heap[parent].count <= d_heap[idx].count)
+        break;
+      swapEntries(parent, idx);
+      idx = parent;
+    }
+  }
+
+  void siftDown(size_t idx)
+  {
+    for(;;) {
+      size_t smallest = idx;
+      size_t left = 2 * idx + 1;
+      size_t right = left + 1;
+      if(left < d_heap.size() && d_heap[left].count < d_heap[smallest].count)
+        smallest = left;
+      if(right < d_heap.size() && d_heap[right].count < d_heap[smallest].count)
+        smallest = right;
+      if(smallest == idx)
+        break;
+      swapEntries(smallest, idx);
+      idx = smallest;
+    }
+  }
+
+  std::vector<Entry> d_heap;
+  std::unordered_map<T, size_t, Hash, Equal> d_positions;
+  size_t d_capacity;
+};
+
+/* Who sent the most queries, the most bytes, asked for a given qtype or got a given rcode, one second
+   at a time over the last 'numberOfBuckets' seconds, so that the heaviest clients over a recent window
+   can be found without going over every query and response seen during that window.
+   Not thread-safe, see Rings::Shard for how it is protected. */
+class TopTalkersAggregator
+{
+public:
+  typedef SpaceSavingTopK<ComboAddress, ComboAddress::addressOnlyHash, ComboAddress::addressOnlyEqual> summary_t;
+  typedef std::unordered_map<ComboAddress, uint64_t, ComboAddress::addressOnlyHash, ComboAddress::addressOnlyEqual> counts_t;
+  enum class Kind : uint8_t { Queries, Bandwidth, RCode, QType };
+
+  TopTalkersAggregator(size_t topKSize, size_t numberOfBuckets);
+
+  void addQuery(time_t now, const ComboAddress& requestor, uint16_t qtype, unsigned int size);
+  /* NoError responses are only accounted for in the bandwidth */
+  void addResponse(time_t now, const ComboAddress& requestor, uint8_t rcode, unsigned int size);
+  /* adds the counts for the seconds in ]now - seconds, now] to 'counts'. 'value' is the
+     rcode or qtype for these kinds, ignored otherwise */
+  void merge(Kind kind, uint16_t value, time_t now, unsigned int seconds, counts_t& counts) const;
+
+  size_t getNumberOfBuckets() const
+  {
+    return d_buckets.size();
+  }
+
+private:
+  struct Bucket
+  {
+    std::map<uint16_t, summary_t> rcodes;
+    std::map<uint16_t, summary_t> qtypes;
+    summary_t queries;
+    summary_t bandwidth;
+    time_t second{0};
+  };
+
+  Bucket& getBucket(time_t now);
+  void addToSummaries(std::map<uint16_t, summary_t>& summaries, uint16_t value, const ComboAddress& requestor);
+  static void mergeSummary(const summary_t& summary, counts_t& counts);
+
+  std::vector<Bucket> d_buckets;
+  size_t d_topKSize;
+  /* so that random qtypes do not make us allocate a summary for each of them */
+  static const size_t s_maxValuesPerBucket = 64;
+};
@@ -80,8 +80,8 @@ static void connectionThread(int sock, ComboAddress remote, string password)
       resp.status=200;
 
       auto obj=Json::object {
-	{ "packetcache-hits", 0},
-	{ "packetcache-misses", 0},
+	{ "packetcache-hits", (int)g_stats.cacheHits.load()},
+	{ "packetcache-misses", (int)g_stats.cacheMisses.load()},
 	{ "over-capacity-drops", 0 },
 	{ "too-old-drops", 0 },
 	{ "server-policy", g_policy.getLocal()->name}
@@ -148,7 +148,8 @@ static void connectionThread(int sock, ComboAddress remote, string password)
 			{"weight", (int)a->weight}, 
 			  {"order", (int)a->order}, 
 			    {"pools", pools},
-			      {"queries", (int)a->queries}};
+			      {"queries", (int)a->queries},
+				{"checkLatency", a->checkLatencyUsec/1000.0}};
       
 	servers.push_back(server);
       }
@@ -179,7 +180,7 @@ static void connectionThread(int sock, ComboAddress remote, string password)
       string localaddresses;
       for(const auto& loc : g_locals) {
         if(!localaddresses.empty()) localaddresses += ", ";
-        localaddresses += loc.first.toStringWithPort();
+        localaddresses += std::get<0>(loc).toStringWithPort();
       }
  
       Json my_json = Json::object {
@@ -40,6 +40,7 @@
 #include <grp.h>
 #include <pwd.h>
 #include "lock.hh"
+#include "mplexer.hh"
 #include <getopt.h>
 
 /* Known sins:
@@ -60,11 +61,12 @@ bool g_verbose;
 
 struct DNSDistStats g_stats;
 uint16_t g_maxOutstanding;
+unsigned int g_udpBatchSize{1};
 bool g_console;
 
 GlobalStateHolder<NetmaskGroup> g_ACL;
 string g_outputBuffer;
-vector<std::pair<ComboAddress, bool>> g_locals;
+vector<std::tuple<ComboAddress, bool, unsigned int>> g_locals;
 #ifdef HAVE_DNSCRYPT
 std::vector<std::pair<ComboAddress,DnsCryptContext>> g_dnsCryptLocals;
 #endif
@@ -108,6 +110,8 @@ Rings g_rings;
 
 GlobalStateHolder<servers_t> g_dstates;
 GlobalStateHolder<NetmaskTree<DynBlock>> g_dynblockNMG;
+GlobalStateHolder<pools_t> g_pools;
+GlobalStateHolder<blockfilter_t> g_perThreadBlockFilter;
 int g_tcpRecvTimeout{2};
 int g_tcpSendTimeout{2};
 
@@ -235,6 +239,10 @@ void* responderThread(std::shared_ptr<DownstreamState> state)
       }
     }
 
+    if(ids->packetCache && !dh->tc) {
+      ids->packetCache->insert(ids->cacheKey, ids->qname, ids->qtype, ids->qclass, response, responseLen);
+    }
+
     g_stats.responses++;
 
 #ifdef HAVE_DNSCRYPT
@@ -269,8 +277,7 @@ void* responderThread(std::shared_ptr<DownstreamState> state)
     {
       struct timespec ts;
       clock_gettime(CLOCK_MONOTONIC, &ts);
-      std::lock_guard<std::mutex> lock(g_rings.respMutex);
-      g_rings.respRing.push_back({ts, ids->origRemote, ids->qname, ids->qtype, (unsigned int)udiff, (unsigned int)len, *dh});
+      g_rings.insertResponse(ts, ids->origRemote, ids->qname, ids->qtype, (unsigned int)udiff, (unsigned int)len, *dh);
     }
     if(dh->rcode == RCode::ServFail)
       g_stats.servfailResponses++;
@@ -296,6 +303,7 @@ void* responderThread(std::shared_ptr<DownstreamState> state)
 #ifdef HAVE_DNSCRYPT
       ids->dnsCryptQuery = 0;
 #endif
+      ids->packetCache = nullptr;
       ids->origFD = -1;
     }
 
@@ -452,6 +460,45 @@ NumberedServerVector getDownstreamCandidates(const servers_t& servers, const std
   return ret;
 }
 
+std::shared_ptr<ServerPool> getPool(const pools_t& pools, const std::string& poolName)
+{
+  auto it = pools.find(poolName);
+  if (it == pools.end())
+    return nullptr;
+  return it->second;
+}
+
+std::shared_ptr<ServerPool> createPoolIfNotExists(pools_t& pools, const string& poolName)
+{
+  std::shared_ptr<ServerPool> pool = getPool(pools, poolName);
+  if (!pool) {
+    pool = std::make_shared<ServerPool>();
+    pools.insert(std::pair<std::string,std::shared_ptr<ServerPool> >(poolName, pool));
+  }
+  return pool;
+}
+
+/* sums up a statistic over all the packet caches in use, counting a cache shared between pools only once */
+uint64_t getPacketCacheStat(const std::string& str)
+{
+  std::set<std::shared_ptr<DNSDistPacketCache>> caches;
+  auto pools = g_pools.getCopy();
+  for(const auto& entry : pools) {
+    auto packetCache = entry.second->getCache();
+    if(packetCache)
+      caches.insert(packetCache);
+  }
+
+  uint64_t result = 0;
+  for(const auto& cache : caches) {
+    if(str == "cache-entries")
+      result += cache->getSize();
+    else if(str == "cache-evictions")
+      result += cache->getEvictions();
+  }
+  return result;
+}
+
 // goal in life - if you send us a reasonably normal packet, we'll get Z for you, otherwise 0
 int getEDNSZ(const char* packet, unsigned int len)
 {
@@ -480,260 +527,524 @@ int getEDNSZ(const char* packet, unsigned int len)
   return 0x100 * (*z) + *(z+1);
 }
 
-// listens to incoming queries, sends out to downstream servers, noting the intended return path 
-static void* udpClientThread(ClientState* cs)
-try
+/* the state a UDP client thread consults for every query, local copies of the global state */
+struct UDPClientHolders
 {
-  ComboAddress remote;
-  remote.sin4.sin_family = cs->local.sin4.sin_family;
-  char packet[1500];
-  string largerQuery;
-  uint16_t qtype;
+  UDPClientHolders() : acl(g_ACL.getLocal()), policy(g_policy.getLocal()), rulactions(g_rulactions.getLocal()), servers(g_dstates.getLocal()), dynBlockNMG(g_dynblockNMG.getLocal()), pools(g_pools.getLocal()), perThreadBlockFilter(g_perThreadBlockFilter.getLocal())
+  {
+  }
+
+  LocalStateHolder<NetmaskGroup> acl;
+  LocalStateHolder<ServerPolicy> policy;
+  LocalStateHolder<vector<pair<std::shared_ptr<DNSRule>, std::shared_ptr<DNSAction> > > > rulactions;
+  LocalStateHolder<servers_t> servers;
+  LocalStateHolder<NetmaskTree<DynBlock>> dynBlockNMG;
+  LocalStateHolder<pools_t> pools;
+  LocalStateHolder<blockfilter_t> perThreadBlockFilter;
+  blockfilter_t blockFilter;
+};
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+#define DNSDIST_UDP_BATCHING 1
+
+/* Receives up to 'size' datagrams with a single recvmmsg(), and collects the responses we
+   generate ourselves and the queries we forward, so they can be sent with one sendmmsg() per
+   socket once the whole batch has been processed. Everything queued points into the slots,
+   so flush() has to be called before the next receive(). */
+class UDPBatch : public boost::noncopyable
+{
+public:
+  struct Slot
+  {
+    ComboAddress remote;
+    ComboAddress dest;
+    struct iovec iov;
+    char cbuf[256];
+    char outcbuf[256];
+    char packet[1500];
+    string largerQuery;
+  };
 
-  typedef std::function<bool(ComboAddress, DNSName, uint16_t, dnsheader*)> blockfilter_t;
-  blockfilter_t blockFilter = 0;
+  UDPBatch(unsigned int size, const ComboAddress& local) : d_slots(size), d_in(size)
   {
-    std::lock_guard<std::mutex> lock(g_luamutex);
-    auto candidate = g_lua.readVariable<boost::optional<blockfilter_t> >("blockFilter");
-    if(candidate)
-      blockFilter = *candidate;
+    d_responses.reserve(size);
+    d_forwards.reserve(size);
+    d_out.reserve(size);
+    d_outIov.reserve(size);
+    for(auto& slot : d_slots)
+      slot.remote.sin6.sin6_family = local.sin6.sin6_family;
   }
-  auto acl = g_ACL.getLocal();
-  auto localPolicy = g_policy.getLocal();
-  auto localRulactions = g_rulactions.getLocal();
-  auto localServers = g_dstates.getLocal();
-  auto localDynBlock = g_dynblockNMG.getLocal();
-  struct msghdr msgh;
-  struct iovec iov;
-  /* used by HarvestDestinationAddress */
-  char cbuf[256];
-  remote.sin6.sin6_family=cs->local.sin6.sin6_family;
-  fillMSGHdr(&msgh, &iov, cbuf, sizeof(cbuf), packet, sizeof(packet), &remote);
 
-  for(;;) {
-    try {
-#ifdef HAVE_DNSCRYPT
-      std::shared_ptr<DnsCryptQuery> dnsCryptQuery = 0;
-#endif
-      char* query = packet;
-      size_t querySize = sizeof(packet);
-      ssize_t ret = recvmsg(cs->udpFD, &msgh, 0);
+  // blocks until at least one datagram is available, returns the number received
+  int receive(int fd)
+  {
+    for(unsigned int i = 0; i < d_slots.size(); i++) {
+      auto& slot = d_slots[i];
+      slot.largerQuery.clear();
+      fillMSGHdr(&d_in[i].msg_hdr, &slot.iov, slot.cbuf, sizeof(slot.cbuf), slot.packet, sizeof(slot.packet), &slot.remote);
+      d_in[i].msg_len = 0;
+    }
+    return recvmmsg(fd, &d_in[0], d_in.size(), MSG_WAITFORONE, nullptr);
+  }
 
-      cs->queries++;
-      g_stats.queries++;
+  Slot& getSlot(unsigned int pos)
+  {
+    return d_slots[pos];
+  }
 
-      if(ret < (int)sizeof(struct dnsheader)) {
-	g_stats.nonCompliantQueries++;
-	continue;
-      }
+  struct msghdr* getMsgHdr(unsigned int pos)
+  {
+    return &d_in[pos].msg_hdr;
+  }
 
-      if (msgh.msg_flags & MSG_TRUNC) {
-        /* message was too large for our buffer */
-        vinfolog("Dropping message too large for our buffer");
-        g_stats.nonCompliantQueries++;
-        continue;
+  ssize_t getLength(unsigned int pos) const
+  {
+    return d_in[pos].msg_len;
+  }
+
+  void queueResponse(Slot& slot, const char* response, uint16_t responseLen, bool haveDest)
+  {
+    d_responses.push_back({&slot, response, responseLen, haveDest});
+  }
+
+  void queueForward(DownstreamState* ss, const char* query, uint16_t queryLen)
+  {
+    d_forwards.push_back({ss, query, queryLen});
+  }
+
+  void flush(int clientFD)
+  {
+    if(!d_responses.empty()) {
+      prepareOut(d_responses.size());
+      for(unsigned int i = 0; i < d_responses.size(); i++) {
+        auto& r = d_responses[i];
+        fillMSGHdr(&d_out[i].msg_hdr, &d_outIov[i], nullptr, 0, const_cast<char*>(r.data), r.len, &r.slot->remote);
+        if(r.haveDest)
+          addCMsgSrcAddr(&d_out[i].msg_hdr, r.slot->outcbuf, &r.slot->dest);
+        else
+          d_out[i].msg_hdr.msg_control = nullptr;
       }
+      sendAll(clientFD, d_responses.size(), nullptr);
+      d_responses.clear();
+    }
 
-      if(!acl->match(remote)) {
-	vinfolog("Query from %s dropped because of ACL", remote.toStringWithPort());
-	g_stats.aclDrops++;
-	continue;
+    if(!d_forwards.empty()) {
+      /* one sendmmsg() per downstream, the sort keeps the order of the queries for each of them */
+      std::stable_sort(d_forwards.begin(), d_forwards.end(), [](const Forward& a, const Forward& b) { return a.ss < b.ss; });
+      for(auto start = d_forwards.begin(); start != d_forwards.end(); ) {
+        auto end = start;
+        unsigned int count = 0;
+        prepareOut(d_forwards.size());
+        for(; end != d_forwards.end() && end->ss == start->ss; ++end, ++count) {
+          fillMSGHdr(&d_out[count].msg_hdr, &d_outIov[count], nullptr, 0, const_cast<char*>(end->data), end->len, &start->ss->remote);
+          /* the downstream socket is connected */
+          d_out[count].msg_hdr.msg_name = nullptr;
+          d_out[count].msg_hdr.msg_namelen = 0;
+          d_out[count].msg_hdr.msg_control = nullptr;
+        }
+        sendAll(start->ss->fd, count, start->ss);
+        start = end;
       }
+      d_forwards.clear();
+    }
+  }
 
-      uint16_t len = ret;
+private:
+  struct Response
+  {
+    Slot* slot;
+    const char* data;
+    uint16_t len;
+    bool haveDest;
+  };
+  struct Forward
+  {
+    DownstreamState* ss;
+    const char* data;
+    uint16_t len;
+  };
 
-#ifdef HAVE_DNSCRYPT
-      if (cs->dnscryptCtx) {
-        vector<uint8_t> response;
-        uint16_t decryptedQueryLen = 0;
-        dnsCryptQuery = std::make_shared<DnsCryptQuery>();
-
-        bool decrypted = handleDnsCryptQuery(cs->dnscryptCtx, query, len, dnsCryptQuery, &decryptedQueryLen, false, response);
-
-        if (!decrypted) {
-          if (response.size() > 0) {
-            ComboAddress dest;
-            if(HarvestDestinationAddress(&msgh, &dest))
-              sendfromto(cs->udpFD, (const char *) response.data(), response.size(), 0, dest, remote);
-            else
-              sendto(cs->udpFD, response.data(), response.size(), 0, (struct sockaddr*)&remote, remote.getSocklen());
-          }
-          continue;
+  void prepareOut(size_t count)
+  {
+    d_out.resize(count);
+    d_outIov.resize(count);
+  }
+
+  // sendmmsg() stops at the first error, skip the offending message and go on with the rest
+  void sendAll(int fd, unsigned int count, DownstreamState* ss)
+  {
+    unsigned int sent = 0;
+    while(sent < count) {
+      int ret = sendmmsg(fd, &d_out[sent], count - sent, 0);
+      if(ret <= 0) {
+        if(ss) {
+          ss->sendErrors++;
+          g_stats.downstreamSendErrors++;
         }
-        len = decryptedQueryLen;
+        sent++;
+      }
+      else {
+        sent += ret;
       }
+    }
+  }
+
+  vector<Slot> d_slots;
+  vector<struct mmsghdr> d_in;
+  vector<Response> d_responses;
+  vector<Forward> d_forwards;
+  vector<struct mmsghdr> d_out;
+  vector<struct iovec> d_outIov;
+};
+#else
+class UDPBatch
+{
+public:
+  struct Slot
+  {
+    ComboAddress remote;
+    ComboAddress dest;
+    string largerQuery;
+  };
+  void queueResponse(Slot& slot, const char* response, uint16_t responseLen, bool haveDest) {}
+  void queueForward(DownstreamState* ss, const char* query, uint16_t queryLen) {}
+};
 #endif
 
-      struct dnsheader* dh = (struct dnsheader*) query;
+/* Handles a single query received on cs->udpFD. When 'slot' is set the query is part of a batch, and
+   anything we have to send is queued in 'batch' instead of being sent right away. */
+static void processUDPQuery(ClientState* cs, UDPClientHolders& holders, struct msghdr* msgh, const ComboAddress& remote, char* query, size_t querySize, ssize_t ret, string& largerQuery, UDPBatch* batch, UDPBatch::Slot* slot)
+{
+#ifdef HAVE_DNSCRYPT
+  std::shared_ptr<DnsCryptQuery> dnsCryptQuery = 0;
+#endif
+  uint16_t qtype, qclass;
 
-      if(dh->qr) {   // don't respond to responses
-	g_stats.nonCompliantQueries++;
-	continue;
-      }
+  cs->queries++;
+  g_stats.queries++;
 
-      if (dh->rd) {
-        g_stats.rdQueries++;
-      }
+  if(ret < (int)sizeof(struct dnsheader)) {
+    g_stats.nonCompliantQueries++;
+    return;
+  }
 
-      const uint16_t * flags = getFlagsFromDNSHeader(dh);
-      const uint16_t origFlags = *flags;
-      unsigned int consumed = 0;
-      DNSName qname(query, len, sizeof(dnsheader), false, &qtype, NULL, &consumed);
-      struct timespec now;
-      clock_gettime(CLOCK_MONOTONIC, &now);
-      {
-        WriteLock wl(&g_rings.queryLock);
-        g_rings.queryRing.push_back({now,remote,qname,len,qtype,*dh});
-      }
+  if (msgh->msg_flags & MSG_TRUNC) {
+    /* message was too large for our buffer */
+    vinfolog("Dropping message too large for our buffer");
+    g_stats.nonCompliantQueries++;
+    return;
+  }
 
-      if(auto got=localDynBlock->lookup(remote)) {
-	if(now < got->second.until) {
-	  vinfolog("Query from %s dropped because of dynamic block", remote.toStringWithPort());
-	  g_stats.dynBlocked++;
-	  got->second.blocks++;
-	  continue;
-	}
+  if(!holders.acl->match(remote)) {
+    vinfolog("Query from %s dropped because of ACL", remote.toStringWithPort());
+    g_stats.aclDrops++;
+    return;
+  }
+
+  uint16_t len = ret;
+
+#ifdef HAVE_DNSCRYPT
+  if (cs->dnscryptCtx) {
+    vector<uint8_t> response;
+    uint16_t decryptedQueryLen = 0;
+    dnsCryptQuery = std::make_shared<DnsCryptQuery>();
+
+    bool decrypted = handleDnsCryptQuery(cs->dnscryptCtx, query, len, dnsCryptQuery, &decryptedQueryLen, false, response);
+
+    if (!decrypted) {
+      if (response.size() > 0) {
+        ComboAddress dest;
+        if(HarvestDestinationAddress(msgh, &dest))
+          sendfromto(cs->udpFD, (const char *) response.data(), response.size(), 0, dest, remote);
+        else
+          sendto(cs->udpFD, response.data(), response.size(), 0, (struct sockaddr*)&remote, remote.getSocklen());
       }
+      return;
+    }
+    len = decryptedQueryLen;
+  }
+#endif
+
+  struct dnsheader* dh = (struct dnsheader*) query;
+
+  if(dh->qr) {   // don't respond to responses
+    g_stats.nonCompliantQueries++;
+    return;
+  }
+
+  if (dh->rd) {
+    g_stats.rdQueries++;
+  }
+
+  const uint16_t * flags = getFlagsFromDNSHeader(dh);
+  const uint16_t origFlags = *flags;
+  unsigned int consumed = 0;
+  DNSName qname(query, len, sizeof(dnsheader), false, &qtype, &qclass, &consumed);
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  g_rings.insertQuery(now, remote, qname, qtype, len, *dh);
+
+  if(auto got=holders.dynBlockNMG->lookup(remote)) {
+    if(now < got->second.until) {
+      vinfolog("Query from %s dropped because of dynamic block", remote.toStringWithPort());
+      g_stats.dynBlocked++;
+      got->second.blocks++;
+      return;
+    }
+  }
+
+  if(holders.blockFilter) {
+    std::lock_guard<std::mutex> lock(g_luamutex);
+
+    if(holders.blockFilter(remote, qname, qtype, dh)) {
+      g_stats.blockFilter++;
+      return;
+    }
+  }
+
+  const auto& perThreadBlockFilter = *holders.perThreadBlockFilter;
+  if(perThreadBlockFilter && perThreadBlockFilter(remote, qname, qtype, dh)) {
+    g_stats.blockFilter++;
+    return;
+  }
+
+  DNSAction::Action action=DNSAction::Action::None;
+  string ruleresult;
+  string pool;
 
-      if(blockFilter) {
-	std::lock_guard<std::mutex> lock(g_luamutex);
-	
-	if(blockFilter(remote, qname, qtype, dh)) {
-	  g_stats.blockFilter++;
-	  continue;
-	}
+  for(const auto& lr : *holders.rulactions) {
+    if(lr.first->matches(remote, qname, qtype, dh, len)) {
+      action=(*lr.second)(remote, qname, qtype, dh, len, &ruleresult);
+      if(action != DNSAction::Action::None) {
+        lr.first->d_matches++;
+        break;
       }
+    }
+  }
+  int delayMsec=0;
+  switch(action) {
+  case DNSAction::Action::Drop:
+    g_stats.ruleDrop++;
+    return;
+  case DNSAction::Action::Nxdomain:
+    dh->rcode = RCode::NXDomain;
+    dh->qr=true;
+    g_stats.ruleNXDomain++;
+    break;
+  case DNSAction::Action::Pool:
+    pool=ruleresult;
+    break;
+  case DNSAction::Action::Spoof:
+    ;
+  case DNSAction::Action::HeaderModify:
+    break;
+  case DNSAction::Action::Delay:
+    delayMsec = static_cast<int>(pdns_stou(ruleresult)); // sorry
+    break;
+  case DNSAction::Action::Allow:
+  case DNSAction::Action::None:
+    break;
+  }
 
-      DNSAction::Action action=DNSAction::Action::None;
-      string ruleresult;
-      string pool;
-
-      for(const auto& lr : *localRulactions) {
-	if(lr.first->matches(remote, qname, qtype, dh, len)) {
-	  action=(*lr.second)(remote, qname, qtype, dh, len, &ruleresult);
-	  if(action != DNSAction::Action::None) {
-	    lr.first->d_matches++;
-	    break;
-	  }
-	}
+  std::shared_ptr<DNSDistPacketCache> packetCache = nullptr;
+  DNSDistPacketCache::CacheKey cacheKey;
+  bool cacheHit = false;
+  if(!dh->qr) {
+    auto serverPool = getPool(*holders.pools, pool);
+    if(serverPool)
+      packetCache = serverPool->getCache();
+    if(packetCache) {
+      /* a hit is copied over the query, and then sent back just like a self-answered query */
+      uint16_t cachedResponseSize = querySize > UINT16_MAX ? UINT16_MAX : querySize;
+      if(packetCache->get(query, len, qname, qtype, qclass, consumed, query, &cachedResponseSize, &cacheKey)) {
+        len = cachedResponseSize;
+        cacheHit = true;
+        g_stats.cacheHits++;
       }
-      int delayMsec=0;
-      switch(action) {
-      case DNSAction::Action::Drop:
-	g_stats.ruleDrop++;
-	continue;
-      case DNSAction::Action::Nxdomain:
-	dh->rcode = RCode::NXDomain;
-	dh->qr=true;
-	g_stats.ruleNXDomain++;
-	break;
-      case DNSAction::Action::Pool: 
-	pool=ruleresult;
-	break;
-      case DNSAction::Action::Spoof:
-	;
-      case DNSAction::Action::HeaderModify:
-	break;
-      case DNSAction::Action::Delay:
-	delayMsec = static_cast<int>(pdns_stou(ruleresult)); // sorry
-	break;
-      case DNSAction::Action::Allow:
-      case DNSAction::Action::None:
-	break;
+      else {
+        g_stats.cacheMisses++;
       }
+    }
+  }
 
-      if(dh->qr) { // something turned it into a response
-        char* response = query;
-        uint16_t responseLen = len;
+  if(dh->qr) { // something turned it into a response
+    char* response = query;
+    uint16_t responseLen = len;
 #ifdef HAVE_DNSCRYPT
-        uint16_t responseSize = querySize;
+    uint16_t responseSize = querySize;
 #endif
-        g_stats.selfAnswered++;
+    if(!cacheHit)
+      g_stats.selfAnswered++;
 
 #ifdef HAVE_DNSCRYPT
-        uint16_t encryptedResponseLen = 0;
+    uint16_t encryptedResponseLen = 0;
 
-        if(dnsCryptQuery) {
-          int res = cs->dnscryptCtx->encryptResponse(response, responseLen, responseSize, dnsCryptQuery, false, &encryptedResponseLen);
+    if(dnsCryptQuery) {
+      int res = cs->dnscryptCtx->encryptResponse(response, responseLen, responseSize, dnsCryptQuery, false, &encryptedResponseLen);
 
-          if (res == 0) {
-            responseLen = encryptedResponseLen;
-          } else {
-            /* dropping response */
-            continue;
-          }
-        }
+      if (res == 0) {
+        responseLen = encryptedResponseLen;
+      } else {
+        /* dropping response */
+        return;
+      }
+    }
 #endif
-        ComboAddress dest;
-        if(HarvestDestinationAddress(&msgh, &dest))
-          sendfromto(cs->udpFD, response, responseLen, 0, dest, remote);
-        else
-          sendto(cs->udpFD, response, responseLen, 0, (struct sockaddr*)&remote, remote.getSocklen());
+    if(slot) {
+      batch->queueResponse(*slot, response, responseLen, HarvestDestinationAddress(msgh, &slot->dest));
+      return;
+    }
 
-        continue;
-      }
+    ComboAddress dest;
+    if(HarvestDestinationAddress(msgh, &dest))
+      sendfromto(cs->udpFD, response, responseLen, 0, dest, remote);
+    else
+      sendto(cs->udpFD, response, responseLen, 0, (struct sockaddr*)&remote, remote.getSocklen());
 
-      DownstreamState* ss = 0;
-      auto candidates=getDownstreamCandidates(*localServers, pool);
-      auto policy=localPolicy->policy;
-      {
-	std::lock_guard<std::mutex> lock(g_luamutex);
-	ss = policy(candidates, remote, qname, qtype, dh).get();
-      }
+    return;
+  }
 
-      if(!ss) {
-	g_stats.noPolicy++;
-	continue;
-      }
+  DownstreamState* ss = 0;
+  auto candidates=getDownstreamCandidates(*holders.servers, pool);
+  const auto& policy=*holders.policy;
+  if(policy.needsLock) {
+    std::lock_guard<std::mutex> lock(g_luamutex);
+    ss = policy.policy(candidates, remote, qname, qtype, dh).get();
+  }
+  else {
+    ss = policy.policy(candidates, remote, qname, qtype, dh).get();
+  }
 
-      ss->queries++;
+  if(!ss) {
+    g_stats.noPolicy++;
+    return;
+  }
 
-      unsigned int idOffset = (ss->idOffset++) % ss->idStates.size();
-      IDState* ids = &ss->idStates[idOffset];
-      ids->age = 0;
+  ss->queries++;
 
-      if(ids->origFD < 0) // if we are reusing, no change in outstanding
-        ss->outstanding++;
-      else {
-        ss->reuseds++;
-        g_stats.downstreamTimeouts++;
-      }
+  unsigned int idOffset = (ss->idOffset++) % ss->idStates.size();
+  IDState* ids = &ss->idStates[idOffset];
+  ids->age = 0;
 
-      ids->origFD = cs->udpFD;
-      ids->origID = dh->id;
-      ids->origRemote = remote;
-      ids->sentTime.start();
-      ids->qname = qname;
-      ids->qtype = qtype;
-      ids->origDest.sin4.sin_family=0;
-      ids->delayMsec = delayMsec;
-      ids->origFlags = origFlags;
-      ids->ednsAdded = false;
+  if(ids->origFD < 0) // if we are reusing, no change in outstanding
+    ss->outstanding++;
+  else {
+    ss->reuseds++;
+    g_stats.downstreamTimeouts++;
+  }
+
+  ids->origFD = cs->udpFD;
+  ids->origID = dh->id;
+  ids->origRemote = remote;
+  ids->sentTime.start();
+  ids->qname = qname;
+  ids->qtype = qtype;
+  ids->origDest.sin4.sin_family=0;
+  ids->delayMsec = delayMsec;
+  ids->origFlags = origFlags;
+  ids->ednsAdded = false;
+  ids->qclass = qclass;
+  ids->cacheKey = cacheKey;
+  /* responses carrying an ECS option are specific to this client, don't share them */
+  ids->packetCache = ss->useECS ? nullptr : packetCache;
 #ifdef HAVE_DNSCRYPT
-      ids->dnsCryptQuery = dnsCryptQuery;
+  ids->dnsCryptQuery = dnsCryptQuery;
 #endif
-      HarvestDestinationAddress(&msgh, &ids->origDest);
+  HarvestDestinationAddress(msgh, &ids->origDest);
 
-      dh->id = idOffset;
+  dh->id = idOffset;
 
-      if (ss->useECS) {
-        handleEDNSClientSubnet(query, querySize, consumed, &len, largerQuery, &(ids->ednsAdded), remote);
-      }
+  if (ss->useECS) {
+    handleEDNSClientSubnet(query, querySize, consumed, &len, largerQuery, &(ids->ednsAdded), remote);
+  }
+
+  if(slot) {
+    if (largerQuery.empty())
+      batch->queueForward(ss, query, len);
+    else
+      batch->queueForward(ss, largerQuery.c_str(), largerQuery.size());
+  }
+  else {
+    if (largerQuery.empty()) {
+      ret = send(ss->fd, query, len, 0);
+    }
+    else {
+      ret = send(ss->fd, largerQuery.c_str(), largerQuery.size(), 0);
+      largerQuery.clear();
+    }
+
+    if(ret < 0) {
+      ss->sendErrors++;
+      g_stats.downstreamSendErrors++;
+    }
+  }
+
+  vinfolog("Got query from %s, relayed to %s", remote.toStringWithPort(), ss->getName());
+}
+
+#ifdef DNSDIST_UDP_BATCHING
+static void batchedUDPClientLoop(ClientState* cs, UDPClientHolders& holders)
+{
+  UDPBatch batch(cs->udpBatchSize, cs->local);
+
+  for(;;) {
+    int received = batch.receive(cs->udpFD);
+    if(received <= 0)
+      continue;
+
+    cs->udpBatches++;
+    g_stats.udpBatches++;
+    g_stats.udpBatchedQueries += received;
 
-      if (largerQuery.empty()) {
-        ret = send(ss->fd, query, len, 0);
+    for(int pos = 0; pos < received; pos++) {
+      try {
+        auto& slot = batch.getSlot(pos);
+        processUDPQuery(cs, holders, batch.getMsgHdr(pos), slot.remote, slot.packet, sizeof(slot.packet), batch.getLength(pos), slot.largerQuery, &batch, &slot);
       }
-      else {
-        ret = send(ss->fd, largerQuery.c_str(), largerQuery.size(), 0);
-        largerQuery.clear();
+      catch(std::exception& e){
+        errlog("Got an error in UDP question thread: %s", e.what());
       }
+    }
 
-      if(ret < 0) {
-	ss->sendErrors++;
-	g_stats.downstreamSendErrors++;
-      }
+    batch.flush(cs->udpFD);
+  }
+}
+#endif
+
+// listens to incoming queries, sends out to downstream servers, noting the intended return path 
+static void* udpClientThread(ClientState* cs)
+try
+{
+  UDPClientHolders holders;
+  {
+    std::lock_guard<std::mutex> lock(g_luamutex);
+    auto candidate = g_lua.readVariable<boost::optional<blockfilter_t> >("blockFilter");
+    if(candidate)
+      holders.blockFilter = *candidate;
+  }
+
+#ifdef DNSDIST_UDP_BATCHING
+  if(cs->udpBatchSize > 1) {
+    batchedUDPClientLoop(cs, holders);
+    return 0;
+  }
+#endif
+
+  ComboAddress remote;
+  remote.sin4.sin_family = cs->local.sin4.sin_family;
+  char packet[1500];
+  string largerQuery;
+  struct msghdr msgh;
+  struct iovec iov;
+  /* used by HarvestDestinationAddress */
+  char cbuf[256];
+  remote.sin6.sin6_family=cs->local.sin6.sin6_family;
+  fillMSGHdr(&msgh, &iov, cbuf, sizeof(cbuf), packet, sizeof(packet), &remote);
 
-      vinfolog("Got query from %s, relayed to %s", remote.toStringWithPort(), ss->getName());
+  for(;;) {
+    try {
+      ssize_t ret = recvmsg(cs->udpFD, &msgh, 0);
+      processUDPQuery(cs, holders, &msgh, remote, packet, sizeof(packet), ret, largerQuery, nullptr, nullptr);
     }
     catch(std::exception& e){
       errlog("Got an error in UDP question thread: %s", e.what());
@@ -758,40 +1069,73 @@ catch(...)
 }
 
 
-bool upCheck(const ComboAddress& remote, const DNSName& checkName, const QType& checkType, bool mustResolve)
-try
+static FDMultiplexer* getMultiplexer()
 {
-  vector<uint8_t> packet;
-  DNSPacketWriter dpw(packet, checkName, checkType.getCode());
-  dnsheader * requestHeader = dpw.getHeader();
-  requestHeader->rd=true;
-
-  Socket sock(remote.sin4.sin_family, SOCK_DGRAM);
-  sock.setNonBlocking();
-  sock.connect(remote);
-  sock.write((char*)&packet[0], packet.size());  
-  int ret=waitForRWData(sock.getHandle(), true, 1, 0);
-  if(ret < 0 || !ret) // error, timeout, both are down!
-    return false;
-  string reply;
-  ComboAddress dest=remote;
-  sock.recvFrom(reply, dest);
+  for(const auto& entry : FDMultiplexer::getMultiplexerMap()) {
+    try {
+      return entry.second();
+    }
+    catch(const FDMultiplexerException& fe) {
+      warnlog("Non-fatal error initializing possible multiplexer (%s), falling back", fe.what());
+    }
+    catch(...) {
+      warnlog("Non-fatal error initializing possible multiplexer");
+    }
+  }
+  throw std::runtime_error("No working multiplexer found");
+}
+
+struct HealthCheckData
+{
+  FDMultiplexer* d_mplexer;
+  std::shared_ptr<DownstreamState> d_ds;
+  struct timeval d_sentAt;
+  uint16_t d_queryID;
+  bool d_initial;
+};
 
-  const dnsheader * responseHeader = (const dnsheader *) reply.c_str();
+static void updateHealthCheckResult(const std::shared_ptr<DownstreamState>& dss, bool initial, bool newState)
+{
+  if(newState) {
+    dss->currentCheckFailures = 0;
+  }
+  else if(!initial) {
+    /* a single lost probe is not enough to take a server out of rotation */
+    if(dss->currentCheckFailures < std::numeric_limits<uint8_t>::max())
+      dss->currentCheckFailures++;
+    if(dss->currentCheckFailures < dss->maxCheckFailures)
+      return;
+  }
 
-  if (reply.size() < sizeof(*responseHeader))
+  if(initial || newState != dss->upStatus) {
+    warnlog("Marking downstream %s as '%s'", dss->getNameWithAddr(), newState ? "up" : "down");
+  }
+  dss->upStatus = newState;
+}
+
+static bool isHealthCheckResponseValid(const HealthCheckData& data, const char* reply, ssize_t len)
+try
+{
+  const std::shared_ptr<DownstreamState>& ds = data.d_ds;
+  if (len < (ssize_t) sizeof(dnsheader))
     return false;
 
-  if (responseHeader->id != requestHeader->id)
+  const dnsheader * responseHeader = reinterpret_cast<const dnsheader*>(reply);
+  if (responseHeader->id != data.d_queryID)
     return false;
   if (!responseHeader->qr)
     return false;
   if (responseHeader->rcode == RCode::ServFail)
     return false;
-  if (mustResolve && (responseHeader->rcode == RCode::NXDomain || responseHeader->rcode == RCode::Refused))
+  if (ds->mustResolve && (responseHeader->rcode == RCode::NXDomain || responseHeader->rcode == RCode::Refused))
+    return false;
+
+  uint16_t receivedType;
+  uint16_t receivedClass;
+  DNSName receivedName(reply, len, sizeof(dnsheader), false, &receivedType, &receivedClass);
+  if (receivedName != ds->checkName || receivedType != ds->checkType.getCode() || receivedClass != QClass::IN)
     return false;
 
-  // XXX fixme do bunch of checking here etc 
   return true;
 }
 catch(...)
@@ -799,11 +1143,144 @@ catch(...)
   return false;
 }
 
+static void healthCheckResponseCallback(int fd, FDMultiplexer::funcparam_t& param)
+{
+  /* removing the fd from the multiplexer invalidates param, so keep a copy */
+  auto data = boost::any_cast<std::shared_ptr<HealthCheckData>>(param);
+  char reply[1500];
+  ssize_t got = recv(fd, reply, sizeof(reply), 0);
+  if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+
+  data->d_mplexer->removeReadFD(fd);
+  close(fd);
+
+  const std::shared_ptr<DownstreamState>& ds = data->d_ds;
+  ds->checkInProgress = false;
+
+  bool newState = got > 0 && isHealthCheckResponseValid(*data, reply, got);
+  if (newState) {
+    struct timeval now;
+    gettimeofday(&now, 0);
+    ds->checkLatencyUsec = (now.tv_sec - data->d_sentAt.tv_sec) * 1000000.0 + (now.tv_usec - data->d_sentAt.tv_usec);
+  }
+  else {
+    vinfolog("Invalid or missing health check response from backend %s", ds->getNameWithAddr());
+  }
+  updateHealthCheckResult(ds, data->d_initial, newState);
+}
+
+/* Sends a health check query to ds without waiting for the response, which will be handled
+   by healthCheckResponseCallback() when it arrives or by handleHealthCheckTimeouts() if it does not */
+static void queueHealthCheck(FDMultiplexer& mplexer, const std::shared_ptr<DownstreamState>& ds, bool initial=false)
+{
+  int sock = -1;
+  try {
+    auto data = std::make_shared<HealthCheckData>();
+    data->d_mplexer = &mplexer;
+    data->d_ds = ds;
+    data->d_queryID = random();
+    data->d_initial = initial;
+
+    vector<uint8_t> packet;
+    DNSPacketWriter dpw(packet, ds->checkName, ds->checkType.getCode());
+    dnsheader * requestHeader = dpw.getHeader();
+    requestHeader->rd=true;
+    requestHeader->id=data->d_queryID;
+
+    sock = SSocket(ds->remote.sin4.sin_family, SOCK_DGRAM, 0);
+    setNonBlocking(sock);
+    SConnect(sock, ds->remote);
+    if (send(sock, (const char*) packet.data(), packet.size(), 0) < 0)
+      throw std::runtime_error("Error sending health check query: " + stringerror());
+
+    gettimeofday(&data->d_sentAt, 0);
+    mplexer.addReadFD(sock, &healthCheckResponseCallback, data);
+    struct timeval ttd = data->d_sentAt;
+    ttd.tv_sec += ds->checkTimeout / 1000;
+    ttd.tv_usec += (ds->checkTimeout % 1000) * 1000;
+    if (ttd.tv_usec >= 1000000) {
+      ttd.tv_sec++;
+      ttd.tv_usec -= 1000000;
+    }
+    mplexer.setReadTTD(sock, ttd, 0);
+    ds->checkInProgress = true;
+  }
+  catch(const std::exception& e) {
+    if (sock >= 0)
+      close(sock);
+    vinfolog("Error checking the health of backend %s: %s", ds->getNameWithAddr(), e.what());
+    updateHealthCheckResult(ds, initial, false);
+  }
+}
+
+static void handleHealthCheckTimeouts(FDMultiplexer& mplexer, const struct timeval& now)
+{
+  for(const auto& timeout : mplexer.getTimeouts(now)) {
+    auto data = boost::any_cast<std::shared_ptr<HealthCheckData>>(timeout.second);
+    mplexer.removeReadFD(timeout.first);
+    close(timeout.first);
+    data->d_ds->checkInProgress = false;
+    vinfolog("Timeout while waiting for the health check response from backend %s", data->d_ds->getNameWithAddr());
+    updateHealthCheckResult(data->d_ds, data->d_initial, false);
+  }
+}
+
+/* All the checks are sent at once, so this takes as long as the slowest server, not the sum of them */
+static void runInitialHealthChecks()
+{
+  std::unique_ptr<FDMultiplexer> mplexer(getMultiplexer());
+  for(auto& dss : g_dstates.getCopy()) { // it is a copy, but the internal shared_ptrs are the real deal
+    if(dss->availability==DownstreamState::Availability::Auto) {
+      queueHealthCheck(*mplexer, dss, true);
+    }
+  }
+
+  struct timeval now;
+  while(mplexer->getWatchedFDCount(false) > 0) {
+    mplexer->run(&now);
+    handleHealthCheckTimeouts(*mplexer, now);
+  }
+}
+
+/* Probes are sent to every server whose checkInterval has elapsed and whose previous probe
+   has completed, then answers and timeouts are dealt with as they come, so that a slow or
+   dead server never holds up the checks of the other ones, nor the maintenance thread */
+void* healthChecksThread()
+{
+  std::unique_ptr<FDMultiplexer> mplexer(getMultiplexer());
+  struct timeval now;
+  gettimeofday(&now, 0);
+  time_t lastRound = now.tv_sec;
+
+  for(;;) {
+    if(now.tv_sec != lastRound) {
+      lastRound = now.tv_sec;
+      for(auto& dss : g_dstates.getCopy()) { // this points to the actual shared_ptrs!
+        if(dss->availability != DownstreamState::Availability::Auto || dss->checkInProgress)
+          continue;
+        if(++dss->lastCheck < dss->checkInterval)
+          continue;
+        dss->lastCheck = 0;
+        queueHealthCheck(*mplexer, dss);
+      }
+    }
+
+    /* waits for at most half a second */
+    mplexer->run(&now);
+    handleHealthCheckTimeouts(*mplexer, now);
+  }
+  return 0;
+}
+
 std::atomic<uint64_t> g_maxTCPClientThreads{10};
 
+uint32_t g_cacheCleaningInterval{60};
+
 void* maintThread()
 {
   int interval = 1;
+  uint32_t secondsSinceCacheCleaning = 0;
 
   for(;;) {
     sleep(interval);
@@ -811,15 +1288,17 @@ void* maintThread()
     if(g_tcpclientthreads.d_queued > 1 && g_tcpclientthreads.d_numthreads < g_maxTCPClientThreads)
       g_tcpclientthreads.addTCPClientThread();
 
-    for(auto& dss : g_dstates.getCopy()) { // this points to the actual shared_ptrs!
-      if(dss->availability==DownstreamState::Availability::Auto) {
-	bool newState=upCheck(dss->remote, dss->checkName, dss->checkType, dss->mustResolve);
-	if(newState != dss->upStatus) {
-	  warnlog("Marking downstream %s as '%s'", dss->getNameWithAddr(), newState ? "up" : "down");
-	}
-	dss->upStatus = newState;
+    if(++secondsSinceCacheCleaning >= g_cacheCleaningInterval) {
+      secondsSinceCacheCleaning = 0;
+      /* a lookup never removes an expired entry, so do it here for the caches that need room */
+      for(const auto& entry : g_pools.getCopy()) {
+        auto packetCache = entry.second->getCache();
+        if(packetCache && packetCache->isFull())
+          packetCache->purgeExpired(packetCache->getMaxEntries() * 0.9);
       }
+    }
 
+    for(auto& dss : g_dstates.getCopy()) { // this points to the actual shared_ptrs!
       auto delta = dss->sw.udiffAndSet()/1000000.0;
       dss->queryLoad = 1.0*(dss->queries.load() - dss->prev.queries.load())/delta;
       dss->dropRate = 1.0*(dss->reuseds.load() - dss->prev.reuseds.load())/delta;
@@ -834,8 +1313,9 @@ void* maintThread()
           --dss->outstanding;
 	  struct timespec ts;
 	  clock_gettime(CLOCK_MONOTONIC, &ts);
-	  std::lock_guard<std::mutex> lock(g_rings.respMutex);
-	  g_rings.respRing.push_back({ts, ids.origRemote, ids.qname, ids.qtype, 0, 2000000, 0});
+	  struct dnsheader fake;
+	  memset(&fake, 0, sizeof(fake));
+	  g_rings.insertResponse(ts, ids.origRemote, ids.qname, ids.qtype, 0, 2000000, fake);
         }          
       }
     }
@@ -1082,11 +1562,11 @@ try
   if(g_cmdLine.locals.size()) {
     g_locals.clear();
     for(auto loc : g_cmdLine.locals)
-      g_locals.push_back({ComboAddress(loc, 53), true});
+      g_locals.push_back(std::make_tuple(ComboAddress(loc, 53), true, 0));
   }
   
   if(g_locals.empty())
-    g_locals.push_back({ComboAddress("127.0.0.1", 53), true});
+    g_locals.push_back(std::make_tuple(ComboAddress("127.0.0.1", 53), true, 0));
   
 
   g_configurationDone = true;
@@ -1094,19 +1574,26 @@ try
   vector<ClientState*> toLaunch;
   for(const auto& local : g_locals) {
     ClientState* cs = new ClientState;
-    cs->local= local.first;
+    cs->local= std::get<0>(local);
+    cs->udpBatchSize = std::get<2>(local) ? std::get<2>(local) : g_udpBatchSize;
+#ifndef DNSDIST_UDP_BATCHING
+    if(cs->udpBatchSize > 1) {
+      warnlog("Batched UDP processing requested on %s, but recvmmsg() and sendmmsg() are not available", cs->local.toStringWithPort());
+      cs->udpBatchSize = 1;
+    }
+#endif
     cs->udpFD = SSocket(cs->local.sin4.sin_family, SOCK_DGRAM, 0);
     if(cs->local.sin4.sin_family == AF_INET6) {
       SSetsockopt(cs->udpFD, IPPROTO_IPV6, IPV6_V6ONLY, 1);
     }
     //if(g_vm.count("bind-non-local"))
-    bindAny(local.first.sin4.sin_family, cs->udpFD);
+    bindAny(cs->local.sin4.sin_family, cs->udpFD);
 
     //    if (!setSocketTimestamps(cs->udpFD))
     //      L<<Logger::Warning<<"Unable to enable timestamp reporting for socket"<<endl;
 
 
-    if(IsAnyAddress(local.first)) {
+    if(IsAnyAddress(cs->local)) {
       int one=1;
       setsockopt(cs->udpFD, IPPROTO_IP, GEN_IP_PKTINFO, &one, sizeof(one));     // linux supports this, so why not - might fail on other systems
 #ifdef IPV6_RECVPKTINFO
@@ -1120,12 +1607,12 @@ try
   }
 
   for(const auto& local : g_locals) {
-    if(!local.second) { // no TCP/IP
-      warnlog("Not providing TCP/IP service on local address '%s'", local.first.toStringWithPort());
+    if(!std::get<1>(local)) { // no TCP/IP
+      warnlog("Not providing TCP/IP service on local address '%s'", std::get<0>(local).toStringWithPort());
       continue;
     }
     ClientState* cs = new ClientState;
-    cs->local= local.first;
+    cs->local= std::get<0>(local);
 
     cs->tcpFD = SSocket(cs->local.sin4.sin_family, SOCK_STREAM, 0);
 
@@ -1229,13 +1716,7 @@ try
     // you might define them later, but you need to know
   }
 
-  for(auto& dss : g_dstates.getCopy()) { // it is a copy, but the internal shared_ptrs are the real deal
-    if(dss->availability==DownstreamState::Availability::Auto) {
-      bool newState=upCheck(dss->remote, dss->checkName, dss->checkType, dss->mustResolve);
-      warnlog("Marking downstream %s as '%s'", dss->getNameWithAddr(), newState ? "up" : "down");
-      dss->upStatus = newState;
-    }
-  }
+  runInitialHealthChecks();
 
   for(auto& cs : toLaunch) {
     if (cs->udpFD >= 0) {
@@ -1251,6 +1732,9 @@ try
   thread carbonthread(carbonDumpThread);
   carbonthread.detach();
 
+  thread healththread(healthChecksThread);
+  healththread.detach();
+
   thread stattid(maintThread);
   
   if(g_cmdLine.beDaemon || g_cmdLine.beSupervised) {
@@ -7,13 +7,17 @@
 #include "dnsname.hh"
 #include <atomic>
 #include <boost/circular_buffer.hpp>
+#include <boost/any.hpp>
 #include <boost/variant.hpp>
 #include <mutex>
 #include <thread>
 #include "sholder.hh"
 #include "dnscrypt.hh"
+#include "dnsdist-cache.hh"
+#include "dnsdist-topk.hh"
 void* carbonDumpThread();
 uint64_t uptimeOfProcess(const std::string& str);
+uint64_t getPacketCacheStat(const std::string& str);
 
 struct DynBlock
 {
@@ -52,6 +56,10 @@ struct DNSDistStats
   stat_t downstreamSendErrors{0};
   stat_t truncFail{0};
   stat_t noPolicy{0};
+  stat_t udpBatches{0};
+  stat_t udpBatchedQueries{0};
+  stat_t cacheHits{0};
+  stat_t cacheMisses{0};
   stat_t latency0_1{0}, latency1_10{0}, latency10_50{0}, latency50_100{0}, latency100_1000{0}, latencySlow{0};
   
   double latencyAvg100{0}, latencyAvg1000{0}, latencyAvg10000{0}, latencyAvg1000000{0};
@@ -76,7 +84,10 @@ struct DNSDistStats
     {"cpu-user-msec", getCPUTimeUser},
     {"cpu-sys-msec", getCPUTimeSystem},
     {"fd-usage", getOpenFileDescriptors}, {"dyn-blocked", &dynBlocked}, 
-    {"dyn-block-nmg-size", [](const std::string&) { return g_dynblockNMG.getLocal()->size(); }}
+    {"dyn-block-nmg-size", [](const std::string&) { return g_dynblockNMG.getLocal()->size(); }},
+    {"udp-batches", &udpBatches}, {"udp-batched-queries", &udpBatchedQueries},
+    {"cache-hits", &cacheHits}, {"cache-misses", &cacheMisses},
+    {"cache-entries", getPacketCacheStat}, {"cache-evictions", getPacketCacheStat}
   };
 };
 
@@ -185,6 +196,9 @@ struct IDState
     origRemote = orig.origRemote;
     origDest = orig.origDest;
     delayMsec = orig.delayMsec;
+    qclass = orig.qclass;
+    cacheKey = orig.cacheKey;
+    packetCache = orig.packetCache;
     age.store(orig.age.load());
   }
 
@@ -201,17 +215,20 @@ struct IDState
   uint16_t qtype;                                             // 2
   uint16_t origID;                                            // 2
   uint16_t origFlags;                                         // 2
+  uint16_t qclass;                                            // 2
+  DNSDistPacketCache::CacheKey cacheKey;                      // 12
+  std::shared_ptr<DNSDistPacketCache> packetCache{nullptr};   // 16
   int delayMsec;
   bool ednsAdded{false};
 };
 
+/* The rings hold the last queries and responses seen, for the console and the dynamic blocking
+   functions. They are split over a number of shards, each writer thread being attached to
+   one of them, so that threads recording a query or a response almost never compete for the
+   same lock. Readers go over all shards in turn, locking only the one they are looking at.
+   Each shard also keeps per-second top talkers summaries, updated along with the rings,
+   so that finding the heaviest clients does not require going over all the entries. */
 struct Rings {
-  Rings()
-  {
-    queryRing.set_capacity(10000);
-    respRing.set_capacity(10000);
-    pthread_rwlock_init(&queryLock, 0);
-  }
   struct Query
   {
     struct timespec when;
@@ -221,7 +238,6 @@ struct Rings {
     uint16_t qtype;
     struct dnsheader dh;
   };
-  boost::circular_buffer<Query> queryRing;
   struct Response
   {
     struct timespec when;
@@ -232,12 +248,81 @@ struct Rings {
     unsigned int size;
     struct dnsheader dh;
   };
-  boost::circular_buffer<Response> respRing;
-  std::mutex respMutex;
-  pthread_rwlock_t queryLock;
+  struct Shard
+  {
+    Shard(size_t topKSize, size_t numberOfBuckets): queryTalkers(topKSize, numberOfBuckets), respTalkers(topKSize, numberOfBuckets)
+    {
+    }
+
+    boost::circular_buffer<Query> queryRing;
+    boost::circular_buffer<Response> respRing;
+    /* protected by queryLock and respLock, respectively */
+    TopTalkersAggregator queryTalkers;
+    TopTalkersAggregator respTalkers;
+    std::mutex queryLock;
+    std::mutex respLock;
+  };
+
+  /* a thread only ever writes to its own shard, so each one gets the capacity the single ring used to have */
+  Rings(size_t capacity=10000, size_t numberOfShards=10)
+  {
+    setCapacity(capacity, numberOfShards);
+  }
+
+  /* capacity is per shard. Not safe once threads are inserting, so configuration time only */
+  void setCapacity(size_t capacity, size_t numberOfShards);
+  /* topKSize counters per second, per shard. Configuration time only as well */
+  void setTopTalkersParameters(size_t topKSize, size_t numberOfBuckets);
+
+  void insertQuery(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, uint16_t size, const struct dnsheader& dh)
+  {
+    Shard& shard = getOwnShard();
+    std::lock_guard<std::mutex> wl(shard.queryLock);
+    shard.queryRing.push_back({when, requestor, name, size, qtype, dh});
+    shard.queryTalkers.addQuery(when.tv_sec, requestor, qtype, size);
+  }
+
+  void insertResponse(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, unsigned int usec, unsigned int size, const struct dnsheader& dh)
+  {
+    Shard& shard = getOwnShard();
+    std::lock_guard<std::mutex> wl(shard.respLock);
+    shard.respRing.push_back({when, requestor, name, qtype, usec, size, dh});
+    shard.respTalkers.addResponse(when.tv_sec, requestor, dh.rcode, size);
+  }
+
+  size_t getNumberOfShards() const
+  {
+    return d_shards.size();
+  }
+
+  size_t getCapacity() const
+  {
+    return d_capacity;
+  }
+
+  /* merged copies of the shards, in no particular order */
+  vector<Query> getQueries();
+  vector<Response> getResponses();
+
+  /* the seconds are capped to the number of buckets */
+  TopTalkersAggregator::counts_t getTopTalkers(TopTalkersAggregator::Kind kind, uint16_t value, unsigned int seconds);
+  size_t getTopTalkersWindow() const
+  {
+    return d_numberOfBuckets;
+  }
 
   vector<pair<unsigned int, ComboAddress> > getTopBandwidth(unsigned int numentries);
   unsigned int numDistinctRequestors();
+
+  vector<std::unique_ptr<Shard> > d_shards;
+
+private:
+  Shard& getOwnShard();
+
+  std::atomic<size_t> d_nextShard{0};
+  size_t d_capacity{0};
+  size_t d_topKSize{100};
+  size_t d_numberOfBuckets{10};
 };
 
 extern Rings g_rings;
@@ -249,8 +334,10 @@ struct ClientState
   DnsCryptContext* dnscryptCtx{0};
 #endif
   std::atomic<uint64_t> queries{0};
+  std::atomic<uint64_t> udpBatches{0}; // recvmmsg() calls, queries/udpBatches is the average batch fill
   int udpFD{-1};
   int tcpFD{-1};
+  unsigned int udpBatchSize{1}; // more than 1 means recvmmsg()/sendmmsg() are used, if available
 };
 
 class TCPClientCollection {
@@ -300,17 +387,24 @@ struct DownstreamState
   double queryLoad{0.0};
   double dropRate{0.0};
   double latencyUsec{0.0};
+  double checkLatencyUsec{0.0};
   int order{1};
   int weight{1};
   int tcpRecvTimeout{30};
   int tcpSendTimeout{30};
   uint16_t retries{5};
+  uint16_t checkTimeout{1000}; /* in milliseconds */
+  uint8_t checkInterval{1}; /* in seconds */
+  uint8_t lastCheck{0};
+  uint8_t maxCheckFailures{1}; /* consecutive failed checks before a server is marked down */
+  uint8_t currentCheckFailures{0};
   StopWatch sw;
   set<string> pools;
   enum class Availability { Up, Down, Auto} availability{Availability::Auto};
   bool mustResolve;
   bool upStatus{false};
   bool useECS{false};
+  bool checkInProgress{false};
   bool isUp() const
   {
     if(availability == Availability::Down)
@@ -377,7 +471,105 @@ struct ServerPolicy
 {
   string name;
   policy_t policy;
+  bool needsLock; // the policy calls into g_lua, and must be called with g_luamutex held
+};
+
+typedef std::function<bool(ComboAddress, DNSName, uint16_t, dnsheader*)> blockfilter_t;
+
+void setupLuaBindings(LuaContext& luaCtx);
+
+/* A LuaContext owned by the calling thread, set up with setupLuaBindings() only. Functions created from Lua
+   code in there can be called without g_luamutex, since no other thread ever touches this context. */
+class PerThreadLuaContext : public boost::noncopyable
+{
+public:
+  static PerThreadLuaContext& get();
+
+  /* returns the function resulting from running 'code' in this thread's context, running it on first use only */
+  template<typename F>
+  const F& getFunction(uint64_t id, const std::shared_ptr<const std::string>& code)
+  {
+    auto it = d_functions.find(id);
+    if(it != d_functions.end())
+      return boost::any_cast<const F&>(it->second.func);
+
+    /* the functions of policies or actions that have been replaced since are not needed anymore */
+    for(it = d_functions.begin(); it != d_functions.end(); ) {
+      if(it->second.code.expired())
+        it = d_functions.erase(it);
+      else
+        ++it;
+    }
+
+    FunctionEntry entry;
+    entry.code = code;
+    entry.func = d_lua.executeCode<F>(*code);
+    return boost::any_cast<const F&>(d_functions.insert({id, entry}).first->second.func);
+  }
+
+private:
+  PerThreadLuaContext();
+
+  struct FunctionEntry
+  {
+    std::weak_ptr<const std::string> code;
+    boost::any func;
+  };
+
+  /* the functions refer to the context, so it has to be declared first to be destroyed last */
+  LuaContext d_lua;
+  std::unordered_map<uint64_t, FunctionEntry> d_functions;
+};
+
+extern std::atomic<uint64_t> g_perThreadLuaFunctionIds;
+
+/* Wraps a Lua function, given as the code returning it, so that each thread calls its own instance of it
+   from its PerThreadLuaContext. Copies share the same instances. */
+template<typename T> class PerThreadLuaFunction;
+
+template<typename R, typename... Args>
+class PerThreadLuaFunction<R(Args...)>
+{
+public:
+  typedef std::function<R(Args...)> func_t;
+
+  explicit PerThreadLuaFunction(const std::string& code) : d_code(std::make_shared<const std::string>(code)), d_id(++g_perThreadLuaFunctionIds)
+  {
+  }
+
+  R operator()(Args... args) const
+  {
+    return PerThreadLuaContext::get().getFunction<func_t>(d_id, d_code)(args...);
+  }
+
+  /* runs the code in the calling thread's context, so that errors in it are reported right away */
+  void prepare() const
+  {
+    PerThreadLuaContext::get().getFunction<func_t>(d_id, d_code);
+  }
+
+private:
+  std::shared_ptr<const std::string> d_code;
+  uint64_t d_id;
+};
+
+/* The cache of a pool can be set or unset from the console while client threads are using it,
+   so it is only ever accessed through atomic loads and stores */
+struct ServerPool
+{
+  std::shared_ptr<DNSDistPacketCache> getCache() const
+  {
+    return std::atomic_load(&packetCache);
+  }
+  void setCache(const std::shared_ptr<DNSDistPacketCache>& cache)
+  {
+    std::atomic_store(&packetCache, cache);
+  }
+
+private:
+  std::shared_ptr<DNSDistPacketCache> packetCache{nullptr};
 };
+using pools_t=map<std::string,std::shared_ptr<ServerPool>>;
 
 struct CarbonConfig
 {
@@ -401,10 +593,12 @@ extern GlobalStateHolder<ServerPolicy> g_policy;
 extern GlobalStateHolder<servers_t> g_dstates;
 extern GlobalStateHolder<vector<pair<std::shared_ptr<DNSRule>, std::shared_ptr<DNSAction> > > > g_rulactions;
 extern GlobalStateHolder<NetmaskGroup> g_ACL;
+extern GlobalStateHolder<pools_t> g_pools;
+extern GlobalStateHolder<blockfilter_t> g_perThreadBlockFilter;
 
 extern ComboAddress g_serverControl; // not changed during runtime
 
-extern std::vector<std::pair<ComboAddress, bool>> g_locals; // not changed at runtime (we hope XXX)
+extern std::vector<std::tuple<ComboAddress, bool, unsigned int>> g_locals; // address, TCP, UDP batch size (0 for the default). not changed at runtime (we hope XXX)
 extern vector<ClientState*> g_frontends;
 extern std::string g_key; // in theory needs locking
 extern bool g_truncateTC;
@@ -412,6 +606,8 @@ extern bool g_fixupCase;
 extern int g_tcpRecvTimeout;
 extern int g_tcpSendTimeout;
 extern uint16_t g_maxOutstanding;
+extern unsigned int g_udpBatchSize;
+extern uint32_t g_cacheCleaningInterval;
 extern std::atomic<bool> g_configurationDone;
 extern std::atomic<uint64_t> g_maxTCPClientThreads;
 extern uint16_t g_ECSSourcePrefixV4;
@@ -423,6 +619,8 @@ struct dnsheader;
 void controlThread(int fd, ComboAddress local);
 vector<std::function<void(void)>> setupLua(bool client, const std::string& config);
 NumberedServerVector getDownstreamCandidates(const servers_t& servers, const std::string& pool);
+std::shared_ptr<ServerPool> getPool(const pools_t& pools, const std::string& poolName);
+std::shared_ptr<ServerPool> createPoolIfNotExists(pools_t& pools, const string& poolName);
 
 std::shared_ptr<DownstreamState> firstAvailable(const NumberedServerVector& servers, const ComboAddress& remote, const DNSName& qname, uint16_t qtype, dnsheader* dh);
 
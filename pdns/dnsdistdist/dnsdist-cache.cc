@@ -0,0 +1 @@
+../dnsdist-cache.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../dnsdist-cache.hh
\ No newline at end of file
@@ -0,0 +1 @@
+../dnsdist-topk.cc
\ No newline at end of file
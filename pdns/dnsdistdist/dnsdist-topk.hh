@@ -0,0 +1 @@
+../dnsdist-topk.hh
\ No newline at end of file
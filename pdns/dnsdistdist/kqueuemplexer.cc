@@ -0,0 +1 @@
+../kqueuemplexer.cc
\ No newline at end of file
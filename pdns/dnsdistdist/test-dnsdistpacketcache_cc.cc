@@ -0,0 +1 @@
+../test-dnsdistpacketcache_cc.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../test-dnsdisttopk_cc.cc
\ No newline at end of file
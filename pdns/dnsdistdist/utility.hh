@@ -0,0 +1 @@
+../utility.hh
\ No newline at end of file
@@ -56,6 +56,7 @@ public:
   unsigned int countLabels() const;
   size_t wirelength() const; //!< Number of total bytes in the name
   bool empty() const { return d_storage.empty(); }
+  const std::string& getStorage() const { return d_storage; } //!< Raw wire format, as it was given to us (not lowercased)
   bool isRoot() const { return d_storage.size()==1 && d_storage[0]==0; }
   void clear() { d_storage.clear(); }
   void trimToLabels(unsigned int);
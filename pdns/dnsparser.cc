@@ -599,6 +599,15 @@ public:
     return *p;
   }
   
+  uint32_t get32BitInt()
+  {
+    const char* p = d_packet.c_str() + d_offset;
+    moveOffset(4);
+    uint32_t ret;
+    memcpy(&ret, (void*)p, sizeof(ret));
+    return ntohl(ret);
+  }
+
   void skipRData()
   {
     int toskip = get16BitInt();
@@ -667,3 +676,39 @@ void ageDNSPacket(std::string& packet, uint32_t seconds)
     return;
   }
 }
+
+/* returns the lowest TTL found in the answer, authority and additional sections, skipping the OPT pseudo-RR,
+   or UINT32_MAX if there are no records. Throws on a malformed packet */
+uint32_t getDNSPacketMinTTL(const char* packet, size_t length)
+{
+  uint32_t result = std::numeric_limits<uint32_t>::max();
+  if(length < sizeof(dnsheader))
+    return result;
+
+  std::string copy(packet, length);
+  dnsheader dh;
+  memcpy((void*)&dh, (const dnsheader*)packet, sizeof(dh));
+  int numrecords = ntohs(dh.ancount) + ntohs(dh.nscount) + ntohs(dh.arcount);
+  DNSPacketMangler dpm(copy);
+
+  int n;
+  for(n=0; n < ntohs(dh.qdcount) ; ++n) {
+    dpm.skipLabel();
+    dpm.skipBytes(4); // qtype, qclass
+  }
+  for(n=0; n < numrecords; ++n) {
+    dpm.skipLabel();
+
+    uint16_t dnstype = dpm.get16BitInt();
+    /* uint16_t dnsclass = */ dpm.get16BitInt();
+
+    if(dnstype == QType::OPT) // the TTL field holds the extended rcode and flags there
+      break;
+
+    uint32_t ttl = dpm.get32BitInt();
+    if(ttl < result)
+      result = ttl;
+    dpm.skipRData();
+  }
+  return result;
+}
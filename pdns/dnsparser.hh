@@ -345,6 +345,7 @@ private:
 string simpleCompress(const string& label, const string& root="");
 void simpleExpandTo(const string& label, unsigned int frompos, string& ret);
 void ageDNSPacket(std::string& packet, uint32_t seconds);
+uint32_t getDNSPacketMinTTL(const char* packet, size_t length);
 
 template<typename T>
 std::shared_ptr<T> getRR(const DNSRecord& dr)
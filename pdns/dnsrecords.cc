@@ -74,6 +74,38 @@ bool DNSResourceRecord::operator==(const DNSResourceRecord& rhs)
     tie(rhs.qname, rhs.qtype, rcontent, rhs.ttl);
 }
 
+bool DNSResourceRecord::parseContent()
+{
+  parsed.reset();
+  if(!qtype.getCode())
+    return false;
+
+  auto pc=std::make_shared<ParsedContent>();
+  pc->content=content;
+  try {
+    // same normalisation as DNSPacket::wrapup() does for records that were not parsed before
+    if(!content.empty() && qtype.getCode()==QType::TXT && content[0]!='"')
+      pc->drc=shared_ptr<DNSRecordContent>(DNSRecordContent::mastermake(qtype.getCode(), qclass, "\""+content+"\""));
+    else
+      pc->drc=shared_ptr<DNSRecordContent>(DNSRecordContent::mastermake(qtype.getCode(), qclass, content.empty() ? "." : content));
+  }
+  catch(std::exception&) {
+    return false;
+  }
+  catch(PDNSException&) {
+    return false;
+  }
+  parsed=pc;
+  return true;
+}
+
+shared_ptr<DNSRecordContent> DNSResourceRecord::getParsedContent() const
+{
+  if(parsed && parsed->drc->getType() == qtype.getCode() && parsed->content == content)
+    return parsed->drc;
+  return shared_ptr<DNSRecordContent>();
+}
+
 DNSResourceRecord::DNSResourceRecord(const DNSRecord &p) {
   auth=true;
   qclass = p.d_class;
@@ -86,6 +118,10 @@ DNSResourceRecord::DNSResourceRecord(const DNSRecord &p) {
   qtype = p.d_type;
   ttl = p.d_ttl;
   setContent(p.d_content->getZoneRepresentation());
+  auto pc=std::make_shared<ParsedContent>();
+  pc->content=content;
+  pc->drc=p.d_content;
+  parsed=pc;
   last_modified = 0;
   signttl = 0;
   domain_id = -1;
@@ -31,6 +31,12 @@
 #include "lock.hh"
 #include "arguments.hh"
 #include "statbag.hh"
+#include <deque>
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+#include <boost/multi_index/member.hpp>
+using namespace ::boost::multi_index;
 extern StatBag S;
 
 /* this is where the RRSIGs begin, keys are retrieved,
@@ -126,23 +132,178 @@ void addSignature(DNSSECKeeper& dk, UeberBackend& db, const DNSName& signer, con
   toSign.clear();
 }
 
-static pthread_rwlock_t g_signatures_lock = PTHREAD_RWLOCK_INITIALIZER;
-typedef map<pair<string, string>, string> signaturecache_t;
-static signaturecache_t g_signatures;
-static int g_cacheweekno;
+/* The signature cache is split in shards, each with its own lock, so signing threads don't
+   queue up behind each other. A shard is kept in least recently used order, and when it is
+   full the least recently used entry goes, instead of the whole cache. */
+namespace {
+  struct SignatureCacheEntry
+  {
+    pair<string, string> d_key;
+    string d_signature;
+    uint32_t d_expire;        //!< start of the week after the one this signature was made for
+    mutable bool d_presigned; //!< the signature for the week after has been queued already
+  };
+
+  struct SignatureCacheShard
+  {
+    SignatureCacheShard()
+    {
+      pthread_mutex_init(&d_lock, 0);
+    }
+
+    typedef multi_index_container<
+      SignatureCacheEntry,
+      indexed_by <
+        hashed_unique<member<SignatureCacheEntry, pair<string, string>, &SignatureCacheEntry::d_key> >,
+        sequenced<>
+      >
+    > entries_t;
+
+    entries_t d_entries;
+    pthread_mutex_t d_lock;
+  };
+
+  struct PresignJob
+  {
+    DNSSECPrivateKey d_dpk;
+    DNSName d_qname;
+    RRSIGRecordContent d_rrc;
+    vector<shared_ptr<DNSRecordContent> > d_toSign;
+  };
+}
+
+static const unsigned int g_signatureShardCount = 64;
+static SignatureCacheShard g_signatures[g_signatureShardCount];
+/* signatures for next week are made during the last day of this one, from the RRsets we sign
+   or find in the cache then, so the cache is warm when the week rolls over */
+static const uint32_t g_presignWindow = 86400;
+static const size_t g_maxPresignJobs = 10000;
+static pthread_mutex_t g_presignLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_presignCond = PTHREAD_COND_INITIALIZER;
+static std::deque<PresignJob> g_presignJobs;
+static bool g_presignerRunning;
 
 AtomicCounter* g_signatureCount;
+static AtomicCounter* g_signatureCacheHits;
+static AtomicCounter* g_signatureCacheMisses;
+static AtomicCounter* g_signatureCacheEvictions;
+static AtomicCounter* g_signaturesPresigned;
 
 uint64_t signatureCacheSize(const std::string& str)
 {
-  ReadLock l(&g_signatures_lock);
-  return g_signatures.size();
+  uint64_t count = 0;
+  for(auto& shard : g_signatures) {
+    Lock l(&shard.d_lock);
+    count += shard.d_entries.size();
+  }
+  return count;
+}
+
+static SignatureCacheShard& getSignatureShard(const pair<string, string>& key)
+{
+  // the second half of the key is an md5sum, any part of it will do for picking a shard
+  uint32_t hash = 0;
+  memcpy(&hash, key.second.c_str(), std::min(sizeof(hash), key.second.size()));
+  return g_signatures[hash % g_signatureShardCount];
+}
+
+/* returns true if we had a signature for key. If so, and wantPresign is set, presign
+   is set to whether the caller should queue the signature for next week */
+static bool getCachedSignature(const pair<string, string>& key, string& signature, bool wantPresign, bool& presign)
+{
+  SignatureCacheShard& shard = getSignatureShard(key);
+  Lock l(&shard.d_lock);
+  auto iter = shard.d_entries.find(key);
+  if(iter == shard.d_entries.end())
+    return false;
+
+  auto& sidx = shard.d_entries.get<1>();
+  sidx.relocate(sidx.end(), shard.d_entries.project<1>(iter));
+  signature = iter->d_signature;
+  presign = wantPresign && !iter->d_presigned;
+  iter->d_presigned = true;
+  return true;
+}
+
+static void cacheSignature(const pair<string, string>& key, const string& signature, uint32_t expire, bool presigned)
+{
+  static const size_t maxShardSize = std::max(::arg().asNum("max-signature-cache-entries", INT_MAX) / g_signatureShardCount, 1U);
+  SignatureCacheShard& shard = getSignatureShard(key);
+  Lock l(&shard.d_lock);
+
+  auto& sidx = shard.d_entries.get<1>();
+  while(shard.d_entries.size() >= maxShardSize) {
+    sidx.pop_front();
+    (*g_signatureCacheEvictions)++;
+  }
+  // signatures for weeks gone by are never asked for again, make room right away
+  uint32_t now = time(0);
+  while(!sidx.empty() && sidx.front().d_expire <= now)
+    sidx.pop_front();
+
+  SignatureCacheEntry entry;
+  entry.d_key = key;
+  entry.d_signature = signature;
+  entry.d_expire = expire;
+  entry.d_presigned = presigned;
+  shard.d_entries.insert(entry);
+}
+
+static void *presigner(void *)
+{
+  pthread_detach(pthread_self());
+  for(;;) {
+    PresignJob job;
+    {
+      Lock l(&g_presignLock);
+      while(g_presignJobs.empty())
+        pthread_cond_wait(&g_presignCond, &g_presignLock);
+      job = g_presignJobs.front();
+      g_presignJobs.pop_front();
+    }
+
+    try {
+      job.d_rrc.d_siginception += 7*86400;
+      job.d_rrc.d_sigexpire += 7*86400;
+      fillOutRRSIG(job.d_dpk, job.d_qname, job.d_rrc, job.d_toSign);
+    }
+    catch(std::exception& e) {
+      L<<Logger::Warning<<"Signing "<<job.d_qname<<" for next week failed: "<<e.what()<<endl;
+    }
+    catch(PDNSException& ae) {
+      L<<Logger::Warning<<"Signing "<<job.d_qname<<" for next week failed: "<<ae.reason<<endl;
+    }
+  }
+  return 0;
+}
+
+static void queuePresign(const DNSSECPrivateKey& dpk, const DNSName& signQName, const RRSIGRecordContent& rrc, const vector<shared_ptr<DNSRecordContent> >& toSign)
+{
+  Lock l(&g_presignLock);
+  if(g_presignJobs.size() >= g_maxPresignJobs)
+    return; // we will sign it when next week comes, as we did before
+
+  if(!g_presignerRunning) {
+    pthread_t tid;
+    if(pthread_create(&tid, 0, presigner, 0)) {
+      L<<Logger::Error<<"Unable to launch thread to sign for next week: "<<stringerror()<<endl;
+      return;
+    }
+    g_presignerRunning = true;
+  }
+  g_presignJobs.push_back({dpk, signQName, rrc, toSign});
+  pthread_cond_signal(&g_presignCond);
 }
 
 void fillOutRRSIG(DNSSECPrivateKey& dpk, const DNSName& signQName, RRSIGRecordContent& rrc, vector<shared_ptr<DNSRecordContent> >& toSign) 
 {
-  if(!g_signatureCount)
+  if(!g_signatureCount) {
+    g_signatureCacheHits = S.getPointer("signature-cache-hits");
+    g_signatureCacheMisses = S.getPointer("signature-cache-misses");
+    g_signatureCacheEvictions = S.getPointer("signature-cache-evictions");
+    g_signaturesPresigned = S.getPointer("signatures-presigned");
     g_signatureCount = S.getPointer("signatures");
+  }
     
   DNSKEYRecordContent drc = dpk.getDNSKEY(); 
   const DNSCryptoKeyEngine* rc = dpk.getKey();
@@ -151,34 +312,34 @@ void fillOutRRSIG(DNSSECPrivateKey& dpk, const DNSName& signQName, RRSIGRecordCo
   
   string msg=getMessageForRRSET(signQName, rrc, toSign); // this is what we will hash & sign
   pair<string, string> lookup(rc->getPubKeyHash(), pdns_md5sum(msg));  // this hash is a memory saving exercise
-  
-  bool doCache=1;
-  if(doCache)
-  {
-    ReadLock l(&g_signatures_lock);
-    signaturecache_t::const_iterator iter = g_signatures.find(lookup);
-    if(iter != g_signatures.end()) {
-      rrc.d_signature=iter->second;
-      return;
-    }
-    // else cerr<<"Miss!"<<endl;  
+
+  /* the inception is a week before the start of the week the signature is for,
+     see getRRSIGsForRRSET() */
+  const uint32_t weekStart = rrc.d_siginception + 7*86400;
+  const uint32_t weekEnd = weekStart + 7*86400;
+  const uint32_t now = time(0);
+  const bool isPresign = weekStart > now;
+  const bool wantPresign = !isPresign && weekEnd - now <= g_presignWindow;
+  bool presign = false;
+
+  if(getCachedSignature(lookup, rrc.d_signature, wantPresign, presign)) {
+    if(!isPresign)
+      (*g_signatureCacheHits)++;
+    if(presign)
+      queuePresign(dpk, signQName, rrc, toSign);
+    return;
   }
-  
+  if(!isPresign)
+    (*g_signatureCacheMisses)++;
+
   rrc.d_signature = rc->sign(msg);
   (*g_signatureCount)++;
-  if(doCache) {
-    /* we add some jitter here so not all your slaves start pruning their caches at the very same millisecond */
-    int weekno = (time(0) - dns_random(3600)) / (86400*7);  // we just spent milliseconds doing a signature, microsecond more won't kill us
-    const static int maxcachesize=::arg().asNum("max-signature-cache-entries", INT_MAX);
-
-    WriteLock l(&g_signatures_lock);
-    if(g_cacheweekno < weekno || g_signatures.size() >= (uint) maxcachesize) {  // blunt but effective (C) Habbie, mind04
-      L<<Logger::Warning<<"Cleared signature cache."<<endl;
-      g_signatures.clear();
-      g_cacheweekno = weekno;
-    }
-    g_signatures[lookup] = rrc.d_signature;
-  }
+  if(isPresign)
+    (*g_signaturesPresigned)++;
+
+  cacheSignature(lookup, rrc.d_signature, weekEnd, wantPresign);
+  if(wantPresign)
+    queuePresign(dpk, signQName, rrc, toSign);
 }
 
 static bool rrsigncomp(const DNSResourceRecord& a, const DNSResourceRecord& b)
@@ -39,12 +39,170 @@ bool findNamedPolicy(const map<DNSName, DNSFilterEngine::Policy>& polmap, const
   return false;
 }
 
+namespace {
+struct CompileNode
+{
+  std::map<string, std::unique_ptr<CompileNode> > children; // on lowercased label
+  int32_t exact{-1};
+  int32_t wildcard{-1};
+};
+}
+
+void DNSFilterEngine::CompiledNames::build(const std::map<DNSName, Policy>& polmap)
+{
+  CompileNode root;
+  for(const auto& entry : polmap) {
+    auto labels = entry.first.getRawLabels();
+    CompileNode* node = &root;
+    CompileNode* parent = nullptr;
+    for(auto iter = labels.rbegin(); iter != labels.rend(); ++iter) {
+      string label(*iter);
+      for(auto& c : label)
+        c = dns2_tolower(c);
+      auto& child = node->children[label];
+      if(!child)
+        child.reset(new CompileNode());
+      parent = node;
+      node = child.get();
+    }
+    node->exact = d_policies.size();
+    d_policies.push_back(entry.second);
+    if(parent && labels.front() == "*")
+      parent->wildcard = node->exact;
+  }
+
+  /* flatten breadth-first, so that the children of a node end up next to each other,
+     sorted the way std::map sorted them */
+  vector<const CompileNode*> todo{&root};
+  d_nodes.resize(1);
+  d_nodes[0].d_exact = root.exact;
+  d_nodes[0].d_wildcard = root.wildcard;
+  for(size_t pos = 0; pos < todo.size(); ++pos) {
+    d_nodes[pos].d_firstChild = d_nodes.size();
+    d_nodes[pos].d_childCount = todo[pos]->children.size();
+    for(const auto& child : todo[pos]->children) {
+      Node n;
+      n.d_labelOffset = d_labels.size();
+      n.d_labelLength = child.first.size();
+      n.d_exact = child.second->exact;
+      n.d_wildcard = child.second->wildcard;
+      d_labels.append(child.first);
+      d_nodes.push_back(n);
+      todo.push_back(child.second.get());
+    }
+  }
+}
+
+const DNSFilterEngine::CompiledNames::Node* DNSFilterEngine::CompiledNames::findChild(const Node& parent, const char* label, uint8_t length) const
+{
+  // same ordering as std::string::compare on the lowercased labels
+  auto cmp = [this, label, length](const Node& n) {
+    const unsigned char* ours = (const unsigned char*)d_labels.c_str() + n.d_labelOffset;
+    uint8_t common = std::min(n.d_labelLength, length);
+    for(uint8_t i = 0; i < common; ++i) {
+      unsigned char theirs = dns2_tolower(label[i]);
+      if(ours[i] != theirs)
+        return ours[i] < theirs ? -1 : 1;
+    }
+    return n.d_labelLength == length ? 0 : (n.d_labelLength < length ? -1 : 1);
+  };
+
+  uint32_t low = parent.d_firstChild, high = parent.d_firstChild + parent.d_childCount;
+  while(low < high) {
+    uint32_t mid = low + (high - low) / 2;
+    int res = cmp(d_nodes[mid]);
+    if(res == 0)
+      return &d_nodes[mid];
+    if(res < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return nullptr;
+}
+
+/* Same semantics as findNamedPolicy(): the most specific name wins, an exact name beating
+   a wildcard at the same level. We walk from the root down, so later matches replace earlier ones. */
+bool DNSFilterEngine::CompiledNames::lookup(const DNSName& qname, Policy& pol) const
+{
+  if(d_policies.empty())
+    return false;
+
+  const string& storage = qname.getStorage();
+  uint8_t pos[128];
+  unsigned int count = 0;
+  for(size_t p = 0; p < storage.size() && storage[p] && count < sizeof(pos); p += (uint8_t)storage[p] + 1)
+    pos[count++] = p;
+
+  int32_t best = -1;
+  const Node* node = &d_nodes[0];
+  for(;;) {
+    if(count && node->d_wildcard >= 0)  // '*.name' only matches names below 'name'
+      best = node->d_wildcard;
+    if(node->d_exact >= 0)
+      best = node->d_exact;
+    if(!count)
+      break;
+    --count;
+    node = findChild(*node, storage.c_str() + pos[count] + 1, storage[pos[count]]);
+    if(!node)
+      break;
+  }
+
+  if(best < 0)
+    return false;
+  pol = d_policies[best];
+  return true;
+}
+
+void DNSFilterEngine::compile()
+{
+  for(auto& z : d_zones) {
+    if(z->qpolCompiled && z->propolCompiled)
+      continue;
+    auto qpol = std::make_shared<CompiledNames>();
+    qpol->build(z->qpolName);
+    auto propol = std::make_shared<CompiledNames>();
+    propol->build(z->propolName);
+    // another copy of the engine might be looking at this zone, don't change it underneath it
+    if(!z.unique())
+      z = std::make_shared<Zone>(*z);
+    z->qpolCompiled = qpol;
+    z->propolCompiled = propol;
+  }
+}
+
+bool DNSFilterEngine::isCompiled() const
+{
+  for(const auto& z : d_zones) {
+    if(!z->qpolCompiled || !z->propolCompiled)
+      return false;
+  }
+  return true;
+}
+
+std::shared_ptr<const DNSFilterEngine::Zone> DNSFilterEngine::getZone(int zone) const
+{
+  if(zone < 0 || (size_t)zone >= d_zones.size())
+    return std::make_shared<Zone>();
+  return d_zones[zone];
+}
+
+void DNSFilterEngine::setZone(int zone, const DNSFilterEngine& source)
+{
+  assureZones(zone);
+  if((size_t)zone < source.d_zones.size())
+    d_zones[zone] = source.d_zones[zone];
+  else
+    d_zones[zone] = std::make_shared<Zone>();
+}
+
 DNSFilterEngine::Policy DNSFilterEngine::getProcessingPolicy(const DNSName& qname) const
 {
   //  cout<<"Got question for nameserver name "<<qname<<endl;
   Policy pol{PolicyKind::NoAction};
   for(const auto& z : d_zones) {
-    if(findNamedPolicy(z.propolName, qname, pol)) {
+    if(z->propolCompiled ? z->propolCompiled->lookup(qname, pol) : findNamedPolicy(z->propolName, qname, pol)) {
       //      cerr<<"Had a hit on the nameserver ("<<qname<<") used to process the query"<<endl;
       return pol;
     }
@@ -59,12 +217,12 @@ DNSFilterEngine::Policy DNSFilterEngine::getQueryPolicy(const DNSName& qname, co
 
   Policy pol{PolicyKind::NoAction};
   for(const auto& z : d_zones) {
-    if(findNamedPolicy(z.qpolName, qname, pol)) {
+    if(z->qpolCompiled ? z->qpolCompiled->lookup(qname, pol) : findNamedPolicy(z->qpolName, qname, pol)) {
       //      cerr<<"Had a hit on the name of the query"<<endl;
       return pol;
     }
     
-    if(auto fnd=z.qpolAddr.lookup(ca)) {
+    if(auto fnd=z->qpolAddr.lookup(ca)) {
       //	cerr<<"Had a hit on the IP address ("<<ca.toString()<<") of the client"<<endl;
       return fnd->second;
     }
@@ -88,7 +246,7 @@ DNSFilterEngine::Policy DNSFilterEngine::getPostPolicy(const vector<DNSRecord>&
       continue;
 
     for(const auto& z : d_zones) {
-      if(auto fnd=z.postpolAddr.lookup(ca))
+      if(auto fnd=z->postpolAddr.lookup(ca))
 	return fnd->second;
     }
   }
@@ -97,61 +255,82 @@ DNSFilterEngine::Policy DNSFilterEngine::getPostPolicy(const vector<DNSRecord>&
 
 void DNSFilterEngine::assureZones(int zone)
 {
-  if((int)d_zones.size() <= zone)
-    d_zones.resize(zone+1);
+  while((int)d_zones.size() <= zone)
+    d_zones.push_back(std::make_shared<Zone>());
 }
 
-void DNSFilterEngine::addClientTrigger(const Netmask& nm, Policy pol, int zone)
+/* Zones may be shared with other copies of the engine, which should not see
+   our changes, so we get our own copy first if needed */
+DNSFilterEngine::Zone& DNSFilterEngine::getZoneForUpdate(int zone)
 {
   assureZones(zone);
-  d_zones[zone].qpolAddr.insert(nm).second=pol;
+  auto& z = d_zones[zone];
+  if(!z.unique())
+    z = std::make_shared<Zone>(*z);
+  return *z;
 }
 
-void DNSFilterEngine::addResponseTrigger(const Netmask& nm, Policy pol, int zone)
+void DNSFilterEngine::clear()
+{
+  d_zones.clear();
+}
+
+void DNSFilterEngine::clear(int zone)
 {
   assureZones(zone);
-  d_zones[zone].postpolAddr.insert(nm).second=pol;
+  d_zones[zone] = std::make_shared<Zone>();
+}
+
+void DNSFilterEngine::addClientTrigger(const Netmask& nm, Policy pol, int zone)
+{
+  getZoneForUpdate(zone).qpolAddr.insert(nm).second=pol;
+}
+
+void DNSFilterEngine::addResponseTrigger(const Netmask& nm, Policy pol, int zone)
+{
+  getZoneForUpdate(zone).postpolAddr.insert(nm).second=pol;
 }
 
 void DNSFilterEngine::addQNameTrigger(const DNSName& n, Policy pol, int zone)
 {
-  assureZones(zone);
-  d_zones[zone].qpolName[n]=pol;
+  auto& z = getZoneForUpdate(zone);
+  z.qpolCompiled.reset();
+  z.qpolName[n]=pol;
 }
 
 void DNSFilterEngine::addNSTrigger(const DNSName& n, Policy pol, int zone)
 {
-  assureZones(zone);
-  d_zones[zone].propolName[n]=pol;
+  auto& z = getZoneForUpdate(zone);
+  z.propolCompiled.reset();
+  z.propolName[n]=pol;
 }
 
 bool DNSFilterEngine::rmClientTrigger(const Netmask& nm, Policy pol, int zone)
 {
-  assureZones(zone);
-
-  auto& qpols = d_zones[zone].qpolAddr;
+  auto& qpols = getZoneForUpdate(zone).qpolAddr;
   qpols.erase(nm);
   return true;
 }
 
 bool DNSFilterEngine::rmResponseTrigger(const Netmask& nm, Policy pol, int zone)
 {
-  assureZones(zone);
-  auto& postpols = d_zones[zone].postpolAddr;
+  auto& postpols = getZoneForUpdate(zone).postpolAddr;
   postpols.erase(nm);  
   return true;
 }
 
 bool DNSFilterEngine::rmQNameTrigger(const DNSName& n, Policy pol, int zone)
 {
-  assureZones(zone);
-  d_zones[zone].qpolName.erase(n); // XXX verify we had identical policy?
+  auto& z = getZoneForUpdate(zone);
+  z.qpolCompiled.reset();
+  z.qpolName.erase(n); // XXX verify we had identical policy?
   return true;
 }
 
 bool DNSFilterEngine::rmNSTrigger(const DNSName& n, Policy pol, int zone)
 {
-  assureZones(zone);
-  d_zones[zone].propolName.erase(n); // XXX verify policy matched? =pol;
+  auto& z = getZoneForUpdate(zone);
+  z.propolCompiled.reset();
+  z.propolName.erase(n); // XXX verify policy matched? =pol;
   return true;
 }
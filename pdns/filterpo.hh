@@ -36,6 +36,14 @@
    Netmasks (IPv4 and IPv6)
    Finally, triggers are grouped in different zones. The "first" zone that has a match
    is consulted. Then within that zone, rules again have precedences. 
+
+   Zones are held through shared pointers, so copies of the engine share them, and a zone is only
+   copied when a shared one gets changed. This allows building a new version of a single zone (from
+   an IXFR for example) next to the one in use, and then putting it in place with setZone().
+
+   Next to the maps that add/rm work on, compile() builds an immutable suffix trie over the qname
+   and ns-name triggers of each zone. Any change to a zone drops its trie, and lookups in that zone
+   fall back to walking the maps until compile() is called again.
 */
 
 
@@ -54,6 +62,40 @@ public:
     int d_ttl;
   };
 
+private:
+  /* Nodes are stored breadth-first, the children of a node being contiguous and sorted on their
+     lowercased label, so a lookup is one binary search per label and does not allocate. */
+  struct CompiledNames
+  {
+    struct Node
+    {
+      uint32_t d_firstChild{0};
+      uint32_t d_childCount{0};
+      uint32_t d_labelOffset{0};
+      uint8_t d_labelLength{0};
+      int32_t d_exact{-1};    // index in d_policies
+      int32_t d_wildcard{-1}; // index in d_policies, for '*.' followed by the name of this node
+    };
+
+    void build(const std::map<DNSName, Policy>& polmap);
+    bool lookup(const DNSName& qname, Policy& pol) const;
+    const Node* findChild(const Node& parent, const char* label, uint8_t length) const;
+
+    vector<Node> d_nodes;
+    std::string d_labels;
+    vector<Policy> d_policies;
+  };
+
+public:
+  struct Zone {
+    std::map<DNSName, Policy> qpolName;
+    NetmaskTree<Policy> qpolAddr;
+    std::map<DNSName, Policy> propolName;
+    NetmaskTree<Policy> postpolAddr;
+    std::shared_ptr<const CompiledNames> qpolCompiled;
+    std::shared_ptr<const CompiledNames> propolCompiled;
+  };
+
   DNSFilterEngine();
   void clear();
   void clear(int zone);
@@ -67,6 +109,14 @@ public:
   bool rmNSTrigger(const DNSName& dn, Policy pol, int zone=0);
   bool rmResponseTrigger(const Netmask& nm, Policy pol, int zone=0);
 
+  //! Build the lookup tries of the zones that changed since the last call, call after (re)loading or applying a batch of changes
+  void compile();
+  bool isCompiled() const;
+
+  //! The zone is shared, not copied, and may be empty if it never had any triggers
+  std::shared_ptr<const Zone> getZone(int zone) const;
+  //! Put zone 'zone' of 'source' in place of ours, sharing it
+  void setZone(int zone, const DNSFilterEngine& source);
 
   Policy getQueryPolicy(const DNSName& qname, const ComboAddress& nm) const;
   Policy getProcessingPolicy(const DNSName& qname) const;
@@ -77,12 +127,6 @@ public:
   }
 private:
   void assureZones(int zone);
-  struct Zone {
-    std::map<DNSName, Policy> qpolName;
-    NetmaskTree<Policy> qpolAddr;
-    std::map<DNSName, Policy> propolName;
-    NetmaskTree<Policy> postpolAddr;
-  };
-  vector<Zone> d_zones;
-
+  Zone& getZoneForUpdate(int zone);
+  vector<std::shared_ptr<Zone> > d_zones;
 };
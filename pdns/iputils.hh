@@ -127,6 +127,17 @@ union ComboAddress {
     }
   };
 
+  struct addressOnlyHash
+  {
+    uint32_t operator()(const ComboAddress& ca) const
+    {
+      if(ca.sin4.sin_family == AF_INET)
+        return burtle(reinterpret_cast<const unsigned char*>(&ca.sin4.sin_addr.s_addr), sizeof(ca.sin4.sin_addr.s_addr), 0);
+      else
+        return burtle(reinterpret_cast<const unsigned char*>(&ca.sin6.sin6_addr.s6_addr), sizeof(ca.sin6.sin6_addr.s6_addr), 0);
+    }
+  };
+
 
   socklen_t getSocklen() const
   {
@@ -781,6 +792,7 @@ private:
 
 struct SComboAddress
 {
+  SComboAddress() {}
   SComboAddress(const ComboAddress& orig) : ca(orig) {}
   ComboAddress ca;
   bool operator<(const SComboAddress& rhs) const
@@ -99,6 +99,11 @@ public:
     return ret;
   }
 
+  size_t getWatchedFDCount(bool writeFDs) const
+  {
+    return writeFDs ? d_writeCallbacks.size() : d_readCallbacks.size();
+  }
+
   typedef FDMultiplexer* getMultiplexer_t();
   typedef std::multimap<int, getMultiplexer_t*> FDMultiplexermap_t;
 
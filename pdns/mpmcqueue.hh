@@ -0,0 +1,109 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bounded multi-producer, multi-consumer queue, after the design by Dmitry Vyukov.
+   Every slot carries a sequence number that tells producers and consumers whether it
+   is theirs to use, so push() and pop() only need a compare-and-swap on the position,
+   and never block, take a lock or allocate. The capacity is rounded up to a power of two. */
+
+template<class T>
+class MPMCQueue
+{
+public:
+  explicit MPMCQueue(size_t capacity)
+  {
+    size_t size = 2;
+    while(size < capacity)
+      size <<= 1;
+    d_mask = size - 1;
+    d_slots = std::unique_ptr<Slot[]>(new Slot[size]);
+    for(size_t pos = 0; pos < size; ++pos)
+      d_slots[pos].d_seq.store(pos, std::memory_order_relaxed);
+  }
+
+  MPMCQueue(const MPMCQueue&) = delete;
+  MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+  //! Returns false if the queue is full
+  bool push(const T& value)
+  {
+    size_t pos = d_enqueuePos.load(std::memory_order_relaxed);
+    Slot* slot;
+    for(;;) {
+      slot = &d_slots[pos & d_mask];
+      size_t seq = slot->d_seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if(diff == 0) {
+        if(d_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else if(diff < 0) {
+        return false;
+      }
+      else {
+        pos = d_enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+    slot->d_value = value;
+    slot->d_seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  //! Returns false if the queue is empty
+  bool pop(T& value)
+  {
+    size_t pos = d_dequeuePos.load(std::memory_order_relaxed);
+    Slot* slot;
+    for(;;) {
+      slot = &d_slots[pos & d_mask];
+      size_t seq = slot->d_seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if(diff == 0) {
+        if(d_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else if(diff < 0) {
+        return false;
+      }
+      else {
+        pos = d_dequeuePos.load(std::memory_order_relaxed);
+      }
+    }
+    value = slot->d_value;
+    slot->d_seq.store(pos + d_mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  //! Only a snapshot, which may be stale by the time it is returned
+  size_t size() const
+  {
+    size_t dequeued = d_dequeuePos.load(std::memory_order_relaxed);
+    size_t enqueued = d_enqueuePos.load(std::memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+  }
+
+  size_t capacity() const
+  {
+    return d_mask + 1;
+  }
+
+private:
+  struct Slot
+  {
+    std::atomic<size_t> d_seq;
+    T d_value;
+  };
+
+  std::unique_ptr<Slot[]> d_slots;
+  size_t d_mask;
+  /* padded to keep them on separate cache lines, producers and consumers should not slow each other down.
+     No alignas(), as we can't count on operator new honouring it before C++17 */
+  char d_pad0[64];
+  std::atomic<size_t> d_enqueuePos{0};
+  char d_pad1[64];
+  std::atomic<size_t> d_dequeuePos{0};
+  char d_pad2[64];
+};
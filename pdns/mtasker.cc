@@ -41,8 +41,9 @@
     code that would ordinarily require a statemachine, for which the author does not consider 
     himself smart enough.
 
-    This class does not perform any magic it only makes calls to makecontext() and swapcontext(). 
-    Getting the details right however is complicated and MTasker does that for you.
+    This class does not perform any magic it only switches stacks, using the functions from mtasker_context.hh,
+    which are makecontext() and swapcontext() or their hand written equivalents. Getting the details right
+    however is complicated and MTasker does that for you.
 
     If preemptive multitasking or more advanced concepts such as semaphores, locks or mutexes
     are required, the use of POSIX threads is advised.
@@ -175,7 +176,7 @@ template<class EventKey, class EventVal>int MTasker<EventKey,EventVal>::waitEven
   }
 
   Waiter w;
-  w.context=new ucontext_t;
+  w.context=d_threads[d_tid].context;
   w.ttd.tv_sec = 0; w.ttd.tv_usec = 0;
   if(timeoutMsec) {
     struct timeval increment;
@@ -198,10 +199,7 @@ template<class EventKey, class EventVal>int MTasker<EventKey,EventVal>::waitEven
   unsigned int diff=d_threads[d_tid].dt.ndiff()/1000;
   d_threads[d_tid].totTime+=diff;
 #endif
-  if(swapcontext(d_waiters.find(key)->context,&d_kernel)) { // 'A' will return here when 'key' has arrived, hands over control to kernel first
-    perror("swapcontext");
-    exit(EXIT_FAILURE); // no way we can deal with this 
-  }
+  pdns_swapcontext(*w.context, d_kernel); // 'A' will return here when 'key' has arrived, hands over control to kernel first
 #ifdef MTASKERTIMING
   d_threads[d_tid].dt.start();
 #endif
@@ -221,10 +219,7 @@ template<class EventKey, class EventVal>int MTasker<EventKey,EventVal>::waitEven
 template<class Key, class Val>void MTasker<Key,Val>::yield()
 {
   d_runQueue.push(d_tid);
-  if(swapcontext(d_threads[d_tid].context ,&d_kernel) < 0) { // give control to the kernel
-    perror("swapcontext in  yield");
-    exit(EXIT_FAILURE);
-  }
+  pdns_swapcontext(*d_threads[d_tid].context, d_kernel); // give control to the kernel
 }
 
 //! reports that an event took place for which threads may be waiting
@@ -248,29 +243,14 @@ template<class EventKey, class EventVal>int MTasker<EventKey,EventVal>::sendEven
   if(val)
     d_waitval=*val;
   
-  ucontext_t *userspace=waiter->context;
+  pdns_ucontext_t *userspace=waiter->context;
   d_tid=waiter->tid;         // set tid 
   d_eventkey=waiter->key;        // pass waitEvent the exact key it was woken for
   d_waiters.erase(waiter);             // removes the waitpoint 
-  if(swapcontext(&d_kernel,userspace)) { // swaps back to the above point 'A'
-    perror("swapcontext in sendEvent");
-    exit(EXIT_FAILURE);
-  }
-  delete userspace;
+  pdns_swapcontext(d_kernel, *userspace); // swaps back to the above point 'A'
   return 1;
 }
 
-inline pair<uint32_t, uint32_t> splitPointer(void *ptr)
-{
-  uint64_t ll = (uint64_t) ptr;
-  return make_pair(ll >> 32, ll & 0xffffffff);
-}
-
-inline void* joinPtr(uint32_t val1, uint32_t val2)
-{
-  return (void*)(((uint64_t)val1 << 32) | (uint64_t)val2);
-}
-
 //! launches a new thread
 /** The kernel can call this to make a new thread, which starts at the function start and gets passed the val void pointer.
     \param start Pointer to the function which will form the start of the thread
@@ -278,19 +258,22 @@ inline void* joinPtr(uint32_t val1, uint32_t val2)
 */
 template<class Key, class Val>void MTasker<Key,Val>::makeThread(tfunc_t *start, void* val)
 {
-  ucontext_t *uc=new ucontext_t;
-  getcontext(uc);
-  
-  uc->uc_link = &d_kernel; // come back to kernel after dying
-  uc->uc_stack.ss_sp = new char[d_stacksize];
-  
-  uc->uc_stack.ss_size = d_stacksize;
-  pair<uint32_t, uint32_t> valpair = splitPointer(val);
-  pair<uint32_t, uint32_t> thispair = splitPointer(this);
+  char* stack;
+  if(!d_stacks.empty()) { // recycle the stack of a thread that is gone
+    stack = d_stacks.back();
+    d_stacks.pop_back();
+  }
+  else
+    stack = pdns_stack_alloc(d_stacksize, d_stackGuard);
 
-  makecontext (uc, (void (*)(void))threadWrapper, 6, thispair.first, thispair.second, start, d_maxtid, valpair.first, valpair.second);
+  ThreadInfo& ti = d_threads[d_maxtid];
+  ti.context = new pdns_ucontext_t;
+  ti.stack = stack;
+  ti.start = start;
+  ti.startVal = val;
+  ti.self = this;
+  pdns_makecontext(*ti.context, d_kernel, stack, d_stacksize, threadWrapper, &ti); // come back to kernel after dying
 
-  d_threads[d_maxtid].context = uc;
   d_runQueue.push(d_maxtid++); // will run at next schedule invocation
 }
 
@@ -312,16 +295,13 @@ template<class Key, class Val>bool MTasker<Key,Val>::schedule(struct timeval*  n
 #ifdef MTASKERTIMING
     d_threads[d_tid].dt.start();
 #endif
-    if(swapcontext(&d_kernel, d_threads[d_tid].context)) {
-      perror("swapcontext in schedule");
-      exit(EXIT_FAILURE);
-    }
+    pdns_swapcontext(d_kernel, *d_threads[d_tid].context);
       
     d_runQueue.pop();
     return true;
   }
   if(!d_zombiesQueue.empty()) {
-    delete[] (char *)d_threads[d_zombiesQueue.front()].context->uc_stack.ss_sp;
+    d_stacks.push_back(d_threads[d_zombiesQueue.front()].stack);
     delete d_threads[d_zombiesQueue.front()].context;
     d_threads.erase(d_zombiesQueue.front());
     d_zombiesQueue.pop();
@@ -342,15 +322,11 @@ template<class Key, class Val>bool MTasker<Key,Val>::schedule(struct timeval*  n
       if(i->ttd.tv_sec && i->ttd < rnow) {
         d_waitstatus=TimeOut;
         d_eventkey=i->key;        // pass waitEvent the exact key it was woken for
-        ucontext_t* uc = i->context;
+        pdns_ucontext_t* uc = i->context;
         d_tid = i->tid;
         ttdindex.erase(i++);                  // removes the waitpoint 
 
-        if(swapcontext(&d_kernel, uc)) { // swaps back to the above point 'A'
-          perror("swapcontext in schedule2");
-          exit(EXIT_FAILURE);
-        }
-        delete uc;
+        pdns_swapcontext(d_kernel, *uc); // swaps back to the above point 'A'
       }
       else if(i->ttd.tv_sec)
         break;
@@ -392,12 +368,13 @@ template<class Key, class Val>void MTasker<Key,Val>::getEvents(std::vector<Key>&
   }
 }
 
-template<class Key, class Val>void MTasker<Key,Val>::threadWrapper(uint32_t self1, uint32_t self2, tfunc_t *tf, int tid, uint32_t val1, uint32_t val2)
+template<class Key, class Val>void MTasker<Key,Val>::threadWrapper(void* ptr)
 {
-  void* val = joinPtr(val1, val2); 
-  MTasker* self = (MTasker*) joinPtr(self1, self2);
-  self->d_threads[self->d_tid].startOfStack = self->d_threads[self->d_tid].highestStackSeen = (char*)&val;
-  (*tf)(val);
+  ThreadInfo* ti = (ThreadInfo*) ptr;
+  MTasker* self = ti->self;
+  int tid = self->d_tid;
+  ti->startOfStack = ti->highestStackSeen = (char*)&ti;
+  (*ti->start)(ti->startVal);
   self->d_zombiesQueue.push(tid);
   
   // we now jump to &kernel, automatically
@@ -418,6 +395,26 @@ template<class Key, class Val>unsigned int MTasker<Key,Val>::getMaxStackUsage()
   return d_threads[d_tid].startOfStack - d_threads[d_tid].highestStackSeen;
 }
 
+//! Returns the deepest any MThread ever got into its stack
+/** Unlike getMaxStackUsage(), this looks at the stacks themselves, for all threads, running or gone.
+    It reads all of them, so don't call this too often.
+*/
+template<class Key, class Val>size_t MTasker<Key,Val>::getStackHighWaterMark()
+{
+  size_t ret = 0;
+  for(const auto& thread : d_threads)
+    ret = std::max(ret, pdns_stack_used(thread.second.stack, d_stacksize));
+  for(const char* stack : d_stacks)
+    ret = std::max(ret, pdns_stack_used(stack, d_stacksize));
+  return ret;
+}
+
+//! Returns the number of stacks allocated, in use or kept for new threads
+template<class Key, class Val>size_t MTasker<Key,Val>::numStacks()
+{
+  return d_threads.size() + d_stacks.size();
+}
+
 //! Returns the maximum stack usage so far of this MThread
 template<class Key, class Val>unsigned int MTasker<Key,Val>::getUsec()
 {
@@ -23,7 +23,6 @@
 #define MTASKER_HH
 #include <stdint.h>
 #include <signal.h>
-#include <ucontext.h>
 #include <queue>
 #include <vector>
 #include <map>
@@ -33,6 +32,7 @@
 #include <boost/multi_index/key_extractors.hpp>
 #include "namespaces.hh"
 #include "misc.hh"
+#include "mtasker_context.hh"
 using namespace ::boost::multi_index;
 
 // #define MTASKERTIMING 1
@@ -47,16 +47,23 @@ struct KeyTag {};
 */
 template<class EventKey=int, class EventVal=int> class MTasker
 {
+public:
+  typedef void tfunc_t(void *); //!< type of the pointer that starts a thread 
+
 private:
-  ucontext_t d_kernel;     
+  pdns_ucontext_t d_kernel;     
   std::queue<int> d_runQueue;
   std::queue<int> d_zombiesQueue;
 
   struct ThreadInfo
   {
-	ucontext_t* context;
+	pdns_ucontext_t* context; // also used to wait for events, a thread waits for one at a time
+	char* stack;
 	char* startOfStack;
 	char* highestStackSeen;
+	tfunc_t* start;
+	void* startVal;
+	MTasker* self;
 #ifdef MTASKERTIMING
     	CPUTime dt;
 	unsigned int totTime;
@@ -68,6 +75,8 @@ private:
   int d_tid;
   int d_maxtid;
   size_t d_stacksize;
+  bool d_stackGuard;
+  std::vector<char*> d_stacks; // stacks of exited threads, for new threads to use. Never more than ran at once
 
   EventVal d_waitval;
   enum waitstatusenum {Error=-1,TimeOut=0,Answer} d_waitstatus;
@@ -76,7 +85,7 @@ public:
   struct Waiter
   {
     EventKey key;
-    ucontext_t *context;
+    pdns_ucontext_t *context;
     struct timeval ttd;
     int tid;    
   };
@@ -96,12 +105,17 @@ public:
       This limit applies solely to the stack, the heap is not limited in any way. If threads need to allocate a lot of data,
       the use of new/delete is suggested. 
    */
-  MTasker(size_t stacksize=8192) : d_stacksize(stacksize)
+  MTasker(size_t stacksize=8192, bool stackGuard=false) : d_stacksize(stacksize), d_stackGuard(stackGuard)
   {
     d_maxtid=0;
   }
 
-  typedef void tfunc_t(void *); //!< type of the pointer that starts a thread 
+  ~MTasker()
+  {
+    for(char* stack : d_stacks)
+      pdns_stack_free(stack, d_stacksize, d_stackGuard);
+  }
+
   int waitEvent(EventKey &key, EventVal *val=0, unsigned int timeoutMsec=0, struct timeval* now=0);
   void yield();
   int sendEvent(const EventKey& key, const EventVal* val=0);
@@ -112,10 +126,12 @@ public:
   unsigned int numProcesses();
   int getTid(); 
   unsigned int getMaxStackUsage();
+  size_t getStackHighWaterMark();
+  size_t numStacks();
   unsigned int getUsec();
 
 private:
-  static void threadWrapper(uint32_t self1, uint32_t self2, tfunc_t *tf, int tid, uint32_t val1, uint32_t val2);
+  static void threadWrapper(void* ptr);
   EventKey d_eventkey;   // for waitEvent, contains exact key it was awoken for
 };
 #include "mtasker.cc"
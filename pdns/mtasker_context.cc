@@ -0,0 +1,271 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "mtasker_context.hh"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <new>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* The assembly backend does not know about sanitizers or shadow stacks, swapcontext() does */
+#if !defined(PDNS_MTASKER_UCONTEXT) && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__)) && \
+  !defined(__SANITIZE_ADDRESS__) && !(defined(__CET__) && (__CET__ & 2))
+#define PDNS_MTASKER_ASM 1
+#endif
+
+static void contextEntry(pdns_ucontext_t* ctx)
+{
+  ctx->uc_start(ctx->uc_arg);
+  pdns_swapcontext(*ctx, *ctx->uc_link); // we are not coming back here
+  abort();
+}
+
+#ifdef PDNS_MTASKER_ASM
+
+/* Saves the callee-saved registers on the current stack, stores the stack pointer in *from, then loads
+   the stack pointer 'to' and restores the registers saved there by an earlier call. A new context gets
+   a stack that looks like it was saved by this function, returning into pdns_context_trampoline with
+   the context in the first and contextEntry() in the second saved register. */
+extern "C" void pdns_context_switch(void** from, void* to);
+extern "C" void pdns_context_trampoline();
+
+#if defined(__x86_64__)
+asm(
+  ".text\n"
+  ".hidden pdns_context_switch\n"
+  ".globl pdns_context_switch\n"
+  ".type pdns_context_switch, @function\n"
+  "pdns_context_switch:\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  subq $8, %rsp\n"
+  "  stmxcsr (%rsp)\n"
+  "  fnstcw 4(%rsp)\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq %rsi, %rsp\n"
+  "  ldmxcsr (%rsp)\n"
+  "  fldcw 4(%rsp)\n"
+  "  addq $8, %rsp\n"
+  "  popq %r15\n"
+  "  popq %r14\n"
+  "  popq %r13\n"
+  "  popq %r12\n"
+  "  popq %rbx\n"
+  "  popq %rbp\n"
+  "  ret\n"
+  ".size pdns_context_switch, .-pdns_context_switch\n"
+  ".hidden pdns_context_trampoline\n"
+  ".globl pdns_context_trampoline\n"
+  ".type pdns_context_trampoline, @function\n"
+  "pdns_context_trampoline:\n"
+  "  movq %r12, %rdi\n"
+  "  callq *%r13\n"
+  "  ud2\n"
+  ".size pdns_context_trampoline, .-pdns_context_trampoline\n"
+);
+
+static const size_t s_frameSize = 80; // mxcsr and x87 control word, r15 to rbp, return address, padding
+static void* initialFrame(char* top, pdns_ucontext_t* ctx)
+{
+  uint64_t* frame = reinterpret_cast<uint64_t*>(top - s_frameSize);
+  memset(frame, 0, s_frameSize);
+  uint32_t mxcsr = 0x1f80;  // the defaults, all exceptions masked
+  uint16_t fpucw = 0x037f;
+  memcpy(reinterpret_cast<char*>(frame), &mxcsr, sizeof(mxcsr));
+  memcpy(reinterpret_cast<char*>(frame) + 4, &fpucw, sizeof(fpucw));
+  frame[3] = reinterpret_cast<uint64_t>(&contextEntry);           // r13
+  frame[4] = reinterpret_cast<uint64_t>(ctx);                     // r12
+  frame[7] = reinterpret_cast<uint64_t>(&pdns_context_trampoline); // return address
+  return frame;
+}
+
+const char* pdns_context_backend()
+{
+  return "x86-64 assembly";
+}
+
+#elif defined(__aarch64__)
+asm(
+  ".text\n"
+  ".hidden pdns_context_switch\n"
+  ".globl pdns_context_switch\n"
+  ".type pdns_context_switch, %function\n"
+  "pdns_context_switch:\n"
+  "  sub sp, sp, #160\n"
+  "  stp x19, x20, [sp, #0]\n"
+  "  stp x21, x22, [sp, #16]\n"
+  "  stp x23, x24, [sp, #32]\n"
+  "  stp x25, x26, [sp, #48]\n"
+  "  stp x27, x28, [sp, #64]\n"
+  "  stp x29, x30, [sp, #80]\n"
+  "  stp d8, d9, [sp, #96]\n"
+  "  stp d10, d11, [sp, #112]\n"
+  "  stp d12, d13, [sp, #128]\n"
+  "  stp d14, d15, [sp, #144]\n"
+  "  mov x2, sp\n"
+  "  str x2, [x0]\n"
+  "  mov sp, x1\n"
+  "  ldp x19, x20, [sp, #0]\n"
+  "  ldp x21, x22, [sp, #16]\n"
+  "  ldp x23, x24, [sp, #32]\n"
+  "  ldp x25, x26, [sp, #48]\n"
+  "  ldp x27, x28, [sp, #64]\n"
+  "  ldp x29, x30, [sp, #80]\n"
+  "  ldp d8, d9, [sp, #96]\n"
+  "  ldp d10, d11, [sp, #112]\n"
+  "  ldp d12, d13, [sp, #128]\n"
+  "  ldp d14, d15, [sp, #144]\n"
+  "  add sp, sp, #160\n"
+  "  ret\n"
+  ".size pdns_context_switch, .-pdns_context_switch\n"
+  ".hidden pdns_context_trampoline\n"
+  ".globl pdns_context_trampoline\n"
+  ".type pdns_context_trampoline, %function\n"
+  "pdns_context_trampoline:\n"
+  "  mov x0, x19\n"
+  "  blr x20\n"
+  "  brk #0\n"
+  ".size pdns_context_trampoline, .-pdns_context_trampoline\n"
+);
+
+static const size_t s_frameSize = 160; // x19 to x30, d8 to d15
+static void* initialFrame(char* top, pdns_ucontext_t* ctx)
+{
+  uint64_t* frame = reinterpret_cast<uint64_t*>(top - s_frameSize);
+  memset(frame, 0, s_frameSize);
+  frame[0] = reinterpret_cast<uint64_t>(ctx);                      // x19
+  frame[1] = reinterpret_cast<uint64_t>(&contextEntry);            // x20
+  frame[11] = reinterpret_cast<uint64_t>(&pdns_context_trampoline); // x30
+  return frame;
+}
+
+const char* pdns_context_backend()
+{
+  return "aarch64 assembly";
+}
+#endif
+
+pdns_ucontext_t::pdns_ucontext_t() : uc_mcontext(nullptr), uc_link(nullptr), uc_start(nullptr), uc_arg(nullptr)
+{
+}
+
+pdns_ucontext_t::~pdns_ucontext_t()
+{
+}
+
+void pdns_swapcontext(pdns_ucontext_t& octx, const pdns_ucontext_t& ctx)
+{
+  pdns_context_switch(&octx.uc_mcontext, ctx.uc_mcontext);
+}
+
+void pdns_makecontext(pdns_ucontext_t& ctx, pdns_ucontext_t& link, char* stack, size_t stacksize, void (*start)(void*), void* arg)
+{
+  ctx.uc_link = &link;
+  ctx.uc_start = start;
+  ctx.uc_arg = arg;
+  char* top = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(stack + stacksize) & ~static_cast<uintptr_t>(15));
+  ctx.uc_mcontext = initialFrame(top, &ctx);
+}
+
+#else // PDNS_MTASKER_ASM
+#include <ucontext.h>
+
+pdns_ucontext_t::pdns_ucontext_t() : uc_mcontext(new ucontext_t), uc_link(nullptr), uc_start(nullptr), uc_arg(nullptr)
+{
+}
+
+pdns_ucontext_t::~pdns_ucontext_t()
+{
+  delete static_cast<ucontext_t*>(uc_mcontext);
+}
+
+void pdns_swapcontext(pdns_ucontext_t& octx, const pdns_ucontext_t& ctx)
+{
+  if(swapcontext(static_cast<ucontext_t*>(octx.uc_mcontext), static_cast<ucontext_t*>(ctx.uc_mcontext))) {
+    perror("swapcontext");
+    exit(EXIT_FAILURE); // no way we can deal with this
+  }
+}
+
+// makecontext() only passes ints
+static void ucontextEntry(uint32_t ctx1, uint32_t ctx2)
+{
+  contextEntry(reinterpret_cast<pdns_ucontext_t*>((static_cast<uint64_t>(ctx1) << 32) | ctx2));
+}
+
+void pdns_makecontext(pdns_ucontext_t& ctx, pdns_ucontext_t& link, char* stack, size_t stacksize, void (*start)(void*), void* arg)
+{
+  ctx.uc_link = &link;
+  ctx.uc_start = start;
+  ctx.uc_arg = arg;
+
+  ucontext_t* uc = static_cast<ucontext_t*>(ctx.uc_mcontext);
+  getcontext(uc);
+  uc->uc_link = nullptr; // contextEntry() switches to ctx.uc_link itself
+  uc->uc_stack.ss_sp = stack;
+  uc->uc_stack.ss_size = stacksize;
+  uint64_t ptr = reinterpret_cast<uint64_t>(&ctx);
+  makecontext(uc, (void (*)(void))ucontextEntry, 2, static_cast<uint32_t>(ptr >> 32), static_cast<uint32_t>(ptr & 0xffffffff));
+}
+
+const char* pdns_context_backend()
+{
+  return "ucontext";
+}
+#endif // PDNS_MTASKER_ASM
+
+static size_t getPageSize()
+{
+  static const size_t pageSize = sysconf(_SC_PAGESIZE);
+  return pageSize;
+}
+
+static size_t getMappedSize(size_t size)
+{
+  return (size + getPageSize() - 1) & ~(getPageSize() - 1);
+}
+
+char* pdns_stack_alloc(size_t size, bool guard)
+{
+  size_t guardSize = guard ? getPageSize() : 0;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_STACK
+  flags |= MAP_STACK;
+#endif
+  void* ptr = mmap(nullptr, getMappedSize(size) + guardSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if(ptr == MAP_FAILED)
+    throw std::bad_alloc();
+
+  if(guard && mprotect(ptr, guardSize, PROT_NONE) < 0) {
+    munmap(ptr, getMappedSize(size) + guardSize);
+    throw std::bad_alloc();
+  }
+  return static_cast<char*>(ptr) + guardSize;
+}
+
+void pdns_stack_free(char* stack, size_t size, bool guard)
+{
+  size_t guardSize = guard ? getPageSize() : 0;
+  munmap(stack - guardSize, getMappedSize(size) + guardSize);
+}
+
+size_t pdns_stack_used(const char* stack, size_t size)
+{
+  // stacks grow down, whatever was written to them is above the zeroes that are left of the mapping
+  const uint64_t* word = reinterpret_cast<const uint64_t*>(stack);
+  const uint64_t* end = word + size / sizeof(*word);
+  while(word != end && !*word)
+    ++word;
+  return size - (reinterpret_cast<const char*>(word) - stack);
+}
@@ -0,0 +1,39 @@
+#ifndef MTASKER_CONTEXT_HH
+#define MTASKER_CONTEXT_HH
+#include <stddef.h>
+
+/* The execution context of an MThread. Switching contexts is what MTasker does most, so on x86-64 and aarch64
+   this is done by a few lines of assembly that only save and restore the registers a function call has to
+   preserve. Elsewhere, or when built with PDNS_MTASKER_UCONTEXT defined, swapcontext() is used, which also
+   saves and restores the signal mask, at the cost of a system call on every switch. */
+struct pdns_ucontext_t
+{
+  pdns_ucontext_t();
+  ~pdns_ucontext_t();
+
+  void* uc_mcontext;         // the saved stack pointer, or a ucontext_t for the ucontext backend
+  pdns_ucontext_t* uc_link;  // switched to when the function of the context returns
+  void (*uc_start)(void*);
+  void* uc_arg;
+
+private:
+  pdns_ucontext_t(const pdns_ucontext_t&);
+  pdns_ucontext_t& operator=(const pdns_ucontext_t&);
+};
+
+//! saves the current context to octx and continues at ctx
+void pdns_swapcontext(pdns_ucontext_t& octx, const pdns_ucontext_t& ctx);
+//! prepares ctx to run start(arg) on the given stack when switched to, continuing at link when start returns
+void pdns_makecontext(pdns_ucontext_t& ctx, pdns_ucontext_t& link, char* stack, size_t stacksize, void (*start)(void*), void* arg);
+//! name of the backend doing the switching, for logging
+const char* pdns_context_backend();
+
+/* Stacks are mapped straight from the kernel, so pages a thread never touched cost no memory, and read back
+   as zeroes. That makes it possible to find how deep a stack ever got, see pdns_stack_used(). With guard set,
+   an inaccessible page is put below the stack, so an overflow crashes instead of corrupting the heap. */
+char* pdns_stack_alloc(size_t size, bool guard);
+void pdns_stack_free(char* stack, size_t size, bool guard);
+//! number of bytes of the stack that were ever written to, as far as can be seen
+size_t pdns_stack_used(const char* stack, size_t size);
+
+#endif
@@ -133,6 +133,36 @@ void PacketCache::getTTLS()
 }
 
 
+uint32_t PacketCache::canHashKey(const DNSName& qname, uint16_t qtype, uint16_t ctype, int zoneID)
+{
+  uint32_t ret = qname.hash(); // case insensitive
+  ret = burtle((const unsigned char*)&qtype, sizeof(qtype), ret);
+  ret = burtle((const unsigned char*)&ctype, sizeof(ctype), ret);
+  ret = burtle((const unsigned char*)&zoneID, sizeof(zoneID), ret);
+  return ret;
+}
+
+bool PacketCache::entryMatches(const CacheEntry& ce, const DNSName& qname, uint16_t qtype, uint16_t ctype, int zoneID, bool meritsRecursion,
+  unsigned int maxReplyLen, bool dnssecOk, bool hasEDNS)
+{
+  // cheap fields first, the name comparison is the expensive bit
+  return ce.qtype == qtype && ce.ctype == ctype && ce.zoneID == zoneID && ce.meritsRecursion == meritsRecursion &&
+    ce.maxReplyLen == maxReplyLen && ce.dnssecOk == dnssecOk && ce.hasEDNS == hasEDNS && ce.qname == qname;
+}
+
+void PacketCache::insertLocked(cmap_t& map, CacheEntry& val)
+{
+  auto& idx = map.get<HashTag>();
+  auto range = idx.equal_range(val.hash);
+  for(auto iter = range.first; iter != range.second; ++iter) {
+    if(entryMatches(*iter, val.qname, val.qtype, val.ctype, val.zoneID, val.meritsRecursion, val.maxReplyLen, val.dnssecOk, val.hasEDNS)) {
+      idx.replace(iter, val);
+      return;
+    }
+  }
+  map.insert(val);
+}
+
 void PacketCache::insert(DNSPacket *q, DNSPacket *r, bool recursive, unsigned int maxttl)
 {
   if(d_ttl < 0)
@@ -183,17 +213,13 @@ void PacketCache::insert(const DNSName &qname, const QType& qtype, CacheEntryTyp
   val.dnssecOk = dnssecOk;
   val.zoneID = zoneID;
   val.hasEDNS = EDNS;
+  val.hash = canHashKey(val.qname, val.qtype, val.ctype, val.zoneID);
   
   auto& mc = getMap(val.qname);
 
   TryWriteLock l(&mc.d_mut);
   if(l.gotIt()) { 
-    bool success;
-    cmap_t::iterator place;
-    tie(place, success)=mc.d_map.insert(val);
-
-    if(!success)
-      mc.d_map.replace(place, val);
+    insertLocked(mc.d_map, val);
   }
   else 
     S.inc("deferred-cache-inserts"); 
@@ -221,17 +247,13 @@ void PacketCache::insert(const DNSName &qname, const QType& qtype, CacheEntryTyp
   val.dnssecOk = false;
   val.zoneID = zoneID;
   val.hasEDNS = false;
+  val.hash = canHashKey(val.qname, val.qtype, val.ctype, val.zoneID);
   
   auto& mc = getMap(val.qname);
 
   TryWriteLock l(&mc.d_mut);
   if(l.gotIt()) { 
-    bool success;
-    cmap_t::iterator place;
-    tie(place, success)=mc.d_map.insert(val);
-
-    if(!success)
-      mc.d_map.replace(place, val);
+    insertLocked(mc.d_map, val);
   }
   else 
     S.inc("deferred-cache-inserts"); 
@@ -257,10 +279,11 @@ int PacketCache::purgeExact(const DNSName& qname)
   auto& mc = getMap(qname);
 
   WriteLock l(&mc.d_mut);
-  auto range = mc.d_map.equal_range(tie(qname));
+  auto& idx = mc.d_map.get<NameTag>();
+  auto range = idx.equal_range(qname);
   if(range.first != range.second) {
     delcount+=distance(range.first, range.second);
-    mc.d_map.erase(range.first, range.second);
+    idx.erase(range.first, range.second);
   }
   *d_statnumentries-=delcount; // XXX FIXME NEEDS TO BE ADJUSTED (for packetcache shards)
   return delcount;
@@ -276,16 +299,17 @@ int PacketCache::purge(const string &match)
     DNSName dprefix(prefix);
     for(auto& mc : d_maps) {
       WriteLock l(&mc.d_mut);
-      cmap_t::const_iterator iter = mc.d_map.lower_bound(tie(dprefix));
+      auto& idx = mc.d_map.get<NameTag>();
+      auto iter = idx.lower_bound(dprefix);
       auto start=iter;
 
-      for(; iter != mc.d_map.end(); ++iter) {
+      for(; iter != idx.end(); ++iter) {
 	if(!iter->qname.isPartOf(dprefix)) {
 	  break;
 	}
 	delcount++;
       }
-      mc.d_map.erase(start, iter);
+      idx.erase(start, iter);
     }
     *d_statnumentries-=delcount; // XXX FIXME NEEDS TO BE ADJUSTED (for packetcache shards)
     return delcount;
@@ -315,6 +339,22 @@ bool PacketCache::getEntry(const DNSName &qname, const QType& qtype, CacheEntryT
   return getEntryLocked(qname, qtype, cet, value, zoneID);
 }
 
+bool PacketCache::getEntry(const DNSName &qname, const QType& qtype, CacheEntryType cet, string& value, int zoneID, bool meritsRecursion,
+  unsigned int maxReplyLen, bool dnssecOk, bool hasEDNS, unsigned int *age)
+{
+  if(d_ttl<0)
+    getTTLS();
+
+  auto& mc=getMap(qname);
+
+  TryReadLock l(&mc.d_mut);
+  if(!l.gotIt()) {
+    S.inc( "deferred-cache-lookup");
+    return false;
+  }
+
+  return getEntryLocked(qname, qtype, cet, value, zoneID, meritsRecursion, maxReplyLen, dnssecOk, hasEDNS, age);
+}
 
 bool PacketCache::getEntryLocked(const DNSName &qname, const QType& qtype, CacheEntryType cet, string& value, int zoneID, bool meritsRecursion,
   unsigned int maxReplyLen, bool dnssecOK, bool hasEDNS, unsigned int *age)
@@ -322,30 +362,40 @@ bool PacketCache::getEntryLocked(const DNSName &qname, const QType& qtype, Cache
   uint16_t qt = qtype.getCode();
   //cerr<<"Lookup for maxReplyLen: "<<maxReplyLen<<endl;
   auto& mc=getMap(qname);
-  cmap_t::const_iterator i=mc.d_map.find(tie(qname, qt, cet, zoneID, meritsRecursion, maxReplyLen, dnssecOK, hasEDNS, *age));
+  auto& idx=mc.d_map.get<HashTag>();
+  auto range=idx.equal_range(canHashKey(qname, qt, cet, zoneID));
   time_t now=time(0);
-  bool ret=(i!=mc.d_map.end() && i->ttd > now);
-  if(ret) {
+  for(auto i=range.first; i != range.second; ++i) {
+    if(!entryMatches(*i, qname, qt, cet, zoneID, meritsRecursion, maxReplyLen, dnssecOK, hasEDNS))
+      continue;
+    if(i->ttd <= now)
+      return false;
     if (age)
       *age = now - i->created;
     value = i->value;
+    return true;
   }
-  
-  return ret;
+
+  return false;
 }
 			   
 bool PacketCache::getEntryLocked(const DNSName &qname, const QType& qtype, CacheEntryType cet, vector<DNSResourceRecord>& value, int zoneID)
 {
   uint16_t qt = qtype.getCode();
-  //cerr<<"Lookup for maxReplyLen: "<<maxReplyLen<<endl;
   auto& mc=getMap(qname);
-  cmap_t::const_iterator i=mc.d_map.find(tie(qname, qt, cet, zoneID));
+  auto& idx=mc.d_map.get<HashTag>();
+  auto range=idx.equal_range(canHashKey(qname, qt, cet, zoneID));
   time_t now=time(0);
-  bool ret=(i!=mc.d_map.end() && i->ttd > now);
-  if(ret) {
+  for(auto i=range.first; i != range.second; ++i) {
+    // only the first part of the key has to match here
+    if(i->qtype != qt || i->ctype != cet || i->zoneID != zoneID || i->qname != qname)
+      continue;
+    if(i->ttd <= now)
+      return false;
     value = i->drs;
+    return true;
   }
-  return ret;
+  return false;
 }
 
 
@@ -421,8 +471,8 @@ void PacketCache::cleanup()
   //unsigned int totErased=0;
   for(auto& mc : d_maps) {
     WriteLock wl(&mc.d_mut);
-    typedef cmap_t::nth_index<1>::type sequence_t;
-    sequence_t& sidx=mc.d_map.get<1>();
+    typedef cmap_t::index<SequenceTag>::type sequence_t;
+    sequence_t& sidx=mc.d_map.get<SequenceTag>();
     unsigned int erased=0, lookedAt=0;
     for(sequence_t::iterator i=sidx.begin(); i != sidx.end(); lookedAt++) {
       if(i->ttd < now) {
@@ -28,6 +28,7 @@
 #include <map>
 #include "dns.hh"
 #include <boost/version.hpp>
+#include <boost/multi_index/hashed_index.hpp>
 #include "namespaces.hh"
 using namespace ::boost::multi_index;
 
@@ -45,6 +46,11 @@ using namespace ::boost::multi_index;
 
     The cache itself is protected by a read/write lock. Because deleting is a two step process, which 
     first marks and then sweeps, a second lock is present to prevent simultaneous inserts and deletes.
+
+    Entries are found through a hash over qname, qtype, kind and zoneID, after which the rest of the
+    key (recursion, maxReplyLen, DO, EDNS) is verified against the entry. This means a lookup costs
+    one hash and a single name comparison, instead of a series of canonical name comparisons. Like
+    the ordered index it replaces, the record lookup only needs that first part of the key to match.
 */
 
 class PacketCache : public boost::noncopyable
@@ -82,7 +88,7 @@ private:
 
   struct CacheEntry
   {
-    CacheEntry() { qtype = ctype = 0; zoneID = -1; meritsRecursion=false; dnssecOk=false; hasEDNS=false; created=0; ttd=0; maxReplyLen=512;}
+    CacheEntry() { qtype = ctype = 0; zoneID = -1; meritsRecursion=false; dnssecOk=false; hasEDNS=false; created=0; ttd=0; maxReplyLen=512; hash=0;}
 
     DNSName qname;
     string value;
@@ -90,6 +96,7 @@ private:
     time_t created;
     time_t ttd;
 
+    uint32_t hash;
     uint16_t qtype;
     uint16_t ctype;
     int zoneID;
@@ -102,28 +109,23 @@ private:
 
   void getTTLS();
 
+  struct HashTag{};
+  struct NameTag{};
+  struct SequenceTag{};
+  /* Lookups only ever go through the hashed index, on a hash precomputed over the first part of the key.
+     The ordered index on the name is maintained for the benefit of purge() and purgeExact(). */
   typedef multi_index_container<
     CacheEntry,
     indexed_by <
-                ordered_unique<
-                      composite_key< 
-                        CacheEntry,
-                        member<CacheEntry,DNSName,&CacheEntry::qname>,
-                        member<CacheEntry,uint16_t,&CacheEntry::qtype>,
-                        member<CacheEntry,uint16_t, &CacheEntry::ctype>,
-                        member<CacheEntry,int, &CacheEntry::zoneID>,
-                        member<CacheEntry,bool, &CacheEntry::meritsRecursion>,
-                        member<CacheEntry,unsigned int, &CacheEntry::maxReplyLen>,
-                        member<CacheEntry,bool, &CacheEntry::dnssecOk>,
-                        member<CacheEntry,bool, &CacheEntry::hasEDNS>
-                        >,
-		       composite_key_compare<CanonDNSNameCompare, std::less<uint16_t>, std::less<uint16_t>, std::less<int>, std::less<bool>, 
-                          std::less<unsigned int>, std::less<bool>, std::less<bool> >
-                            >,
-                           sequenced<>
-                           >
+      hashed_non_unique<tag<HashTag>, member<CacheEntry,uint32_t,&CacheEntry::hash> >,
+      ordered_non_unique<tag<NameTag>, member<CacheEntry,DNSName,&CacheEntry::qname>, CanonDNSNameCompare >,
+      sequenced<tag<SequenceTag>>
+      >
   > cmap_t;
 
+  static uint32_t canHashKey(const DNSName& qname, uint16_t qtype, uint16_t ctype, int zoneID);
+  static bool entryMatches(const CacheEntry& ce, const DNSName& qname, uint16_t qtype, uint16_t ctype, int zoneID, bool meritsRecursion,
+    unsigned int maxReplyLen, bool dnssecOk, bool hasEDNS);
 
   struct MapCombo
   {
@@ -131,6 +133,8 @@ private:
     cmap_t d_map;
   };
 
+  void insertLocked(cmap_t& mc, CacheEntry& val);
+
   vector<MapCombo> d_maps;
   MapCombo& getMap(const DNSName& qname) 
   {
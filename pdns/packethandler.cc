@@ -978,7 +978,9 @@ void PacketHandler::makeNOError(DNSPacket* p, DNSPacket* r, const DNSName& targe
   if(d_dk.isSecuredZone(sd.qname))
     addNSECX(p, r, target, wildcard, sd.qname, mode);
 
-  S.ringAccount("noerror-queries",p->qdomain.toString()+"/"+p->qtype.getName());
+  static ThreadStatRing<SQuestion>* noerrorRing = S.getQuestionRing("noerror-queries");
+  if(S.ringsEnabled())
+    noerrorRing->account(SQuestion(p->qdomain, p->qtype.getCode()));
 }
 
 
@@ -1499,7 +1501,7 @@ DNSPacket *PacketHandler::questionOrRecurse(DNSPacket *p, bool *shouldRecurse)
     r=p->replyPacket(); // generate an empty reply packet
     r->setRcode(RCode::ServFail);
     S.inc("servfail-packets");
-    S.ringAccount("servfail-queries",p->qdomain.toString());
+    S.ringAccount("servfail-queries",p->qdomain);
   }
   catch(PDNSException &e) {
     L<<Logger::Error<<"Backend reported permanent error which prevented lookup ("+e.reason+"), aborting"<<endl;
@@ -1511,7 +1513,7 @@ DNSPacket *PacketHandler::questionOrRecurse(DNSPacket *p, bool *shouldRecurse)
     r=p->replyPacket(); // generate an empty reply packet
     r->setRcode(RCode::ServFail);
     S.inc("servfail-packets");
-    S.ringAccount("servfail-queries",p->qdomain.toString());
+    S.ringAccount("servfail-queries",p->qdomain);
   }
   return r; 
 
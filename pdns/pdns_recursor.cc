@@ -62,6 +62,9 @@ extern SortList g_sortlist;
 #include "malloctrace.hh"
 #endif
 #include <netinet/tcp.h>
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+#include <linux/filter.h>
+#endif
 #include "dnsparser.hh"
 #include "dnswriter.hh"
 #include "dnsrecords.hh"
@@ -80,6 +83,7 @@ extern SortList g_sortlist;
 #include "rpzloader.hh"
 #include "validate-recursor.hh"
 #include "rec-lua-conf.hh"
+#include "rec-snapshot.hh"
 
 #ifndef RECURSOR
 #include "statbag.hh"
@@ -122,11 +126,14 @@ SyncRes::domainmap_t* g_initialDomainMap; // new threads needs this to be setup
 #include "namespaces.hh"
 
 __thread MemRecursorCache* t_RC;
+MemRecursorCache* g_sharedRC;
 __thread RecursorPacketCache* t_packetCache;
 RecursorStats g_stats;
 bool g_quiet;
 
 bool g_weDistributeQueries; // if true, only 1 thread listens on the incoming query sockets
+static time_t g_snapshotInterval; // 0 if we only write a snapshot when quitting nicely
+static bool g_reusePort; // if true, each worker thread has its own SO_REUSEPORT sockets, and listens on those only
 
 __thread NetmaskGroup* t_allowFrom;
 static NetmaskGroup* g_initialAllowFrom; // new thread needs to be setup with this
@@ -135,7 +142,7 @@ NetmaskGroup* g_dontQuery;
 string s_programname="pdns_recursor";
 
 typedef vector<int> tcpListenSockets_t;
-tcpListenSockets_t g_tcpListenSockets;   // shared across threads, but this is fine, never written to from a thread. All threads listen on all sockets
+vector<tcpListenSockets_t> g_tcpListenSockets;   // one set, or one per worker thread with reuseport. Shared across threads, but this is fine, never written to from a thread
 int g_tcpTimeout;
 unsigned int g_maxMThreads;
 __thread struct timeval g_now; // timestamp, updated (too) frequently
@@ -186,6 +193,8 @@ struct DNSComboWriter {
   ComboAddress d_remote, d_local;
   bool d_tcp;
   int d_socket;
+  uint32_t d_qhash{0}; // packet cache key of the query, computed on the lookup
+  string d_ednsKey; // and the EDNS part of the query that went into it
   shared_ptr<TCPConnection> d_tcpConnection;
 };
 
@@ -345,6 +354,9 @@ static void setSocketSendBuffer(int fd, uint32_t size)
 // you can ask this class for a UDP socket to send a query from
 // this socket is not yours, don't even think about deleting it
 // but after you call 'returnSocket' on it, don't assume anything anymore
+// By default every query gets a fresh socket, connected to the remote. With a pool size set, queries are instead
+// sent from a set of long-lived unconnected sockets on random ports, which are only closed once they have been
+// rotated out and have no queries outstanding. Answers are matched to their query on remote, id and question anyhow.
 class UDPClientSocks
 {
   unsigned int d_numsocks;
@@ -356,9 +368,43 @@ public:
   typedef set<int> socks_t;
   socks_t d_socks;
 
+  struct PooledSocket
+  {
+    time_t rotateAt;
+    unsigned int outstanding; // number of queries sent from this socket still waiting for an answer
+    bool retired;             // rotated out, no new queries are sent from it
+  };
+  typedef map<int, PooledSocket> pooled_t;
+  pooled_t d_pooled;           // all pooled sockets, including retired ones
+  vector<int> d_pool4, d_pool6; // the ones we send new queries from
+
+  static unsigned int s_poolSize;         // per address family, 0 means no pooling
+  static unsigned int s_rotationInterval; // seconds
+
+  bool isPooled(int fd) const
+  {
+    return d_pooled.count(fd);
+  }
+
+  uint64_t numPooled() const
+  {
+    return d_pooled.size();
+  }
+
+  uint64_t numPooledOutstanding() const
+  {
+    uint64_t ret=0;
+    for(const auto& p : d_pooled)
+      ret+=p.second.outstanding;
+    return ret;
+  }
+
   // returning -2 means: temporary OS error (ie, out of files), -1 means error related to remote
   int getSocket(const ComboAddress& toaddr, int* fd)
   {
+    if(s_poolSize)
+      return getPooledSocket(toaddr.sin4.sin_family, fd);
+
     *fd=makeClientSocket(toaddr.sin4.sin_family);
     if(*fd < 0) // temporary error - receive exception otherwise
       return -2;
@@ -379,6 +425,15 @@ public:
 
   void returnSocket(int fd)
   {
+    pooled_t::iterator p=d_pooled.find(fd);
+    if(p != d_pooled.end()) {
+      if(p->second.outstanding)
+        --p->second.outstanding;
+      if(p->second.retired && !p->second.outstanding)
+        closePooledSocket(p);
+      return;
+    }
+
     socks_t::iterator i=d_socks.find(fd);
     if(i==d_socks.end()) {
       throw PDNSException("Trying to return a socket (fd="+std::to_string(fd)+") not in the pool");
@@ -404,6 +459,13 @@ public:
     --d_numsocks;
   }
 
+  // replaces the pooled sockets that are due by sockets on new random ports
+  void rotatePool(time_t now)
+  {
+    rotatePool(d_pool4, AF_INET, now);
+    rotatePool(d_pool6, AF_INET6, now);
+  }
+
   // returns -1 for errors which might go away, throws for ones that won't
   static int makeClientSocket(int family)
   {
@@ -438,10 +500,77 @@ public:
     setNonBlocking(ret);
     return ret;
   }
+
+private:
+  int getPooledSocket(int family, int* fd)
+  {
+    vector<int>& pool = family == AF_INET ? d_pool4 : d_pool6;
+    if(pool.size() < s_poolSize) { // the pool fills up as queries go out
+      int newfd=makeClientSocket(family);
+      if(newfd >= 0)
+        pool.push_back(addPooledSocket(newfd, g_now.tv_sec));
+      else if(pool.empty())
+        return -2;
+    }
+
+    *fd=pool[dns_random(pool.size())];
+    d_pooled[*fd].outstanding++;
+    return 0;
+  }
+
+  int addPooledSocket(int fd, time_t now)
+  {
+    PooledSocket ps;
+    // spread the rotations, so we don't replace all sockets at once
+    ps.rotateAt=now + s_rotationInterval/2 + dns_random(s_rotationInterval/2 + 1);
+    ps.outstanding=0;
+    ps.retired=false;
+    d_pooled[fd]=ps;
+    t_fdm->addReadFD(fd, handleUDPServerResponse, PacketID());
+    return fd;
+  }
+
+  void closePooledSocket(pooled_t::iterator& p)
+  {
+    t_fdm->removeReadFD(p->first);
+    closesocket(p->first);
+    d_pooled.erase(p++);
+  }
+
+  void rotatePool(vector<int>& pool, int family, time_t now)
+  {
+    for(auto& fd : pool) {
+      pooled_t::iterator p=d_pooled.find(fd);
+      if(p->second.rotateAt > now)
+        continue;
+      int newfd=makeClientSocket(family);
+      if(newfd < 0) // out of files, try again next time
+        continue;
+      fd=addPooledSocket(newfd, now);
+      g_stats.udpPoolRotations++;
+      // queries still waiting for an answer on the old port keep it open for a while
+      p->second.retired=true;
+      if(!p->second.outstanding)
+        closePooledSocket(p);
+    }
+  }
 };
 
+unsigned int UDPClientSocks::s_poolSize;
+unsigned int UDPClientSocks::s_rotationInterval;
+
 static __thread UDPClientSocks* t_udpclientsocks;
 
+uint64_t* pleaseGetUDPPoolSockets()
+{
+  return new uint64_t(t_udpclientsocks ? t_udpclientsocks->numPooled() : 0);
+}
+
+uint64_t* pleaseGetUDPPoolQueries()
+{
+  return new uint64_t(t_udpclientsocks ? t_udpclientsocks->numPooledOutstanding() : 0);
+}
+
 /* these two functions are used by LWRes */
 // -2 is OS error, -1 is error that depends on the remote, > 0 is success
 int asendto(const char *data, int len, int flags,
@@ -476,13 +605,22 @@ int asendto(const char *data, int len, int flags,
   pident.fd=*fd;
   pident.id=id;
 
-  t_fdm->addReadFD(*fd, handleUDPServerResponse, pident);
-  ret = send(*fd, data, len, 0);
+  bool pooled=t_udpclientsocks->isPooled(*fd);
+  if(pooled) { // already watched, and shared with other queries
+    ret = sendto(*fd, data, len, 0, (struct sockaddr*)&toaddr, toaddr.getSocklen());
+  }
+  else {
+    t_fdm->addReadFD(*fd, handleUDPServerResponse, pident);
+    ret = send(*fd, data, len, 0);
+  }
 
   int tmp = errno;
 
-  if(ret < 0)
+  if(ret < 0) {
     t_udpclientsocks->returnSocket(*fd);
+    if(pooled && tmp == ENETUNREACH) // what connect() would have told us in getSocket()
+      ret = -2;
+  }
 
   errno = tmp; // this is for logging purposes only
   return ret;
@@ -592,6 +730,55 @@ catch(...)
   return "Exception making error message for exception";
 }
 
+struct PrefetchRequest
+{
+  DNSName qname;
+  QType qtype;
+};
+
+static void doPrefetch(void* p)
+{
+  std::unique_ptr<PrefetchRequest> req(reinterpret_cast<PrefetchRequest*>(p));
+  struct timeval now;
+  Utility::gettimeofday(&now, 0);
+  DTime dt;
+  dt.setTimeval(now);
+
+  SyncRes sr(now);
+  sr.setId(MT->getTid());
+  sr.setRefresh();
+  sr.setDoEDNS0(true);
+  // get the signatures too, or clients asking for them would lose them once the entry is replaced
+  sr.d_doDNSSEC=true;
+  vector<DNSRecord> ret;
+  int res=-1;
+  try {
+    res=sr.beginResolve(req->qname, req->qtype, QClass::IN, ret);
+  }
+  catch(ImmediateServFailException& e) {
+  }
+  catch(PDNSException& e) {
+    L<<Logger::Error<<"Prefetch of '"<<req->qname<<"|"<<req->qtype.getName()<<"' failed: "<<e.reason<<endl;
+  }
+  catch(std::exception& e) {
+    L<<Logger::Error<<"Prefetch of '"<<req->qname<<"|"<<req->qtype.getName()<<"' failed: "<<e.what()<<endl;
+  }
+
+  if(res != RCode::NoError && res != RCode::NXDomain)
+    g_stats.prefetchFailures++;
+  g_stats.prefetchUsec+=dt.udiff();
+}
+
+void schedulePrefetch(const DNSName& qname, const QType& qtype)
+{
+  // client queries come first
+  if(!MT || MT->numProcesses() >= g_maxMThreads)
+    return;
+
+  g_stats.prefetches++;
+  MT->makeThread(doPrefetch, new PrefetchRequest{qname, qtype});
+}
+
 void startDoResolve(void *p)
 {
   DNSComboWriter* dc=(DNSComboWriter *)p;
@@ -877,8 +1064,8 @@ void startDoResolve(void *p)
         msgh.msg_control=NULL;
       sendmsg(dc->d_socket, &msgh, 0);
       if(!SyncRes::s_nopacketcache && !variableAnswer && !sr.wasVariable() ) {
-        t_packetCache->insertResponsePacket(string((const char*)&*packet.begin(), packet.size()),
-                                            (edo.d_Z & EDNSOpts::DNSSECOK), // ponder filtering on dnssecmode here
+        t_packetCache->insertResponsePacket(dc->d_qhash, dc->d_ednsKey, dc->d_mdp.d_qname, dc->d_mdp.d_qtype,
+                                            string((const char*)&*packet.begin(), packet.size()),
                                             g_now.tv_sec,
                                             min(minTTL,
                                                 (pw.getHeader()->rcode == RCode::ServFail) ? SyncRes::s_packetcacheservfailttl : SyncRes::s_packetcachettl
@@ -1135,6 +1322,8 @@ string* doProcessUDPQuestion(const std::string& question, const ComboAddress& fr
      g_stats.ipv6qcounter++;
 
   string response;
+  uint32_t qhash = 0;
+  string ednsKey;
   try {
     uint32_t age;
 #ifdef MALLOC_TRACE
@@ -1148,16 +1337,7 @@ string* doProcessUDPQuestion(const std::string& question, const ComboAddress& fr
     g_mtracer->clearAllocators();
     */
 #endif
-    bool needsDNSSEC=false;
-    const struct dnsheader* dh = (struct dnsheader*)question.c_str();
-    if(dh->arcount) {
-      unsigned int consumed=0;
-      DNSName qname(question.c_str(), question.length(), sizeof(dnsheader), false, 0, 0, &consumed);
-      if(question.size() > (consumed+12+11) && ((question[consumed+12+11]&0x80)==0x80))
-        needsDNSSEC=true;
-    }
-    
-    if(!SyncRes::s_nopacketcache && t_packetCache->getResponsePacket(question, needsDNSSEC, g_now.tv_sec, &response, &age)) {
+    if(!SyncRes::s_nopacketcache && t_packetCache->getResponsePacket(question, g_now.tv_sec, &response, &age, &qhash, &ednsKey)) {
       if(!g_quiet)
         L<<Logger::Notice<<t_id<< " question answered from packet cache from "<<fromaddr.toString()<<endl;
       // t_queryring->push_back("packetcached");
@@ -1217,6 +1397,8 @@ string* doProcessUDPQuestion(const std::string& question, const ComboAddress& fr
   dc->setSocket(fd);
   dc->setRemote(&fromaddr);
   dc->setLocal(destaddr);
+  dc->d_qhash=qhash;
+  dc->d_ednsKey=ednsKey;
 
   dc->d_tcp=false;
   MT->makeThread(startDoResolve, (void*) dc); // deletes dc
@@ -1303,9 +1485,9 @@ void handleNewUDPQuestion(int fd, FDMultiplexer::funcparam_t& var)
 
 
 typedef vector<pair<int, function< void(int, any&) > > > deferredAdd_t;
-deferredAdd_t deferredAdd;
+vector<deferredAdd_t> g_deferredAdds; // same as g_tcpListenSockets
 
-void makeTCPServerSockets()
+void makeTCPServerSockets(unsigned int n)
 {
   int fd;
   vector<string>locals;
@@ -1340,6 +1522,10 @@ void makeTCPServerSockets()
       L<<Logger::Error<<"Setsockopt failed for TCP listening socket"<<endl;
       exit(1);
     }
+#ifdef SO_REUSEPORT
+    if(g_reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &tmp, sizeof(tmp)) < 0)
+      throw PDNSException("SO_REUSEPORT: "+stringerror());
+#endif
     if(sin.sin6.sin6_family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &tmp, sizeof(tmp)) < 0) {
       L<<Logger::Error<<"Failed to set IPv6 socket to IPv6 only, continuing anyhow: "<<strerror(errno)<<endl;
     }
@@ -1362,10 +1548,12 @@ void makeTCPServerSockets()
     setNonBlocking(fd);
     setSocketSendBuffer(fd, 65000);
     listen(fd, 128);
-    deferredAdd.push_back(make_pair(fd, handleNewTCPQuestion));
-    g_tcpListenSockets.push_back(fd);
+    g_deferredAdds[n].push_back(make_pair(fd, handleNewTCPQuestion));
+    g_tcpListenSockets[n].push_back(fd);
     // we don't need to update g_listenSocketsAddresses since it doesn't work for TCP/IP:
     //  - fd is not that which we know here, but returned from accept()
+    if(n)
+      continue;
     if(sin.sin4.sin_family == AF_INET)
       L<<Logger::Error<<"Listening for TCP queries on "<< sin.toString() <<":"<<st.port<<endl;
     else
@@ -1373,7 +1561,47 @@ void makeTCPServerSockets()
   }
 }
 
-void makeUDPServerSockets()
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+/* Has the kernel pick, among the SO_REUSEPORT sockets bound to the address of fd, the one at position
+   hash % numSockets, in the order they were bound. The hash covers the first 16 bytes of the question,
+   lowercased (or as much of them as the packet holds), so queries for a name keep hitting the caches of
+   the same thread. This is a poor man's hashQuestion(), but it runs before the packet reaches any of us. */
+static void setReusePortSteering(int fd, unsigned int numSockets)
+{
+  static const uint32_t offsets[] = {12, 16, 20, 24}; // the question starts right after the 12 bytes of header
+  const unsigned int numOffsets = sizeof(offsets)/sizeof(offsets[0]);
+  const unsigned int blockSize = 8;
+
+  vector<struct sock_filter> code;
+  code.push_back(BPF_STMT(BPF_LD|BPF_IMM, 2166136261U)); // FNV-1a
+  code.push_back(BPF_STMT(BPF_ST, 0));
+  for(unsigned int n = 0; n < numOffsets; ++n) {
+    // skip what is left of the words if the packet is too short
+    code.push_back(BPF_STMT(BPF_LD|BPF_W|BPF_LEN, 0));
+    code.push_back(BPF_JUMP(BPF_JMP|BPF_JGE|BPF_K, offsets[n] + 4, 0, static_cast<uint8_t>((blockSize - 2) + blockSize * (numOffsets - n - 1))));
+    code.push_back(BPF_STMT(BPF_LD|BPF_W|BPF_ABS, offsets[n]));
+    code.push_back(BPF_STMT(BPF_ALU|BPF_OR|BPF_K, 0x20202020));
+    code.push_back(BPF_STMT(BPF_LDX|BPF_W|BPF_MEM, 0));
+    code.push_back(BPF_STMT(BPF_ALU|BPF_XOR|BPF_X, 0));
+    code.push_back(BPF_STMT(BPF_ALU|BPF_MUL|BPF_K, 16777619));
+    code.push_back(BPF_STMT(BPF_ST, 0));
+  }
+  code.push_back(BPF_STMT(BPF_LD|BPF_MEM, 0));
+  code.push_back(BPF_STMT(BPF_ALU|BPF_RSH|BPF_K, 16));
+  code.push_back(BPF_STMT(BPF_LDX|BPF_W|BPF_MEM, 0));
+  code.push_back(BPF_STMT(BPF_ALU|BPF_XOR|BPF_X, 0));
+  code.push_back(BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, numSockets));
+  code.push_back(BPF_STMT(BPF_RET|BPF_A, 0));
+
+  struct sock_fprog prog;
+  prog.len = code.size();
+  prog.filter = code.data();
+  if(setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+    L<<Logger::Error<<"Unable to steer queries to threads by question for "<<g_listenSocketsAddresses[fd].toStringWithPort()<<", the kernel will pick one: "<<stringerror()<<endl;
+}
+#endif
+
+void makeUDPServerSockets(unsigned int n)
 {
   int one=1;
   vector<string>locals;
@@ -1417,6 +1645,11 @@ void makeUDPServerSockets()
     if( ::arg().mustDo("non-local-bind") )
 	Utility::setBindAny(AF_INET6, fd);
 
+#ifdef SO_REUSEPORT
+    if(g_reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+      throw PDNSException("SO_REUSEPORT: "+stringerror());
+#endif
+
     setCloseOnExec(fd);
 
     setSocketReceiveBuffer(fd, 250000);
@@ -1428,8 +1661,10 @@ void makeUDPServerSockets()
 
     setNonBlocking(fd);
 
-    deferredAdd.push_back(make_pair(fd, handleNewUDPQuestion));
+    g_deferredAdds[n].push_back(make_pair(fd, handleNewUDPQuestion));
     g_listenSocketsAddresses[fd]=sin;  // this is written to only from the startup thread, not from the workers
+    if(n)
+      continue;
     if(sin.sin4.sin_family == AF_INET)
       L<<Logger::Error<<"Listening for UDP queries on "<< sin.toString() <<":"<<st.port<<endl;
     else
@@ -1515,7 +1750,7 @@ void doStats(void)
 
 static void houseKeeping(void *)
 {
-  static __thread time_t last_stat, last_rootupdate, last_prune, last_secpoll;
+  static __thread time_t last_stat, last_rootupdate, last_prune, last_secpoll, last_snapshot;
   static __thread int cleanCounter=0;
   static __thread bool s_running;  // houseKeeping can get suspended in secpoll, and be restarted, which makes us do duplicate work
   try {
@@ -1529,10 +1764,15 @@ static void houseKeeping(void *)
     if(now.tv_sec - last_prune > (time_t)(5 + t_id)) {
       DTime dt;
       dt.setTimeval(now);
-      t_RC->doPrune(); // this function is local to a thread, so fine anyhow
+      if(!g_sharedRC)
+        t_RC->doPrune(::arg().asNum("max-cache-entries") / g_numThreads); // this function is local to a thread, so fine anyhow
+      else if(t_id == 0)
+        t_RC->doPrune(::arg().asNum("max-cache-entries"));
       t_packetCache->doPruneTo(::arg().asNum("max-packetcache-entries") / g_numWorkerThreads);
 
       pruneCollection(t_sstorage->negcache, ::arg().asNum("max-cache-entries") / (g_numWorkerThreads * 10), 200);
+      t_sstorage->aggressiveNSEC.prune(SyncRes::s_aggressiveNSECCacheSize / g_numWorkerThreads);
+      t_udpclientsocks->rotatePool(now.tv_sec);
 
       if(!((cleanCounter++)%40)) {  // this is a full scan!
 	time_t limit=now.tv_sec-300;
@@ -1589,6 +1829,21 @@ static void houseKeeping(void *)
 	}
 	catch(...) {}
       }
+
+      if(g_snapshotInterval && now.tv_sec - last_snapshot >= g_snapshotInterval) {
+	if(last_snapshot) { // the first time round, only start counting
+	  try {
+	    DTime dt;
+	    dt.set();
+	    uint64_t count = writeSnapshot(::arg()["snapshot-file"], true);
+	    L<<Logger::Info<<"Took a snapshot of "<<count<<" entries in "<<dt.udiff()/1000<<" ms, writing it out in the background"<<endl;
+	  }
+	  catch(PDNSException& e) {
+	    L<<Logger::Error<<e.reason<<endl;
+	  }
+	}
+	last_snapshot=now.tv_sec;
+      }
     }
     s_running=false;
   }
@@ -1880,6 +2135,9 @@ void handleUDPServerResponse(int fd, FDMultiplexer::funcparam_t& var)
           ": packet smaller than DNS header"<<endl;
     }
 
+    if(t_udpclientsocks->isPooled(fd)) // not tied to a single query, which will time out if this was meant for it
+      return;
+
     t_udpclientsocks->returnSocket(fd);
     string empty;
 
@@ -2230,7 +2488,20 @@ int serviceMain(int argc, char*argv[])
   g_quiet=::arg().mustDo("quiet");
 
   g_weDistributeQueries = ::arg().mustDo("pdns-distributes-queries");
-  if(g_weDistributeQueries) {
+  g_reusePort = ::arg().mustDo("reuseport");
+#ifndef SO_REUSEPORT
+  if(g_reusePort) {
+    L<<Logger::Error<<"SO_REUSEPORT is not supported on this platform, ignoring 'reuseport'"<<endl;
+    g_reusePort = false;
+  }
+#endif
+  if(g_reusePort) {
+    if(g_weDistributeQueries)
+      L<<Logger::Warning<<"Not distributing queries over threads ourselves, 'reuseport' is set"<<endl;
+    g_weDistributeQueries = false;
+    L<<Logger::Warning<<"Each thread listens on its own sockets, the kernel distributes queries over threads"<<endl;
+  }
+  else if(g_weDistributeQueries) {
       L<<Logger::Warning<<"PowerDNS Recursor itself will distribute queries over threads"<<endl;
   }
 
@@ -2290,6 +2561,13 @@ int serviceMain(int argc, char*argv[])
   SyncRes::s_nopacketcache = ::arg().mustDo("disable-packetcache");
 
   SyncRes::s_maxnegttl=::arg().asNum("max-negative-ttl");
+  SyncRes::s_aggressiveNSECCacheSize=::arg().asNum("aggressive-nsec-cache-size");
+  if(!::arg()["snapshot-file"].empty())
+    g_snapshotInterval=::arg().asNum("snapshot-interval");
+  UDPClientSocks::s_poolSize=::arg().asNum("udp-source-port-pool-size");
+  UDPClientSocks::s_rotationInterval=::arg().asNum("udp-source-port-rotation");
+  if(UDPClientSocks::s_poolSize)
+    L<<Logger::Warning<<"Sending outgoing UDP queries from a pool of "<<UDPClientSocks::s_poolSize<<" sockets per address family per thread, rotated every "<<UDPClientSocks::s_rotationInterval<<" seconds"<<endl;
   SyncRes::s_maxcachettl=::arg().asNum("max-cache-ttl");
   SyncRes::s_packetcachettl=::arg().asNum("packetcache-ttl");
   SyncRes::s_packetcacheservfailttl=::arg().asNum("packetcache-servfail-ttl");
@@ -2299,6 +2577,9 @@ int serviceMain(int argc, char*argv[])
   SyncRes::s_maxqperq=::arg().asNum("max-qperq");
   SyncRes::s_maxtotusec=1000*::arg().asNum("max-total-msec");
   SyncRes::s_rootNXTrust = ::arg().mustDo( "root-nx-trust");
+  MemRecursorCache::s_prefetchPercent = std::min(::arg().asNum("prefetch-percentage"), 100);
+  MemRecursorCache::s_serveStaleSeconds = ::arg().asNum("serve-stale-window");
+  MemRecursorCache::s_staleAnswerTTL = ::arg().asNum("serve-stale-ttl");
   if(SyncRes::s_serverID.empty()) {
     char tmp[128];
     gethostname(tmp, sizeof(tmp)-1);
@@ -2316,8 +2597,24 @@ int serviceMain(int argc, char*argv[])
   g_anyToTcp = ::arg().mustDo("any-to-tcp");
   g_udpTruncationThreshold = ::arg().asNum("udp-truncation-threshold");
 
-  makeUDPServerSockets();
-  makeTCPServerSockets();
+  // with reuseport, every worker thread gets a set of its own
+  unsigned int listenSets = g_reusePort ? std::max(::arg().asNum("threads"), 1) : 1;
+  g_deferredAdds.resize(listenSets);
+  g_tcpListenSockets.resize(listenSets);
+  for(unsigned int n = 0; n < listenSets; ++n) {
+    makeUDPServerSockets(n);
+    makeTCPServerSockets(n);
+  }
+  if(listenSets > 1 && ::arg().mustDo("reuseport-steering")) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    for(const auto& fd : g_deferredAdds[0]) {
+      if(g_listenSocketsAddresses.count(fd.first))
+        setReusePortSteering(fd.first, listenSets);
+    }
+#else
+    L<<Logger::Error<<"Steering queries to threads by question is not supported on this platform, ignoring 'reuseport-steering'"<<endl;
+#endif
+  }
 
   parseEDNSSubnetWhitelist(::arg()["edns-subnet-whitelist"]);
 
@@ -2335,7 +2632,7 @@ int serviceMain(int argc, char*argv[])
   signal(SIGUSR1,usr1Handler);
   signal(SIGUSR2,usr2Handler);
   signal(SIGPIPE,SIG_IGN);
-  g_numThreads = ::arg().asNum("threads") + ::arg().mustDo("pdns-distributes-queries");
+  g_numThreads = ::arg().asNum("threads") + g_weDistributeQueries;
   g_numWorkerThreads = ::arg().asNum("threads");
   g_maxMThreads = ::arg().asNum("max-mthreads");
   checkOrFixFDS();
@@ -2372,6 +2669,11 @@ int serviceMain(int argc, char*argv[])
   g_tcpTimeout=::arg().asNum("client-tcp-timeout");
   g_maxTCPPerClient=::arg().asNum("max-tcp-per-client");
 
+  if(::arg().mustDo("record-cache-shared")) {
+    g_sharedRC = new MemRecursorCache(::arg().asNum("record-cache-shards"));
+    L<<Logger::Warning<<"Sharing the record cache between threads, using "<<::arg().asNum("record-cache-shards")<<" shards"<<endl;
+  }
+
   if(g_numThreads == 1) {
     L<<Logger::Warning<<"Operating unthreaded"<<endl;
     recursorThread(0);
@@ -2399,7 +2701,10 @@ try
   t_allowFrom = g_initialAllowFrom;
   t_udpclientsocks = new UDPClientSocks();
   t_tcpClientCounts = new tcpClientCounts_t();
+  t_RC = g_sharedRC ? g_sharedRC : new MemRecursorCache();
   primeHints();
+  if(!::arg()["snapshot-file"].empty())
+    loadSnapshot(::arg()["snapshot-file"]);
 
   t_packetCache = new RecursorPacketCache();
 
@@ -2437,7 +2742,9 @@ try
     t_servfailqueryring->set_capacity(ringsize);
   }
 
-  MT=new MTasker<PacketID,string>(::arg().asNum("stack-size"));
+  MT=new MTasker<PacketID,string>(::arg().asNum("stack-size"), ::arg().mustDo("stack-guard"));
+  if(!t_id)
+    L<<Logger::Warning<<"MThreads switch contexts using the "<<pdns_context_backend()<<" backend"<<endl;
 
   PacketID pident;
 
@@ -2458,8 +2765,9 @@ try
 
   t_fdm->addReadFD(g_pipes[t_id].readToThread, handlePipeRequest);
 
+  const unsigned int listenSet = g_reusePort ? t_id : 0;
   if(!g_weDistributeQueries || !t_id)  // if we distribute queries, only t_id = 0 listens
-    for(deferredAdd_t::const_iterator i=deferredAdd.begin(); i!=deferredAdd.end(); ++i)
+    for(deferredAdd_t::const_iterator i=g_deferredAdds[listenSet].begin(); i!=g_deferredAdds[listenSet].end(); ++i)
       t_fdm->addReadFD(i->first, i->second);
 
   if(!t_id) {
@@ -2511,14 +2819,14 @@ try
     if(!g_weDistributeQueries || !t_id) { // if pdns distributes queries, only tid 0 should do this
       if(listenOnTCP) {
 	if(TCPConnection::getCurrentConnections() > maxTcpClients) {  // shutdown, too many connections
-	  for(tcpListenSockets_t::iterator i=g_tcpListenSockets.begin(); i != g_tcpListenSockets.end(); ++i)
+	  for(tcpListenSockets_t::iterator i=g_tcpListenSockets[listenSet].begin(); i != g_tcpListenSockets[listenSet].end(); ++i)
 	    t_fdm->removeReadFD(*i);
 	  listenOnTCP=false;
 	}
       }
       else {
 	if(TCPConnection::getCurrentConnections() <= maxTcpClients) {  // reenable
-	  for(tcpListenSockets_t::iterator i=g_tcpListenSockets.begin(); i != g_tcpListenSockets.end(); ++i)
+	  for(tcpListenSockets_t::iterator i=g_tcpListenSockets[listenSet].begin(); i != g_tcpListenSockets[listenSet].end(); ++i)
 	    t_fdm->addReadFD(*i, handleNewTCPQuestion);
 	  listenOnTCP=true;
 	}
@@ -2553,6 +2861,7 @@ int main(int argc, char **argv)
 
   try {
     ::arg().set("stack-size","stack size per mthread")="200000";
+    ::arg().setSwitch("stack-guard","Put an inaccessible page below every mthread stack, so a stack overflow crashes the recursor instead of corrupting memory")="no";
     ::arg().set("soa-minimum-ttl","Don't change")="0";
     ::arg().set("no-shuffle","Don't change")="off";
     ::arg().set("local-port","port to listen on")="53";
@@ -2601,7 +2910,17 @@ int main(int argc, char **argv)
     ::arg().set("server-down-throttle-time","Number of seconds to throttle all queries to a server after being marked as down")="60";
     ::arg().set("hint-file", "If set, load root hints from this file")="";
     ::arg().set("max-cache-entries", "If set, maximum number of entries in the main cache")="1000000";
+    ::arg().set("record-cache-shared", "If set, all threads share a single record cache instead of having one each")="no";
+    ::arg().set("record-cache-shards", "Number of shards, each with its own lock, of the shared record cache")="1024";
+    ::arg().set("snapshot-file", "If set, save the caches to this file when quitting nicely, and load them from it on startup")="";
+    ::arg().set("snapshot-interval", "Also save the caches to 'snapshot-file' every this many seconds, 0 to only save them when quitting nicely")="0";
     ::arg().set("max-negative-ttl", "maximum number of seconds to keep a negative cached entry in memory")="3600";
+    ::arg().set("udp-source-port-pool-size", "Send outgoing UDP queries from this many long-lived sockets per address family and thread, 0 for a new socket per query")="0";
+    ::arg().set("udp-source-port-rotation", "Replace each pooled outgoing UDP socket by one on a new random port after about this many seconds")="60";
+    ::arg().set("aggressive-nsec-cache-size", "Maximum number of validated NSEC and NSEC3 records kept to synthesize negative answers from, 0 to disable")="100000";
+    ::arg().set("prefetch-percentage", "Refresh a cached record in the background when it is hit with less than this percentage of its TTL left, 0 to disable")="0";
+    ::arg().set("serve-stale-window", "Number of seconds after their expiry that records may still be served when the authoritative servers can not be reached, 0 to disable")="0";
+    ::arg().set("serve-stale-ttl", "TTL of records served stale")="30";
     ::arg().set("max-cache-ttl", "maximum number of seconds to keep a cached entry in memory")="86400";
     ::arg().set("packetcache-ttl", "maximum number of seconds to keep a cached entry in packetcache")="3600";
     ::arg().set("max-packetcache-entries", "maximum number of entries to keep in the packetcache")="500000";
@@ -2630,6 +2949,8 @@ int main(int argc, char **argv)
     ::arg().set("latency-statistic-size","Number of latency values to calculate the qa-latency average")="10000";
     ::arg().setSwitch( "disable-packetcache", "Disable packetcache" )= "no";
     ::arg().set("edns-subnet-whitelist", "List of netmasks and domains that we should enable EDNS subnet for")="powerdns.com,82.94.213.34,2001:888:2000:1d::2";
+    ::arg().setSwitch("reuseport", "Give each worker thread its own listening sockets using SO_REUSEPORT, letting the kernel spread queries over threads")="no";
+    ::arg().setSwitch("reuseport-steering", "With reuseport, have the kernel pick the thread by a hash of the question, to keep queries for a name on the same thread")="no";
     ::arg().setSwitch( "pdns-distributes-queries", "If PowerDNS itself should distribute queries over threads")="";
     ::arg().setSwitch( "root-nx-trust", "If set, believe that an NXDOMAIN from the root means the TLD does not exist")="no";
     ::arg().setSwitch( "any-to-tcp","Answer ANY queries with tc=1, shunting to TCP" )="no";
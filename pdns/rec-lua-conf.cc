@@ -58,6 +58,8 @@ void loadRecursorLuaConfig(const std::string& fname)
 void loadRecursorLuaConfig(const std::string& fname)
 {
   LuaConfigItems lci;
+  // RPZ trackers may only start once lci has been published, or what they publish would be overwritten
+  vector<std::function<void()> > rpzTrackers;
 
   LuaContext Lua;
   if(fname.empty())
@@ -108,7 +110,7 @@ void loadRecursorLuaConfig(const std::string& fname)
 	  }
 	    
 	}
-	loadRPZFromFile(fname, lci.dfe, defpol, 0);
+	loadRPZFromFile(fname, lci.dfe, defpol, lci.dfe.size());
       }
       catch(std::exception& e) {
 	theL()<<Logger::Error<<"Unable to load RPZ zone from '"<<fname<<"': "<<e.what()<<endl;
@@ -116,7 +118,7 @@ void loadRecursorLuaConfig(const std::string& fname)
     });
 
 
-  Lua.writeFunction("rpzMaster", [&lci](const string& master_, const string& zone_, const boost::optional<std::unordered_map<string,boost::variant<int, string>>>& options) {
+  Lua.writeFunction("rpzMaster", [&lci, &rpzTrackers](const string& master_, const string& zone_, const boost::optional<std::unordered_map<string,boost::variant<int, string>>>& options) {
       try {
 	boost::optional<DNSFilterEngine::Policy> defpol;
 	if(options) {
@@ -142,11 +144,46 @@ void loadRecursorLuaConfig(const std::string& fname)
 	  }
 	    
 	}
+	string seedFile, dumpFile;
+	if(options) {
+	  auto& have = *options;
+	  if(have.count("seedFile"))
+	    seedFile = boost::get<string>(constGet(have, "seedFile"));
+	  if(have.count("dumpFile"))
+	    dumpFile = boost::get<string>(constGet(have, "dumpFile"));
+	}
 	ComboAddress master(master_, 53);
 	DNSName zone(zone_);
-	auto sr=loadRPZFromServer(master,zone, lci.dfe, defpol, 0);
-	std::thread t(RPZIXFRTracker, master, zone, sr);
-	t.detach();
+	int place = lci.dfe.size();
+	lci.dfe.clear(place); // claim our place, even while it is still empty
+
+	/* starting from a local copy gets us going right away, the tracker then catches up using IXFR.
+	   Without it, the tracker does the full transfer in the background. */
+	shared_ptr<SOARecordContent> sr;
+	if(!seedFile.empty()) {
+	  try {
+	    DTime dt;
+	    dt.set();
+	    sr = loadRPZFromFile(seedFile, lci.dfe, defpol, place);
+	    g_stats.rpzLoads++;
+	    g_stats.rpzLoadUsec += dt.udiff();
+	    theL()<<Logger::Info<<"Loaded RPZ zone '"<<zone<<"' from seed file '"<<seedFile<<"'"<<endl;
+	  }
+	  catch(std::exception& e) {
+	    theL()<<Logger::Warning<<"Unable to load RPZ zone '"<<zone<<"' from seed file '"<<seedFile<<"': "<<e.what()<<endl;
+	    lci.dfe.clear(place);
+	    sr.reset();
+	  }
+	  catch(PDNSException& e) {
+	    theL()<<Logger::Warning<<"Unable to load RPZ zone '"<<zone<<"' from seed file '"<<seedFile<<"': "<<e.reason<<endl;
+	    lci.dfe.clear(place);
+	    sr.reset();
+	  }
+	}
+	rpzTrackers.push_back([master, zone, defpol, place, sr, dumpFile]() {
+	    std::thread t(RPZIXFRTracker, master, zone, defpol, place, sr, dumpFile);
+	    t.detach();
+	  });
       }
       catch(std::exception& e) {
 	theL()<<Logger::Error<<"Unable to load RPZ zone '"<<zone_<<"' from '"<<master_<<"': "<<e.what()<<endl;
@@ -202,7 +239,10 @@ void loadRecursorLuaConfig(const std::string& fname)
 
   try {
     Lua.executeCode(ifs);
+    lci.dfe.compile();
     g_luaconfs.setState(lci);
+    for(const auto& start : rpzTrackers)
+      start();
   }
   catch(const LuaContext::ExecutionErrorException& e) {
     theL()<<Logger::Error<<"Unable to load Lua script from '"+fname+"': ";
@@ -0,0 +1,269 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "rec-snapshot.hh"
+#include "syncres.hh"
+#include "recursor_cache.hh"
+#include "logger.hh"
+#include "misc.hh"
+#include "cachecleaner.hh"
+#include <cmath>
+#include <mutex>
+#include <thread>
+#include <boost/bind.hpp>
+#include "namespaces.hh"
+
+/* What goes into the snapshot sections, see rec-snapshot.cc for the format itself. This part needs the
+   tables of the recursor threads, which is why it lives apart from the format. */
+
+static void putRecords(SnapshotWriter& out, const vector<DNSRecord>& records)
+{
+  out.putUInt32(records.size());
+  for(const auto& record : records)
+    out.putRecord(record);
+}
+
+static void getRecords(SnapshotReader& in, vector<DNSRecord>& records)
+{
+  uint32_t count = in.getUInt32();
+  records.clear();
+  records.reserve(count);
+  for(uint32_t n = 0; n < count; ++n)
+    records.push_back(in.getRecord());
+}
+
+/* The tables of this thread. The record cache is left out here, since it might be shared by all threads */
+static uint64_t writeThreadTables(SnapshotWriter& out, time_t now)
+{
+  uint64_t count = 0;
+
+  size_t pos = out.reserveUInt32();
+  uint32_t written = 0;
+  for(const auto& ne : t_sstorage->negcache) {
+    if(ne.d_ttd <= now)
+      continue;
+    out.putName(ne.d_name);
+    out.putUInt16(ne.d_qtype.getCode());
+    out.putName(ne.d_qname);
+    out.putUInt32(ne.d_ttd);
+    out.putUInt32(ne.d_dnssecProof.size());
+    for(const auto& proof : ne.d_dnssecProof) {
+      out.putName(proof.first.first);
+      out.putUInt16(proof.first.second);
+      putRecords(out, proof.second.records);
+      putRecords(out, proof.second.signatures);
+    }
+    ++written;
+  }
+  out.setUInt32(pos, written);
+  count += written;
+
+  pos = out.reserveUInt32();
+  written = 0;
+  for(auto& speeds : t_sstorage->nsSpeeds) {
+    out.putName(speeds.first);
+    out.putUInt32(speeds.second.d_collection.size());
+    for(auto& server : speeds.second.d_collection) {
+      out.putString(server.first.toStringWithPort());
+      out.putUInt32(static_cast<uint32_t>(server.second.peek()));
+    }
+    ++written;
+  }
+  out.setUInt32(pos, written);
+  count += written;
+
+  pos = out.reserveUInt32();
+  written = 0;
+  for(const auto& status : t_sstorage->ednsstatus) {
+    if(status.second.mode == SyncRes::EDNSStatus::UNKNOWN)
+      continue;
+    out.putString(status.first.toStringWithPort());
+    out.putUInt8(status.second.mode);
+    out.putUInt64(status.second.modeSetAt);
+    ++written;
+  }
+  out.setUInt32(pos, written);
+  count += written;
+
+  return count;
+}
+
+static uint64_t loadThreadTables(SnapshotReader& in, time_t now, time_t writtenAt)
+{
+  uint64_t count = 0;
+
+  uint32_t entries = in.getUInt32();
+  for(uint32_t n = 0; n < entries; ++n) {
+    NegCacheEntry ne;
+    ne.d_name = in.getName();
+    ne.d_qtype = QType(in.getUInt16());
+    ne.d_qname = in.getName();
+    ne.d_ttd = in.getUInt32();
+    uint32_t proofs = in.getUInt32();
+    for(uint32_t p = 0; p < proofs; ++p) {
+      DNSName name = in.getName();
+      uint16_t qtype = in.getUInt16();
+      BothRecordsAndSignatures& proof = ne.d_dnssecProof[make_pair(name, qtype)];
+      getRecords(in, proof.records);
+      getRecords(in, proof.signatures);
+    }
+    if(ne.d_ttd > now) {
+      replacing_insert(t_sstorage->negcache, ne);
+      ++count;
+    }
+  }
+
+  /* the speeds decay as they would have if we had been running, and housekeeping drops whatever
+     was not used for 300 seconds, so older ones are not worth keeping */
+  time_t elapsed = now > writtenAt ? now - writtenAt : 0;
+  bool keepSpeeds = elapsed < 300;
+  double decay = exp(-static_cast<double>(elapsed) / 60.0);
+  struct timeval tv;
+  tv.tv_sec = now;
+  tv.tv_usec = 0;
+  entries = in.getUInt32();
+  for(uint32_t n = 0; n < entries; ++n) {
+    DNSName name = in.getName();
+    uint32_t servers = in.getUInt32();
+    for(uint32_t s = 0; s < servers; ++s) {
+      ComboAddress server(in.getString());
+      uint32_t usecs = in.getUInt32();
+      if(keepSpeeds)
+        t_sstorage->nsSpeeds[name].submit(server, usecs * decay, &tv);
+    }
+    if(keepSpeeds)
+      ++count;
+  }
+
+  // the EDNS status of a server is forgotten after an hour, see SyncRes::asyncresolveWrapper()
+  entries = in.getUInt32();
+  for(uint32_t n = 0; n < entries; ++n) {
+    ComboAddress server(in.getString());
+    uint8_t mode = in.getUInt8();
+    time_t modeSetAt = in.getUInt64();
+    if(mode > SyncRes::EDNSStatus::NOEDNS)
+      throw SnapshotError("invalid EDNS mode "+std::to_string(mode));
+    if(modeSetAt + 3600 < now)
+      continue;
+    SyncRes::EDNSStatus& status = t_sstorage->ednsstatus[server];
+    status.mode = static_cast<SyncRes::EDNSStatus::EDNSMode>(mode);
+    status.modeSetAt = modeSetAt;
+    ++count;
+  }
+
+  return count;
+}
+
+
+/* Each thread serializes its own section into memory, with a shared record cache its part of the shards. The
+   sections end up one after the other, as broadcastAccFunction() asks one thread at a time */
+static string* pleaseGetSnapshotSection(time_t now, uint64_t* count, bool* failed)
+{
+  try {
+    SnapshotWriter out;
+    size_t pos = startSnapshotSection(out);
+    if(g_sharedRC)
+      *count += t_RC->doSnapshot(out, now, t_id, g_numThreads);
+    else
+      *count += t_RC->doSnapshot(out, now, 0, 1);
+    *count += writeThreadTables(out, now);
+    finishSnapshotSection(out, pos);
+    return new string(std::move(out.d_data));
+  }
+  catch(const std::exception& e) {
+    L<<Logger::Error<<"Thread "<<t_id<<" failed to write its part of the snapshot: "<<e.what()<<endl;
+  }
+  catch(const PDNSException& e) {
+    L<<Logger::Error<<"Thread "<<t_id<<" failed to write its part of the snapshot: "<<e.reason<<endl;
+  }
+  *failed = true;
+  return 0;
+}
+
+static std::mutex s_snapshotFileLock; // held while writing the file, so a snapshot taken on exit waits for a background one
+static std::atomic<bool> s_snapshotInBackground{false};
+
+static void writeSnapshotInBackground(const std::string fname, const std::string data)
+{
+  try {
+    DTime dt;
+    dt.set();
+    std::lock_guard<std::mutex> lock(s_snapshotFileLock);
+    writeSnapshotFile(fname, data);
+    L<<Logger::Info<<"Wrote "<<data.size()<<" bytes to snapshot file '"<<fname<<"' in "<<dt.udiff()/1000<<" ms"<<endl;
+  }
+  catch(const PDNSException& e) {
+    L<<Logger::Error<<e.reason<<endl;
+  }
+  s_snapshotInBackground = false;
+}
+
+uint64_t writeSnapshot(const std::string& fname, bool background)
+{
+  if(background && s_snapshotInBackground.exchange(true))
+    throw PDNSException("Not writing snapshot file '"+fname+"', the previous one is still being written");
+
+  time_t now = time(0);
+  uint64_t count = 0;
+  bool failed = false;
+  string data = getSnapshotHeader(now);
+  data += broadcastAccFunction<string>(boost::bind(pleaseGetSnapshotSection, now, &count, &failed));
+  if(failed) {
+    s_snapshotInBackground = false;
+    throw PDNSException("Unable to write snapshot file '"+fname+"': a thread could not write its section");
+  }
+
+  if(background) {
+    std::thread(writeSnapshotInBackground, fname, std::move(data)).detach();
+    return count;
+  }
+
+  std::lock_guard<std::mutex> lock(s_snapshotFileLock);
+  writeSnapshotFile(fname, data);
+  return count;
+}
+
+/* Section n goes to thread n modulo the number of threads, so a snapshot is still fully loaded after
+   the number of threads changed. All threads read the file at the same time, each skipping over the
+   sections of the others. */
+void loadSnapshot(const std::string& fname)
+{
+  FILE* fp = fopen(fname.c_str(), "r");
+  if(!fp) {
+    if(errno != ENOENT)
+      L<<Logger::Error<<"Unable to open snapshot file '"<<fname<<"': "<<stringerror()<<endl;
+    return;
+  }
+  std::shared_ptr<FILE> file(fp, fclose);
+
+  DTime dt;
+  dt.set();
+  time_t now = time(0);
+  uint64_t count = 0;
+  unsigned int sections = 0;
+  try {
+    time_t writtenAt = readSnapshotHeader(fp);
+    string data;
+    for(unsigned int n = 0; ; ++n) {
+      bool ours = n % g_numThreads == t_id;
+      if(!readSnapshotSection(fp, ours ? &data : nullptr))
+        break;
+      if(!ours)
+        continue;
+
+      SnapshotReader in(data);
+      count += t_RC->loadSnapshot(in, now);
+      count += loadThreadTables(in, now, writtenAt);
+      ++sections;
+    }
+  }
+  catch(const std::exception& e) {
+    L<<Logger::Error<<"Stopped loading snapshot file '"<<fname<<"': "<<e.what()<<endl;
+  }
+  catch(const PDNSException& e) {
+    L<<Logger::Error<<"Stopped loading snapshot file '"<<fname<<"': "<<e.reason<<endl;
+  }
+
+  if(sections)
+    L<<Logger::Warning<<"Loaded "<<count<<" entries from "<<sections<<" section(s) of snapshot file '"<<fname<<"' in "<<dt.udiff()/1000<<" ms"<<endl;
+}
@@ -0,0 +1,231 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "rec-snapshot.hh"
+#include "misc.hh"
+#include "pdnsexception.hh"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "namespaces.hh"
+
+static const char s_magic[] = "PDNSSNAP";
+static const size_t s_magicLength = 8;
+static const uint16_t s_version = 1;
+
+void SnapshotWriter::putUInt8(uint8_t val)
+{
+  d_data.append(1, static_cast<char>(val));
+}
+
+void SnapshotWriter::putUInt16(uint16_t val)
+{
+  putUInt8(val >> 8);
+  putUInt8(val & 0xff);
+}
+
+void SnapshotWriter::putUInt32(uint32_t val)
+{
+  putUInt16(val >> 16);
+  putUInt16(val & 0xffff);
+}
+
+void SnapshotWriter::putUInt64(uint64_t val)
+{
+  putUInt32(val >> 32);
+  putUInt32(val & 0xffffffff);
+}
+
+void SnapshotWriter::putString(const std::string& str)
+{
+  putUInt32(str.size());
+  d_data.append(str);
+}
+
+void SnapshotWriter::putName(const DNSName& name)
+{
+  putString(name.empty() ? std::string() : name.toDNSString());
+}
+
+void SnapshotWriter::putContent(const DNSName& qname, const std::shared_ptr<DNSRecordContent>& content)
+{
+  putString(content->serialize(qname));
+}
+
+void SnapshotWriter::putRecord(const DNSRecord& record)
+{
+  putName(record.d_name);
+  putUInt16(record.d_type);
+  putUInt16(record.d_class);
+  putUInt32(record.d_ttl);
+  putUInt8(record.d_place);
+  putContent(record.d_name, record.d_content);
+}
+
+size_t SnapshotWriter::reserveUInt32()
+{
+  size_t pos = d_data.size();
+  putUInt32(0);
+  return pos;
+}
+
+void SnapshotWriter::setUInt32(size_t pos, uint32_t val)
+{
+  for(int n = 3; n >= 0; --n) {
+    d_data.at(pos + n) = static_cast<char>(val & 0xff);
+    val >>= 8;
+  }
+}
+
+const char* SnapshotReader::need(size_t len)
+{
+  if(len > d_data.size() - d_pos)
+    throw SnapshotError("truncated snapshot section");
+  const char* ret = d_data.data() + d_pos;
+  d_pos += len;
+  return ret;
+}
+
+uint8_t SnapshotReader::getUInt8()
+{
+  return static_cast<uint8_t>(*need(1));
+}
+
+uint16_t SnapshotReader::getUInt16()
+{
+  uint16_t ret = getUInt8();
+  return (ret << 8) | getUInt8();
+}
+
+uint32_t SnapshotReader::getUInt32()
+{
+  uint32_t ret = getUInt16();
+  return (ret << 16) | getUInt16();
+}
+
+uint64_t SnapshotReader::getUInt64()
+{
+  uint64_t ret = getUInt32();
+  return (ret << 32) | getUInt32();
+}
+
+std::string SnapshotReader::getString()
+{
+  uint32_t len = getUInt32();
+  return std::string(need(len), len);
+}
+
+DNSName SnapshotReader::getName()
+{
+  std::string wire = getString();
+  if(wire.empty())
+    return DNSName();
+  return DNSName(wire.c_str(), wire.size(), 0, false);
+}
+
+std::shared_ptr<DNSRecordContent> SnapshotReader::getContent(const DNSName& qname, uint16_t qtype)
+{
+  return DNSRecordContent::unserialize(qname, qtype, getString());
+}
+
+DNSRecord SnapshotReader::getRecord()
+{
+  DNSRecord record;
+  record.d_name = getName();
+  record.d_type = getUInt16();
+  record.d_class = getUInt16();
+  record.d_ttl = getUInt32();
+  record.d_place = static_cast<DNSResourceRecord::Place>(getUInt8());
+  record.d_content = getContent(record.d_name, record.d_type);
+  record.d_clen = 0;
+  return record;
+}
+
+std::string getSnapshotHeader(time_t now)
+{
+  SnapshotWriter header;
+  header.d_data.append(s_magic, s_magicLength);
+  header.putUInt16(s_version);
+  header.putUInt64(now);
+  return header.d_data;
+}
+
+time_t readSnapshotHeader(FILE* fp)
+{
+  string magic(s_magicLength, 0);
+  if(fread(&magic.at(0), 1, magic.size(), fp) != magic.size() || magic != string(s_magic, s_magicLength))
+    throw SnapshotError("not a snapshot file");
+
+  string data(2 + 8, 0);
+  if(fread(&data.at(0), 1, data.size(), fp) != data.size())
+    throw SnapshotError("truncated header");
+  SnapshotReader header(data);
+  uint16_t version = header.getUInt16();
+  if(version != s_version)
+    throw SnapshotError("unsupported version "+std::to_string(version));
+  return header.getUInt64();
+}
+
+size_t startSnapshotSection(SnapshotWriter& out)
+{
+  size_t pos = out.d_data.size();
+  out.putUInt64(0);
+  return pos;
+}
+
+void finishSnapshotSection(SnapshotWriter& out, size_t pos)
+{
+  uint64_t size = out.d_data.size() - pos - 8;
+  out.setUInt32(pos, size >> 32);
+  out.setUInt32(pos + 4, size & 0xffffffff);
+}
+
+bool readSnapshotSection(FILE* fp, std::string* data)
+{
+  string length(8, 0);
+  size_t got = fread(&length.at(0), 1, length.size(), fp);
+  if(!got && feof(fp))
+    return false;
+  if(got != length.size())
+    throw SnapshotError("truncated section length");
+  uint64_t size = SnapshotReader(length).getUInt64();
+
+  // a corrupt length should not have us allocate whatever it says before noticing
+  struct stat st;
+  off_t pos = ftello(fp);
+  if(fstat(fileno(fp), &st) < 0 || pos < 0)
+    throw SnapshotError(stringerror());
+  if(size > static_cast<uint64_t>(st.st_size - std::min(pos, st.st_size)))
+    throw SnapshotError("truncated section");
+
+  if(!data) {
+    if(fseeko(fp, size, SEEK_CUR) < 0)
+      throw SnapshotError(stringerror());
+    return true;
+  }
+
+  data->resize(size);
+  if(size && fread(&data->at(0), 1, size, fp) != size)
+    throw SnapshotError("truncated section");
+  return true;
+}
+
+void writeSnapshotFile(const std::string& fname, const std::string& data)
+{
+  string tmpname = fname + ".tmp";
+  int fd = open(tmpname.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0640);
+  if(fd < 0)
+    throw PDNSException("Unable to open snapshot file '"+tmpname+"' for writing: "+stringerror());
+
+  string error;
+  if(writen2(fd, data) < 0 || fsync(fd) < 0)
+    error = stringerror();
+  if(close(fd) < 0 && error.empty())
+    error = stringerror();
+  if(error.empty() && rename(tmpname.c_str(), fname.c_str()) < 0)
+    error = stringerror();
+
+  if(!error.empty()) {
+    unlink(tmpname.c_str());
+    throw PDNSException("Unable to write snapshot file '"+fname+"': "+error);
+  }
+}
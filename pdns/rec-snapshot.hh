@@ -0,0 +1,83 @@
+#ifndef PDNS_REC_SNAPSHOT_HH
+#define PDNS_REC_SNAPSHOT_HH
+#include <string>
+#include <stdexcept>
+#include <stdio.h>
+#include "dnsname.hh"
+#include "dnsparser.hh"
+
+/* A snapshot holds what the recursor learned so far: the record cache, the negative cache and the speeds and
+   EDNS status of servers, so that a restarted recursor does not have to learn it all again. The file starts
+   with a header (magic, format version, time of writing) followed by one section per thread, each a 64 bit
+   length and the tables of that thread. Integers are in network byte order, names and record contents in
+   wire format. Expiry times are stored as absolute times, so whatever expired while we were down is simply
+   skipped when loading. */
+
+class SnapshotError : public std::runtime_error
+{
+public:
+  SnapshotError(const std::string& what) : std::runtime_error(what) {}
+};
+
+class SnapshotWriter
+{
+public:
+  void putUInt8(uint8_t val);
+  void putUInt16(uint16_t val);
+  void putUInt32(uint32_t val);
+  void putUInt64(uint64_t val);
+  void putString(const std::string& str);
+  void putName(const DNSName& name);
+  void putContent(const DNSName& qname, const std::shared_ptr<DNSRecordContent>& content);
+  void putRecord(const DNSRecord& record);
+  //! reserves room for a count that is only known once the entries are written, see setUInt32()
+  size_t reserveUInt32();
+  void setUInt32(size_t pos, uint32_t val);
+
+  std::string d_data;
+};
+
+//! reads what SnapshotWriter wrote, throws SnapshotError when running out of data
+class SnapshotReader
+{
+public:
+  SnapshotReader(const std::string& data) : d_data(data), d_pos(0)
+  {
+  }
+
+  uint8_t getUInt8();
+  uint16_t getUInt16();
+  uint32_t getUInt32();
+  uint64_t getUInt64();
+  std::string getString();
+  DNSName getName();
+  std::shared_ptr<DNSRecordContent> getContent(const DNSName& qname, uint16_t qtype);
+  DNSRecord getRecord();
+
+private:
+  const char* need(size_t len);
+
+  const std::string& d_data;
+  size_t d_pos;
+};
+
+//! the header a snapshot written at now starts with
+std::string getSnapshotHeader(time_t now);
+//! checks the header at the start of fp, returning the time the snapshot was written
+time_t readSnapshotHeader(FILE* fp);
+//! starts a section in out, to be finished by finishSnapshotSection() once all of its data is in
+size_t startSnapshotSection(SnapshotWriter& out);
+void finishSnapshotSection(SnapshotWriter& out, size_t pos);
+//! reads the next section of fp into *data, or skips over it if data is null. Returns false at the end of the file
+bool readSnapshotSection(FILE* fp, std::string* data);
+//! writes data to fname through a temporary file, which is synced and only renamed once complete
+void writeSnapshotFile(const std::string& fname, const std::string& data);
+
+/* writes a snapshot of all threads to fname, returning the number of entries written. Call from a recursor
+   thread. With background set, the threads only serialize their tables into memory, the file being written
+   and synced by a thread of its own, which skips this snapshot if the previous one is still being written */
+uint64_t writeSnapshot(const std::string& fname, bool background=false);
+//! loads the share of this thread of the snapshot in fname, if there is one
+void loadSnapshot(const std::string& fname);
+
+#endif
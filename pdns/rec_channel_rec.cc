@@ -30,6 +30,8 @@
 #include "responsestats.hh"
 
 #include "secpoll-recursor.hh"
+#include "rec-snapshot.hh"
+#include "validate-recursor.hh"
 #include "pubsuffix.hh"
 #include "namespaces.hh"
 pthread_mutex_t g_carbon_config_lock=PTHREAD_MUTEX_INITIALIZER;
@@ -152,14 +154,22 @@ static uint64_t dumpNegCache(SyncRes::negcache_t& negcache, int fd)
   return count;
 }
 
+/* with a shared record cache, only the first thread needs to look at it, or we would
+   count (and dump, and wipe) everything once per thread */
+static bool ownsRecordCache()
+{
+  return !g_sharedRC || t_id == 0;
+}
+
 static uint64_t* pleaseDump(int fd)
 {
-  return new uint64_t(t_RC->doDump(fd) + dumpNegCache(t_sstorage->negcache, fd));
+  uint64_t count = ownsRecordCache() ? t_RC->doDump(fd) : 0;
+  return new uint64_t(count + dumpNegCache(t_sstorage->negcache, fd));
 }
 
 static uint64_t* pleaseDumpNSSpeeds(int fd)
 {
-  return new uint64_t(t_RC->doDumpNSSpeeds(fd));
+  return new uint64_t(SyncRes::doDumpNSSpeeds(fd));
 }
 
 template<typename T>
@@ -226,6 +236,10 @@ string doDumpEDNSStatus(T begin, T end)
 
 uint64_t* pleaseWipeCache(const DNSName& canon, bool subtree)
 {
+  // the validation caches are per thread, whoever owns the record cache
+  wipeValidationCaches(canon);
+  if(!ownsRecordCache())
+    return new uint64_t(0);
   return new uint64_t(t_RC->doWipeCache(canon, subtree));
 }
 
@@ -237,14 +251,15 @@ uint64_t* pleaseWipePacketCache(const DNSName& canon, bool subtree)
 
 uint64_t* pleaseWipeAndCountNegCache(const DNSName& canon, bool subtree)
 {
+  uint64_t nsecs = t_sstorage->aggressiveNSEC.wipe(canon, subtree);
   if(!subtree) {
-    uint64_t res = t_sstorage->negcache.count(tie(canon));
+    uint64_t res = nsecs + t_sstorage->negcache.count(tie(canon));
     auto range=t_sstorage->negcache.equal_range(tie(canon));
     t_sstorage->negcache.erase(range.first, range.second);
     return new uint64_t(res);
   }
   else {
-    unsigned int erased=0;
+    uint64_t erased=nsecs;
     for(auto iter = t_sstorage->negcache.lower_bound(tie(canon)); iter != t_sstorage->negcache.end(); ) {
       if(!iter->d_qname.isPartOf(canon))
 	break;
@@ -374,6 +389,16 @@ uint64_t getNegCacheSize()
   return broadcastAccFunction<uint64_t>(pleaseGetNegCacheSize);
 }
 
+static uint64_t* pleaseGetAggressiveNSECCacheSize()
+{
+  return new uint64_t(t_sstorage->aggressiveNSEC.size());
+}
+
+static uint64_t getAggressiveNSECCacheSize()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetAggressiveNSECCacheSize);
+}
+
 uint64_t* pleaseGetFailedHostsSize()
 {
   uint64_t tmp=t_sstorage->fails.size();
@@ -399,19 +424,55 @@ uint64_t* pleaseGetConcurrentQueries()
   return new uint64_t(MT->numProcesses()); 
 }
 
+static string* pleaseGetMThreadStacks()
+{
+  return new string("thread "+std::to_string(t_id)+": "+std::to_string(MT->numStacks())+" stacks of "+std::to_string(::arg().asNum("stack-size"))+
+                    " bytes, deepest use "+std::to_string(MT->getStackHighWaterMark())+" bytes\n");
+}
+
 static uint64_t getConcurrentQueries()
 {
   return broadcastAccFunction<uint64_t>(pleaseGetConcurrentQueries);
 }
 
+static uint64_t getUDPPoolSockets()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetUDPPoolSockets);
+}
+
+static uint64_t getUDPPoolQueries()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetUDPPoolQueries);
+}
+
 uint64_t* pleaseGetCacheSize()
 {
-  return new uint64_t(t_RC->size());
+  return new uint64_t(ownsRecordCache() ? t_RC->size() : 0);
 }
 
 uint64_t* pleaseGetCacheBytes()
 {
-  return new uint64_t(t_RC->bytes());
+  return new uint64_t(ownsRecordCache() ? t_RC->bytes() : 0);
+}
+
+uint64_t* pleaseGetRecordCacheLockAcquisitions()
+{
+  return new uint64_t(ownsRecordCache() ? t_RC->getLockAcquisitions() : 0);
+}
+
+uint64_t* pleaseGetRecordCacheLockContentions()
+{
+  return new uint64_t(ownsRecordCache() ? t_RC->getLockContentions() : 0);
+}
+
+static uint64_t doGetRecordCacheLockAcquisitions()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetRecordCacheLockAcquisitions);
+}
+
+static uint64_t doGetRecordCacheLockContentions()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetRecordCacheLockContentions);
 }
 
 
@@ -433,7 +494,7 @@ uint64_t doGetCacheBytes()
 
 uint64_t* pleaseGetCacheHits()
 {
-  return new uint64_t(t_RC->cacheHits);
+  return new uint64_t(ownsRecordCache() ? t_RC->cacheHits.load() : 0);
 }
 
 uint64_t doGetCacheHits()
@@ -443,7 +504,7 @@ uint64_t doGetCacheHits()
 
 uint64_t* pleaseGetCacheMisses()
 {
-  return new uint64_t(t_RC->cacheMisses);
+  return new uint64_t(ownsRecordCache() ? t_RC->cacheMisses.load() : 0);
 }
 
 uint64_t doGetCacheMisses()
@@ -519,8 +580,25 @@ RecursorControlParser::RecursorControlParser()
   addGetStat("cache-misses", doGetCacheMisses); 
   addGetStat("cache-entries", doGetCacheSize); 
   addGetStat("cache-bytes", doGetCacheBytes); 
+  addGetStat("record-cache-lock-acquisitions", doGetRecordCacheLockAcquisitions);
+  addGetStat("record-cache-lock-contentions", doGetRecordCacheLockContentions);
   
   addGetStat("packetcache-hits", doGetPacketCacheHits);
+  addGetStat("prefetches", &g_stats.prefetches);
+  addGetStat("prefetch-failures", &g_stats.prefetchFailures);
+  addGetStat("prefetch-usec", &g_stats.prefetchUsec);
+  addGetStat("stale-answers", &g_stats.staleAnswers);
+  addGetStat("aggressive-nsec-entries", getAggressiveNSECCacheSize);
+  addGetStat("aggressive-nsec-nxdomains", &g_stats.aggressiveNSECNXDomains);
+  addGetStat("aggressive-nsec-nodata", &g_stats.aggressiveNSECNoData);
+  addGetStat("dnssec-keyset-cache-hits", &g_stats.dnssecKeysetCacheHits);
+  addGetStat("dnssec-keyset-cache-misses", &g_stats.dnssecKeysetCacheMisses);
+  addGetStat("dnssec-signature-cache-hits", &g_stats.dnssecSignatureCacheHits);
+  addGetStat("dnssec-signature-cache-misses", &g_stats.dnssecSignatureCacheMisses);
+  addGetStat("rpz-loads", &g_stats.rpzLoads);
+  addGetStat("rpz-load-usec", &g_stats.rpzLoadUsec);
+  addGetStat("rpz-ixfr-updates", &g_stats.rpzIXFRUpdates);
+  addGetStat("rpz-ixfr-usec", &g_stats.rpzIXFRUsec);
   addGetStat("packetcache-misses", doGetPacketCacheMisses); 
   addGetStat("packetcache-entries", doGetPacketCacheSize); 
   addGetStat("packetcache-bytes", doGetPacketCacheBytes); 
@@ -592,6 +670,9 @@ RecursorControlParser::RecursorControlParser()
   addGetStat("throttled-out", &SyncRes::s_throttledqueries);
   addGetStat("unreachables", &SyncRes::s_unreachables);
   addGetStat("chain-resends", &g_stats.chainResends);
+  addGetStat("udp-source-port-pool-sockets", getUDPPoolSockets);
+  addGetStat("udp-source-port-pool-queries", getUDPPoolQueries);
+  addGetStat("udp-source-port-rotations", &g_stats.udpPoolRotations);
   addGetStat("tcp-clients", boost::bind(TCPConnection::getCurrentConnections));
 
 #ifdef __linux__
@@ -631,6 +712,15 @@ static void doExitGeneric(bool nicely)
   extern string s_pidfname;
   if(!s_pidfname.empty()) 
     unlink(s_pidfname.c_str()); // we can at least try..
+  if(nicely && !::arg()["snapshot-file"].empty()) {
+    try {
+      uint64_t count = writeSnapshot(::arg()["snapshot-file"]);
+      L<<Logger::Warning<<"Wrote "<<count<<" entries to snapshot file '"<<::arg()["snapshot-file"]<<"'"<<endl;
+    }
+    catch(PDNSException& e) {
+      L<<Logger::Error<<e.reason<<endl;
+    }
+  }
   if(nicely)
     exit(1);
   else
@@ -863,8 +953,10 @@ string RecursorControlParser::getAnswer(const string& question, RecursorControlP
 "get [key1] [key2] ..             get specific statistics\n"
 "get-all                          get all statistics\n"
 "get-parameter [key1] [key2] ..   get configuration parameters\n"
+"get-mthread-stacks               get the number of MThread stacks and how deep they got, per thread\n"
 "get-qtypelist                    get QType statistics\n"
 "                                 notice: queries from cache aren't being counted yet\n"
+"get-record-cache-shards          get per-shard statistics of the shared record cache\n"
 "help                             get this list\n"
 "ping                             check that all threads are alive\n"
 "quit                             stop the recursor daemon\n"
@@ -910,6 +1002,15 @@ string RecursorControlParser::getAnswer(const string& question, RecursorControlP
   if(cmd=="dump-cache") 
     return doDumpCache(begin, end);
 
+  if(cmd=="get-mthread-stacks")
+    return broadcastAccFunction<string>(pleaseGetMThreadStacks);
+
+  if(cmd=="get-record-cache-shards") {
+    if(!g_sharedRC)
+      return "the record cache is not shared between threads\n";
+    return g_sharedRC->getShardsStats();
+  }
+
   if(cmd=="dump-ednsstatus" || cmd=="dump-edns") 
     return doDumpEDNSStatus(begin, end);
 
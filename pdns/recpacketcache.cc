@@ -9,6 +9,7 @@
 #include "namespaces.hh"
 #include "lock.hh"
 #include "dnswriter.hh"
+#include "misc.hh"
 
 RecursorPacketCache::RecursorPacketCache()
 {
@@ -17,35 +18,22 @@ RecursorPacketCache::RecursorPacketCache()
 
 int RecursorPacketCache::doWipePacketCache(const DNSName& name, uint16_t qtype, bool subtree)
 {
-  vector<uint8_t> packet;
-  DNSPacketWriter pw(packet, name, 0);
-  pw.getHeader()->rd=1;
-  Entry e;
-  e.d_packet.assign((const char*)&*packet.begin(), packet.size());
-  e.d_wantsDNSSEC=false;
-  // so the idea is, we search for a packet with qtype=0, which is ahead of anything with that name
-
   int count=0;
-  for(auto iter = d_packetCache.lower_bound(e); iter != d_packetCache.end(); ) {
-    const struct dnsheader* packet = reinterpret_cast<const struct dnsheader*>((*iter).d_packet.c_str());
-    if(packet->qdcount==0)
-      break;
-    uint16_t t;
-
-    DNSName found(iter->d_packet.c_str(), iter->d_packet.size(), 12, false, &t);
-    //    cout<<"At record "<<found<<" while searching for "<<name<<", subtree= "<<subtree<<endl;
+  auto& idx = d_packetCache.get<NameTag>();
+  for(auto iter = idx.lower_bound(name); iter != idx.end(); ) {
+    //    cout<<"At record "<<iter->d_name<<" while searching for "<<name<<", subtree= "<<subtree<<endl;
     if(subtree) {
-      if(!found.isPartOf(name)) {   // this is case insensitive
+      if(!iter->d_name.isPartOf(name)) {   // this is case insensitive
 	break;
       }
     }
     else {
-      if(found != name)
+      if(iter->d_name != name)
 	break;
     }
 
-    if(t==qtype || qtype==0xffff) {
-      iter=d_packetCache.erase(iter);
+    if(iter->d_type==qtype || qtype==0xffff) {
+      iter=idx.erase(iter);
       count++;
     }
     else
@@ -55,16 +43,119 @@ int RecursorPacketCache::doWipePacketCache(const DNSName& name, uint16_t qtype,
   return count;
 }
 
-bool RecursorPacketCache::getResponsePacket(const std::string& queryPacket, bool wantsDNSSEC, time_t now, 
-  std::string* responsePacket, uint32_t* age)
+/* returns the offset of the first byte after the question (qname, qtype and qclass), or 0 if there is none */
+static size_t getQuestionEnd(const std::string& packet)
 {
-  struct Entry e;
-  e.d_packet=queryPacket;
-  e.d_wantsDNSSEC = wantsDNSSEC;
-  
-  packetCache_t::const_iterator iter = d_packetCache.find(e);
-  
-  if(iter == d_packetCache.end()) {
+  size_t pos=sizeof(dnsheader);
+  while(pos < packet.size()) {
+    const unsigned char labellen = packet[pos];
+    if(!labellen)
+      break;
+    if(labellen > 63) // no compression in a question we care to cache
+      return 0;
+    pos += labellen + 1;
+  }
+  pos += 1 + 4;
+  return pos <= packet.size() ? pos : 0;
+}
+
+/* The part of what follows the question that the answer may depend on. For an OPT record, that is
+   the buffer size, version, DO bit and ECS option, for anything else all of it */
+static std::string getEDNSKey(const std::string& origPacket, size_t qend)
+{
+  const unsigned char* packet = reinterpret_cast<const unsigned char*>(origPacket.c_str());
+  const struct dnsheader* dh = reinterpret_cast<const struct dnsheader*>(packet);
+  const size_t len = origPacket.size();
+  size_t pos = qend;
+  std::string key;
+  if(pos == len)
+    return key;
+
+  /* A query carries at most an OPT record in its additional section, which is: root name (1), type (2),
+     buffer size (2), extended rcode (1), version (1), flags (2), rdata length (2), options */
+  if(!dh->ancount && !dh->nscount && ntohs(dh->arcount) == 1 && len - pos >= 11 &&
+     packet[pos] == 0 && packet[pos+1] == 0 && packet[pos+2] == QType::OPT) {
+    key.append(1, 'E');
+    key.append(origPacket, pos + 3, 2);
+    key.append(origPacket, pos + 6, 1);
+    key.append(1, static_cast<char>(packet[pos+7] & 0x80)); // DO
+
+    const size_t optEnd = std::min(len, pos + 11 + ((packet[pos+9] << 8) | packet[pos+10]));
+    pos += 11;
+    while(pos + 4 <= optEnd) {
+      const uint16_t code = (packet[pos] << 8) | packet[pos+1];
+      const uint16_t optLen = (packet[pos+2] << 8) | packet[pos+3];
+      if(pos + 4 + optLen > optEnd)
+        break;
+      if(code == 8) // EDNS Client Subnet, the answer may depend on it
+        key.append(origPacket, pos, 4 + optLen);
+      pos += 4 + optLen;
+    }
+    return key;
+  }
+
+  key.append(1, 'R');
+  key.append(origPacket, pos, len - pos);
+  return key;
+}
+
+uint32_t RecursorPacketCache::canHashPacket(const std::string& origPacket, std::string* ednsKey)
+{
+  if(ednsKey)
+    ednsKey->clear();
+  if(origPacket.size() < sizeof(dnsheader))
+    return 0;
+
+  const unsigned char* packet = reinterpret_cast<const unsigned char*>(origPacket.c_str());
+  const struct dnsheader* dh = reinterpret_cast<const struct dnsheader*>(packet);
+  const size_t qend = getQuestionEnd(origPacket);
+  if(!qend) // never matches, see questionMatches()
+    return burtle(packet + sizeof(dnsheader), origPacket.size() - sizeof(dnsheader), 0);
+
+  uint32_t ret=hashQuestion(origPacket.c_str(), qend, 0);
+  const unsigned char bits = dh->opcode | (dh->rd << 4) | (dh->cd << 5);
+  ret=burtle(&bits, sizeof(bits), ret);
+  ret=burtle(packet + qend - 4, 4, ret); // qtype and qclass
+
+  const std::string key = getEDNSKey(origPacket, qend);
+  if(!key.empty())
+    ret=burtle(reinterpret_cast<const unsigned char*>(key.c_str()), key.size(), ret);
+  if(ednsKey)
+    *ednsKey = key;
+  return ret;
+}
+
+bool RecursorPacketCache::questionMatches(const std::string& queryPacket, const std::string& cachedPacket)
+{
+  const size_t qend = getQuestionEnd(queryPacket);
+  if(!qend || cachedPacket.size() < qend)
+    return false;
+
+  const struct dnsheader* dh = reinterpret_cast<const struct dnsheader*>(queryPacket.c_str());
+  const struct dnsheader* cachedDH = reinterpret_cast<const struct dnsheader*>(cachedPacket.c_str());
+  if(dh->opcode != cachedDH->opcode || dh->rd != cachedDH->rd || dh->cd != cachedDH->cd || dh->qdcount != cachedDH->qdcount)
+    return false;
+
+  for(size_t pos = sizeof(dnsheader); pos < qend; pos++) {
+    if(queryPacket[pos] != cachedPacket[pos] && dns_tolower(queryPacket[pos]) != dns_tolower(cachedPacket[pos]))
+      return false;
+  }
+  return true;
+}
+
+bool RecursorPacketCache::getResponsePacket(const std::string& queryPacket, time_t now, 
+  std::string* responsePacket, uint32_t* age, uint32_t* qhash, std::string* ednsKey)
+{
+  *qhash = canHashPacket(queryPacket, ednsKey);
+  auto range = d_packetCache.equal_range(*qhash);
+
+  packetCache_t::iterator iter = range.first;
+  for(; iter != range.second; ++iter) {
+    if(iter->d_ednsKey == *ednsKey && questionMatches(queryPacket, iter->d_packet))
+      break;
+  }
+
+  if(iter == range.second) {
     d_misses++;
     return false;
   }
@@ -97,22 +188,28 @@ bool RecursorPacketCache::getResponsePacket(const std::string& queryPacket, bool
   return false;
 }
 
-void RecursorPacketCache::insertResponsePacket(const std::string& responsePacket, bool wantsDNSSEC, time_t now, uint32_t ttl)
+void RecursorPacketCache::insertResponsePacket(uint32_t qhash, const std::string& ednsKey, const DNSName& qname, uint16_t qtype, const std::string& responsePacket, time_t now, uint32_t ttl)
 {
+  auto range = d_packetCache.equal_range(qhash);
+  for(auto iter = range.first; iter != range.second; ++iter) {
+    /* the response question section is the one of the query, qname case aside */
+    if(iter->d_type == qtype && iter->d_ednsKey == ednsKey && questionMatches(responsePacket, iter->d_packet)) {
+      iter->d_packet = responsePacket;
+      iter->d_ttd = now + ttl;
+      iter->d_creation = now;
+      return;
+    }
+  }
+
   struct Entry e;
   e.d_packet = responsePacket;
-  e.d_wantsDNSSEC = wantsDNSSEC;
+  e.d_ednsKey = ednsKey;
+  e.d_name = qname;
+  e.d_qhash = qhash;
+  e.d_type = qtype;
   e.d_ttd = now+ttl;
   e.d_creation = now;
-  packetCache_t::iterator iter = d_packetCache.find(e);
-  
-  if(iter != d_packetCache.end()) {
-    iter->d_packet = responsePacket;
-    iter->d_ttd = now + ttl;
-    iter->d_creation = now;
-  }
-  else 
-    d_packetCache.insert(e);
+  d_packetCache.insert(e);
 }
 
 uint64_t RecursorPacketCache::size()
@@ -124,7 +221,7 @@ uint64_t RecursorPacketCache::bytes()
 {
   uint64_t sum=0;
   for(const struct Entry& e :  d_packetCache) {
-    sum += sizeof(e) + e.d_packet.length() + 4;
+    sum += sizeof(e) + e.d_packet.length() + e.d_ednsKey.length() + e.d_name.wirelength() + 4;
   }
   return sum;
 }
@@ -4,10 +4,12 @@
 #include <set>
 #include <inttypes.h>
 #include "dns.hh"
+#include "dnsname.hh"
 #include "namespaces.hh"
 #include <iostream>
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/hashed_index.hpp>
 #include <boost/tuple/tuple_comparison.hpp>
 #include <boost/multi_index/sequenced_index.hpp>
 
@@ -15,16 +17,21 @@
 using namespace ::boost::multi_index;
 
 //! Stores whole packets, ready for lobbing back at the client. Not threadsafe.
-/* Note: we store answers as value AND KEY, and with careful work, we make sure that
-   you can use a query as a key too. But query and answer must compare as identical! 
-   
-   This precludes doing anything smart with EDNS directly from the packet */
+/* Entries are found by a hash over the normalized question: the lowercased qname, qtype and qclass,
+   the opcode, RD and CD bits and, if there is an OPT record, the EDNS buffer size, version, DO bit
+   and ECS option. Other EDNS options, like cookies, are left out. Any other additional record is
+   hashed as is. The hash is computed on the query by getResponsePacket(), which returns it for the
+   insertResponsePacket() that follows a miss.
+
+   The EDNS part that went into the hash is also kept, normalized, as the 'EDNS key' of the entry. A hit
+   is checked against that key and against the question section and header bits of the stored response,
+   so a collision on the hash is never served, nor replaces the entry of another query. */
 class RecursorPacketCache
 {
 public:
   RecursorPacketCache();
-  bool getResponsePacket(const std::string& queryPacket, bool wantsDNSSEC, time_t now, std::string* responsePacket, uint32_t* age);
-  void insertResponsePacket(const std::string& responsePacket, bool wantsDNSSEC, time_t now, uint32_t ttd);
+  bool getResponsePacket(const std::string& queryPacket, time_t now, std::string* responsePacket, uint32_t* age, uint32_t* qhash, std::string* ednsKey);
+  void insertResponsePacket(uint32_t qhash, const std::string& ednsKey, const DNSName& qname, uint16_t qtype, const std::string& responsePacket, time_t now, uint32_t ttd);
   void doPruneTo(unsigned int maxSize=250000);
   int doWipePacketCache(const DNSName& name, uint16_t qtype=0xffff, bool subtree=false);
   
@@ -33,6 +40,8 @@ public:
   uint64_t size();
   uint64_t bytes();
 
+  static uint32_t canHashPacket(const std::string& origPacket, std::string* ednsKey=nullptr);
+
 private:
 
   struct Entry 
@@ -40,43 +49,34 @@ private:
     mutable uint32_t d_ttd;
     mutable uint32_t d_creation;
     mutable std::string d_packet; // "I know what I am doing"
-    bool d_wantsDNSSEC;
-    inline bool operator<(const struct Entry& rhs) const;
+    std::string d_ednsKey;
+    DNSName d_name;
+    uint32_t d_qhash;
+    uint16_t d_type;
     
     uint32_t getTTD() const
     {
       return d_ttd;
     }
   };
- 
+
+  struct HashTag {};
+  struct SequencedTag {};
+  struct NameTag {};
+  /* lookups only use the hashed index, the ordered one on the name is there for doWipePacketCache(),
+     and the sequenced one for pruneCollection(), which expects it at position 1 */
   typedef multi_index_container<
     Entry,
     indexed_by  <
-                  ordered_unique<identity<Entry> >, 
-                  sequenced<> 
+                  hashed_non_unique<tag<HashTag>, member<Entry,uint32_t,&Entry::d_qhash> >,
+                  sequenced<tag<SequencedTag>>,
+                  ordered_non_unique<tag<NameTag>, member<Entry,DNSName,&Entry::d_name>, CanonDNSNameCompare>
                >
   > packetCache_t;
+
+  static bool questionMatches(const std::string& queryPacket, const std::string& cachedPacket);
   
    packetCache_t d_packetCache;
 };
 
-// needs to take into account: qname, qtype, opcode, rd, qdcount, EDNS size
-inline bool RecursorPacketCache::Entry::operator<(const struct RecursorPacketCache::Entry &rhs) const
-{
-  const struct dnsheader* 
-    dh=(const struct dnsheader*) d_packet.c_str(), 
-    *rhsdh=(const struct dnsheader*)rhs.d_packet.c_str();
-  if(std::tie(d_wantsDNSSEC, dh->opcode, dh->rd, dh->qdcount) < 
-     std::tie(rhs.d_wantsDNSSEC, rhsdh->opcode, rhsdh->rd, rhsdh->qdcount))
-    return true;
-
-  if(std::tie(d_wantsDNSSEC, dh->opcode, dh->rd, dh->qdcount) >
-     std::tie(rhs.d_wantsDNSSEC, rhsdh->opcode, rhsdh->rd, rhsdh->qdcount))
-    return false;
-
-  return dnspacketLessThan(d_packet, rhs.d_packet);
-}
-
-
-
 #endif
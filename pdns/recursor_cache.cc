@@ -9,37 +9,137 @@
 #include "syncres.hh"
 #include "recursor_cache.hh"
 #include "cachecleaner.hh"
+#include "rec-snapshot.hh"
 #include "namespaces.hh"
 
-unsigned int MemRecursorCache::size()
+uint32_t MemRecursorCache::s_serveStaleSeconds;
+uint32_t MemRecursorCache::s_staleAnswerTTL{30};
+uint32_t MemRecursorCache::s_prefetchPercent;
+
+MemRecursorCache::MemRecursorCache(size_t shardsCount) : d_maps(shardsCount ? shardsCount : 1)
 {
-  return (unsigned int)d_cache.size();
 }
 
-// this function is too slow to poll!
-unsigned int MemRecursorCache::bytes()
+uint64_t MemRecursorCache::size()
+{
+  uint64_t count=0;
+  for(auto& map : d_maps) {
+    ShardLock lock(map);
+    count+=map.d_map.size();
+  }
+  return count;
+}
+
+void MemRecursorCache::CacheEntry::getSignatures(vector<std::shared_ptr<RRSIGRecordContent>>& signatures) const
+{
+  signatures.clear();
+  signatures.reserve(d_contents.size() - d_recordsCount);
+  for(auto i=recordsEnd(); i != d_contents.cend(); ++i)
+    signatures.push_back(std::static_pointer_cast<RRSIGRecordContent>(*i));
+}
+
+void MemRecursorCache::CacheEntry::setContents(const vector<DNSRecord>& records, const vector<std::shared_ptr<RRSIGRecordContent>>& signatures)
+{
+  contents_t contents;
+  contents.reserve(records.size() + signatures.size());
+  uint32_t bytes=0;
+  for(const auto& record : records) {
+    contents.push_back(record.d_content);
+    // what the record took on the wire, not known for the ones we did not receive (hints, local zones)
+    bytes+=record.d_clen;
+  }
+  for(const auto& signature : signatures) {
+    contents.push_back(signature);
+    // the fixed part of the RDATA, the signer and the signature
+    bytes+=18 + signature->d_signer.wirelength() + signature->d_signature.size();
+  }
+  d_contents.swap(contents);
+  d_recordsCount=records.size();
+  d_contentsBytes=bytes;
+}
+
+size_t MemRecursorCache::CacheEntry::memoryUsage() const
 {
-  unsigned int ret=0;
+  size_t ret=sizeof(*this);
+  ret+=d_qname.wirelength();
+  ret+=d_contents.capacity() * sizeof(contents_t::value_type);
+  // the objects themselves, the control blocks of their shared_ptr and what they hold, roughly their wire size
+  ret+=d_contents.size() * (sizeof(DNSRecordContent) + 2 * sizeof(void*));
+  ret+=d_contentsBytes;
+  return ret;
+}
 
-  for(cache_t::const_iterator i=d_cache.begin(); i!=d_cache.end(); ++i) {
-    ret+=sizeof(struct CacheEntry);
-    ret+=(unsigned int)i->d_qname.toString().length();
-    for(auto j=i->d_records.begin(); j!= i->d_records.end(); ++j)
-      ret+= sizeof(*j); // XXX WRONG we don't know the stored size! j->size();
+// this function is too slow to poll!
+uint64_t MemRecursorCache::bytes()
+{
+  uint64_t ret=0;
+
+  for(auto& map : d_maps) {
+    ShardLock lock(map);
+    // the nodes of the three indexes, and the buckets of the hashed one
+    ret+=map.d_map.size() * 6 * sizeof(void*);
+    ret+=map.d_map.bucket_count() * sizeof(void*);
+    for(const auto& entry : map.d_map)
+      ret+=entry.memoryUsage();
   }
   return ret;
 }
 
-int MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt, vector<DNSRecord>* res, const ComboAddress& who, vector<std::shared_ptr<RRSIGRecordContent>>* signatures)
+MemRecursorCache::cache_t::iterator MemRecursorCache::findEntry(MapCombo& map, const DNSName& qname, uint16_t qtype, const Netmask& netmask)
+{
+  auto range=map.d_map.equal_range(qname);
+  for(auto i=range.first; i != range.second; ++i) {
+    if(i->d_qtype == qtype && i->d_netmask == netmask)
+      return i;
+  }
+  return map.d_map.end();
+}
+
+uint64_t MemRecursorCache::getLockAcquisitions() const
+{
+  uint64_t count=0;
+  for(const auto& map : d_maps)
+    count+=map.d_acquired;
+  return count;
+}
+
+uint64_t MemRecursorCache::getLockContentions() const
+{
+  uint64_t count=0;
+  for(const auto& map : d_maps)
+    count+=map.d_contended;
+  return count;
+}
+
+string MemRecursorCache::getShardsStats()
+{
+  ostringstream ret;
+  boost::format fmt("%-6d %10d %15d %15d\n");
+  ret<<(fmt % "shard" % "entries" % "acquired" % "contended").str();
+  for(size_t idx=0; idx < d_maps.size(); idx++) {
+    MapCombo& map=d_maps[idx];
+    uint64_t entries;
+    {
+      ShardLock lock(map);
+      entries=map.d_map.size();
+    }
+    ret<<(fmt % idx % entries % map.d_acquired % map.d_contended).str();
+  }
+  return ret.str();
+}
+
+int MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt, vector<DNSRecord>* res, const ComboAddress& who, vector<std::shared_ptr<RRSIGRecordContent>>* signatures, bool serveStale, bool* wasStale, bool* needsRefresh)
 {
   unsigned int ttd=0;
   //  cerr<<"looking up "<< qname<<"|"+qt.getName()<<"\n";
+  MapCombo& map=getMap(qname);
+  ShardLock lock(map);
 
-  if(!d_cachecachevalid || d_cachedqname!= qname) {
+  if(!map.d_cachecachevalid || map.d_cachedqname!= qname) {
     //    cerr<<"had cache cache miss"<<endl;
-    d_cachedqname=qname;
-    d_cachecache=d_cache.equal_range(tie(qname));
-    d_cachecachevalid=true;
+    map.d_cachedqname=qname;
+    map.d_cachecache=map.d_map.equal_range(qname);
+    map.d_cachecachevalid=true;
   }
   //  else cerr<<"had cache cache hit!"<<endl;
 
@@ -47,6 +147,7 @@ int MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt, vec
     res->clear();
 
   bool haveSubnetSpecific=false;
+  const auto& d_cachecache=map.d_cachecache;
   if(d_cachecache.first!=d_cachecache.second) {
     for(cache_t::const_iterator i=d_cachecache.first; i != d_cachecache.second; ++i) {
       if(!i->d_netmask.empty()) {
@@ -55,32 +156,42 @@ int MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt, vec
       }
     }
     for(cache_t::const_iterator i=d_cachecache.first; i != d_cachecache.second; ++i)
-      if(i->d_ttd > now && ((i->d_qtype == qt.getCode() || qt.getCode()==QType::ANY ||
+      if((i->d_ttd > now || (serveStale && i->d_ttd + s_serveStaleSeconds > (uint32_t)now)) &&
+         ((i->d_qtype == qt.getCode() || qt.getCode()==QType::ANY ||
 			    (qt.getCode()==QType::ADDR && (i->d_qtype == QType::A || i->d_qtype == QType::AAAA) )) 
 			    && (!haveSubnetSpecific || i->d_netmask.match(who)))
          ) {
 
 	ttd = i->d_ttd;	
-	for(auto k=i->d_records.begin(); k != i->d_records.end(); ++k) {
+        if(ttd <= now) {
+          ttd = now + s_staleAnswerTTL;
+          if(wasStale)
+            *wasStale = true;
+        }
+        else if(needsRefresh && s_prefetchPercent && !i->d_refreshing && (uint64_t)(ttd - now) * 100 <= (uint64_t) i->d_origTTL * s_prefetchPercent) {
+          i->d_refreshing = true;
+          *needsRefresh = true;
+        }
+	for(auto k=i->recordsBegin(); k != i->recordsEnd(); ++k) {
 	  if(res) {
 	    DNSRecord dr;
 	    dr.d_name = qname;
 	    dr.d_type = i->d_qtype;
 	    dr.d_class = 1;
 	    dr.d_content = *k; 
-	    dr.d_ttl = i->d_ttd;
+	    dr.d_ttl = ttd;
 	    dr.d_place = DNSResourceRecord::ANSWER;
 	    res->push_back(dr);
 	  }
 	}
       
 	if(signatures)  // if you do an ANY lookup you are hosed XXXX
-	  *signatures=i->d_signatures;
+	  i->getSignatures(*signatures);
         if(res) {
           if(res->empty())
-            moveCacheItemToFront(d_cache, i);
+            moveCacheItemToFront(map.d_map, i);
           else
-            moveCacheItemToBack(d_cache, i);
+            moveCacheItemToBack(map.d_map, i);
         }
         if(qt.getCode()!=QType::ANY && qt.getCode()!=QType::ADDR) // normally if we have a hit, we are done
           break;
@@ -105,11 +216,11 @@ bool MemRecursorCache::attemptToRefreshNSTTL(const QType& qt, const vector<DNSRe
     //~ cerr<<"Not NS record"<<endl;
     return false;
   }
-  if(content.size()!=stored.d_records.size()) {
+  if(content.size()!=stored.recordsCount()) {
     //~ cerr<<"Not equal number of records"<<endl;
     return false;
   }
-  if(stored.d_records.empty())
+  if(!stored.recordsCount())
     return false;
 
   if(stored.d_ttd > content.begin()->d_ttl) {
@@ -124,24 +235,22 @@ bool MemRecursorCache::attemptToRefreshNSTTL(const QType& qt, const vector<DNSRe
 
 void MemRecursorCache::replace(time_t now, const DNSName &qname, const QType& qt,  const vector<DNSRecord>& content, const vector<shared_ptr<RRSIGRecordContent>>& signatures, bool auth, boost::optional<Netmask> ednsmask)
 {
-  d_cachecachevalid=false;
-
-  cache_t::iterator stored;
-  auto key=boost::make_tuple(qname, qt.getCode(), ednsmask ? *ednsmask : Netmask());
-  stored=d_cache.find(key);
-  if(stored == d_cache.end()) {
-    stored=d_cache.insert(CacheEntry(key,CacheEntry::records_t(), auth)).first;
+  MapCombo& map=getMap(qname);
+  ShardLock lock(map);
+  map.d_cachecachevalid=false;
+
+  const Netmask netmask=ednsmask ? *ednsmask : Netmask();
+  cache_t::iterator stored=findEntry(map, qname, qt.getCode(), netmask);
+  if(stored == map.d_map.end()) {
+    stored=map.d_map.insert(CacheEntry(qname, qt.getCode(), netmask, auth)).first;
   }
 
   uint32_t maxTTD=UINT_MAX;
   CacheEntry ce=*stored;
-  ce.d_qtype=qt.getCode();
-  ce.d_signatures=signatures;
+  ce.d_refreshing=false;
 
   // cerr<<"asked to store "<< (qname.empty() ? "EMPTY" : qname.toString()) <<"|"+qt.getName()<<" -> '"<<content.begin()->d_content->getZoneRepresentation()<<"', auth="<<auth<<", ce.auth="<<ce.d_auth<<", "<< (ednsmask ? ednsmask->toString() : "")<<endl;
 
-  ce.d_records.clear();
-
   if(!auth && ce.d_auth) {  // unauth data came in, we have some auth data, but is it fresh?
     if(ce.d_ttd > now) { // we still have valid data, ignore unauth data
       //      cerr<<"\tStill hold valid auth data, and the new data is unauth, return\n";
@@ -161,7 +270,6 @@ void MemRecursorCache::replace(time_t now, const DNSName &qname, const QType& qt
   // make sure that we CAN refresh the root
   if(auth && (qname.isRoot() || !attemptToRefreshNSTTL(qt, content, ce) ) ) {
     // cerr<<"\tGot auth data, and it was not refresh attempt of an unchanged NS set, nuking storage"<<endl;
-    ce.d_records.clear(); // clear non-auth data
     ce.d_auth = true;
   }
 //  else cerr<<"\tNot nuking"<<endl;
@@ -170,39 +278,48 @@ void MemRecursorCache::replace(time_t now, const DNSName &qname, const QType& qt
   for(auto i=content.cbegin(); i != content.cend(); ++i) {
     //    cerr<<"To store: "<<i->d_content->getZoneRepresentation()<<" with ttl/ttd "<<i->d_ttl<<endl;
     ce.d_ttd=min(maxTTD, i->d_ttl);   // XXX this does weird things if TTLs differ in the set
-    ce.d_records.push_back(i->d_content);
     // there was code here that did things with TTL and auth. Unsure if it was good. XXX
   }
+  ce.d_origTTL = ce.d_ttd > now ? ce.d_ttd - now : 0;
+  ce.setContents(content, signatures);
 
-  d_cache.replace(stored, ce);
+  map.d_map.replace(stored, ce);
 }
 
 int MemRecursorCache::doWipeCache(const DNSName& name, bool sub, uint16_t qtype)
 {
   int count=0;
-  d_cachecachevalid=false;
-  pair<cache_t::iterator, cache_t::iterator> range;
 
   if(!sub) {
-    if(qtype==0xffff)
-      range=d_cache.equal_range(tie(name));
-    else
-      range=d_cache.equal_range(tie(name, qtype));
-    for(cache_t::const_iterator i=range.first; i != range.second; ) {
-      count++;
-      d_cache.erase(i++);
+    MapCombo& map=getMap(name);
+    ShardLock lock(map);
+    map.d_cachecachevalid=false;
+    auto range=map.d_map.equal_range(name);
+    for(auto i=range.first; i != range.second; ) {
+      if(i->d_qtype == qtype || qtype == 0xffff) {
+        count++;
+        map.d_map.erase(i++);
+      }
+      else
+        ++i;
     }
   }
   else {
-    for(auto iter = d_cache.lower_bound(tie(name)); iter != d_cache.end(); ) {
-      if(!iter->d_qname.isPartOf(name))
-	break;
-      if(iter->d_qtype == qtype || qtype == 0xffff) {
-	count++;
-	d_cache.erase(iter++);
+    // names below 'name' can be in any shard
+    for(auto& map : d_maps) {
+      ShardLock lock(map);
+      map.d_cachecachevalid=false;
+      auto& idx=map.d_map.get<OrderedTag>();
+      for(auto iter = idx.lower_bound(name); iter != idx.end(); ) {
+        if(!iter->d_qname.isPartOf(name))
+          break;
+        if(iter->d_qtype == qtype || qtype == 0xffff) {
+          count++;
+          idx.erase(iter++);
+        }
+        else
+          iter++;
       }
-      else 
-	iter++;
     }
   }
   return count;
@@ -210,9 +327,12 @@ int MemRecursorCache::doWipeCache(const DNSName& name, bool sub, uint16_t qtype)
 
 bool MemRecursorCache::doAgeCache(time_t now, const DNSName& name, uint16_t qtype, int32_t newTTL)
 {
-  cache_t::iterator iter = d_cache.find(tie(name, qtype));
+  MapCombo& map=getMap(name);
+  ShardLock lock(map);
+  auto range=map.d_map.equal_range(name);
+  auto iter=std::find_if(range.first, range.second, [qtype](const CacheEntry& entry) { return entry.d_qtype == qtype; });
   uint32_t maxTTD=std::numeric_limits<uint32_t>::min();
-  if(iter == d_cache.end()) {
+  if(iter == range.second) {
     return false;
   }
 
@@ -226,7 +346,7 @@ bool MemRecursorCache::doAgeCache(time_t now, const DNSName& name, uint16_t qtyp
     return false;  // would be dead anyhow
 
   if(maxTTL > newTTL) {
-    d_cachecachevalid=false;
+    map.d_cachecachevalid=false;
 
     uint32_t newTTD = now + newTTL;
 
@@ -235,65 +355,124 @@ bool MemRecursorCache::doAgeCache(time_t now, const DNSName& name, uint16_t qtyp
       ce.d_ttd = newTTD;
   
 
-    d_cache.replace(iter, ce);
+    map.d_map.replace(iter, ce);
     return true;
   }
   return false;
 }
 
-uint64_t MemRecursorCache::doDumpNSSpeeds(int fd)
+uint64_t MemRecursorCache::doDump(int fd)
 {
   FILE* fp=fdopen(dup(fd), "w");
-  if(!fp)
+  if(!fp) { // dup probably failed
     return 0;
-  fprintf(fp, "; nsspeed dump from thread follows\n;\n");
-  uint64_t count=0;
+  }
+  fprintf(fp, "; main record cache dump follows\n;\n");
 
-  for(SyncRes::nsspeeds_t::iterator i = t_sstorage->nsSpeeds.begin() ; i!= t_sstorage->nsSpeeds.end(); ++i)
-  {
-    count++;
-    fprintf(fp, "%s -> ", i->first.toString().c_str());
-    for(SyncRes::DecayingEwmaCollection::collection_t::iterator j = i->second.d_collection.begin(); j!= i->second.d_collection.end(); ++j)
-    {
-      // typedef vector<pair<ComboAddress, DecayingEwma> > collection_t;
-      fprintf(fp, "%s/%f ", j->first.toString().c_str(), j->second.peek());
+  uint64_t count=0;
+  time_t now=time(0);
+  for(auto& map : d_maps) {
+    ShardLock lock(map);
+    const auto& sidx=map.d_map.get<OrderedTag>();
+    for(auto i=sidx.cbegin(); i != sidx.cend(); ++i) {
+      for(auto j=i->recordsBegin(); j != i->recordsEnd(); ++j) {
+        count++;
+        try {
+          fprintf(fp, "%s %d IN %s %s ; %s\n", i->d_qname.toString().c_str(), (int32_t)(i->d_ttd - now), DNSRecordContent::NumberToType(i->d_qtype).c_str(), (*j)->getZoneRepresentation().c_str(), i->d_netmask.empty() ? "" : i->d_netmask.toString().c_str());
+        }
+        catch(...) {
+          fprintf(fp, "; error printing '%s'\n", i->d_qname.empty() ? "EMPTY" : i->d_qname.toString().c_str());
+        }
+      }
     }
-    fprintf(fp, "\n");
   }
   fclose(fp);
   return count;
 }
 
-uint64_t MemRecursorCache::doDump(int fd)
+uint64_t MemRecursorCache::doSnapshot(SnapshotWriter& out, time_t now, size_t part, size_t parts)
 {
-  FILE* fp=fdopen(dup(fd), "w");
-  if(!fp) { // dup probably failed
-    return 0;
-  }
-  fprintf(fp, "; main record cache dump from thread follows\n;\n");
-  auto& sidx=d_cache.get<0>();
-
-  uint64_t count=0;
-  time_t now=time(0);
-  for(auto i=sidx.cbegin(); i != sidx.cend(); ++i) {
-    for(auto j=i->d_records.cbegin(); j != i->d_records.cend(); ++j) {
+  size_t pos=out.reserveUInt32();
+  uint32_t count=0;
+  for(size_t shard=part; shard < d_maps.size(); shard+=parts) {
+    MapCombo& map=d_maps[shard];
+    ShardLock lock(map);
+    for(const auto& entry : map.d_map) {
+      if(entry.getTTD() <= now)
+        continue;
+      out.putName(entry.d_qname);
+      out.putUInt16(entry.d_qtype);
+      out.putString(entry.d_netmask.empty() ? string() : entry.d_netmask.toString());
+      out.putUInt32(entry.d_ttd);
+      out.putUInt32(entry.d_origTTL);
+      out.putUInt8(entry.d_auth);
+      out.putUInt16(entry.d_recordsCount);
+      out.putUInt16(entry.d_contents.size() - entry.d_recordsCount);
+      for(auto i=entry.recordsBegin(); i != entry.recordsEnd(); ++i)
+        out.putContent(entry.d_qname, *i);
+      for(auto i=entry.recordsEnd(); i != entry.d_contents.cend(); ++i)
+        out.putContent(entry.d_qname, *i);
       count++;
-      try {
-        fprintf(fp, "%s %d IN %s %s ; %s\n", i->d_qname.toString().c_str(), (int32_t)(i->d_ttd - now), DNSRecordContent::NumberToType(i->d_qtype).c_str(), (*j)->getZoneRepresentation().c_str(), i->d_netmask.empty() ? "" : i->d_netmask.toString().c_str());
-      }
-      catch(...) {
-        fprintf(fp, "; error printing '%s'\n", i->d_qname.empty() ? "EMPTY" : i->d_qname.toString().c_str());
-      }
     }
   }
-  fclose(fp);
+  out.setUInt32(pos, count);
   return count;
 }
 
-void MemRecursorCache::doPrune(void)
+uint64_t MemRecursorCache::loadSnapshot(SnapshotReader& in, time_t now)
 {
-  d_cachecachevalid=false;
+  uint64_t loaded=0;
+  uint32_t count=in.getUInt32();
+  vector<DNSRecord> records;
+  vector<std::shared_ptr<RRSIGRecordContent>> signatures;
+  for(uint32_t n=0; n < count; n++) {
+    DNSName qname=in.getName();
+    uint16_t qtype=in.getUInt16();
+    string netmask=in.getString();
+    CacheEntry ce(qname, qtype, netmask.empty() ? Netmask() : Netmask(netmask), false);
+    ce.d_ttd=in.getUInt32();
+    ce.d_origTTL=in.getUInt32();
+    ce.d_auth=in.getUInt8();
+    uint16_t recordsCount=in.getUInt16();
+    uint16_t signaturesCount=in.getUInt16();
+
+    records.resize(recordsCount);
+    for(auto& record : records) {
+      string wire=in.getString();
+      record.d_content=DNSRecordContent::unserialize(qname, qtype, wire);
+      record.d_clen=wire.size();
+    }
+    signatures.clear();
+    for(uint16_t s=0; s < signaturesCount; s++) {
+      auto signature=std::dynamic_pointer_cast<RRSIGRecordContent>(in.getContent(qname, QType::RRSIG));
+      if(!signature)
+        throw SnapshotError("invalid signature for "+qname.toString());
+      signatures.push_back(signature);
+    }
+
+    if(ce.getTTD() <= now)
+      continue;
+    ce.setContents(records, signatures);
 
-  unsigned int maxCached=::arg().asNum("max-cache-entries") / g_numThreads;
-  pruneCollection(d_cache, maxCached);
+    MapCombo& map=getMap(qname);
+    ShardLock lock(map);
+    map.d_cachecachevalid=false;
+    auto stored=findEntry(map, qname, qtype, ce.d_netmask);
+    if(stored == map.d_map.end())
+      map.d_map.insert(ce);
+    else
+      map.d_map.replace(stored, ce);
+    loaded++;
+  }
+  return loaded;
+}
+
+void MemRecursorCache::doPrune(unsigned int keep)
+{
+  const unsigned int maxCached=keep / d_maps.size();
+  for(auto& map : d_maps) {
+    ShardLock lock(map);
+    map.d_cachecachevalid=false;
+    pruneCollection(map.d_map, maxCached);
+  }
 }
@@ -12,81 +12,156 @@
 #undef L
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/hashed_index.hpp>
 #include <boost/tuple/tuple_comparison.hpp>
 #include <boost/multi_index/key_extractors.hpp>
 #include <boost/multi_index/sequenced_index.hpp>
 #include <boost/version.hpp>
 #include "iputils.hh"
+#include <atomic>
+#include <mutex>
 #undef max
 
 #define L theL()
 #include "namespaces.hh"
 using namespace ::boost::multi_index;
 
+class SnapshotWriter;
+class SnapshotReader;
+
+/* The record cache is split into shards by qname hash, each with its own lock, so that a single
+   instance can be shared by all threads (see 'record-cache-shared'). Per-thread caches have a single
+   shard, whose lock is never contended. */
 class MemRecursorCache : public boost::noncopyable //  : public RecursorCache
 {
 public:
-  MemRecursorCache() : d_cachecachevalid(false)
-  {
-    cacheHits = cacheMisses = 0;
-  }
-  unsigned int size();
-  unsigned int bytes();
-  int get(time_t, const DNSName &qname, const QType& qt, vector<DNSRecord>* res, const ComboAddress& who, vector<std::shared_ptr<RRSIGRecordContent>>* signatures=0);
+  MemRecursorCache(size_t shardsCount=1);
+  uint64_t size();
+  uint64_t bytes();
+  /* With serveStale, entries that expired less than s_serveStaleSeconds ago are returned too, with a TTL of
+     s_staleAnswerTTL, and *wasStale is set if the answer came from one. *needsRefresh is set, once per entry,
+     on a hit in the last s_prefetchPercent percent of its TTL */
+  int get(time_t, const DNSName &qname, const QType& qt, vector<DNSRecord>* res, const ComboAddress& who, vector<std::shared_ptr<RRSIGRecordContent>>* signatures=0, bool serveStale=false, bool* wasStale=0, bool* needsRefresh=0);
 
   void replace(time_t, const DNSName &qname, const QType& qt,  const vector<DNSRecord>& content, const vector<shared_ptr<RRSIGRecordContent>>& signatures, bool auth, boost::optional<Netmask> ednsmask=boost::optional<Netmask>());
-  void doPrune(void);
+  void doPrune(unsigned int keep);
   void doSlash(int perc);
   uint64_t doDump(int fd);
-  uint64_t doDumpNSSpeeds(int fd);
+  /* writes the entries of one part of the shards, for a shared cache written by several threads, and
+     returns how many there were. loadSnapshot() reads them back, skipping those that expired meanwhile */
+  uint64_t doSnapshot(SnapshotWriter& out, time_t now, size_t part, size_t parts);
+  uint64_t loadSnapshot(SnapshotReader& in, time_t now);
 
   int doWipeCache(const DNSName& name, bool sub, uint16_t qtype=0xffff);
   bool doAgeCache(time_t now, const DNSName& name, uint16_t qtype, int32_t newTTL);
-  uint64_t cacheHits, cacheMisses;
+
+  /* times a shard lock was taken, and how many of those had to wait for another thread */
+  uint64_t getLockAcquisitions() const;
+  uint64_t getLockContentions() const;
+  string getShardsStats();
+
+  std::atomic<uint64_t> cacheHits{0}, cacheMisses{0};
+
+  static uint32_t s_serveStaleSeconds;
+  static uint32_t s_staleAnswerTTL;
+  static uint32_t s_prefetchPercent;
 
 private:
 
+  /* Kept small since there can be millions of them: the records of the set and their RRSIGs share
+     a single allocation, records first. The DNSRecordContent objects themselves are shared with
+     whoever asked for them, so a cache hit does not need to parse or copy anything. */
   struct CacheEntry
   {
-    CacheEntry(const boost::tuple<DNSName, uint16_t, Netmask>& key, const vector<shared_ptr<DNSRecordContent>>& records, bool auth) : 
-      d_qname(key.get<0>()), d_qtype(key.get<1>()), d_auth(auth), d_ttd(0), d_records(records), d_netmask(key.get<2>())
+    CacheEntry(const DNSName& qname, uint16_t qtype, const Netmask& netmask, bool auth) :
+      d_qname(qname), d_netmask(netmask), d_ttd(0), d_origTTL(0), d_contentsBytes(0), d_qtype(qtype), d_recordsCount(0), d_auth(auth), d_refreshing(false)
     {}
 
-    typedef vector<std::shared_ptr<DNSRecordContent>> records_t;
-    vector<std::shared_ptr<RRSIGRecordContent>> d_signatures;
+    typedef vector<std::shared_ptr<DNSRecordContent>> contents_t;
+
+    // used by pruneCollection(), which should leave entries we might still serve stale alone
     uint32_t getTTD() const
     {
-      return d_ttd;
+      return d_ttd + s_serveStaleSeconds;
     }
 
-    DNSName d_qname; 
+    contents_t::const_iterator recordsBegin() const
+    {
+      return d_contents.cbegin();
+    }
+    contents_t::const_iterator recordsEnd() const
+    {
+      return d_contents.cbegin() + d_recordsCount;
+    }
+    size_t recordsCount() const
+    {
+      return d_recordsCount;
+    }
+    void getSignatures(vector<std::shared_ptr<RRSIGRecordContent>>& signatures) const;
+    void setContents(const vector<DNSRecord>& records, const vector<std::shared_ptr<RRSIGRecordContent>>& signatures);
+    size_t memoryUsage() const;
+
+    DNSName d_qname;
+    Netmask d_netmask;
+    contents_t d_contents;
+    uint32_t d_ttd;
+    uint32_t d_origTTL;
+    uint32_t d_contentsBytes; // the wire size of the contents, for memoryUsage()
     uint16_t d_qtype;
+    uint16_t d_recordsCount;
     bool d_auth;
-    uint32_t d_ttd;
-    records_t d_records;
-    Netmask d_netmask;
+    mutable bool d_refreshing; // a prefetch has been requested for this entry
   };
 
+  struct HashedTag {};
+  struct SequencedTag {};
+  struct OrderedTag {};
+  /* Lookups go through the hashed index on the name, the few entries sharing a name (one per type and
+     netmask) being scanned linearly. The ordered index is only there for doWipeCache() on a whole
+     subtree, and the sequenced one for pruneCollection(), which expects it at position 1. */
   typedef multi_index_container<
     CacheEntry,
     indexed_by <
-                ordered_unique<
-                      composite_key< 
-                        CacheEntry,
-                        member<CacheEntry,DNSName,&CacheEntry::d_qname>,
-                        member<CacheEntry,uint16_t,&CacheEntry::d_qtype>,
-                        member<CacheEntry,Netmask,&CacheEntry::d_netmask>
-                      >,
-		  composite_key_compare<CanonDNSNameCompare, std::less<uint16_t>, std::less<Netmask> >
-                >,
-               sequenced<>
-               >
+      hashed_non_unique<tag<HashedTag>, member<CacheEntry,DNSName,&CacheEntry::d_qname> >,
+      sequenced<tag<SequencedTag>>,
+      ordered_non_unique<tag<OrderedTag>, member<CacheEntry,DNSName,&CacheEntry::d_qname>, CanonDNSNameCompare>
+    >
   > cache_t;
 
-  cache_t d_cache;
-  pair<cache_t::iterator, cache_t::iterator> d_cachecache;
-  DNSName d_cachedqname;
-  bool d_cachecachevalid;
-  bool attemptToRefreshNSTTL(const QType& qt, const vector<DNSRecord>& content, const CacheEntry& stored);
+  struct MapCombo
+  {
+    cache_t d_map;
+    pair<cache_t::iterator, cache_t::iterator> d_cachecache;
+    DNSName d_cachedqname;
+    std::mutex d_mutex;
+    std::atomic<uint64_t> d_acquired{0};
+    std::atomic<uint64_t> d_contended{0};
+    bool d_cachecachevalid{false};
+  };
+
+  /* takes the lock of a shard, keeping track of how often we had to wait for it */
+  class ShardLock
+  {
+  public:
+    ShardLock(MapCombo& map): d_lock(map.d_mutex, std::try_to_lock)
+    {
+      if(!d_lock.owns_lock()) {
+        map.d_contended++;
+        d_lock.lock();
+      }
+      map.d_acquired++;
+    }
+  private:
+    std::unique_lock<std::mutex> d_lock;
+  };
+
+  MapCombo& getMap(const DNSName& qname)
+  {
+    return d_maps[qname.hash() % d_maps.size()];
+  }
+
+  vector<MapCombo> d_maps;
+  static cache_t::iterator findEntry(MapCombo& map, const DNSName& qname, uint16_t qtype, const Netmask& netmask);
+  static bool attemptToRefreshNSTTL(const QType& qt, const vector<DNSRecord>& content, const CacheEntry& stored);
 };
 #endif
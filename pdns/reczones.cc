@@ -237,6 +237,7 @@ void convertServersForAD(const std::string& input, SyncRes::AuthDomain& ad, cons
 void* pleaseWipeNegCache()
 {
   t_sstorage->negcache.clear();   
+  t_sstorage->aggressiveNSEC.clear();
   return 0;
 }
 
@@ -317,8 +318,49 @@ string reloadAuthAndForwards()
 }
 
 
-void RPZIXFRTracker(const ComboAddress& master, const DNSName& zone, shared_ptr<SOARecordContent> oursr) 
+static void dumpRPZ(const DNSFilterEngine& dfe, int place, const DNSName& zone, const SOARecordContent& sr, const std::string& dumpFile)
 {
+  if(dumpFile.empty())
+    return;
+  try {
+    dumpRPZToFile(dfe, place, zone, sr, dumpFile);
+  }
+  catch(PDNSException& e) {
+    L<<Logger::Error<<"Unable to dump RPZ zone "<<zone<<" to '"<<dumpFile<<"': "<<e.reason<<endl;
+  }
+}
+
+/* All changes are made to a copy of the engine, which only copies our own zone, and only once we change it.
+   The lookup tries are built here as well, so all the query threads see is the new version of the zone
+   being put in place of the old one. */
+void RPZIXFRTracker(const ComboAddress& master, const DNSName& zone, boost::optional<DNSFilterEngine::Policy> defpol, int place, shared_ptr<SOARecordContent> oursr, const std::string& dumpFile)
+{
+  // no seed to start from, do the initial transfer here instead of holding up the startup
+  while(!oursr) {
+    try {
+      DTime dt;
+      dt.set();
+      DNSFilterEngine dfe;
+      auto sr = loadRPZFromServer(master, zone, dfe, defpol, place);
+      dfe.compile();
+      g_luaconfs.modify([&dfe, place](LuaConfigItems& lci) {
+          lci.dfe.setZone(place, dfe);
+        });
+      g_stats.rpzLoads++;
+      g_stats.rpzLoadUsec += dt.udiff();
+      oursr = sr;
+      dumpRPZ(dfe, place, zone, *oursr, dumpFile);
+    }
+    catch(std::exception& e) {
+      L<<Logger::Error<<"Unable to load RPZ zone '"<<zone<<"' from '"<<master.toStringWithPort()<<"': "<<e.what()<<", retrying in 60 seconds"<<endl;
+      sleep(60);
+    }
+    catch(PDNSException& e) {
+      L<<Logger::Error<<"Unable to load RPZ zone '"<<zone<<"' from '"<<master.toStringWithPort()<<"': "<<e.reason<<", retrying in 60 seconds"<<endl;
+      sleep(60);
+    }
+  }
+
   for(;;) {
     DNSRecord dr;
     dr.d_content=oursr;
@@ -327,48 +369,65 @@ void RPZIXFRTracker(const ComboAddress& master, const DNSName& zone, shared_ptr<
     
     L<<Logger::Info<<"Getting IXFR deltas for "<<zone<<" from "<<master.toStringWithPort()<<", our serial: "<<std::dynamic_pointer_cast<SOARecordContent>(dr.d_content)->d_st.serial<<endl;
 
-    auto deltas = getIXFRDeltas(master, zone, dr);
-    if(deltas.empty())
-      continue;
-    L<<Logger::Info<<"Processing "<<deltas.size()<<" delta"<<addS(deltas)<<" for RPZ "<<zone<<endl;
-
-    auto luaconfsCopy = g_luaconfs.getCopy();
-    int totremove=0, totadd=0;
-    for(const auto& delta : deltas) {
-      const auto& remove = delta.first;
-      const auto& add = delta.second;
-      
-      for(const auto& rr : remove) { // should always contain the SOA
-	totremove++;
-	if(rr.d_type == QType::SOA) {
-	  auto oldsr = std::dynamic_pointer_cast<SOARecordContent>(rr.d_content);
-	  if(oldsr->d_st.serial == oursr->d_st.serial) {
-	    //	    cout<<"Got good removal of SOA serial "<<oldsr->d_st.serial<<endl;
-	  }
-	  else
-	    L<<Logger::Error<<"GOT WRONG SOA SERIAL REMOVAL, SHOULD TRIGGER WHOLE RELOAD"<<endl;
-	}
-	else {
-	  L<<Logger::Info<<"Had removal of "<<rr.d_name<<endl;
-	  RPZRecordToPolicy(rr, luaconfsCopy.dfe, false, boost::optional<DNSFilterEngine::Policy>(), 0);
-	}
-      }
+    try {
+      auto deltas = getIXFRDeltas(master, zone, dr);
+      if(deltas.empty())
+        continue;
+      L<<Logger::Info<<"Processing "<<deltas.size()<<" delta"<<addS(deltas)<<" for RPZ "<<zone<<endl;
+
+      DTime dt;
+      dt.set();
+      DNSFilterEngine dfe = g_luaconfs.getCopy().dfe;
+      auto newsr = oursr;
+      int totremove=0, totadd=0;
+      for(const auto& delta : deltas) {
+        const auto& remove = delta.first;
+        const auto& add = delta.second;
+
+        for(const auto& rr : remove) { // should always contain the SOA
+          totremove++;
+          if(rr.d_type == QType::SOA) {
+            auto oldsr = std::dynamic_pointer_cast<SOARecordContent>(rr.d_content);
+            if(oldsr->d_st.serial == newsr->d_st.serial) {
+              //	    cout<<"Got good removal of SOA serial "<<oldsr->d_st.serial<<endl;
+            }
+            else
+              L<<Logger::Error<<"GOT WRONG SOA SERIAL REMOVAL, SHOULD TRIGGER WHOLE RELOAD"<<endl;
+          }
+          else {
+            L<<Logger::Info<<"Had removal of "<<rr.d_name<<endl;
+            RPZRecordToPolicy(rr, dfe, false, defpol, place);
+          }
+        }
 
-      for(const auto& rr : add) { // should always contain the new SOA
-	totadd++;
-	if(rr.d_type == QType::SOA) {
-	  auto newsr = std::dynamic_pointer_cast<SOARecordContent>(rr.d_content);
-	  //	  L<<Logger::Info<<"New SOA serial for "<<zone<<": "<<newsr->d_st.serial<<endl;
-	  oursr = newsr;
-	}
-	else {
-	  L<<Logger::Info<<"Had addition of "<<rr.d_name<<endl;
-	  RPZRecordToPolicy(rr, luaconfsCopy.dfe, true, boost::optional<DNSFilterEngine::Policy>(), 0);
-	}
+        for(const auto& rr : add) { // should always contain the new SOA
+          totadd++;
+          if(rr.d_type == QType::SOA) {
+            newsr = std::dynamic_pointer_cast<SOARecordContent>(rr.d_content);
+            //	  L<<Logger::Info<<"New SOA serial for "<<zone<<": "<<newsr->d_st.serial<<endl;
+          }
+          else {
+            L<<Logger::Info<<"Had addition of "<<rr.d_name<<endl;
+            RPZRecordToPolicy(rr, dfe, true, defpol, place);
+          }
+        }
       }
+      dfe.compile();
+      g_luaconfs.modify([&dfe, place](LuaConfigItems& lci) {
+          lci.dfe.setZone(place, dfe);
+        });
+      oursr = newsr;
+      g_stats.rpzIXFRUpdates++;
+      g_stats.rpzIXFRUsec += dt.udiff();
+      L<<Logger::Info<<"Had "<<totremove<<" RPZ removal"<<addS(totremove)<<", "<<totadd<<" addition"<<addS(totadd)<<" for "<<zone<<" New serial: "<<oursr->d_st.serial<<endl;
+      dumpRPZ(dfe, place, zone, *oursr, dumpFile);
+    }
+    catch(std::exception& e) {
+      L<<Logger::Error<<"Error while updating RPZ zone '"<<zone<<"' from '"<<master.toStringWithPort()<<"': "<<e.what()<<endl;
+    }
+    catch(PDNSException& e) {
+      L<<Logger::Error<<"Error while updating RPZ zone '"<<zone<<"' from '"<<master.toStringWithPort()<<"': "<<e.reason<<endl;
     }
-    L<<Logger::Info<<"Had "<<totremove<<" RPZ removal"<<addS(totremove)<<", "<<totadd<<" addition"<<addS(totadd)<<" for "<<zone<<" New serial: "<<oursr->d_st.serial<<endl;
-    g_luaconfs.setState(luaconfsCopy);
   }
 }
 
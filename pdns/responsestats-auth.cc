@@ -21,13 +21,18 @@ void ResponseStats::submitResponse(DNSPacket &p, bool udpOrTCP) {
   static AtomicCounter &tcpbytesanswered=*S.getPointer("tcp-answers-bytes");
   static AtomicCounter &tcpbytesanswered4=*S.getPointer("tcp4-answers-bytes");
   static AtomicCounter &tcpbytesanswered6=*S.getPointer("tcp6-answers-bytes");
+  static ThreadStatRing<SQuestion>* nxdomainRing = S.getQuestionRing("nxdomain-queries");
+  static ThreadStatRing<SQuestion>* unauthRing = S.getQuestionRing("unauth-queries");
+  static ThreadStatRing<SComboAddress>* unauthRemotesRing = S.getComboRing("remotes-unauth");
 
-  if(p.d.aa) {
+  if(!S.ringsEnabled()) {
+    // nothing to account
+  } else if(p.d.aa) {
     if (p.d.rcode==RCode::NXDomain)
-      S.ringAccount("nxdomain-queries",p.qdomain.toString()+"/"+p.qtype.getName());
+      nxdomainRing->account(SQuestion(p.qdomain, p.qtype.getCode()));
   } else if (p.isEmpty()) {
-    S.ringAccount("unauth-queries",p.qdomain.toString()+"/"+p.qtype.getName());
-    S.ringAccount("remotes-unauth",p.d_remote);
+    unauthRing->account(SQuestion(p.qdomain, p.qtype.getCode()));
+    unauthRemotesRing->account(p.d_remote);
   }
 
   if (udpOrTCP) { // udp
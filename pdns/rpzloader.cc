@@ -67,33 +67,33 @@ void RPZRecordToPolicy(const DNSRecord& dr, DNSFilterEngine& target, bool addOrR
   if(dr.d_name.isPartOf(rpzNSDname)) {
     DNSName filt=dr.d_name.makeRelative(rpzNSDname);
     if(addOrRemove)
-      target.addNSTrigger(filt, pol);
+      target.addNSTrigger(filt, pol, place);
     else
-      target.rmNSTrigger(filt, pol);
+      target.rmNSTrigger(filt, pol, place);
   } else 	if(dr.d_name.isPartOf(rpzClientIP)) {
 
     auto nm=makeNetmaskFromRPZ(dr.d_name);
 
     if(addOrRemove)
-      target.addClientTrigger(nm, pol);
+      target.addClientTrigger(nm, pol, place);
     else
-      target.rmClientTrigger(nm, pol);
+      target.rmClientTrigger(nm, pol, place);
     
   } else 	if(dr.d_name.isPartOf(rpzIP)) {
     // cerr<<"Should apply answer content IP policy: "<<dr.d_name<<endl;
     auto nm=makeNetmaskFromRPZ(dr.d_name);
     if(addOrRemove)
-      target.addResponseTrigger(nm, pol);
+      target.addResponseTrigger(nm, pol, place);
     else
-      target.rmResponseTrigger(nm, pol);
+      target.rmResponseTrigger(nm, pol, place);
   } else if(dr.d_name.isPartOf(rpzNSIP)) {
     cerr<<"Should apply to nameserver IP address policy HAVE NOTHING HERE"<<endl;
 
   } else {
     if(addOrRemove)
-      target.addQNameTrigger(dr.d_name, pol);
+      target.addQNameTrigger(dr.d_name, pol, place);
     else
-      target.rmQNameTrigger(dr.d_name, pol);
+      target.rmQNameTrigger(dr.d_name, pol, place);
   }
 }
 
@@ -130,17 +130,19 @@ shared_ptr<SOARecordContent> loadRPZFromServer(const ComboAddress& master, const
   return sr;
 }
 
-int loadRPZFromFile(const std::string& fname, DNSFilterEngine& target, boost::optional<DNSFilterEngine::Policy> defpol, int place)
+shared_ptr<SOARecordContent> loadRPZFromFile(const std::string& fname, DNSFilterEngine& target, boost::optional<DNSFilterEngine::Policy> defpol, int place)
 {
   ZoneParserTNG zpt(fname);
   DNSResourceRecord drr;
   DNSName domain;
+  shared_ptr<SOARecordContent> sr;
   while(zpt.get(drr)) {
     try {
       if(drr.qtype.getCode() == QType::CNAME && drr.content.empty())
 	drr.content=".";
       DNSRecord dr(drr);
       if(dr.d_type == QType::SOA) {
+	sr = std::dynamic_pointer_cast<SOARecordContent>(dr.d_content);
 	domain = dr.d_name;
 //	cerr<<"Origin is "<<domain<<endl;
       }
@@ -158,5 +160,92 @@ int loadRPZFromFile(const std::string& fname, DNSFilterEngine& target, boost::op
     }
   }
   
-  return place;
+  return sr;
+}
+
+static string policyToRPZContent(const DNSFilterEngine::Policy& pol, uint16_t& qtype)
+{
+  qtype = QType::CNAME;
+  switch(pol.d_kind) {
+  case DNSFilterEngine::PolicyKind::NXDOMAIN:
+    return ".";
+  case DNSFilterEngine::PolicyKind::NODATA:
+    return "*.";
+  case DNSFilterEngine::PolicyKind::Drop:
+    return "rpz-drop.";
+  case DNSFilterEngine::PolicyKind::Truncate:
+    return "rpz-tcp-only.";
+  case DNSFilterEngine::PolicyKind::NoAction:
+    return "rpz-passthru.";
+  case DNSFilterEngine::PolicyKind::Custom:
+    break;
+  }
+  qtype = pol.d_custom->getType();
+  return pol.d_custom->getZoneRepresentation();
+}
+
+// the inverse of makeNetmaskFromRPZ(), which only knows about IPv4
+static bool netmaskToRPZ(const Netmask& nm, DNSName& name)
+{
+  const ComboAddress& network = nm.getNetwork();
+  if(network.sin4.sin_family != AF_INET)
+    return false;
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&network.sin4.sin_addr.s_addr);
+  name = DNSName(std::to_string(nm.getBits())+"."+std::to_string(bytes[3])+"."+std::to_string(bytes[2])+"."+std::to_string(bytes[1])+"."+std::to_string(bytes[0]));
+  return true;
+}
+
+static void writeRPZRecord(FILE* fp, const DNSName& name, const DNSFilterEngine::Policy& pol)
+{
+  uint16_t qtype;
+  string content = policyToRPZContent(pol, qtype);
+  if(fprintf(fp, "%s\t%d\tIN\t%s\t%s\n", name.toString().c_str(), pol.d_ttl, QType(qtype).getName().c_str(), content.c_str()) < 0)
+    throw PDNSException("Error writing RPZ dump: "+stringerror());
+}
+
+/* Writes the triggers we have for 'place' as an RPZ zone file that loadRPZFromFile() can read back,
+   going through a temporary file so that a crash never leaves a truncated dump behind */
+void dumpRPZToFile(const DNSFilterEngine& source, int place, const DNSName& zone, const SOARecordContent& sr, const std::string& fname)
+{
+  static const DNSName rpzClientIP("rpz-client-ip"), rpzIP("rpz-ip"), rpzNSDname("rpz-nsdname");
+
+  string tmpname = fname + ".tmp";
+  FILE* fp = fopen(tmpname.c_str(), "w");
+  if(!fp)
+    throw PDNSException("Unable to open '"+tmpname+"' for writing: "+stringerror());
+
+  try {
+    auto z = source.getZone(place);
+    if(fprintf(fp, "%s\t%u\tIN\tSOA\t%s\n", zone.toString().c_str(), sr.d_st.minimum, sr.getZoneRepresentation().c_str()) < 0)
+      throw PDNSException("Error writing RPZ dump: "+stringerror());
+
+    for(const auto& entry : z->qpolName)
+      writeRPZRecord(fp, entry.first + zone, entry.second);
+    for(const auto& entry : z->propolName)
+      writeRPZRecord(fp, entry.first + rpzNSDname + zone, entry.second);
+
+    DNSName name;
+    for(const auto& entry : z->qpolAddr) {
+      if(netmaskToRPZ(entry->first, name))
+        writeRPZRecord(fp, name + rpzClientIP + zone, entry->second);
+    }
+    for(const auto& entry : z->postpolAddr) {
+      if(netmaskToRPZ(entry->first, name))
+        writeRPZRecord(fp, name + rpzIP + zone, entry->second);
+    }
+  }
+  catch(...) {
+    fclose(fp);
+    unlink(tmpname.c_str());
+    throw;
+  }
+
+  if(fclose(fp) != 0) {
+    unlink(tmpname.c_str());
+    throw PDNSException("Error closing '"+tmpname+"': "+stringerror());
+  }
+  if(rename(tmpname.c_str(), fname.c_str()) < 0) {
+    unlink(tmpname.c_str());
+    throw PDNSException("Unable to rename '"+tmpname+"' to '"+fname+"': "+stringerror());
+  }
 }
@@ -5,7 +5,6 @@
 #include "sstuff.hh"
 #include <iostream>
 #include "misc.hh"
-#include "syncres.hh"
 #include "utility.hh" 
 
 
@@ -67,7 +66,7 @@ int SelectFDMultiplexer::run(struct timeval* now)
   
   struct timeval tv={0,500000};
   int ret=select(fdmax + 1, &readfds, &writefds, 0, &tv);
-  Utility::gettimeofday(now, 0); // MANDATORY!
+  gettimeofday(now, 0); // MANDATORY!
   
   if(ret < 0 && errno!=EINTR)
     throw FDMultiplexerException("select returned error: "+stringerror());
@@ -32,6 +32,7 @@
 #include "arguments.hh"
 #include "lock.hh"
 #include "iputils.hh"
+#include "qtype.hh"
 
 
 #include "namespaces.hh"
@@ -224,6 +225,166 @@ vector<pair<T, unsigned int> >StatRing<T,Comp>::get() const
   return tmp;
 }
 
+static std::atomic<unsigned int> s_threadRingIds;
+// the lanes of this thread, indexed by ring id
+static __thread vector<void*>* t_ringLanes;
+
+template<typename T, typename Comp>
+ThreadStatRing<T,Comp>::ThreadStatRing(unsigned int size) : d_id(s_threadRingIds++), d_capacity(size)
+{
+  pthread_mutex_init(&d_lock, 0);
+}
+
+template<typename T, typename Comp>
+ThreadStatRing<T,Comp>::~ThreadStatRing()
+{
+  for(Lane* lane : d_lanes)
+    delete lane;
+}
+
+template<typename T, typename Comp>
+typename ThreadStatRing<T,Comp>::Lane* ThreadStatRing<T,Comp>::getLane()
+{
+  if(!t_ringLanes)
+    t_ringLanes = new vector<void*>();
+  if(t_ringLanes->size() <= d_id)
+    t_ringLanes->resize(d_id + 1);
+
+  Lane* lane = static_cast<Lane*>((*t_ringLanes)[d_id]);
+  if(lane && lane->d_gen == d_gen.load(std::memory_order_acquire))
+    return lane;
+
+  // first time this thread accounts to us, or after a reset or resize
+  Lock l(&d_lock);
+  if(!lane) {
+    lane = new Lane();
+    d_lanes.push_back(lane);
+    (*t_ringLanes)[d_id] = lane;
+  }
+  lane->d_slots = std::unique_ptr<Slot[]>(new Slot[d_capacity]);
+  lane->d_capacity = d_capacity;
+  lane->d_count.store(0, std::memory_order_relaxed);
+  lane->d_gen = d_gen.load(std::memory_order_relaxed);
+  return lane;
+}
+
+template<typename T, typename Comp>
+void ThreadStatRing<T,Comp>::account(const T& t)
+{
+  Lane* lane = getLane();
+  if(!lane->d_capacity)
+    return;
+
+  uint64_t count = lane->d_count.load(std::memory_order_relaxed);
+  Slot& slot = lane->d_slots[count % lane->d_capacity];
+  uint32_t seq = slot.d_seq.load(std::memory_order_relaxed);
+  slot.d_seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.d_item = t;
+  slot.d_seq.store(seq + 2, std::memory_order_release);
+  lane->d_count.store(count + 1, std::memory_order_release);
+}
+
+template<typename T, typename Comp>
+unsigned int ThreadStatRing<T,Comp>::getSize()
+{
+  Lock l(&d_lock);
+  return d_capacity;
+}
+
+template<typename T, typename Comp>
+void ThreadStatRing<T,Comp>::resize(unsigned int newsize)
+{
+  Lock l(&d_lock);
+  d_capacity = newsize;
+  d_gen++;
+}
+
+template<typename T, typename Comp>
+void ThreadStatRing<T,Comp>::reset()
+{
+  Lock l(&d_lock);
+  d_gen++;
+}
+
+template<typename T, typename Comp>
+void ThreadStatRing<T,Comp>::setHelp(const string &str)
+{
+  d_help=str;
+}
+
+template<typename T, typename Comp>
+string ThreadStatRing<T,Comp>::getHelp()
+{
+  return d_help;
+}
+
+template<typename T, typename Comp>
+vector<pair<T, unsigned int> >ThreadStatRing<T,Comp>::get() const
+{
+  // holding the lock keeps the owners of the lanes from replacing their slots under us
+  Lock l(&d_lock);
+  const unsigned int gen = d_gen.load(std::memory_order_relaxed);
+  map<T,unsigned int, Comp> res;
+  for(const Lane* lane : d_lanes) {
+    if(lane->d_gen != gen || !lane->d_capacity)
+      continue;
+    const uint64_t count = lane->d_count.load(std::memory_order_acquire);
+    const uint64_t first = count > lane->d_capacity ? count - lane->d_capacity : 0;
+    for(uint64_t pos = first; pos < count; ++pos) {
+      const Slot& slot = lane->d_slots[pos % lane->d_capacity];
+      uint32_t seq = slot.d_seq.load(std::memory_order_acquire);
+      if(seq & 1)
+        continue;
+      T item = slot.d_item;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(slot.d_seq.load(std::memory_order_relaxed) != seq)
+        continue; // overwritten while we were reading it
+      res[item]++;
+    }
+  }
+
+  vector<pair<T ,unsigned int> > tmp;
+  for(typename map<T, unsigned int, Comp>::const_iterator i=res.begin();i!=res.end();++i)
+    tmp.push_back(*i);
+
+  sort(tmp.begin(),tmp.end(),[](const pair<T,unsigned int>& a, const pair<T,unsigned int>& b) {
+      return a.second > b.second;
+    });
+
+  return tmp;
+}
+
+SQuestion::SQuestion(const DNSName& qname, uint16_t qtype) : d_qtype(qtype)
+{
+  const string& storage = qname.getStorage();
+  d_len = std::min(storage.size(), sizeof(d_name));
+  memcpy(d_name, storage.c_str(), d_len);
+}
+
+bool SQuestion::operator<(const SQuestion& rhs) const
+{
+  if(d_qtype != rhs.d_qtype)
+    return d_qtype < rhs.d_qtype;
+  if(d_len != rhs.d_len)
+    return d_len < rhs.d_len;
+  return memcmp(d_name, rhs.d_name, d_len) < 0;
+}
+
+string SQuestion::toString() const
+{
+  string ret;
+  try {
+    ret = DNSName(d_name, d_len, 0, false).toString();
+  }
+  catch(const std::exception& e) {
+    ret = "(unparseable)";
+  }
+  if(d_qtype)
+    ret += "/" + QType(d_qtype).getName();
+  return ret;
+}
+
 void StatBag::declareRing(const string &name, const string &help, unsigned int size)
 {
   d_rings[name]=StatRing<string>(size);
@@ -232,25 +393,52 @@ void StatBag::declareRing(const string &name, const string &help, unsigned int s
 
 void StatBag::declareComboRing(const string &name, const string &help, unsigned int size)
 {
-  d_comborings[name]=StatRing<SComboAddress>(size);
-  d_comborings[name].setHelp(help);
+  d_comborings.erase(name);
+  d_comborings.emplace(std::piecewise_construct, std::forward_as_tuple(name), std::forward_as_tuple(size));
+  d_comborings.at(name).setHelp(help);
 }
 
+void StatBag::declareQuestionRing(const string &name, const string &help, unsigned int size)
+{
+  d_questionrings.erase(name);
+  d_questionrings.emplace(std::piecewise_construct, std::forward_as_tuple(name), std::forward_as_tuple(size));
+  d_questionrings.at(name).setHelp(help);
+}
+
+ThreadStatRing<SComboAddress>* StatBag::getComboRing(const string &name)
+{
+  auto iter = d_comborings.find(name);
+  if(iter == d_comborings.end())
+    throw runtime_error("Attempting to account to non-existent comboring '"+name+"'");
+  return &iter->second;
+}
+
+ThreadStatRing<SQuestion>* StatBag::getQuestionRing(const string &name)
+{
+  auto iter = d_questionrings.find(name);
+  if(iter == d_questionrings.end())
+    throw runtime_error("Attempting to account to non-existent question ring '"+name+"'");
+  return &iter->second;
+}
 
 vector<pair<string, unsigned int> > StatBag::getRing(const string &name)
 {
   if(d_rings.count(name))
     return d_rings[name].get();
+
+  vector<pair<string, unsigned int> > ret;
+  if(d_questionrings.count(name)) {
+    for(const auto& stor : d_questionrings.at(name).get())
+      ret.push_back(make_pair(stor.first.toString(), stor.second));
+  }
   else {
     typedef pair<SComboAddress, unsigned int> stor_t;
-    vector<stor_t> raw =d_comborings[name].get();
-    vector<pair<string, unsigned int> > ret;
+    vector<stor_t> raw =d_comborings.at(name).get();
     for(const stor_t& stor :  raw) {
       ret.push_back(make_pair(stor.first.ca.toString(), stor.second));
     }
-    return ret;
   }
-    
+  return ret;
 }
 
 template<typename T, typename Comp>
@@ -264,16 +452,20 @@ void StatBag::resetRing(const string &name)
 {
   if(d_rings.count(name))
     d_rings[name].reset();
+  else if(d_questionrings.count(name))
+    d_questionrings.at(name).reset();
   else
-    d_comborings[name].reset();
+    d_comborings.at(name).reset();
 }
 
 void StatBag::resizeRing(const string &name, unsigned int newsize)
 {
   if(d_rings.count(name))
     d_rings[name].resize(newsize);
+  else if(d_questionrings.count(name))
+    d_questionrings.at(name).resize(newsize);
   else
-    d_comborings[name].resize(newsize);
+    d_comborings.at(name).resize(newsize);
 }
 
 
@@ -281,16 +473,20 @@ unsigned int StatBag::getRingSize(const string &name)
 {
   if(d_rings.count(name))
     return d_rings[name].getSize();
+  else if(d_questionrings.count(name))
+    return d_questionrings.at(name).getSize();
   else
-    return d_comborings[name].getSize();
+    return d_comborings.at(name).getSize();
 }
 
 string StatBag::getRingTitle(const string &name)
 {
   if(d_rings.count(name))
     return d_rings[name].getHelp();
-  else 
-    return d_comborings[name].getHelp();
+  else if(d_questionrings.count(name))
+    return d_questionrings.at(name).getHelp();
+  else
+    return d_comborings.at(name).getHelp();
 }
 
 vector<string>StatBag::listRings()
@@ -298,7 +494,9 @@ vector<string>StatBag::listRings()
   vector<string> ret;
   for(map<string,StatRing<string> >::const_iterator i=d_rings.begin();i!=d_rings.end();++i)
     ret.push_back(i->first);
-  for(map<string,StatRing<SComboAddress> >::const_iterator i=d_comborings.begin();i!=d_comborings.end();++i)
+  for(map<string,ThreadStatRing<SComboAddress> >::const_iterator i=d_comborings.begin();i!=d_comborings.end();++i)
+    ret.push_back(i->first);
+  for(map<string,ThreadStatRing<SQuestion> >::const_iterator i=d_questionrings.begin();i!=d_questionrings.end();++i)
     ret.push_back(i->first);
 
   return ret;
@@ -306,8 +504,9 @@ vector<string>StatBag::listRings()
 
 bool StatBag::ringExists(const string &name)
 {
-  return d_rings.count(name) || d_comborings.count(name);
+  return d_rings.count(name) || d_comborings.count(name) || d_questionrings.count(name);
 }
 
 template class StatRing<std::string>;
-template class StatRing<SComboAddress>;
+template class ThreadStatRing<SComboAddress>;
+template class ThreadStatRing<SQuestion>;
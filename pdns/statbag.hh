@@ -29,6 +29,9 @@
 #include "lock.hh"
 #include "namespaces.hh"
 #include "iputils.hh"
+#include "dnsname.hh"
+#include <atomic>
+#include <memory>
 #include <boost/circular_buffer.hpp>
 
 
@@ -58,6 +61,64 @@ private:
   string d_help;
 };
 
+/* A ring for the hot paths, which every thread that accounts to it gets its own part of,
+   so accounting never takes a lock or touches memory another thread writes to. Each slot
+   carries a sequence number that is odd while it is being written, which lets get() skip
+   items it read halfway through an update. T must therefore be trivially copyable.
+   Every thread keeps the last 'size' items it accounted. */
+template<typename T, typename Comp=std::less<T> >
+class ThreadStatRing
+{
+public:
+  ThreadStatRing(unsigned int size=10000);
+  ThreadStatRing(const ThreadStatRing&) = delete;
+  ~ThreadStatRing();
+  void account(const T &item);
+
+  unsigned int getSize();
+  void resize(unsigned int newsize);
+  void reset();
+  void setHelp(const string &str);
+  string getHelp();
+
+  vector<pair<T, unsigned int> > get() const;
+private:
+  struct Slot
+  {
+    std::atomic<uint32_t> d_seq{0};
+    T d_item;
+  };
+  struct Lane
+  {
+    std::unique_ptr<Slot[]> d_slots;
+    unsigned int d_capacity;
+    unsigned int d_gen;
+    std::atomic<uint64_t> d_count{0};
+  };
+
+  Lane* getLane();
+
+  vector<Lane*> d_lanes;
+  mutable pthread_mutex_t d_lock;
+  string d_help;
+  const unsigned int d_id;
+  unsigned int d_capacity;
+  std::atomic<unsigned int> d_gen{0}; //!< bumped on reset() and resize(), lanes of an older generation are refilled
+};
+
+//! A question as kept in a ThreadStatRing: the name in wire format, and the type
+struct SQuestion
+{
+  SQuestion() {}
+  SQuestion(const DNSName& qname, uint16_t qtype=0);
+  bool operator<(const SQuestion& rhs) const;
+  string toString() const; //!< name/type, or just the name if there is no type
+
+  uint16_t d_qtype;
+  uint8_t d_len;
+  char d_name[255];
+};
+
 
 //! use this to gather and query statistics
 class StatBag
@@ -65,7 +126,8 @@ class StatBag
   map<string, AtomicCounter *> d_stats;
   map<string, string> d_keyDescrips;
   map<string,StatRing<string> >d_rings;
-  map<string,StatRing<SComboAddress> >d_comborings;
+  map<string,ThreadStatRing<SComboAddress> >d_comborings;
+  map<string,ThreadStatRing<SQuestion> >d_questionrings;
   typedef boost::function<uint64_t(const std::string&)> func_t;
   typedef map<string, func_t> funcstats_t;
   funcstats_t d_funcstats;
@@ -79,6 +141,7 @@ public:
 
   void declareRing(const string &name, const string &title, unsigned int size=10000);
   void declareComboRing(const string &name, const string &help, unsigned int size=10000);
+  void declareQuestionRing(const string &name, const string &help, unsigned int size=10000);
   vector<pair<string, unsigned int> >getRing(const string &name);
   string getRingTitle(const string &name);
   void ringAccount(const char* name, const string &item)
@@ -92,11 +155,20 @@ public:
   }
   void ringAccount(const char* name, const ComboAddress &item)
   {
-    if(d_doRings) {
-      if(!d_comborings.count(name))
-	throw runtime_error("Attempting to account to non-existent comboring '"+std::string(name)+"'");
-      d_comborings[name].account(item);
-    }
+    if(d_doRings)
+      getComboRing(name)->account(item);
+  }
+  void ringAccount(const char* name, const DNSName &qname, uint16_t qtype=0)
+  {
+    if(d_doRings)
+      getQuestionRing(name)->account(SQuestion(qname, qtype));
+  }
+  //! Look a ring up once, for use in hot paths. Only account to it if ringsEnabled()
+  ThreadStatRing<SComboAddress>* getComboRing(const string &name);
+  ThreadStatRing<SQuestion>* getQuestionRing(const string &name);
+  bool ringsEnabled() const
+  {
+    return d_doRings;
   }
 
   void doRings()
@@ -40,6 +40,7 @@
 #include <deque>
 #include "logger.hh"
 #include "validate.hh"
+#include "validate-recursor.hh"
 #include "misc.hh"
 #include "arguments.hh"
 #include "lwres.hh"
@@ -53,6 +54,7 @@
 __thread SyncRes::StaticStorage* t_sstorage;
 
 unsigned int SyncRes::s_maxnegttl;
+unsigned int SyncRes::s_aggressiveNSECCacheSize;
 unsigned int SyncRes::s_maxcachettl;
 unsigned int SyncRes::s_packetcachettl;
 unsigned int SyncRes::s_packetcacheservfailttl;
@@ -112,7 +114,7 @@ void accountAuthLatency(int usec, int family)
 
 SyncRes::SyncRes(const struct timeval& now) :  d_outqueries(0), d_tcpoutqueries(0), d_throttledqueries(0), d_timeouts(0), d_unreachables(0),
 					       d_totUsec(0), d_doDNSSEC(false), d_now(now),
-					       d_cacheonly(false), d_nocache(false), d_doEDNS0(false), d_lm(s_lm)
+					       d_cacheonly(false), d_nocache(false), d_refresh(false), d_serveStale(false), d_doEDNS0(false), d_lm(s_lm)
                                                  
 { 
   if(!t_sstorage) {
@@ -291,6 +293,29 @@ void SyncRes::doEDNSDumpAndClose(int fd)
   fclose(fp);
 }
 
+uint64_t SyncRes::doDumpNSSpeeds(int fd)
+{
+  FILE* fp=fdopen(dup(fd), "w");
+  if(!fp)
+    return 0;
+  fprintf(fp, "; nsspeed dump from thread follows\n;\n");
+  uint64_t count=0;
+
+  for(nsspeeds_t::iterator i = t_sstorage->nsSpeeds.begin() ; i!= t_sstorage->nsSpeeds.end(); ++i)
+  {
+    count++;
+    fprintf(fp, "%s -> ", i->first.toString().c_str());
+    for(DecayingEwmaCollection::collection_t::iterator j = i->second.d_collection.begin(); j!= i->second.d_collection.end(); ++j)
+    {
+      // typedef vector<pair<ComboAddress, DecayingEwma> > collection_t;
+      fprintf(fp, "%s/%f ", j->first.toString().c_str(), j->second.peek());
+    }
+    fprintf(fp, "\n");
+  }
+  fclose(fp);
+  return count;
+}
+
 int SyncRes::asyncresolveWrapper(const ComboAddress& ip, bool ednsMANDATORY, const DNSName& domain, int type, bool doTCP, bool sendRDQuery, struct timeval* now, boost::optional<Netmask>& srcmask, LWResult* res)
 {
   /* what is your QUEST?
@@ -417,11 +442,13 @@ int SyncRes::doResolve(const DNSName &qname, const QType &qtype, vector<DNSRecor
       }
     }
 
-    if(doCNAMECacheCheck(qname,qtype,ret,depth,res)) // will reroute us if needed
-      return res;
+    if(!(d_refresh && depth==0)) {
+      if(doCNAMECacheCheck(qname,qtype,ret,depth,res)) // will reroute us if needed
+        return res;
 
-    if(doCacheCheck(qname,qtype,ret,depth,res)) // we done
-      return res;
+      if(doCacheCheck(qname,qtype,ret,depth,res)) // we done
+        return res;
+    }
   }
 
   if(d_cacheonly)
@@ -440,10 +467,24 @@ int SyncRes::doResolve(const DNSName &qname, const QType &qtype, vector<DNSRecor
     subdomain=getBestNSNamesFromCache(subdomain, qtype, nsset, &flawedNSSet, depth, beenthere); //  pass beenthere to both occasions
   }
 
+  const size_t retSize=ret.size();
   if(!(res=doResolveAt(nsset, subdomain, flawedNSSet, qname, qtype, ret, depth, beenthere)))
     return 0;
 
   LOG(prefix<<qname.toString()<<": failed (res="<<res<<")"<<endl);
+
+  // the authoritative servers could not be reached (or were throttled), an expired answer beats a ServFail
+  if((res < 0 || res == RCode::ServFail) && MemRecursorCache::s_serveStaleSeconds && !d_serveStale && !d_refresh) {
+    ret.resize(retSize);
+    d_serveStale=true;
+    int staleRes=0;
+    bool found=doCNAMECacheCheck(qname, qtype, ret, depth, staleRes) || doCacheCheck(qname, qtype, ret, depth, staleRes);
+    d_serveStale=false;
+    if(found) {
+      LOG(prefix<<qname.toString()<<": answering with stale data from the cache"<<endl);
+      return staleRes;
+    }
+  }
   ;
   return res<0 ? RCode::ServFail : res;
 }
@@ -664,7 +705,12 @@ bool SyncRes::doCNAMECacheCheck(const DNSName &qname, const QType &qtype, vector
   LOG(prefix<<qname.toString()<<": Looking for CNAME cache hit of '"<<(qname.toString()+"|CNAME")<<"'"<<endl);
   vector<DNSRecord> cset;
   vector<std::shared_ptr<RRSIGRecordContent>> signatures;
-  if(t_RC->get(d_now.tv_sec, qname,QType(QType::CNAME), &cset, d_requestor, &signatures) > 0) {
+  bool wasStale=false, needsRefresh=false;
+  if(t_RC->get(d_now.tv_sec, qname,QType(QType::CNAME), &cset, d_requestor, &signatures, d_serveStale, &wasStale, &needsRefresh) > 0) {
+    if(wasStale)
+      g_stats.staleAnswers++;
+    if(needsRefresh)
+      schedulePrefetch(qname, QType(QType::CNAME));
 
     for(auto j=cset.cbegin() ; j != cset.cend() ; ++j) {
       if(j->d_ttl>(unsigned int) d_now.tv_sec) {
@@ -775,11 +821,31 @@ bool SyncRes::doCacheCheck(const DNSName &qname, const QType &qtype, vector<DNSR
       }
     }
   }
+  vector<DNSRecord> synthesizedProof;
+  bool synthesized=false;
+  if(!giveNegative && s_aggressiveNSECCacheSize && g_dnssecmode != DNSSECMode::Off) {
+    DNSName zone;
+    uint32_t ttd;
+    if(t_sstorage->aggressiveNSEC.getDenial(d_now.tv_sec, qname, qtype, res, zone, ttd, synthesizedProof)) {
+      sttl=ttd - d_now.tv_sec;
+      LOG(prefix<<qname.toString()<<": "<<qtype.getName()<<" is denied by cached NSEC(3) records of '"<<zone.toString()<<"' for another "<<sttl<<" seconds"<<endl);
+      giveNegative=true;
+      synthesized=true;
+      sqname=zone;
+      sqt=QType::SOA;
+    }
+  }
+
   vector<DNSRecord> cset;
   bool found=false, expired=false;
   vector<std::shared_ptr<RRSIGRecordContent>> signatures;
   uint32_t ttl=0;
-  if(t_RC->get(d_now.tv_sec, sqname, sqt, &cset, d_requestor, d_doDNSSEC ? &signatures : 0) > 0) {
+  bool wasStale=false, needsRefresh=false;
+  if(t_RC->get(d_now.tv_sec, sqname, sqt, &cset, d_requestor, d_doDNSSEC ? &signatures : 0, d_serveStale, &wasStale, giveNegative ? 0 : &needsRefresh) > 0) {
+    if(wasStale)
+      g_stats.staleAnswers++;
+    if(needsRefresh)
+      schedulePrefetch(sqname, sqt);
     LOG(prefix<<sqname.toString()<<": Found cache hit for "<<sqt.getName()<<": ");
     for(auto j=cset.cbegin() ; j != cset.cend() ; ++j) {
       LOG(j->d_content->getZoneRepresentation());
@@ -788,7 +854,7 @@ bool SyncRes::doCacheCheck(const DNSName &qname, const QType &qtype, vector<DNSR
         ttl = (dr.d_ttl-=d_now.tv_sec);
         if(giveNegative) {
           dr.d_place=DNSResourceRecord::AUTHORITY;
-          dr.d_ttl=sttl;
+          dr.d_ttl=synthesized ? min(sttl, dr.d_ttl) : sttl;
         }
         ret.push_back(dr);
         LOG("[ttl="<<dr.d_ttl<<"] ");
@@ -815,6 +881,14 @@ bool SyncRes::doCacheCheck(const DNSName &qname, const QType &qtype, vector<DNSR
     if(found && !expired) {
       if(!giveNegative)
         res=0;
+      if(synthesized) {
+        if(d_doDNSSEC)
+          ret.insert(ret.end(), synthesizedProof.cbegin(), synthesizedProof.cend());
+        if(res == RCode::NXDomain)
+          g_stats.aggressiveNSECNXDomains++;
+        else
+          g_stats.aggressiveNSECNoData++;
+      }
       return true;
     }
     else
@@ -911,6 +985,60 @@ static void addNXNSECS(vector<DNSRecord>&ret, const vector<DNSRecord>& records)
   }
 }
 
+/* Validating the denials seen while fetching the keys of a zone would recurse for little gain, those are skipped */
+static __thread bool t_validatingDenial;
+
+/** Hands the NSEC and NSEC3 records of a negative answer to the aggressive NSEC cache, if they validate.
+    Validating them may cost DNSKEY and DS queries and signature checks that would otherwise not have been done,
+    so this only happens when we validate everything anyway, or when the client asked for DNSSEC (doDNSSEC). */
+static void addToAggressiveNSECCache(const recsig_t& proof, time_t now, bool doDNSSEC)
+{
+  if(!SyncRes::s_aggressiveNSECCacheSize || proof.empty() || t_validatingDenial)
+    return;
+  if(g_dnssecmode != DNSSECMode::ValidateAll && g_dnssecmode != DNSSECMode::ValidateForLog && !(g_dnssecmode == DNSSECMode::Process && doDNSSEC))
+    return;
+
+  vector<DNSRecord> records;
+  for(const auto& csp : proof) {
+    // an NSEC(3) RRset holds a single record, and unsigned ones are of no use
+    if(csp.second.records.size() != 1 || csp.second.signatures.empty())
+      return;
+    records.insert(records.end(), csp.second.records.cbegin(), csp.second.records.cend());
+    records.insert(records.end(), csp.second.signatures.cbegin(), csp.second.signatures.cend());
+  }
+
+  // this is only a cache filling side effect, so a failure here must not fail the query itself
+  vState state=Indeterminate;
+  t_validatingDenial=true;
+  try {
+    state=validateRecords(records);
+  }
+  catch(const ImmediateServFailException& e) {
+    L<<Logger::Debug<<"Not keeping the denial of '"<<proof.begin()->first.first.toString()<<"' for aggressive NSEC use, validating it failed: "<<e.reason<<endl;
+  }
+  catch(const PDNSException& e) {
+    L<<Logger::Debug<<"Not keeping the denial of '"<<proof.begin()->first.first.toString()<<"' for aggressive NSEC use, validating it failed: "<<e.reason<<endl;
+  }
+  catch(const std::exception& e) {
+    L<<Logger::Debug<<"Not keeping the denial of '"<<proof.begin()->first.first.toString()<<"' for aggressive NSEC use, validating it failed: "<<e.what()<<endl;
+  }
+  t_validatingDenial=false;
+  if(state != Secure)
+    return;
+
+  for(const auto& csp : proof) {
+    const DNSRecord& record=csp.second.records.front();
+    uint32_t ttd=now + min(record.d_ttl, SyncRes::s_maxnegttl);
+    DNSName signer;
+    for(const auto& signature : csp.second.signatures) {
+      auto rrsig=getRR<RRSIGRecordContent>(signature);
+      signer=rrsig->d_signer;
+      ttd=min(ttd, rrsig->d_sigexpire);
+    }
+    t_sstorage->aggressiveNSEC.insert(signer, record, csp.second.signatures, ttd);
+  }
+}
+
 /** returns -1 in case of no results, rcode otherwise */
 int SyncRes::doResolveAt(set<DNSName> nameservers, DNSName auth, bool flawedNSSet, const DNSName &qname, const QType &qtype,
                          vector<DNSRecord>&ret,
@@ -1247,6 +1375,7 @@ int SyncRes::doResolveAt(set<DNSName> nameservers, DNSName auth, bool flawedNSSe
 	    ne.d_qtype=QType(0); // this encodes 'whole record'
 	    ne.d_dnssecProof = harvestRecords(lwr.d_records, {QType::NSEC, QType::NSEC3});
 	    replacing_insert(t_sstorage->negcache, ne);
+	    addToAggressiveNSECCache(ne.d_dnssecProof, d_now.tv_sec, d_doDNSSEC);
 	    if(s_rootNXTrust && auth.isRoot()) {
 	      ne.d_name = getLastLabel(ne.d_name);
 	      replacing_insert(t_sstorage->negcache, ne);
@@ -1311,6 +1440,7 @@ int SyncRes::doResolveAt(set<DNSName> nameservers, DNSName auth, bool flawedNSSe
 	      if(qtype.getCode()) {  // prevents us from blacking out a whole domain
 		replacing_insert(t_sstorage->negcache, ne);
 	      }
+	      addToAggressiveNSECCache(ne.d_dnssecProof, d_now.tv_sec, d_doDNSSEC);
 	    }
             negindic=true;
           }
@@ -17,6 +17,7 @@
 #include "sstuff.hh"
 #include "recursor_cache.hh"
 #include "recpacketcache.hh"
+#include "aggressive_nsec.hh"
 #include <boost/tuple/tuple.hpp>
 #include <boost/optional.hpp>
 #include <boost/tuple/tuple_comparison.hpp>
@@ -26,6 +27,8 @@
 #include "filterpo.hh"
 
 void primeHints(void);
+//! Resolves qname|qtype again in a new MTasker thread, bypassing the cache, if we have room for it
+void schedulePrefetch(const DNSName& qname, const QType& qtype);
 class RecursorLua4;
 
 struct BothRecordsAndSignatures
@@ -283,6 +286,12 @@ public:
     d_nocache=state;
   }
 
+  //! Don't look in the cache for the query itself, but do for everything needed to resolve it. Used for prefetches.
+  void setRefresh(bool state=true)
+  {
+    d_refresh=state;
+  }
+
   void setDoEDNS0(bool state=true)
   {
     d_doEDNS0=state;
@@ -306,6 +315,7 @@ public:
   int asyncresolveWrapper(const ComboAddress& ip, bool ednsMANDATORY, const DNSName& domain, int type, bool doTCP, bool sendRDQuery, struct timeval* now, boost::optional<Netmask>& srcmask, LWResult* res);
 
   static void doEDNSDumpAndClose(int fd);
+  static uint64_t doDumpNSSpeeds(int fd);
 
   static uint64_t s_queries;
   static uint64_t s_outgoingtimeouts;
@@ -440,6 +450,7 @@ public:
 
   struct timeval d_now;
   static unsigned int s_maxnegttl;
+  static unsigned int s_aggressiveNSECCacheSize;
   static unsigned int s_maxcachettl;
   static unsigned int s_packetcachettl;
   static unsigned int s_packetcacheservfailttl;
@@ -450,6 +461,7 @@ public:
 
   struct StaticStorage {
     negcache_t negcache;
+    AggressiveNSECCache aggressiveNSEC;
     nsspeeds_t nsSpeeds;
     ednsstatus_t ednsstatus;
     throttle_t throttle;
@@ -479,6 +491,8 @@ private:
   string d_prefix;
   bool d_cacheonly;
   bool d_nocache;
+  bool d_refresh;
+  bool d_serveStale;
   bool d_doEDNS0;
 
   static LogMode s_lm;
@@ -558,6 +572,9 @@ struct PacketIDBirthdayCompare: public std::binary_function<PacketID, PacketID,
   }
 };
 extern __thread MemRecursorCache* t_RC;
+/* set when 'record-cache-shared' is enabled, in which case t_RC points to it in every thread */
+extern MemRecursorCache* g_sharedRC;
+extern __thread unsigned int t_id;
 extern __thread RecursorPacketCache* t_packetCache;
 typedef MTasker<PacketID,string> MT_t;
 extern __thread MT_t* MT;
@@ -588,11 +605,21 @@ struct RecursorStats
   uint64_t overCapacityDrops;
   uint64_t ipv6queries;
   uint64_t chainResends;
+  uint64_t udpPoolRotations;
   uint64_t nsSetInvalidations;
   uint64_t ednsPingMatches;
   uint64_t ednsPingMismatches;
   uint64_t noPingOutQueries, noEdnsOutQueries;
   uint64_t packetCacheHits;
+  uint64_t prefetches;
+  uint64_t prefetchFailures;
+  uint64_t prefetchUsec;
+  uint64_t staleAnswers;
+  uint64_t aggressiveNSECNXDomains, aggressiveNSECNoData;
+  uint64_t dnssecKeysetCacheHits, dnssecKeysetCacheMisses;
+  uint64_t dnssecSignatureCacheHits, dnssecSignatureCacheMisses;
+  uint64_t rpzLoads, rpzLoadUsec;
+  uint64_t rpzIXFRUpdates, rpzIXFRUsec;
   uint64_t noPacketError;
   uint64_t ignoredCount;
   time_t startupTime;
@@ -666,10 +693,14 @@ uint64_t* pleaseGetNegCacheSize();
 uint64_t* pleaseGetCacheHits();
 uint64_t* pleaseGetCacheMisses();
 uint64_t* pleaseGetConcurrentQueries();
+uint64_t* pleaseGetUDPPoolSockets();
+uint64_t* pleaseGetUDPPoolQueries();
 uint64_t* pleaseGetThrottleSize();
 uint64_t* pleaseGetPacketCacheHits();
 uint64_t* pleaseGetPacketCacheSize();
 uint64_t* pleaseWipeCache(const DNSName& canon, bool subtree=false);
+uint64_t* pleaseGetRecordCacheLockAcquisitions();
+uint64_t* pleaseGetRecordCacheLockContentions();
 uint64_t* pleaseWipePacketCache(const DNSName& canon, bool subtree);
 uint64_t* pleaseWipeAndCountNegCache(const DNSName& canon, bool subtree=false);
 void doCarbonDump(void*);
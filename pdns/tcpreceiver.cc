@@ -54,6 +54,8 @@
 #include "communicator.hh"
 #include "namespaces.hh"
 #include "signingpipe.hh"
+#include "mplexer.hh"
+#include <boost/bind.hpp>
 extern PacketCache PC;
 extern StatBag S;
 
@@ -67,20 +69,8 @@ Semaphore *TCPNameserver::d_connectionroom_sem;
 PacketHandler *TCPNameserver::s_P; 
 int TCPNameserver::s_timeout;
 NetmaskGroup TCPNameserver::d_ng;
-
-void TCPNameserver::go()
-{
-  L<<Logger::Error<<"Creating backend connection for TCP"<<endl;
-  s_P=0;
-  try {
-    s_P=new PacketHandler;
-  }
-  catch(PDNSException &ae) {
-    L<<Logger::Error<<Logger::NTLog<<"TCP server is unable to launch backends - will try again when questions come in"<<endl;
-    L<<Logger::Error<<"TCP server is unable to launch backends - will try again when questions come in: "<<ae.reason<<endl;
-  }
-  pthread_create(&d_tid, 0, launcher, static_cast<void *>(this));
-}
+vector<TCPNameserver::Worker*> TCPNameserver::s_workers;
+std::atomic<unsigned int> TCPNameserver::s_nextWorker;
 
 void *TCPNameserver::launcher(void *data)
 {
@@ -188,16 +178,7 @@ void TCPNameserver::sendPacket(shared_ptr<DNSPacket> p, int outsock)
 }
 
 
-void TCPNameserver::getQuestion(int fd, char *mesg, int pktlen, const ComboAddress &remote)
-try
-{
-  readnWithTimeout(fd, mesg, pktlen);
-}
-catch(NetworkError& ae) {
-  throw NetworkError("Error reading DNS data from TCP client "+remote.toString()+": "+ae.what());
-}
-
-static void proxyQuestion(shared_ptr<DNSPacket> packet)
+static string proxyQuestion(shared_ptr<DNSPacket> packet)
 {
   int sock=socket(AF_INET, SOCK_STREAM, 0);
   
@@ -210,12 +191,13 @@ static void proxyQuestion(shared_ptr<DNSPacket> packet)
   st.port=53;
   parseService(::arg()["recursor"],st);
 
+  string answer;
   try {
     ComboAddress recursor(st.host, st.port);
     connectWithTimeout(sock, (struct sockaddr*)&recursor, recursor.getSocklen());
     const string &buffer=packet->getString();
     
-    uint16_t len=htons(buffer.length()), slen;
+    uint16_t len=htons(buffer.length());
     
     writenWithTimeout(sock, &len, 2);
     writenWithTimeout(sock, buffer.c_str(), buffer.length());
@@ -223,20 +205,15 @@ static void proxyQuestion(shared_ptr<DNSPacket> packet)
     readnWithTimeout(sock, &len, 2);
     len=ntohs(len);
 
-    char answer[len];
-    readnWithTimeout(sock, answer, len);
-
-    slen=htons(len);
-    writenWithTimeout(packet->getSocket(), &slen, 2);
-    
-    writenWithTimeout(packet->getSocket(), answer, len);
+    answer.resize(len);
+    readnWithTimeout(sock, &answer.at(0), len);
   }
   catch(NetworkError& ae) {
     close(sock);
     throw NetworkError("While proxying a question to recursor "+st.host+": " +ae.what());
   }
   close(sock);
-  return;
+  return answer;
 }
 
 
@@ -248,122 +225,400 @@ static void incTCPAnswerCount(const ComboAddress& remote)
   else
     S.inc("tcp4-answers");
 }
-void *TCPNameserver::doConnection(void *data)
+
+static FDMultiplexer* getMultiplexer()
 {
-  shared_ptr<DNSPacket> packet;
-  // Fix gcc-4.0 error (on AMD64)
-  int fd=(int)(long)data; // gotta love C (generates a harmless warning on opteron)
-  pthread_detach(pthread_self());
-  setNonBlocking(fd);
-  try {
-    int mesgsize=65535;
-    scoped_array<char> mesg(new char[mesgsize]);
-    
-    DLOG(L<<"TCP Connection accepted on fd "<<fd<<endl);
-    bool logDNSQueries= ::arg().mustDo("log-dns-queries");
-    for(;;) {
-      ComboAddress remote;
-      socklen_t remotelen=sizeof(remote);
-      if(getpeername(fd, (struct sockaddr *)&remote, &remotelen) < 0) {
-        L<<Logger::Warning<<"Received question from socket which had no remote address, dropping ("<<stringerror()<<")"<<endl;
-        break;
+  for(const auto& entry : FDMultiplexer::getMultiplexerMap()) {
+    try {
+      return entry.second();
+    }
+    catch(FDMultiplexerException &fe) {
+      L<<Logger::Error<<"Non-fatal error initializing possible multiplexer ("<<fe.what()<<"), falling back"<<endl;
+    }
+    catch(...) {
+      L<<Logger::Error<<"Non-fatal error initializing possible multiplexer"<<endl;
+    }
+  }
+  L<<Logger::Error<<"No working multiplexer found!"<<endl;
+  exit(1);
+}
+
+/* A TCP client. It belongs to exactly one worker at a time, or to the thread doing
+   an AXFR or IXFR for it, so it needs no locking of its own. */
+struct TCPNameserver::Connection
+{
+  Connection(int fd, const ComboAddress& remote) : d_fd(fd), d_remote(remote), d_lastActive(time(0))
+  {
+  }
+  ~Connection()
+  {
+    close(d_fd);
+    d_connectionroom_sem->post();
+  }
+
+  //! Writes as much of d_out as the socket takes, returns true if all of it went out
+  bool flush()
+  {
+    while(d_outPos < d_out.size()) {
+      ssize_t ret=write(d_fd, d_out.c_str() + d_outPos, d_out.size() - d_outPos);
+      if(ret < 0) {
+        if(errno==EAGAIN || errno==EINTR)
+          return false;
+        throw NetworkError("Writing data: "+stringerror());
       }
+      d_outPos += ret;
+      d_lastActive=time(0);
+    }
+    d_out.clear();
+    d_outPos=0;
+    return true;
+  }
 
-      uint16_t pktlen;
-      if(!readnWithTimeout(fd, &pktlen, 2, false))
-        break;
-      else
-        pktlen=ntohs(pktlen);
+  int d_fd;
+  ComboAddress d_remote;
+  string d_in;                  //!< received bytes not yet parsed into questions
+  string d_out;                 //!< answers not yet written, starting at d_outPos
+  string::size_type d_outPos{0};
+  time_t d_lastActive;
+};
+
+/* A worker owns a multiplexer and the connections registered with it, and answers their
+   questions with its own PacketHandler. Connections arrive over a pipe, from the acceptor
+   or from a finished zone transfer. A connection is read from until an answer can not be
+   written right away, and then only written to until that answer is out, so a client that
+   does not read its answers can not make us buffer more than one batch of them. */
+class TCPNameserver::Worker
+{
+public:
+  Worker() : d_fdm(getMultiplexer()), d_idleTimeout(::arg().asNum("tcp-idle-timeout"))
+  {
+    if(pipe(d_pipe) < 0)
+      throw PDNSException("Unable to create pipe for TCP worker: "+stringerror());
+    setCloseOnExec(d_pipe[0]);
+    setCloseOnExec(d_pipe[1]);
+  }
 
-      // this check will always be false *if* no one touches
-      // the mesg array. pktlen can be maximum of 65535 as
-      // it is 2 byte unsigned variable. In getQuestion, we 
-      // write to 0 up to pktlen-1 so 65535 is just right. 
+  //! Called from any thread, takes ownership of conn
+  void add(Connection* conn)
+  {
+    if(write(d_pipe[1], &conn, sizeof(conn)) != sizeof(conn)) {
+      L<<Logger::Error<<"Unable to pass TCP connection from "<<conn->d_remote.toStringWithPort()<<" to a worker: "<<stringerror()<<endl;
+      delete conn;
+    }
+  }
 
-      // do not remove this check as it will catch if someone
-      // decreases the mesg buffer size for some reason. 
-      if(pktlen > mesgsize) {
-        L<<Logger::Warning<<"Received an overly large question from "<<remote.toString()<<", dropping"<<endl;
-        break;
-      }
-      
-      getQuestion(fd, mesg.get(), pktlen, remote);
-      S.inc("tcp-queries");      
-      if(remote.sin4.sin_family == AF_INET6)
-        S.inc("tcp6-queries");
-      else
-        S.inc("tcp4-queries");
+  void start()
+  {
+    pthread_t tid;
+    if(pthread_create(&tid, 0, run, static_cast<void*>(this)))
+      throw PDNSException("Unable to launch TCP worker thread: "+stringerror());
+  }
 
-      packet=shared_ptr<DNSPacket>(new DNSPacket);
-      packet->setRemote(&remote);
-      packet->d_tcp=true;
-      packet->setSocket(fd);
-      if(packet->parse(mesg.get(), pktlen)<0)
-        break;
-      
-      if(packet->qtype.getCode()==QType::AXFR) {
-        if(doAXFR(packet->qdomain, packet, fd))
-          incTCPAnswerCount(remote);
-        continue;
+private:
+  static void *run(void *data)
+  {
+    try {
+      static_cast<Worker*>(data)->loop();
+    }
+    catch(PDNSException &AE) {
+      L<<Logger::Error<<"TCP worker thread dying because of fatal error: "<<AE.reason<<endl;
+    }
+    catch(std::exception &e) {
+      L<<Logger::Error<<"TCP worker thread dying because of STL error: "<<e.what()<<endl;
+    }
+    exit(1); // take rest of server with us
+  }
+
+  void loop()
+  {
+    d_fdm->addReadFD(d_pipe[0], boost::bind(&Worker::handlePipe, this, _1));
+    time_t lastScan=time(0);
+    struct timeval now;
+    for(;;) {
+      d_fdm->run(&now);
+      if(now.tv_sec != lastScan) {
+        lastScan=now.tv_sec;
+        expireIdle(now.tv_sec);
       }
+    }
+  }
 
-      if(packet->qtype.getCode()==QType::IXFR) {
-        if(doIXFR(packet, fd))
-          incTCPAnswerCount(remote);
-        continue;
+  void handlePipe(int fd)
+  {
+    Connection* conn;
+    if(read(fd, &conn, sizeof(conn)) != sizeof(conn)) {
+      L<<Logger::Error<<"Error reading TCP connection from worker pipe: "<<stringerror()<<endl;
+      return;
+    }
+    d_conns[conn->d_fd].reset(conn);
+    conn->d_lastActive=time(0);
+    d_fdm->addReadFD(conn->d_fd, boost::bind(&Worker::handleRead, this, _1));
+    // a connection back from a zone transfer might have pipelined questions waiting
+    process(conn);
+  }
+
+  void handleRead(int fd)
+  {
+    Connection* conn=d_conns[fd].get();
+    char buffer[16384];
+    ssize_t got=recv(fd, buffer, sizeof(buffer), 0);
+    if(got < 0 && (errno==EAGAIN || errno==EINTR))
+      return;
+    if(got <= 0) {
+      if(got < 0)
+        L<<Logger::Info<<"TCP connection from "<<conn->d_remote.toStringWithPort()<<" failed: "<<stringerror()<<endl;
+      d_fdm->removeReadFD(fd);
+      d_conns.erase(fd);
+      return;
+    }
+    conn->d_in.append(buffer, got);
+    conn->d_lastActive=time(0);
+    process(conn);
+  }
+
+  void handleWrite(int fd)
+  {
+    Connection* conn=d_conns[fd].get();
+    try {
+      if(!conn->flush())
+        return;
+    }
+    catch(NetworkError &e) {
+      L<<Logger::Info<<"TCP connection from "<<conn->d_remote.toStringWithPort()<<" failed: "<<e.what()<<endl;
+      d_fdm->removeWriteFD(fd);
+      d_conns.erase(fd);
+      return;
+    }
+    d_fdm->removeWriteFD(fd);
+    d_fdm->addReadFD(fd, boost::bind(&Worker::handleRead, this, _1));
+  }
+
+  //! Answers all complete questions in conn->d_in, conn must be on our read list
+  void process(Connection* conn)
+  {
+    const int fd=conn->d_fd;
+    bool keep=true;
+    try {
+      string::size_type pos=0;
+      while(keep && conn->d_in.size() - pos >= 2) {
+        uint16_t pktlen=((uint8_t)conn->d_in[pos] << 8) + (uint8_t)conn->d_in[pos+1];
+        if(conn->d_in.size() - pos - 2 < pktlen)
+          break;
+        string mesg=conn->d_in.substr(pos + 2, pktlen);
+        pos += 2 + pktlen;
+
+        shared_ptr<DNSPacket> packet=shared_ptr<DNSPacket>(new DNSPacket);
+        packet->setRemote(&conn->d_remote);
+        packet->d_tcp=true;
+        packet->setSocket(fd);
+        if(packet->parse(mesg.c_str(), mesg.size())<0) {
+          keep=false;
+          break;
+        }
+        if(packet->qtype.getCode()==QType::AXFR || packet->qtype.getCode()==QType::IXFR) {
+          conn->d_in.erase(0, pos);
+          transfer(conn, packet);
+          return;
+        }
+        keep=answer(conn, packet);
       }
+      conn->d_in.erase(0, pos);
 
-      shared_ptr<DNSPacket> reply; 
-      shared_ptr<DNSPacket> cached= shared_ptr<DNSPacket>(new DNSPacket);
-      if(logDNSQueries)  {
-        string remote;
-        if(packet->hasEDNSSubnet()) 
-          remote = packet->getRemote() + "<-" + packet->getRealRemote().toString();
-        else
-          remote = packet->getRemote();
-        L << Logger::Notice<<"TCP Remote "<< remote <<" wants '" << packet->qdomain<<"|"<<packet->qtype.getName() << 
-        "', do = " <<packet->d_dnssecOk <<", bufsize = "<< packet->getMaxReplyLen()<<": ";
+      if(keep && !conn->flush()) {
+        d_fdm->removeReadFD(fd);
+        d_fdm->addWriteFD(fd, boost::bind(&Worker::handleWrite, this, _1));
+        return;
       }
+    }
+    catch(DBException &e) {
+      d_P.reset();
+      L<<Logger::Error<<"TCP worker unable to answer a question because of a backend error, cycling"<<endl;
+      keep=false;
+    }
+    catch(PDNSException &ae) {
+      d_P.reset(); // on next question, backend will be recycled
+      L<<Logger::Error<<"TCP nameserver had error, cycling backend: "<<ae.reason<<endl;
+      keep=false;
+    }
+    catch(NetworkError &e) {
+      L<<Logger::Info<<"TCP connection from "<<conn->d_remote.toStringWithPort()<<" failed because of network error: "<<e.what()<<endl;
+      keep=false;
+    }
+    catch(std::exception &e) {
+      L<<Logger::Error<<"TCP connection from "<<conn->d_remote.toStringWithPort()<<" failed because of STL error: "<<e.what()<<endl;
+      keep=false;
+    }
+    if(!keep) {
+      d_fdm->removeReadFD(fd);
+      d_conns.erase(fd);
+    }
+  }
+
+  //! Queues the answer to packet on conn, returns false if the connection should be closed
+  bool answer(Connection* conn, shared_ptr<DNSPacket> packet)
+  {
+    S.inc("tcp-queries");
+    if(conn->d_remote.sin4.sin_family == AF_INET6)
+      S.inc("tcp6-queries");
+    else
+      S.inc("tcp4-queries");
 
+    bool logDNSQueries= ::arg().mustDo("log-dns-queries");
+    shared_ptr<DNSPacket> reply;
+    shared_ptr<DNSPacket> cached= shared_ptr<DNSPacket>(new DNSPacket);
+    if(logDNSQueries)  {
+      string remote;
+      if(packet->hasEDNSSubnet()) 
+        remote = packet->getRemote() + "<-" + packet->getRealRemote().toString();
+      else
+        remote = packet->getRemote();
+      L << Logger::Notice<<"TCP Remote "<< remote <<" wants '" << packet->qdomain<<"|"<<packet->qtype.getName() << 
+      "', do = " <<packet->d_dnssecOk <<", bufsize = "<< packet->getMaxReplyLen()<<": ";
+    }
 
-      if(!packet->d.rd && packet->couldBeCached() && PC.get(packet.get(), cached.get(), false)) { // short circuit - does the PacketCache recognize this question?
-        if(logDNSQueries)
-          L<<"packetcache HIT"<<endl;
-        cached->setRemote(&packet->d_remote);
-        cached->d.id=packet->d.id;
-        cached->d.rd=packet->d.rd; // copy in recursion desired bit 
-        cached->commitD(); // commit d to the packet                        inlined
+    if(!packet->d.rd && packet->couldBeCached() && PC.get(packet.get(), cached.get(), false)) { // short circuit - does the PacketCache recognize this question?
+      if(logDNSQueries)
+        L<<"packetcache HIT"<<endl;
+      cached->setRemote(&packet->d_remote);
+      cached->d.id=packet->d.id;
+      cached->d.rd=packet->d.rd; // copy in recursion desired bit 
+      cached->commitD(); // commit d to the packet                        inlined
 
-        if(LPE) LPE->police(&(*packet), &(*cached), true);
+      if(LPE) LPE->police(&(*packet), &(*cached), true);
 
-        sendPacket(cached, fd); // presigned, don't do it again
+      queueAnswer(conn, cached); // presigned, don't do it again
+      return true;
+    }
+    if(logDNSQueries)
+      L<<"packetcache MISS"<<endl;
+
+    if(!d_P) {
+      L<<Logger::Error<<"TCP worker is without backend connections, launching"<<endl;
+      d_P=std::unique_ptr<PacketHandler>(new PacketHandler);
+    }
+    bool shouldRecurse;
+
+    reply=shared_ptr<DNSPacket>(d_P->questionOrRecurse(packet.get(), &shouldRecurse)); // we really need to ask the backend :-)
+
+    if(LPE) LPE->police(&(*packet), &(*reply), true);
+
+    if(shouldRecurse) {
+      // this still blocks the worker for as long as the recursor takes
+      string answer=proxyQuestion(packet);
+      uint16_t len=htons(answer.length());
+      conn->d_out.append((const char*)&len, 2);
+      conn->d_out.append(answer);
+      return true;
+    }
+
+    if(!reply)  // unable to write an answer?
+      return false;
+
+    queueAnswer(conn, reply);
+    return true;
+  }
+
+  static void queueAnswer(Connection* conn, shared_ptr<DNSPacket> p)
+  {
+    g_rs.submitResponse(*p, false);
+
+    const string& buffer=p->getString();
+    uint16_t len=htons(buffer.length());
+    conn->d_out.append((const char*)&len, 2);
+    conn->d_out.append(buffer);
+  }
+
+  //! Hands conn over to a thread of its own for the zone transfer asked for in packet
+  void transfer(Connection* conn, shared_ptr<DNSPacket> packet)
+  {
+    d_fdm->removeReadFD(conn->d_fd);
+    auto job=new std::pair<Connection*, shared_ptr<DNSPacket> >(d_conns[conn->d_fd].release(), packet);
+    d_conns.erase(conn->d_fd);
+
+    pthread_t tid;
+    if(pthread_create(&tid, 0, &TCPNameserver::doTransfer, static_cast<void*>(job))) {
+      L<<Logger::Error<<"Error creating thread: "<<stringerror()<<endl;
+      delete job->first;
+      delete job;
+    }
+  }
+
+  //! Closes the connections that have not made progress within tcp-idle-timeout seconds
+  void expireIdle(time_t now)
+  {
+    for(auto iter=d_conns.begin(); iter != d_conns.end(); ) {
+      if(now - iter->second->d_lastActive <= d_idleTimeout) {
+        ++iter;
         continue;
       }
-      if(logDNSQueries)
-          L<<"packetcache MISS"<<endl;  
-      {
-        Lock l(&s_plock);
-        if(!s_P) {
-          L<<Logger::Error<<"TCP server is without backend connections, launching"<<endl;
-          s_P=new PacketHandler;
-        }
-        bool shouldRecurse;
+      if(iter->second->d_out.empty())
+        d_fdm->removeReadFD(iter->first);
+      else
+        d_fdm->removeWriteFD(iter->first);
+      iter=d_conns.erase(iter);
+    }
+  }
 
-        reply=shared_ptr<DNSPacket>(s_P->questionOrRecurse(packet.get(), &shouldRecurse)); // we really need to ask the backend :-)
+  int d_pipe[2];
+  std::unique_ptr<FDMultiplexer> d_fdm;
+  std::unique_ptr<PacketHandler> d_P;
+  map<int, std::unique_ptr<Connection> > d_conns;
+  time_t d_idleTimeout;
+};
 
-        if(LPE) LPE->police(&(*packet), &(*reply), true);
+void TCPNameserver::handOff(Connection* conn)
+{
+  s_workers[s_nextWorker++ % s_workers.size()]->add(conn);
+}
 
-        if(shouldRecurse) {
-          proxyQuestion(packet);
-          continue;
-        }
-      }
+void TCPNameserver::go()
+{
+  L<<Logger::Error<<"Creating backend connection for TCP"<<endl;
+  s_P=0;
+  try {
+    s_P=new PacketHandler;
+  }
+  catch(PDNSException &ae) {
+    L<<Logger::Error<<Logger::NTLog<<"TCP server is unable to launch backends - will try again when questions come in"<<endl;
+    L<<Logger::Error<<"TCP server is unable to launch backends - will try again when questions come in: "<<ae.reason<<endl;
+  }
+  for(auto worker : s_workers)
+    worker->start();
+  pthread_create(&d_tid, 0, launcher, static_cast<void *>(this));
+}
 
-      if(!reply)  // unable to write an answer?
-        break;
+/* A zone transfer goes out blocking, as it always did. Once it is done the connection
+   returns to a worker, which answers whatever the client sent in the meantime. */
+void *TCPNameserver::doTransfer(void *data)
+{
+  pthread_detach(pthread_self());
+  auto job=static_cast<std::pair<Connection*, shared_ptr<DNSPacket> >*>(data);
+  std::unique_ptr<Connection> conn(job->first);
+  shared_ptr<DNSPacket> packet=job->second;
+  delete job;
 
-      sendPacket(reply, fd);
-    }
+  try {
+    // answers to questions before this one go out first
+    if(conn->d_outPos < conn->d_out.size())
+      writenWithTimeout(conn->d_fd, conn->d_out.c_str() + conn->d_outPos, conn->d_out.size() - conn->d_outPos);
+    conn->d_out.clear();
+    conn->d_outPos=0;
+
+    S.inc("tcp-queries");
+    if(conn->d_remote.sin4.sin_family == AF_INET6)
+      S.inc("tcp6-queries");
+    else
+      S.inc("tcp4-queries");
+
+    int ret;
+    if(packet->qtype.getCode()==QType::AXFR)
+      ret=doAXFR(packet->qdomain, packet, conn->d_fd);
+    else
+      ret=doIXFR(packet, conn->d_fd);
+    if(ret)
+      incTCPAnswerCount(conn->d_remote);
+
+    handOff(conn.release());
   }
   catch(DBException &e) {
     Lock l(&s_plock);
@@ -389,8 +644,6 @@ void *TCPNameserver::doConnection(void *data)
   {
     L << Logger::Error << "TCP Connection Thread caught unknown exception." << endl;
   }
-  d_connectionroom_sem->post();
-  closesocket(fd);
 
   return 0;
 }
@@ -719,114 +972,53 @@ int TCPNameserver::doAXFR(const DNSName &target, shared_ptr<DNSPacket> q, int ou
     csp.submit(rr);
   }
   
+  const bool rectify = !(presignedZone || ::arg().mustDo("disable-axfr-rectify"));
+
+  /* Backends that list in canonical order let us send the zone while it is being read,
+     keeping only the NSEC3 hashes around. Presigned zones are not streamed: which of their
+     NSEC3s make it into the chain depends on signatures that can come anywhere in the zone. */
+  const bool streaming = !presignedZone && sd.db->listCanonical(target, sd.domain_id);
+
   // now start list zone
-  if(!(sd.db->list(target, sd.domain_id))) {  
+  if(!streaming && !(sd.db->list(target, sd.domain_id))) {  
     L<<Logger::Error<<"Backend signals error condition"<<endl;
     outpacket->setRcode(2); // 'SERVFAIL'
     sendPacket(outpacket,outsock);
     return 0;
   }
 
-
-  const bool rectify = !(presignedZone || ::arg().mustDo("disable-axfr-rectify"));
-  set<DNSName> qnames, nsset, terms;
-  vector<DNSResourceRecord> rrs;
-
-  // Add the CDNSKEY and CDS records we created earlier
-  for (auto const &rr : cds)
-    rrs.push_back(rr);
-
-  for (auto const &rr : cdnskey)
-    rrs.push_back(rr);
-
-  while(sd.db->get(rr)) {
-    if(rr.qname.isPartOf(target)) {
-      if (rectify) {
-        if (rr.qtype.getCode()) {
-          qnames.insert(rr.qname);
-          if(rr.qtype.getCode() == QType::NS && rr.qname!=target)
-            nsset.insert(rr.qname);
-        } else {
-          // remove existing ents
-          continue;
-        }
-      }
-      rrs.push_back(rr);
-    } else {
-      if (rr.qtype.getCode())
-        L<<Logger::Warning<<"Zone '"<<target<<"' contains out-of-zone data '"<<rr.qname<<"|"<<rr.qtype.getName()<<"', ignoring"<<endl;
-      continue;
-    }
-  }
-
-  if(rectify) {
-    // set auth
-    for(DNSResourceRecord &rr :  rrs) {
-      rr.auth=true;
-      if (rr.qtype.getCode() != QType::NS || rr.qname!=target) {
-        DNSName shorter(rr.qname);
-        do {
-          if (shorter==target) // apex is always auth
-            continue;
-          if(nsset.count(shorter) && !(rr.qname==shorter && rr.qtype.getCode() == QType::DS))
-            rr.auth=false;
-        } while(shorter.chopOff());
-      } else
-        continue;
-    }
-
-    if(NSEC3Zone) {
-      // ents are only required for NSEC3 zones
-      uint32_t maxent = ::arg().asNum("max-ent-entries");
-      map<DNSName,bool> nonterm;
-      for(DNSResourceRecord &rr :  rrs) {
-        DNSName shorter(rr.qname);
-        while(shorter != target && shorter.chopOff()) {
-          if(!qnames.count(shorter)) {
-            if(!(maxent)) {
-              L<<Logger::Warning<<"Zone '"<<target<<"' has too many empty non terminals."<<endl;
-              return 0;
-            }
-            if (!nonterm.count(shorter)) {
-              nonterm.insert(pair<DNSName, bool>(shorter, rr.auth));
-              --maxent;
-            } else if (rr.auth)
-              nonterm[shorter]=true;
-          }
-        }
-      }
-
-      for(const auto& nt :  nonterm) {
-        DNSResourceRecord rr;
-        rr.qname=nt.first;
-        rr.qtype="TYPE0";
-        rr.auth=(nt.second || !ns3pr.d_flags);
-        rrs.push_back(rr);
-      }
+  auto sendChunks = [&](bool flush) {
+    for(;;) {
+      outpacket->getRRS() = csp.getChunk(flush);
+      if(outpacket->getRRS().empty())
+        break;
+      if(!tsigkeyname.empty())
+        outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true);
+      sendPacket(outpacket, outsock);
+      trc.d_mac=outpacket->d_trc.d_mac;
+      outpacket=getFreshAXFRPacket(q);
     }
-  }
-
+  };
 
-  /* now write all other records */
-  
   string keyname;
   set<string> ns3rrs;
   unsigned int udiff;
   DTime dt;
   dt.set();
   int records=0;
-  for(DNSResourceRecord &rr :  rrs) {
+
+  auto writeRecord = [&](const DNSResourceRecord& rr) {
     if (rr.qtype.getCode() == QType::RRSIG) {
       RRSIGRecordContent rrc(rr.content);
       if(presignedZone && rrc.d_type == QType::NSEC3)
         ns3rrs.insert(fromBase32Hex(makeRelative(rr.qname.toString(), target.toString())));
-      continue;
+      return;
     }
 
     // only skip the DNSKEY, CDNSKEY and CDS if direct-dnskey is enabled, to avoid changing behaviour
     // when it is not enabled.
     if(::arg().mustDo("direct-dnskey") && (rr.qtype.getCode() == QType::DNSKEY || rr.qtype.getCode() == QType::CDNSKEY || rr.qtype.getCode() == QType::CDS))
-      continue;
+      return;
 
     records++;
     if(securedZone && (rr.auth || rr.qtype.getCode() == QType::NS)) {
@@ -842,25 +1034,222 @@ int TCPNameserver::doAXFR(const DNSName &target, shared_ptr<DNSPacket> q, int ou
     }
 
     if (!rr.qtype.getCode())
-      continue; // skip empty non-terminals
+      return; // skip empty non-terminals
 
     if(rr.qtype.getCode() == QType::SOA)
-      continue; // skip SOA - would indicate end of AXFR
-
-    if(csp.submit(rr)) {
-      for(;;) {
-        outpacket->getRRS() = csp.getChunk();
-        if(!outpacket->getRRS().empty()) {
-          if(!tsigkeyname.empty()) 
-            outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true);
-          sendPacket(outpacket, outsock);
-          trc.d_mac=outpacket->d_trc.d_mac;
-          outpacket=getFreshAXFRPacket(q);
+      return; // skip SOA - would indicate end of AXFR
+
+    if(csp.submit(rr))
+      sendChunks(false);
+  };
+
+  auto writeNSEC = [&](const DNSName& name, const NSECXEntry& entry, const DNSName& next) {
+    NSECRecordContent nrc;
+    nrc.d_set = entry.d_set;
+    nrc.d_set.insert(QType::RRSIG);
+    nrc.d_set.insert(QType::NSEC);
+    nrc.d_next = next;
+
+    DNSResourceRecord nsec;
+    nsec.qname = name;
+    nsec.ttl = sd.default_ttl;
+    nsec.content = nrc.getZoneRepresentation();
+    nsec.qtype = QType::NSEC;
+    nsec.d_place = DNSResourceRecord::ANSWER;
+    nsec.auth=true;
+    if(csp.submit(nsec))
+      sendChunks(false);
+  };
+
+  // Add the CDNSKEY and CDS records we created earlier
+  vector<DNSResourceRecord> rrs;
+  for (auto const &rr : cds)
+    rrs.push_back(rr);
+
+  for (auto const &rr : cdnskey)
+    rrs.push_back(rr);
+
+  if(streaming) {
+    /* All records of a name arrive together, and a name never before its ancestors. That
+       is all we need to set auth bits, spot empty non-terminals and write each NSEC as soon
+       as the next name is known. rrs holds the records of the name at hand. */
+    DNSName prev, cut, nsecName;
+    NSECXEntry nsecEntry;
+    struct PathEntry
+    {
+      DNSName name;
+      string entHash; //!< set if this is an empty non-terminal we made up
+    };
+    vector<PathEntry> path; // the names above the one at hand
+    uint32_t maxent = ::arg().asNum("max-ent-entries");
+
+    auto writeName = [&]() {
+      const DNSName name = rrs.front().qname;
+      if(!prev.empty() && !prev.canonCompare(name)) {
+        L<<Logger::Error<<"AXFR of domain '"<<target<<"' aborted: backend did not list it in canonical order, '"<<name<<"' came after '"<<prev<<"'"<<endl;
+        return false;
+      }
+      prev = name;
+
+      if(rectify) {
+        if(!cut.empty() && !name.isPartOf(cut))
+          cut.clear();
+        bool isCut = false;
+        if(name != target)
+          for(const auto& rr : rrs)
+            if(rr.qtype.getCode() == QType::NS)
+              isCut = true;
+        for(auto& rr : rrs)
+          rr.auth = cut.empty() && (!isCut || rr.qtype.getCode() == QType::DS);
+        if(cut.empty() && isCut)
+          cut = name;
+
+        if(NSEC3Zone) {
+          // ents are only required for NSEC3 zones
+          while(!path.empty() && !name.isPartOf(path.back().name))
+            path.pop_back();
+          const DNSName& above = path.empty() ? target : path.back().name;
+          vector<DNSName> ents;
+          DNSName shorter(name);
+          while(shorter.chopOff() && shorter != above && shorter.isPartOf(above))
+            ents.push_back(shorter);
+          for(auto ent = ents.rbegin(); ent != ents.rend(); ++ent) {
+            if(!(maxent)) {
+              L<<Logger::Warning<<"Zone '"<<target<<"' has too many empty non terminals."<<endl;
+              return false;
+            }
+            --maxent;
+            DNSResourceRecord rr;
+            rr.qname=*ent;
+            rr.qtype="TYPE0";
+            rr.auth=!ns3pr.d_flags;
+            writeRecord(rr);
+            path.push_back({*ent, hashQNameWithSalt(ns3pr, *ent)});
+          }
+          path.push_back({name, string()});
+
+          // an empty non-terminal is auth if anything below it is
+          bool anyAuth = false;
+          for(const auto& rr : rrs)
+            anyAuth = anyAuth || rr.auth;
+          if(anyAuth && securedZone) {
+            for(const auto& entry : path) {
+              if(entry.entHash.empty())
+                continue;
+              NSECXEntry& ne = nsecxrepo[entry.entHash];
+              ne.d_ttl = sd.default_ttl;
+              ne.d_auth = true;
+            }
+          }
         }
-        else
-          break;
       }
+
+      for(const auto& rr : rrs)
+        writeRecord(rr);
+      rrs.clear();
+
+      if(securedZone && !NSEC3Zone) {
+        auto iter = nsecxrepo.find(labelReverse(name.toString()));
+        if(iter != nsecxrepo.end()) {
+          if(!nsecName.empty())
+            writeNSEC(nsecName, nsecEntry, name);
+          nsecName = name;
+          nsecEntry = iter->second;
+          nsecxrepo.erase(iter);
+        }
+      }
+      return true;
+    };
+
+    while(sd.db->get(rr)) {
+      if(!rr.qname.isPartOf(target)) {
+        if (rr.qtype.getCode())
+          L<<Logger::Warning<<"Zone '"<<target<<"' contains out-of-zone data '"<<rr.qname<<"|"<<rr.qtype.getName()<<"', ignoring"<<endl;
+        continue;
+      }
+      if(rectify && !rr.qtype.getCode())
+        continue; // remove existing ents
+      if(!rrs.empty() && rr.qname != rrs.front().qname && !writeName())
+        return 0;
+      rrs.push_back(rr);
     }
+    if(!rrs.empty() && !writeName())
+      return 0;
+    if(!nsecName.empty())
+      writeNSEC(nsecName, nsecEntry, target);
+  }
+  else {
+    set<DNSName> qnames, nsset, terms;
+
+    while(sd.db->get(rr)) {
+      if(rr.qname.isPartOf(target)) {
+        if (rectify) {
+          if (rr.qtype.getCode()) {
+            qnames.insert(rr.qname);
+            if(rr.qtype.getCode() == QType::NS && rr.qname!=target)
+              nsset.insert(rr.qname);
+          } else {
+            // remove existing ents
+            continue;
+          }
+        }
+        rrs.push_back(rr);
+      } else {
+        if (rr.qtype.getCode())
+          L<<Logger::Warning<<"Zone '"<<target<<"' contains out-of-zone data '"<<rr.qname<<"|"<<rr.qtype.getName()<<"', ignoring"<<endl;
+        continue;
+      }
+    }
+
+    if(rectify) {
+      // set auth
+      for(DNSResourceRecord &rr :  rrs) {
+        rr.auth=true;
+        if (rr.qtype.getCode() != QType::NS || rr.qname!=target) {
+          DNSName shorter(rr.qname);
+          do {
+            if (shorter==target) // apex is always auth
+              continue;
+            if(nsset.count(shorter) && !(rr.qname==shorter && rr.qtype.getCode() == QType::DS))
+              rr.auth=false;
+          } while(shorter.chopOff());
+        } else
+          continue;
+      }
+
+      if(NSEC3Zone) {
+        // ents are only required for NSEC3 zones
+        uint32_t maxent = ::arg().asNum("max-ent-entries");
+        map<DNSName,bool> nonterm;
+        for(DNSResourceRecord &rr :  rrs) {
+          DNSName shorter(rr.qname);
+          while(shorter != target && shorter.chopOff()) {
+            if(!qnames.count(shorter)) {
+              if(!(maxent)) {
+                L<<Logger::Warning<<"Zone '"<<target<<"' has too many empty non terminals."<<endl;
+                return 0;
+              }
+              if (!nonterm.count(shorter)) {
+                nonterm.insert(pair<DNSName, bool>(shorter, rr.auth));
+                --maxent;
+              } else if (rr.auth)
+                nonterm[shorter]=true;
+            }
+          }
+        }
+
+        for(const auto& nt :  nonterm) {
+          DNSResourceRecord rr;
+          rr.qname=nt.first;
+          rr.qtype="TYPE0";
+          rr.auth=(nt.second || !ns3pr.d_flags);
+          rrs.push_back(rr);
+        }
+      }
+    }
+
+    for(const DNSResourceRecord &rr :  rrs)
+      writeRecord(rr);
   }
   /*
   udiff=dt.udiffNoReset();
@@ -898,55 +1287,16 @@ int TCPNameserver::doAXFR(const DNSName &target, shared_ptr<DNSPacket> q, int ou
           rr.qtype = QType::NSEC3;
           rr.d_place = DNSResourceRecord::ANSWER;
           rr.auth=true;
-          if(csp.submit(rr)) {
-            for(;;) {
-              outpacket->getRRS() = csp.getChunk();
-              if(!outpacket->getRRS().empty()) {
-                if(!tsigkeyname.empty())
-                  outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true);
-                sendPacket(outpacket, outsock);
-                trc.d_mac=outpacket->d_trc.d_mac;
-                outpacket=getFreshAXFRPacket(q);
-              }
-              else
-                break;
-            }
-          }
+          if(csp.submit(rr))
+            sendChunks(false);
         }
       }
     }
     else for(nsecxrepo_t::const_iterator iter = nsecxrepo.begin(); iter != nsecxrepo.end(); ++iter) {
-      NSECRecordContent nrc;
-      nrc.d_set = iter->second.d_set;
-      nrc.d_set.insert(QType::RRSIG);
-      nrc.d_set.insert(QType::NSEC);
-      if(boost::next(iter) != nsecxrepo.end()) {
-        nrc.d_next = DNSName(labelReverse(boost::next(iter)->first));
-      }
-      else
-        nrc.d_next=DNSName(labelReverse(nsecxrepo.begin()->first));
-  
-      rr.qname = DNSName(labelReverse(iter->first));
-  
-      rr.ttl = sd.default_ttl;
-      rr.content = nrc.getZoneRepresentation();
-      rr.qtype = QType::NSEC;
-      rr.d_place = DNSResourceRecord::ANSWER;
-      rr.auth=true;
-      if(csp.submit(rr)) {
-        for(;;) {
-          outpacket->getRRS() = csp.getChunk();
-          if(!outpacket->getRRS().empty()) {
-            if(!tsigkeyname.empty())
-              outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true); 
-            sendPacket(outpacket, outsock);
-            trc.d_mac=outpacket->d_trc.d_mac;
-            outpacket=getFreshAXFRPacket(q);
-          }
-          else
-            break;
-        }
-      }
+      nsecxrepo_t::const_iterator inext = boost::next(iter);
+      if(inext == nsecxrepo.end())
+        inext = nsecxrepo.begin();
+      writeNSEC(DNSName(labelReverse(iter->first)), iter->second, DNSName(labelReverse(inext->first)));
     }
   }
   /*
@@ -955,18 +1305,7 @@ int TCPNameserver::doAXFR(const DNSName &target, shared_ptr<DNSPacket> q, int ou
   cerr<<"Outstanding: "<<csp.d_outstanding<<", "<<csp.d_queued - csp.d_signed << endl;
   cerr<<"Ready for consumption: "<<csp.getReady()<<endl;
   * */
-  for(;;) { 
-    outpacket->getRRS() = csp.getChunk(true); // flush the pipe
-    if(!outpacket->getRRS().empty()) {
-      if(!tsigkeyname.empty())
-        outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true); // first answer is 'normal'
-      sendPacket(outpacket, outsock);
-      trc.d_mac=outpacket->d_trc.d_mac;
-      outpacket=getFreshAXFRPacket(q);
-    }
-    else 
-      break;
-  }
+  sendChunks(true); // flush the pipe
   
   udiff=dt.udiffNoReset();
   if(securedZone) 
@@ -1121,6 +1460,13 @@ TCPNameserver::TCPNameserver()
   d_connectionroom_sem = new Semaphore( ::arg().asNum( "max-tcp-connections" ));
   d_tid=0;
   s_timeout=10;
+
+  unsigned int workers=::arg().asNum("tcp-worker-threads");
+  if(workers < 1)
+    workers=1;
+  for(unsigned int n=0; n < workers; ++n)
+    s_workers.push_back(new Worker());
+
   vector<string>locals;
   stringtok(locals,::arg()["local-address"]," ,");
 
@@ -1220,13 +1566,13 @@ TCPNameserver::TCPNameserver()
 }
 
 
-//! Start of TCP operations thread, we launch a new thread for each incoming TCP question
+//! Start of TCP operations thread, we accept connections here and hand them to the workers
 void TCPNameserver::thread()
 {
   try {
     for(;;) {
       int fd;
-      struct sockaddr_in remote;
+      ComboAddress remote;
       Utility::socklen_t addrlen=sizeof(remote);
 
       int ret=poll(&d_prfds[0], d_prfds.size(), -1); // blocks, forever if need be
@@ -1248,7 +1594,6 @@ void TCPNameserver::thread()
             }
           }
           else {
-            pthread_t tid;
             d_connectionroom_sem->wait(); // blocks if no connections are available
 
             int room;
@@ -1256,10 +1601,10 @@ void TCPNameserver::thread()
             if(room<1)
               L<<Logger::Warning<<Logger::NTLog<<"Limit of simultaneous TCP connections reached - raise max-tcp-connections"<<endl;
 
-            if(pthread_create(&tid, 0, &doConnection, reinterpret_cast<void*>(fd))) {
-              L<<Logger::Error<<"Error creating thread: "<<stringerror()<<endl;
-              d_connectionroom_sem->post();
-            }
+            DLOG(L<<"TCP Connection accepted on fd "<<fd<<endl);
+            setNonBlocking(fd);
+            setCloseOnExec(fd);
+            handOff(new Connection(fd, remote));
           }
         }
       }
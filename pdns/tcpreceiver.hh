@@ -26,6 +26,7 @@
 #include "iputils.hh"
 #include "dnsbackend.hh"
 #include "packethandler.hh"
+#include <atomic>
 #include <vector>
 
 #include <poll.h>
@@ -41,6 +42,8 @@
 
 #include "namespaces.hh"
 
+class FDMultiplexer;
+
 class TCPNameserver
 {
 public:
@@ -49,13 +52,15 @@ public:
   void go();
 private:
 
+  struct Connection;
+  class Worker;
+
   static void sendPacket(std::shared_ptr<DNSPacket> p, int outsock);
-  static int readLength(int fd, ComboAddress *remote);
-  static void getQuestion(int fd, char *mesg, int pktlen, const ComboAddress& remote);
   static int doAXFR(const DNSName &target, std::shared_ptr<DNSPacket> q, int outsock);
   static int doIXFR(std::shared_ptr<DNSPacket> q, int outsock);
   static bool canDoAXFR(std::shared_ptr<DNSPacket> q);
-  static void *doConnection(void *data);
+  static void *doTransfer(void *data);
+  static void handOff(Connection* conn);
   static void *launcher(void *data);
   void thread(void);
   static pthread_mutex_t s_plock;
@@ -63,6 +68,8 @@ private:
   pthread_t d_tid;
   static Semaphore *d_connectionroom_sem;
   static NetmaskGroup d_ng;
+  static vector<Worker*> s_workers;
+  static std::atomic<unsigned int> s_nextWorker;
 
   vector<int>d_sockets;
   vector<struct pollfd> d_prfds;
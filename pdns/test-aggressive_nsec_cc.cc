@@ -0,0 +1,178 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include "aggressive_nsec.hh"
+#include "base32.hh"
+#include "dnssecinfra.hh"
+#include "dnsname.hh"
+#include "dnsrecords.hh"
+
+BOOST_AUTO_TEST_SUITE(aggressive_nsec_cc)
+
+static DNSRecord makeNSEC(const DNSName& owner, const DNSName& next, const std::set<uint16_t>& types)
+{
+  auto content = std::make_shared<NSECRecordContent>();
+  content->d_next = next;
+  content->d_set = types;
+
+  DNSRecord dr;
+  dr.d_name = owner;
+  dr.d_type = QType::NSEC;
+  dr.d_ttl = 3600;
+  dr.d_content = content;
+  dr.d_place = DNSResourceRecord::AUTHORITY;
+  return dr;
+}
+
+static std::string hashName(const DNSName& name)
+{
+  NSEC3PARAMRecordContent params;
+  params.d_algorithm = 1;
+  params.d_iterations = 1;
+  params.d_salt = "salt";
+  return hashQNameWithSalt(params, name);
+}
+
+static DNSRecord makeNSEC3(const DNSName& zone, const std::string& hash, const std::string& nextHash, const std::set<uint16_t>& types, bool optOut=false)
+{
+  auto content = std::make_shared<NSEC3RecordContent>();
+  content->d_algorithm = 1;
+  content->d_flags = optOut ? 1 : 0;
+  content->d_iterations = 1;
+  content->d_salt = "salt";
+  content->d_nexthash = nextHash;
+  content->d_set = types;
+
+  DNSRecord dr;
+  dr.d_name = DNSName(toBase32Hex(hash)) + zone;
+  dr.d_type = QType::NSEC3;
+  dr.d_ttl = 3600;
+  dr.d_content = content;
+  dr.d_place = DNSResourceRecord::AUTHORITY;
+  return dr;
+}
+
+BOOST_AUTO_TEST_CASE(test_AggressiveNSECCacheNSEC) {
+  AggressiveNSECCache cache;
+  const DNSName zone("example.org.");
+  const time_t now = time(nullptr);
+  const uint32_t ttd = now + 3600;
+  vector<DNSRecord> signatures;
+
+  cache.insert(zone, makeNSEC(zone, DNSName("a.example.org."), {QType::SOA, QType::NS, QType::NSEC, QType::RRSIG, QType::DNSKEY}), signatures, ttd);
+  cache.insert(zone, makeNSEC(DNSName("a.example.org."), DNSName("c.example.org."), {QType::A, QType::NSEC, QType::RRSIG}), signatures, ttd);
+  cache.insert(zone, makeNSEC(DNSName("c.example.org."), DNSName("del.example.org."), {QType::A, QType::NSEC, QType::RRSIG}), signatures, ttd);
+  cache.insert(zone, makeNSEC(DNSName("del.example.org."), DNSName("d.sub.example.org."), {QType::NS, QType::NSEC, QType::RRSIG}), signatures, ttd);
+  cache.insert(zone, makeNSEC(DNSName("d.sub.example.org."), zone, {QType::A, QType::NSEC, QType::RRSIG}), signatures, ttd);
+  BOOST_CHECK_EQUAL(cache.size(), 5);
+
+  int res;
+  DNSName found;
+  uint32_t foundTTD;
+  vector<DNSRecord> proof;
+
+  /* b is covered by a -> c, the wildcard by the apex NSEC */
+  BOOST_CHECK(cache.getDenial(now, DNSName("b.example.org."), QType(QType::A), res, found, foundTTD, proof));
+  BOOST_CHECK_EQUAL(res, RCode::NXDomain);
+  BOOST_CHECK_EQUAL(found, zone);
+  BOOST_CHECK_EQUAL(foundTTD, ttd);
+  BOOST_CHECK_EQUAL(proof.size(), 2);
+  for(const auto& rec : proof)
+    BOOST_CHECK_EQUAL(rec.d_ttl, 3600);
+
+  /* NODATA */
+  proof.clear();
+  BOOST_CHECK(cache.getDenial(now, DNSName("a.example.org."), QType(QType::AAAA), res, found, foundTTD, proof));
+  BOOST_CHECK_EQUAL(res, RCode::NoError);
+  BOOST_CHECK_EQUAL(proof.size(), 1);
+  BOOST_CHECK(!cache.getDenial(now, DNSName("a.example.org."), QType(QType::A), res, found, foundTTD, proof));
+  /* the name exists, ANY is for the record cache to answer */
+  BOOST_CHECK(!cache.getDenial(now, DNSName("a.example.org."), QType(QType::ANY), res, found, foundTTD, proof));
+  BOOST_CHECK(!cache.getDenial(now, zone, QType(QType::ANY), res, found, foundTTD, proof));
+
+  /* sub.example.org is an empty non-terminal */
+  proof.clear();
+  BOOST_CHECK(cache.getDenial(now, DNSName("sub.example.org."), QType(QType::A), res, found, foundTTD, proof));
+  BOOST_CHECK_EQUAL(res, RCode::NoError);
+
+  /* below a delegation, only its DS is ours to deny */
+  BOOST_CHECK(!cache.getDenial(now, DNSName("www.del.example.org."), QType(QType::A), res, found, foundTTD, proof));
+  BOOST_CHECK(!cache.getDenial(now, DNSName("del.example.org."), QType(QType::A), res, found, foundTTD, proof));
+  proof.clear();
+  BOOST_CHECK(cache.getDenial(now, DNSName("del.example.org."), QType(QType::DS), res, found, foundTTD, proof));
+  BOOST_CHECK_EQUAL(res, RCode::NoError);
+
+  /* names outside of the zone, and expired entries */
+  BOOST_CHECK(!cache.getDenial(now, DNSName("b.example.net."), QType(QType::A), res, found, foundTTD, proof));
+  BOOST_CHECK(!cache.getDenial(ttd, DNSName("b.example.org."), QType(QType::A), res, found, foundTTD, proof));
+
+  BOOST_CHECK_EQUAL(cache.wipe(DNSName("org."), false), 0);
+  BOOST_CHECK_EQUAL(cache.wipe(DNSName("org."), true), 5);
+  BOOST_CHECK_EQUAL(cache.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_AggressiveNSECCacheWildcard) {
+  AggressiveNSECCache cache;
+  const DNSName zone("example.org.");
+  const time_t now = time(nullptr);
+  const uint32_t ttd = now + 3600;
+  vector<DNSRecord> signatures;
+
+  cache.insert(zone, makeNSEC(zone, DNSName("*.example.org."), {QType::SOA, QType::NS, QType::NSEC, QType::RRSIG, QType::DNSKEY}), signatures, ttd);
+  cache.insert(zone, makeNSEC(DNSName("*.example.org."), DNSName("c.example.org."), {QType::A, QType::NSEC, QType::RRSIG}), signatures, ttd);
+  cache.insert(zone, makeNSEC(DNSName("c.example.org."), zone, {QType::A, QType::NSEC, QType::RRSIG}), signatures, ttd);
+
+  int res;
+  DNSName found;
+  uint32_t foundTTD;
+  vector<DNSRecord> proof;
+  /* b is covered, but the wildcard would answer for it */
+  BOOST_CHECK(!cache.getDenial(now, DNSName("b.example.org."), QType(QType::A), res, found, foundTTD, proof));
+  BOOST_CHECK(proof.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_AggressiveNSECCacheNSEC3) {
+  AggressiveNSECCache cache;
+  const DNSName zone("example.com.");
+  const time_t now = time(nullptr);
+  const uint32_t ttd = now + 3600;
+  vector<DNSRecord> signatures;
+
+  std::string apexHash = hashName(zone);
+  std::string wwwHash = hashName(DNSName("www.example.com."));
+  std::set<uint16_t> apexTypes{QType::SOA, QType::NS, QType::DNSKEY, QType::NSEC3PARAM, QType::RRSIG};
+  std::set<uint16_t> wwwTypes{QType::A, QType::RRSIG};
+  cache.insert(zone, makeNSEC3(zone, apexHash, wwwHash, apexTypes), signatures, ttd);
+  cache.insert(zone, makeNSEC3(zone, wwwHash, apexHash, wwwTypes), signatures, ttd);
+  BOOST_CHECK_EQUAL(cache.size(), 2);
+
+  int res;
+  DNSName found;
+  uint32_t foundTTD;
+  vector<DNSRecord> proof;
+
+  BOOST_CHECK(cache.getDenial(now, DNSName("nx.example.com."), QType(QType::A), res, found, foundTTD, proof));
+  BOOST_CHECK_EQUAL(res, RCode::NXDomain);
+  BOOST_CHECK_EQUAL(found, zone);
+  BOOST_CHECK(proof.size() >= 1 && proof.size() <= 2);
+
+  proof.clear();
+  BOOST_CHECK(cache.getDenial(now, DNSName("www.example.com."), QType(QType::AAAA), res, found, foundTTD, proof));
+  BOOST_CHECK_EQUAL(res, RCode::NoError);
+  BOOST_CHECK_EQUAL(proof.size(), 1);
+  BOOST_CHECK(!cache.getDenial(now, DNSName("www.example.com."), QType(QType::A), res, found, foundTTD, proof));
+  BOOST_CHECK(!cache.getDenial(now, DNSName("www.example.com."), QType(QType::ANY), res, found, foundTTD, proof));
+  BOOST_CHECK(!cache.getDenial(now, zone, QType(QType::ANY), res, found, foundTTD, proof));
+
+  /* with opt-out, an insecure delegation might be hiding in the range */
+  cache.clear();
+  cache.insert(zone, makeNSEC3(zone, apexHash, wwwHash, apexTypes, true), signatures, ttd);
+  cache.insert(zone, makeNSEC3(zone, wwwHash, apexHash, wwwTypes, true), signatures, ttd);
+  BOOST_CHECK(!cache.getDenial(now, DNSName("nx.example.com."), QType(QType::A), res, found, foundTTD, proof));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -38,12 +38,17 @@ static void report(DNSPacket* A)
   g_receivedAnswers++;
 }
 
-BOOST_AUTO_TEST_CASE(test_distributor_basic) {
+static void declareDistributorSettings()
+{
   ::arg().set("overload-queue-length","Maximum queuelength moving to packetcache only")="0";
   ::arg().set("max-queue-length","Maximum queuelength before considering situation lost")="5000";
   ::arg().set("queue-limit","Maximum number of milliseconds to queue a query")="1500";
   S.declare("servfail-packets","Number of times a server-failed packet was sent out");
   S.declare("timedout-packets", "timedout-packets");
+}
+
+BOOST_AUTO_TEST_CASE(test_distributor_basic) {
+  declareDistributorSettings();
 
   auto d=Distributor<DNSPacket, Question, Backend>::Create(2);
 
@@ -57,6 +62,24 @@ BOOST_AUTO_TEST_CASE(test_distributor_basic) {
   BOOST_CHECK_EQUAL(n, g_receivedAnswers);
 };
 
+BOOST_AUTO_TEST_CASE(test_distributor_wakeup) {
+  auto d=Distributor<DNSPacket, Question, Backend>::Create(2);
+  g_receivedAnswers=0;
+
+  /* one question at a time, so that every one of them arrives while the backend threads are parking,
+     or asleep. One that gets lost between the two would not be answered at all */
+  for(int n=0; n < 10000; ++n) {
+    auto q = new Question();
+    q->d_dt.set();
+    d->question(q, report);
+    DTime dt;
+    dt.set();
+    while(g_receivedAnswers != n + 1 && dt.udiffNoReset() < 1000000)
+      ;
+    BOOST_REQUIRE_EQUAL(g_receivedAnswers, n + 1);
+  }
+};
+
 struct BackendSlow
 {
   DNSPacket* question(Question*)
@@ -80,6 +103,52 @@ BOOST_AUTO_TEST_CASE(test_distributor_queue) {
     }, DistributorFatal, [](DistributorFatal) { return true; });
 };
 
+struct BackendStuck
+{
+  BackendStuck()
+  {
+    d_ourcount=s_count++;
+  }
+  DNSPacket* question(Question*)
+  {
+    if(!d_ourcount && !d_stuck) {
+      d_stuck = true;
+      sleep(2);
+    }
+    return new DNSPacket();
+  }
+  static std::atomic<int> s_count;
+  int d_ourcount;
+  bool d_stuck{false};
+};
+
+std::atomic<int> BackendStuck::s_count;
+
+std::atomic<int> g_receivedAnswers3;
+
+static void report3(DNSPacket* A)
+{
+  delete A;
+  g_receivedAnswers3++;
+}
+
+BOOST_AUTO_TEST_CASE(test_distributor_stuck) {
+  auto d=Distributor<DNSPacket, Question, BackendStuck>::Create(2);
+
+  /* the first backend thread gets stuck on its first question, the other one should
+     take care of everything else, including what was queued for the stuck one */
+  for(int n=0; n < 100; ++n)  {
+    auto q = new Question();
+    q->d_dt.set();
+    d->question(q, report3);
+  }
+  usleep(500000);
+  BOOST_CHECK_GE(g_receivedAnswers3, 99);
+  sleep(2);
+  BOOST_CHECK_EQUAL(g_receivedAnswers3, 100);
+  BOOST_CHECK_EQUAL(d->getQueueSize(), 0);
+};
+
 struct BackendDies
 {
   BackendDies()
@@ -140,5 +209,54 @@ BOOST_AUTO_TEST_CASE(test_distributor_dies) {
 };
 
 
+struct BackendFails
+{
+  DNSPacket* question(Question*)
+  {
+    throw runtime_error("backend failure");
+  }
+};
+
+std::atomic<int> g_receivedServfails;
+
+static void reportServfail(DNSPacket* A)
+{
+  if(A->d.rcode == RCode::ServFail)
+    g_receivedServfails++;
+  delete A;
+}
+
+BOOST_AUTO_TEST_CASE(test_distributor_servfail_ring) {
+  declareDistributorSettings();
+  // as common_startup.cc declares them, the rings are on whenever the webserver is
+  if(!S.ringExists("logmessages"))
+    S.declareRing("logmessages","Log Messages");
+  if(!S.ringExists("servfail-queries"))
+    S.declareQuestionRing("servfail-queries","Queries that could not be answered due to backend errors");
+  S.doRings();
+
+  for(int threads : {1, 2}) {
+    auto d=Distributor<DNSPacket, Question, BackendFails>::Create(threads);
+    g_receivedServfails=0;
+    S.resetRing("servfail-queries");
+
+    for(int n=0; n < 10; ++n) {
+      auto q = new Question();
+      q->d_dt.set();
+      q->qdomain=DNSName("servfail.example.org.");
+      d->question(q, reportServfail);
+    }
+    DTime dt;
+    dt.set();
+    while(g_receivedServfails != 10 && dt.udiffNoReset() < 1000000)
+      ;
+    BOOST_CHECK_EQUAL(g_receivedServfails, 10);
+
+    auto ring = S.getRing("servfail-queries");
+    BOOST_REQUIRE_EQUAL(ring.size(), 1);
+    BOOST_CHECK_EQUAL(ring.at(0).first, "servfail.example.org.");
+    BOOST_CHECK_EQUAL(ring.at(0).second, 10);
+  }
+};
 
 BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,244 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist-cache.hh"
+#include "dnsname.hh"
+#include "dnsparser.hh"
+#include "dnswriter.hh"
+#include "dnsrecords.hh"
+
+BOOST_AUTO_TEST_SUITE(dnsdistpacketcache_cc)
+
+static void makeQuery(vector<uint8_t>& query, const DNSName& qname, uint16_t qtype, uint16_t id, bool rd)
+{
+  DNSPacketWriter pw(query, qname, qtype, QClass::IN, 0);
+  pw.getHeader()->rd = rd;
+  pw.getHeader()->id = id;
+}
+
+static void makeResponse(vector<uint8_t>& response, const DNSName& qname, uint16_t qtype, uint16_t id, bool rd, uint32_t ttl)
+{
+  DNSPacketWriter pwR(response, qname, qtype, QClass::IN, 0);
+  pwR.getHeader()->rd = rd;
+  pwR.getHeader()->qr = 1;
+  pwR.getHeader()->id = id;
+  pwR.startRecord(qname, QType::A, ttl, QClass::IN, DNSResourceRecord::ANSWER, true);
+  pwR.xfr32BitInt(0x01020304);
+  pwR.commit();
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheSimple) {
+  DNSDistPacketCache PC(30000);
+
+  size_t counter=0;
+  size_t skipped=0;
+  try {
+    for(counter = 0; counter < 1000; ++counter) {
+      DNSName a=DNSName("hello ")+DNSName(std::to_string(counter));
+
+      vector<uint8_t> query;
+      makeQuery(query, a, QType::A, 42, true);
+      vector<uint8_t> response;
+      makeResponse(response, a, QType::A, 42, true, 3600);
+
+      char responseBuf[4096];
+      uint16_t responseBufSize = sizeof(responseBuf);
+      DNSDistPacketCache::CacheKey key;
+      unsigned int consumed = 0;
+      uint16_t qtype, qclass;
+      DNSName qname((const char*) query.data(), query.size(), sizeof(dnsheader), false, &qtype, &qclass, &consumed);
+      bool found = PC.get((const char*) query.data(), query.size(), qname, qtype, qclass, consumed, responseBuf, &responseBufSize, &key);
+      BOOST_CHECK_EQUAL(found, false);
+
+      PC.insert(key, qname, qtype, qclass, (const char*) response.data(), response.size());
+
+      responseBufSize = sizeof(responseBuf);
+      found = PC.get((const char*) query.data(), query.size(), qname, qtype, qclass, consumed, responseBuf, &responseBufSize, &key, true);
+      if (found == true) {
+        BOOST_CHECK_EQUAL(responseBufSize, response.size());
+        BOOST_CHECK(memcmp(responseBuf, response.data(), responseBufSize) == 0);
+      }
+      else {
+        skipped++;
+      }
+    }
+
+    BOOST_CHECK_EQUAL(skipped, PC.getInsertCollisions());
+    BOOST_CHECK_EQUAL(PC.getSize(), counter - skipped);
+
+    size_t deleted=0;
+    size_t delcounter=0;
+    for(delcounter=0; delcounter < counter/1000; ++delcounter) {
+      DNSName a=DNSName("hello ")+DNSName(std::to_string(delcounter));
+      vector<uint8_t> query;
+      makeQuery(query, a, QType::A, 42, true);
+      char responseBuf[4096];
+      uint16_t responseBufSize = sizeof(responseBuf);
+      DNSDistPacketCache::CacheKey key;
+      unsigned int consumed = 0;
+      uint16_t qtype, qclass;
+      DNSName qname((const char*) query.data(), query.size(), sizeof(dnsheader), false, &qtype, &qclass, &consumed);
+      if(PC.get((const char*) query.data(), query.size(), qname, qtype, qclass, consumed, responseBuf, &responseBufSize, &key)) {
+        PC.expungeByName(a);
+        deleted++;
+      }
+    }
+    BOOST_CHECK_EQUAL(PC.getSize(), counter - skipped - deleted);
+
+    PC.expunge();
+    BOOST_CHECK_EQUAL(PC.getSize(), 0);
+  }
+  catch(PDNSException& e) {
+    cerr<<"Had error: "<<e.reason<<endl;
+    throw;
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheKeyFields) {
+  DNSDistPacketCache PC(1000);
+
+  const DNSName name("www.PowerDNS.com.");
+  vector<uint8_t> query;
+  makeQuery(query, name, QType::A, 42, true);
+  vector<uint8_t> response;
+  makeResponse(response, name, QType::A, 42, true, 3600);
+
+  unsigned int consumed = 0;
+  uint16_t qtype, qclass;
+  DNSName qname((const char*) query.data(), query.size(), sizeof(dnsheader), false, &qtype, &qclass, &consumed);
+  char responseBuf[4096];
+  uint16_t responseBufSize = sizeof(responseBuf);
+  DNSDistPacketCache::CacheKey key;
+  BOOST_CHECK(!PC.get((const char*) query.data(), query.size(), qname, qtype, qclass, consumed, responseBuf, &responseBufSize, &key));
+  PC.insert(key, qname, qtype, qclass, (const char*) response.data(), response.size());
+  BOOST_CHECK_EQUAL(PC.getSize(), 1);
+
+  /* same question in a different case, with a different ID: hit, with the ID and the case of the new query */
+  {
+    const DNSName otherCase("WWW.powerdns.COM.");
+    vector<uint8_t> other;
+    makeQuery(other, otherCase, QType::A, 4242, true);
+    DNSName oqname((const char*) other.data(), other.size(), sizeof(dnsheader), false, &qtype, &qclass, &consumed);
+    responseBufSize = sizeof(responseBuf);
+    BOOST_REQUIRE(PC.get((const char*) other.data(), other.size(), oqname, qtype, qclass, consumed, responseBuf, &responseBufSize, &key));
+    MOADNSParser mdp(responseBuf, responseBufSize);
+    BOOST_CHECK_EQUAL(mdp.d_header.id, 4242);
+    BOOST_CHECK_EQUAL(mdp.d_qname.toString(), "WWW.powerdns.COM.");
+    BOOST_CHECK_EQUAL(mdp.d_answers.size(), 1);
+    BOOST_CHECK_LE(mdp.d_answers.at(0).first.d_ttl, 3600);
+  }
+
+  /* the response may be written over the query itself */
+  {
+    vector<uint8_t> other;
+    makeQuery(other, name, QType::A, 1234, true);
+    other.resize(4096);
+    DNSName oqname((const char*) other.data(), other.size(), sizeof(dnsheader), false, &qtype, &qclass, &consumed);
+    responseBufSize = other.size();
+    BOOST_REQUIRE(PC.get((const char*) other.data(), sizeof(dnsheader) + consumed + 4, oqname, qtype, qclass, consumed, (char*) other.data(), &responseBufSize, &key));
+    MOADNSParser mdp((const char*) other.data(), responseBufSize);
+    BOOST_CHECK_EQUAL(mdp.d_header.id, 1234);
+    BOOST_CHECK_EQUAL(mdp.d_qname, name);
+  }
+
+  /* different qtype or RD bit: miss */
+  {
+    vector<uint8_t> other;
+    makeQuery(other, name, QType::AAAA, 42, true);
+    DNSName oqname((const char*) other.data(), other.size(), sizeof(dnsheader), false, &qtype, &qclass, &consumed);
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK(!PC.get((const char*) other.data(), other.size(), oqname, qtype, qclass, consumed, responseBuf, &responseBufSize, &key));
+  }
+  {
+    vector<uint8_t> other;
+    makeQuery(other, name, QType::A, 42, false);
+    DNSName oqname((const char*) other.data(), other.size(), sizeof(dnsheader), false, &qtype, &qclass, &consumed);
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK(!PC.get((const char*) other.data(), other.size(), oqname, qtype, qclass, consumed, responseBuf, &responseBufSize, &key));
+  }
+
+  /* a buffer too small for the response is a miss */
+  {
+    responseBufSize = sizeof(dnsheader);
+    BOOST_CHECK(!PC.get((const char*) query.data(), query.size(), qname, QType::A, QClass::IN, consumed, responseBuf, &responseBufSize, &key));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheDNSSECOK) {
+  DNSDistPacketCache PC(1000);
+
+  const DNSName name("do.powerdns.com.");
+  vector<uint8_t> query;
+  makeQuery(query, name, QType::A, 42, true);
+  vector<uint8_t> doQuery;
+  {
+    DNSPacketWriter pw(doQuery, name, QType::A, QClass::IN, 0);
+    pw.getHeader()->rd = 1;
+    pw.getHeader()->id = 42;
+    DNSPacketWriter::optvect_t opts;
+    pw.addOpt(4096, 0, EDNSOpts::DNSSECOK, opts);
+    pw.commit();
+  }
+  vector<uint8_t> response;
+  makeResponse(response, name, QType::A, 42, true, 3600);
+
+  unsigned int consumed = 0;
+  uint16_t qtype, qclass;
+  DNSName qname((const char*) query.data(), query.size(), sizeof(dnsheader), false, &qtype, &qclass, &consumed);
+  char responseBuf[4096];
+  uint16_t responseBufSize = sizeof(responseBuf);
+  DNSDistPacketCache::CacheKey key;
+  DNSDistPacketCache::CacheKey doKey;
+  BOOST_CHECK(!PC.get((const char*) query.data(), query.size(), qname, qtype, qclass, consumed, responseBuf, &responseBufSize, &key));
+  BOOST_CHECK(!PC.get((const char*) doQuery.data(), doQuery.size(), qname, qtype, qclass, consumed, responseBuf, &responseBufSize, &doKey));
+  BOOST_CHECK_EQUAL(key.flags, 1);
+  BOOST_CHECK_EQUAL(doKey.flags, 5);
+  BOOST_CHECK_NE(key.additionalHash, doKey.additionalHash);
+
+  /* the answer to the query without DO, stored under the key of the DO one as if they collided */
+  DNSDistPacketCache::CacheKey collision = key;
+  collision.key = doKey.key;
+  PC.insert(collision, qname, qtype, qclass, (const char*) response.data(), response.size());
+  BOOST_CHECK_EQUAL(PC.getSize(), 1);
+  responseBufSize = sizeof(responseBuf);
+  BOOST_CHECK(!PC.get((const char*) doQuery.data(), doQuery.size(), qname, qtype, qclass, consumed, responseBuf, &responseBufSize, &doKey));
+  BOOST_CHECK_EQUAL(PC.getLookupCollisions(), 1);
+
+  /* nor does the answer to the DO query replace it */
+  PC.insert(doKey, qname, qtype, qclass, (const char*) response.data(), response.size());
+  BOOST_CHECK_EQUAL(PC.getInsertCollisions(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheTTL) {
+  DNSDistPacketCache PC(1000, 300, 10);
+
+  const DNSName name("ttl.powerdns.com.");
+  vector<uint8_t> query;
+  makeQuery(query, name, QType::A, 42, true);
+  unsigned int consumed = 0;
+  uint16_t qtype, qclass;
+  DNSName qname((const char*) query.data(), query.size(), sizeof(dnsheader), false, &qtype, &qclass, &consumed);
+  char responseBuf[4096];
+  uint16_t responseBufSize = sizeof(responseBuf);
+  DNSDistPacketCache::CacheKey key;
+  BOOST_CHECK(!PC.get((const char*) query.data(), query.size(), qname, qtype, qclass, consumed, responseBuf, &responseBufSize, &key));
+
+  /* below the minimum TTL, not cached */
+  vector<uint8_t> response;
+  makeResponse(response, name, QType::A, 42, true, 5);
+  PC.insert(key, qname, qtype, qclass, (const char*) response.data(), response.size());
+  BOOST_CHECK_EQUAL(PC.getSize(), 0);
+
+  /* above the maximum TTL, cached but capped */
+  response.clear();
+  makeResponse(response, name, QType::A, 42, true, 86400);
+  PC.insert(key, qname, qtype, qclass, (const char*) response.data(), response.size());
+  BOOST_CHECK_EQUAL(PC.getSize(), 1);
+  responseBufSize = sizeof(responseBuf);
+  BOOST_CHECK(PC.get((const char*) query.data(), query.size(), qname, qtype, qclass, consumed, responseBuf, &responseBufSize, &key, true));
+  BOOST_CHECK_EQUAL(getDNSPacketMinTTL(responseBuf, responseBufSize), 86400);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,107 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist-topk.hh"
+#include "dns.hh"
+
+BOOST_AUTO_TEST_SUITE(dnsdisttopk_cc)
+
+BOOST_AUTO_TEST_CASE(test_SpaceSavingHeavyHitters) {
+  SpaceSavingTopK<int> summary(10);
+
+  /* 5 heavy hitters among a lot of keys seen only once */
+  for(int round = 0; round < 100; round++) {
+    for(int heavy = 0; heavy < 5; heavy++) {
+      summary.add(heavy, 2);
+    }
+    for(int idx = 0; idx < 10; idx++) {
+      summary.add(1000 + round * 10 + idx);
+    }
+  }
+
+  BOOST_CHECK_EQUAL(summary.size(), 10);
+  size_t found = 0;
+  for(const auto& entry : summary.getEntries()) {
+    if(entry.key < 5) {
+      found++;
+      /* counts are upper bounds */
+      BOOST_CHECK_GE(entry.count, 200);
+      BOOST_CHECK_LE(entry.count - entry.error, 200);
+    }
+  }
+  BOOST_CHECK_EQUAL(found, 5);
+
+  summary.clear();
+  BOOST_CHECK_EQUAL(summary.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_SpaceSavingExactBelowCapacity) {
+  SpaceSavingTopK<int> summary(100);
+  for(int idx = 0; idx < 50; idx++) {
+    for(int count = 0; count <= idx; count++) {
+      summary.add(idx);
+    }
+  }
+
+  BOOST_CHECK_EQUAL(summary.size(), 50);
+  for(const auto& entry : summary.getEntries()) {
+    BOOST_CHECK_EQUAL(entry.count, (uint64_t) entry.key + 1);
+    BOOST_CHECK_EQUAL(entry.error, 0);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_TopTalkersWindow) {
+  TopTalkersAggregator aggregator(10, 5);
+  const ComboAddress first("192.0.2.1");
+  const ComboAddress second("2001:db8::1");
+  const time_t start = 1000;
+
+  for(time_t now = start; now < start + 10; now++) {
+    aggregator.addQuery(now, first, QType::A, 50);
+    aggregator.addQuery(now, ComboAddress("192.0.2.1", 4242), QType::ANY, 50);
+    aggregator.addQuery(now, second, QType::A, 100);
+    aggregator.addResponse(now, first, RCode::NoError, 500);
+    aggregator.addResponse(now, second, RCode::ServFail, 100);
+  }
+  const time_t now = start + 9;
+
+  /* only the last 5 seconds are kept, and the source port does not matter */
+  TopTalkersAggregator::counts_t counts;
+  aggregator.merge(TopTalkersAggregator::Kind::Queries, 0, now, 60, counts);
+  BOOST_CHECK_EQUAL(counts.size(), 2);
+  BOOST_CHECK_EQUAL(counts[first], 10);
+  BOOST_CHECK_EQUAL(counts[second], 5);
+
+  counts.clear();
+  aggregator.merge(TopTalkersAggregator::Kind::Queries, 0, now, 2, counts);
+  BOOST_CHECK_EQUAL(counts[first], 4);
+
+  counts.clear();
+  aggregator.merge(TopTalkersAggregator::Kind::QType, QType::ANY, now, 5, counts);
+  BOOST_CHECK_EQUAL(counts.size(), 1);
+  BOOST_CHECK_EQUAL(counts[first], 5);
+
+  counts.clear();
+  aggregator.merge(TopTalkersAggregator::Kind::Bandwidth, 0, now, 1, counts);
+  BOOST_CHECK_EQUAL(counts[first], 600);
+  BOOST_CHECK_EQUAL(counts[second], 200);
+
+  counts.clear();
+  aggregator.merge(TopTalkersAggregator::Kind::RCode, RCode::ServFail, now, 5, counts);
+  BOOST_CHECK_EQUAL(counts.size(), 1);
+  BOOST_CHECK_EQUAL(counts[second], 5);
+
+  /* NoError is not tracked per rcode */
+  counts.clear();
+  aggregator.merge(TopTalkersAggregator::Kind::RCode, RCode::NoError, now, 5, counts);
+  BOOST_CHECK(counts.empty());
+
+  /* nothing in the window anymore */
+  counts.clear();
+  aggregator.merge(TopTalkersAggregator::Kind::Queries, 0, now + 10, 5, counts);
+  BOOST_CHECK(counts.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -312,4 +312,41 @@ BOOST_AUTO_TEST_CASE(test_opt_record_out) {
   BOOST_CHECK_EQUAL(makeHexDump(std::string(pak.begin(),pak.end())), makeHexDump(packet));
 }
 
+BOOST_AUTO_TEST_CASE(test_resourcerecord_parsecontent) {
+  reportAllTypes();
+  DNSResourceRecord rr;
+  rr.qname=DNSName("www.powerdns.com");
+
+  rr.qtype=QType::A;
+  rr.content="127.0.0.1";
+  BOOST_CHECK(rr.parseContent());
+  BOOST_REQUIRE(rr.getParsedContent());
+  BOOST_CHECK_EQUAL(rr.getParsedContent()->getType(), QType::A);
+  BOOST_CHECK_EQUAL(rr.getParsedContent()->getZoneRepresentation(), "127.0.0.1");
+
+  // rewriting content makes the parsed form stale
+  rr.content="127.0.0.2";
+  BOOST_CHECK(!rr.getParsedContent());
+  rr.content="127.0.0.1";
+  BOOST_CHECK(rr.getParsedContent());
+  rr.qtype=QType::AAAA;
+  BOOST_CHECK(!rr.getParsedContent());
+
+  // unquoted TXT gets the same treatment as in DNSPacket::wrapup()
+  rr.qtype=QType::TXT;
+  rr.content="hello world";
+  BOOST_CHECK(rr.parseContent());
+  BOOST_REQUIRE(rr.getParsedContent());
+  BOOST_CHECK_EQUAL(rr.getParsedContent()->getZoneRepresentation(), "\"hello world\"");
+
+  rr.qtype=QType::A;
+  rr.content="not an ip";
+  BOOST_CHECK(!rr.parseContent());
+  BOOST_CHECK(!rr.getParsedContent());
+
+  rr.qtype=QType(0);
+  rr.content="";
+  BOOST_CHECK(!rr.parseContent());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
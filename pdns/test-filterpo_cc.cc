@@ -0,0 +1,107 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "filterpo.hh"
+
+BOOST_AUTO_TEST_SUITE(filterpo_cc)
+
+static DNSFilterEngine::Policy makePolicy(DNSFilterEngine::PolicyKind kind)
+{
+  DNSFilterEngine::Policy pol{kind};
+  pol.d_ttl = 0;
+  return pol;
+}
+
+BOOST_AUTO_TEST_CASE(test_filter_compiled_names) {
+  DNSFilterEngine dfe;
+  dfe.addQNameTrigger(DNSName("bad.example.com."), makePolicy(DNSFilterEngine::PolicyKind::NXDOMAIN), 0);
+  dfe.addQNameTrigger(DNSName("*.wild.example.com."), makePolicy(DNSFilterEngine::PolicyKind::NODATA), 0);
+  dfe.addQNameTrigger(DNSName("exact.wild.example.com."), makePolicy(DNSFilterEngine::PolicyKind::Truncate), 0);
+  dfe.addQNameTrigger(DNSName("later.example.net."), makePolicy(DNSFilterEngine::PolicyKind::Drop), 1);
+  dfe.addQNameTrigger(DNSName("deep.later.example.net."), makePolicy(DNSFilterEngine::PolicyKind::NODATA), 2);
+  dfe.addClientTrigger(Netmask("192.0.2.0/24"), makePolicy(DNSFilterEngine::PolicyKind::Truncate), 0);
+  dfe.addNSTrigger(DNSName("ns.evil.example."), makePolicy(DNSFilterEngine::PolicyKind::Drop), 0);
+
+  const vector<DNSName> names{
+    DNSName("bad.example.com."), DNSName("BAD.Example.COM."), DNSName("www.bad.example.com."), DNSName("example.com."),
+    DNSName("wild.example.com."), DNSName("a.wild.example.com."), DNSName("a.b.wild.example.com."), DNSName("exact.wild.example.com."),
+    DNSName("*.wild.example.com."), DNSName("later.example.net."), DNSName("deep.later.example.net."), DNSName("."),
+    DNSName("ns.evil.example."), DNSName("other.ns.evil.example.")
+  };
+  const vector<ComboAddress> clients{ComboAddress("192.0.2.1"), ComboAddress("198.51.100.1")};
+
+  vector<DNSFilterEngine::PolicyKind> expected;
+  BOOST_CHECK(!dfe.isCompiled());
+  for(const auto& name : names) {
+    for(const auto& client : clients)
+      expected.push_back(dfe.getQueryPolicy(name, client).d_kind);
+    expected.push_back(dfe.getProcessingPolicy(name).d_kind);
+  }
+
+  dfe.compile();
+  BOOST_CHECK(dfe.isCompiled());
+  size_t idx = 0;
+  for(const auto& name : names) {
+    for(const auto& client : clients) {
+      BOOST_CHECK_MESSAGE(dfe.getQueryPolicy(name, client).d_kind == expected.at(idx), "query policy mismatch for "<<name<<" from "<<client.toString());
+      idx++;
+    }
+    BOOST_CHECK_MESSAGE(dfe.getProcessingPolicy(name).d_kind == expected.at(idx), "processing policy mismatch for "<<name);
+    idx++;
+  }
+
+  const ComboAddress outside("198.51.100.1");
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("bad.example.com."), outside).d_kind == DNSFilterEngine::PolicyKind::NXDOMAIN);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("a.wild.example.com."), outside).d_kind == DNSFilterEngine::PolicyKind::NODATA);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("wild.example.com."), outside).d_kind == DNSFilterEngine::PolicyKind::NoAction);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("exact.wild.example.com."), outside).d_kind == DNSFilterEngine::PolicyKind::Truncate);
+  /* the first zone wins, even with a more specific match in a later one */
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("deep.later.example.net."), outside).d_kind == DNSFilterEngine::PolicyKind::Drop);
+  /* client triggers of zone 0 go before name triggers of zone 1 */
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("later.example.net."), ComboAddress("192.0.2.1")).d_kind == DNSFilterEngine::PolicyKind::Truncate);
+  BOOST_CHECK(dfe.getProcessingPolicy(DNSName("ns.evil.example.")).d_kind == DNSFilterEngine::PolicyKind::Drop);
+
+  /* changes drop the compiled trie */
+  dfe.rmQNameTrigger(DNSName("bad.example.com."), makePolicy(DNSFilterEngine::PolicyKind::NXDOMAIN), 0);
+  BOOST_CHECK(!dfe.isCompiled());
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("bad.example.com."), outside).d_kind == DNSFilterEngine::PolicyKind::NoAction);
+  dfe.compile();
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("bad.example.com."), outside).d_kind == DNSFilterEngine::PolicyKind::NoAction);
+}
+
+BOOST_AUTO_TEST_CASE(test_filter_zone_copy_on_write) {
+  DNSFilterEngine dfe;
+  dfe.addQNameTrigger(DNSName("zero.example."), makePolicy(DNSFilterEngine::PolicyKind::NXDOMAIN), 0);
+  dfe.addQNameTrigger(DNSName("one.example."), makePolicy(DNSFilterEngine::PolicyKind::Drop), 1);
+  dfe.compile();
+
+  /* a copy shares the zones, until one of them changes */
+  DNSFilterEngine copy(dfe);
+  BOOST_CHECK(copy.getZone(0) == dfe.getZone(0));
+  BOOST_CHECK(copy.getZone(1) == dfe.getZone(1));
+  copy.addQNameTrigger(DNSName("more.example."), makePolicy(DNSFilterEngine::PolicyKind::NODATA), 1);
+  BOOST_CHECK(copy.getZone(0) == dfe.getZone(0));
+  BOOST_CHECK(copy.getZone(1) != dfe.getZone(1));
+  BOOST_CHECK(!copy.isCompiled());
+  BOOST_CHECK(dfe.isCompiled());
+
+  const ComboAddress client("198.51.100.1");
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("more.example."), client).d_kind == DNSFilterEngine::PolicyKind::NoAction);
+  BOOST_CHECK(copy.getQueryPolicy(DNSName("more.example."), client).d_kind == DNSFilterEngine::PolicyKind::NODATA);
+
+  /* and the changed zone can be put in place in the original */
+  copy.compile();
+  dfe.setZone(1, copy);
+  BOOST_CHECK(dfe.getZone(1) == copy.getZone(1));
+  BOOST_CHECK(dfe.isCompiled());
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("more.example."), client).d_kind == DNSFilterEngine::PolicyKind::NODATA);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("zero.example."), client).d_kind == DNSFilterEngine::PolicyKind::NXDOMAIN);
+
+  dfe.clear(1);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("one.example."), client).d_kind == DNSFilterEngine::PolicyKind::NoAction);
+  BOOST_CHECK(copy.getQueryPolicy(DNSName("one.example."), client).d_kind == DNSFilterEngine::PolicyKind::Drop);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
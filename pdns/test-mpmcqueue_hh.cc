@@ -0,0 +1,74 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include <thread>
+#include <vector>
+#include "mpmcqueue.hh"
+
+BOOST_AUTO_TEST_SUITE(test_mpmcqueue_hh)
+
+BOOST_AUTO_TEST_CASE(test_mpmcqueue_simple) {
+  MPMCQueue<int> q(5);
+  BOOST_CHECK_EQUAL(q.capacity(), 8);
+  int value;
+  BOOST_CHECK(!q.pop(value));
+
+  for(int n = 0; n < 8; ++n)
+    BOOST_CHECK(q.push(n));
+  BOOST_CHECK(!q.push(8));
+  BOOST_CHECK_EQUAL(q.size(), 8);
+
+  for(int n = 0; n < 8; ++n) {
+    BOOST_REQUIRE(q.pop(value));
+    BOOST_CHECK_EQUAL(value, n);
+  }
+  BOOST_CHECK(!q.pop(value));
+  BOOST_CHECK_EQUAL(q.size(), 0);
+
+  // wrap around a few times
+  for(int n = 0; n < 100; ++n) {
+    BOOST_CHECK(q.push(n));
+    BOOST_REQUIRE(q.pop(value));
+    BOOST_CHECK_EQUAL(value, n);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_mpmcqueue_threads) {
+  MPMCQueue<uint64_t> q(1024);
+  const uint64_t perProducer = 100000;
+  const unsigned int producers = 4, consumers = 4;
+  std::atomic<uint64_t> sum{0}, count{0};
+
+  std::vector<std::thread> threads;
+  for(unsigned int p = 0; p < producers; ++p) {
+    threads.push_back(std::thread([&q, perProducer]() {
+          for(uint64_t n = 1; n <= perProducer; ++n) {
+            while(!q.push(n))
+              std::this_thread::yield();
+          }
+        }));
+  }
+  for(unsigned int c = 0; c < consumers; ++c) {
+    threads.push_back(std::thread([&]() {
+          uint64_t value;
+          while(count < producers * perProducer) {
+            if(q.pop(value)) {
+              sum += value;
+              count++;
+            }
+            else
+              std::this_thread::yield();
+          }
+        }));
+  }
+  for(auto& t : threads)
+    t.join();
+
+  BOOST_CHECK_EQUAL(count, producers * perProducer);
+  BOOST_CHECK_EQUAL(sum, producers * perProducer * (perProducer + 1) / 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,128 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include "mtasker.hh"
+
+BOOST_AUTO_TEST_SUITE(mtasker_cc)
+
+static std::vector<int> g_result;
+
+static void doSomething(void* p)
+{
+  MTasker<>* mt = reinterpret_cast<MTasker<>*>(p);
+  int i=12, o;
+  if (mt->waitEvent(i, &o, 1000) == 1)
+    g_result.push_back(o);
+}
+
+BOOST_AUTO_TEST_CASE(test_Simple) {
+  MTasker<> mt;
+  mt.makeThread(doSomething, &mt);
+  struct timeval now;
+  gettimeofday(&now, 0);
+  bool first=true;
+  int o=24;
+  for(;;) {
+    while(mt.schedule(&now)) {
+    }
+    if(first) {
+      mt.sendEvent(12, &o);
+      first=false;
+    }
+    if(mt.noProcesses())
+      break;
+  }
+  BOOST_CHECK_EQUAL(g_result.size(), 1);
+  BOOST_CHECK_EQUAL(g_result[0], o);
+}
+
+static std::string g_order;
+
+static void printer(void* p)
+{
+  MTasker<>* mt = reinterpret_cast<MTasker<>*>(p);
+  char c = 'a' + mt->getTid();
+  for(int n = 0; n < 3; ++n) {
+    g_order += c;
+    mt->yield();
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_Yield) {
+  MTasker<> mt;
+  mt.makeThread(printer, &mt);
+  mt.makeThread(printer, &mt);
+  while(!mt.noProcesses())
+    mt.schedule();
+  BOOST_CHECK_EQUAL(g_order, "ababab");
+}
+
+static void timeOut(void* p)
+{
+  MTasker<>* mt = reinterpret_cast<MTasker<>*>(p);
+  int i=12, o;
+  g_result.push_back(mt->waitEvent(i, &o, 1));
+}
+
+BOOST_AUTO_TEST_CASE(test_TimeOut) {
+  MTasker<> mt;
+  g_result.clear();
+  mt.makeThread(timeOut, &mt);
+  struct timeval now;
+  gettimeofday(&now, 0);
+  while(!mt.noProcesses()) {
+    mt.schedule(&now);
+    now.tv_sec++;
+  }
+  BOOST_CHECK_EQUAL(g_result.size(), 1);
+  BOOST_CHECK_EQUAL(g_result[0], 0);
+}
+
+static unsigned int recurse(unsigned int depth)
+{
+  volatile char buffer[1024];
+  for(size_t n = 0; n < sizeof(buffer); ++n)
+    buffer[n] = depth + 1;
+  if(!depth)
+    return buffer[0];
+  return recurse(depth - 1) + buffer[0];
+}
+
+static void deepThought(void* p)
+{
+  recurse(*reinterpret_cast<unsigned int*>(p));
+}
+
+BOOST_AUTO_TEST_CASE(test_Stacks) {
+  MTasker<> mt(65536, true);
+  unsigned int depth = 2;
+  mt.makeThread(deepThought, &depth);
+  while(!mt.noProcesses())
+    mt.schedule();
+  size_t shallow = mt.getStackHighWaterMark();
+  BOOST_CHECK_GT(shallow, 2048);
+  BOOST_CHECK_LT(shallow, 16384);
+
+  // exited threads leave their stack to the next one
+  BOOST_CHECK_EQUAL(mt.numStacks(), 1);
+  depth = 32;
+  mt.makeThread(deepThought, &depth);
+  BOOST_CHECK_EQUAL(mt.numStacks(), 1);
+  while(!mt.noProcesses())
+    mt.schedule();
+  BOOST_CHECK_GT(mt.getStackHighWaterMark(), 32768);
+
+  // and the high-water mark does not go down again
+  depth = 1;
+  mt.makeThread(deepThought, &depth);
+  while(!mt.noProcesses())
+    mt.schedule();
+  BOOST_CHECK_GT(mt.getStackHighWaterMark(), 32768);
+  BOOST_CHECK_EQUAL(mt.numStacks(), 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -76,6 +76,35 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheSimple) {
 
 }
 
+BOOST_AUTO_TEST_CASE(test_PacketCacheKeyFields) {
+  PacketCache PC;
+
+  DNSName qname("key.powerdns.com");
+  string value;
+  PC.insert(qname, QType(QType::A), PacketCache::PACKETCACHE, "small", 3600, -1, false, 512, false, false);
+  PC.insert(qname, QType(QType::A), PacketCache::PACKETCACHE, "large", 3600, -1, false, 4096, false, true);
+  PC.insert(qname, QType(QType::A), PacketCache::PACKETCACHE, "dnssec", 3600, -1, false, 4096, true, true);
+  BOOST_CHECK_EQUAL(PC.size(), 3);
+
+  BOOST_CHECK(PC.getEntry(qname, QType(QType::A), PacketCache::PACKETCACHE, value, -1, false, 512, false, false));
+  BOOST_CHECK_EQUAL(value, "small");
+  BOOST_CHECK(PC.getEntry(DNSName("KEY.PowerDNS.com"), QType(QType::A), PacketCache::PACKETCACHE, value, -1, false, 4096, false, true));
+  BOOST_CHECK_EQUAL(value, "large");
+  BOOST_CHECK(PC.getEntry(qname, QType(QType::A), PacketCache::PACKETCACHE, value, -1, false, 4096, true, true));
+  BOOST_CHECK_EQUAL(value, "dnssec");
+  BOOST_CHECK(!PC.getEntry(qname, QType(QType::AAAA), PacketCache::PACKETCACHE, value, -1, false, 512, false, false));
+  BOOST_CHECK(!PC.getEntry(qname, QType(QType::A), PacketCache::PACKETCACHE, value, -1, true, 512, false, false));
+
+  // replacing an entry must not create a second one
+  PC.insert(qname, QType(QType::A), PacketCache::PACKETCACHE, "small2", 3600, -1, false, 512, false, false);
+  BOOST_CHECK_EQUAL(PC.size(), 3);
+  BOOST_CHECK(PC.getEntry(qname, QType(QType::A), PacketCache::PACKETCACHE, value, -1, false, 512, false, false));
+  BOOST_CHECK_EQUAL(value, "small2");
+
+  BOOST_CHECK_EQUAL(PC.purgeExact(qname), 3);
+  BOOST_CHECK_EQUAL(PC.size(), 0);
+}
+
 static PacketCache* g_PC;
 
 static void *threadMangler(void* a)
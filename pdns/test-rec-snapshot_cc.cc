@@ -0,0 +1,252 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include "rec-snapshot.hh"
+#include "recursor_cache.hh"
+#include "dnsname.hh"
+#include "dnsrecords.hh"
+#include "iputils.hh"
+#include <stdio.h>
+
+BOOST_AUTO_TEST_SUITE(rec_snapshot_cc)
+
+static std::shared_ptr<FILE> makeFile(const std::string& data)
+{
+  std::shared_ptr<FILE> fp(tmpfile(), fclose);
+  BOOST_REQUIRE(fp);
+  BOOST_REQUIRE_EQUAL(fwrite(data.c_str(), 1, data.size(), fp.get()), data.size());
+  rewind(fp.get());
+  return fp;
+}
+
+static std::shared_ptr<RRSIGRecordContent> makeRRSIG(const DNSName& signer, uint16_t type, time_t now)
+{
+  auto rrsig = std::make_shared<RRSIGRecordContent>();
+  rrsig->d_type = type;
+  rrsig->d_algorithm = 8;
+  rrsig->d_labels = 3;
+  rrsig->d_originalttl = 3600;
+  rrsig->d_siginception = now - 3600;
+  rrsig->d_sigexpire = now + 86400;
+  rrsig->d_tag = 4242;
+  rrsig->d_signer = signer;
+  rrsig->d_signature = "signature";
+  return rrsig;
+}
+
+static DNSRecord makeA(const DNSName& name, const std::string& address, uint32_t ttd)
+{
+  DNSRecord dr;
+  dr.d_name = name;
+  dr.d_type = QType::A;
+  dr.d_class = QClass::IN;
+  dr.d_ttl = ttd;
+  dr.d_place = DNSResourceRecord::ANSWER;
+  dr.d_content = std::make_shared<ARecordContent>(ComboAddress(address));
+  return dr;
+}
+
+BOOST_AUTO_TEST_CASE(test_snapshotPrimitives) {
+  reportAllTypes();
+  time_t now = time(0);
+  DNSName name("www.example.org.");
+  DNSRecord a = makeA(name, "192.0.2.1", 3600);
+  DNSRecord sig;
+  sig.d_name = name;
+  sig.d_type = QType::RRSIG;
+  sig.d_class = QClass::IN;
+  sig.d_ttl = 3600;
+  sig.d_place = DNSResourceRecord::AUTHORITY;
+  sig.d_content = makeRRSIG(DNSName("example.org."), QType::A, now);
+
+  SnapshotWriter out;
+  out.putUInt8(0xab);
+  out.putUInt16(0xabcd);
+  size_t pos = out.reserveUInt32();
+  out.putUInt64(0x0123456789abcdefULL);
+  out.putString(std::string("with\0zero", 9));
+  out.putName(name);
+  out.putName(DNSName());
+  out.putRecord(a);
+  out.putRecord(sig);
+  out.setUInt32(pos, 0xdeadbeef);
+
+  SnapshotReader in(out.d_data);
+  BOOST_CHECK_EQUAL(in.getUInt8(), 0xab);
+  BOOST_CHECK_EQUAL(in.getUInt16(), 0xabcd);
+  BOOST_CHECK_EQUAL(in.getUInt32(), 0xdeadbeef);
+  BOOST_CHECK_EQUAL(in.getUInt64(), 0x0123456789abcdefULL);
+  BOOST_CHECK_EQUAL(in.getString(), std::string("with\0zero", 9));
+  BOOST_CHECK_EQUAL(in.getName(), name);
+  BOOST_CHECK(in.getName().empty());
+
+  DNSRecord got = in.getRecord();
+  BOOST_CHECK_EQUAL(got.d_name, name);
+  BOOST_CHECK_EQUAL(got.d_type, QType::A);
+  BOOST_CHECK_EQUAL(got.d_ttl, 3600);
+  BOOST_CHECK_EQUAL(got.d_place, DNSResourceRecord::ANSWER);
+  BOOST_CHECK_EQUAL(got.d_content->getZoneRepresentation(), "192.0.2.1");
+
+  got = in.getRecord();
+  BOOST_CHECK_EQUAL(got.d_type, QType::RRSIG);
+  BOOST_CHECK_EQUAL(got.d_place, DNSResourceRecord::AUTHORITY);
+  BOOST_CHECK_EQUAL(got.d_content->getZoneRepresentation(), sig.d_content->getZoneRepresentation());
+
+  // everything was read
+  BOOST_CHECK_THROW(in.getUInt8(), SnapshotError);
+
+  std::string truncated = out.d_data.substr(0, out.d_data.size() - 1);
+  SnapshotReader partial(truncated);
+  partial.getUInt8();
+  partial.getUInt16();
+  partial.getUInt32();
+  partial.getUInt64();
+  partial.getString();
+  partial.getName();
+  partial.getName();
+  partial.getRecord();
+  BOOST_CHECK_THROW(partial.getRecord(), SnapshotError);
+}
+
+BOOST_AUTO_TEST_CASE(test_snapshotFile) {
+  char fname[] = "/tmp/test-rec-snapshot.XXXXXX";
+  int fd = mkstemp(fname);
+  BOOST_REQUIRE(fd >= 0);
+  close(fd);
+
+  time_t now = time(0);
+  SnapshotWriter out;
+  size_t pos = startSnapshotSection(out);
+  out.putString("first");
+  finishSnapshotSection(out, pos);
+  pos = startSnapshotSection(out);
+  finishSnapshotSection(out, pos);
+  pos = startSnapshotSection(out);
+  out.putString("third");
+  finishSnapshotSection(out, pos);
+
+  writeSnapshotFile(fname, getSnapshotHeader(now) + out.d_data);
+  BOOST_CHECK(access((std::string(fname) + ".tmp").c_str(), F_OK) < 0);
+
+  std::shared_ptr<FILE> fp(fopen(fname, "r"), fclose);
+  unlink(fname);
+  BOOST_REQUIRE(fp);
+  BOOST_CHECK_EQUAL(readSnapshotHeader(fp.get()), now);
+
+  // the first one is skipped, as if it belonged to another thread
+  std::string data;
+  BOOST_REQUIRE(readSnapshotSection(fp.get(), nullptr));
+  BOOST_REQUIRE(readSnapshotSection(fp.get(), &data));
+  BOOST_CHECK(data.empty());
+  BOOST_REQUIRE(readSnapshotSection(fp.get(), &data));
+  SnapshotReader in(data);
+  BOOST_CHECK_EQUAL(in.getString(), "third");
+  BOOST_CHECK(!readSnapshotSection(fp.get(), &data));
+}
+
+BOOST_AUTO_TEST_CASE(test_snapshotRejectsBadInput) {
+  std::string header = getSnapshotHeader(time(0));
+
+  auto fp = makeFile("NOTSNAPS" + header.substr(8));
+  BOOST_CHECK_THROW(readSnapshotHeader(fp.get()), SnapshotError);
+
+  // the version follows the magic
+  std::string wrongVersion = header;
+  wrongVersion.at(9) = wrongVersion.at(9) + 1;
+  fp = makeFile(wrongVersion);
+  BOOST_CHECK_THROW(readSnapshotHeader(fp.get()), SnapshotError);
+
+  fp = makeFile(header.substr(0, header.size() - 1));
+  BOOST_CHECK_THROW(readSnapshotHeader(fp.get()), SnapshotError);
+
+  fp = makeFile("");
+  BOOST_CHECK_THROW(readSnapshotHeader(fp.get()), SnapshotError);
+
+  SnapshotWriter out;
+  size_t pos = startSnapshotSection(out);
+  out.putString("section");
+  finishSnapshotSection(out, pos);
+
+  fp = makeFile(header + out.d_data.substr(0, out.d_data.size() - 1));
+  readSnapshotHeader(fp.get());
+  std::string data;
+  BOOST_CHECK_THROW(readSnapshotSection(fp.get(), &data), SnapshotError);
+
+  fp = makeFile(header + out.d_data.substr(0, 4));
+  readSnapshotHeader(fp.get());
+  BOOST_CHECK_THROW(readSnapshotSection(fp.get(), &data), SnapshotError);
+
+  // a length way beyond the end of the file, which must not be allocated, or skipped over
+  std::string huge = out.d_data;
+  huge.at(0) = 0x7f;
+  fp = makeFile(header + huge);
+  readSnapshotHeader(fp.get());
+  BOOST_CHECK_THROW(readSnapshotSection(fp.get(), &data), SnapshotError);
+  fp = makeFile(header + huge);
+  readSnapshotHeader(fp.get());
+  BOOST_CHECK_THROW(readSnapshotSection(fp.get(), nullptr), SnapshotError);
+}
+
+BOOST_AUTO_TEST_CASE(test_recordCacheSnapshot) {
+  reportAllTypes();
+  time_t now = time(0);
+  MemRecursorCache cache(4);
+  DNSName www("www.example.org."), ecs("ecs.example.org."), expiring("expiring.example.org.");
+  ComboAddress inside("192.0.2.42"), outside("198.51.100.1");
+
+  vector<std::shared_ptr<RRSIGRecordContent>> signatures{makeRRSIG(DNSName("example.org."), QType::A, now)};
+  vector<std::shared_ptr<RRSIGRecordContent>> none;
+  cache.replace(now, www, QType(QType::A), {makeA(www, "192.0.2.1", now + 3600), makeA(www, "192.0.2.2", now + 3600)}, signatures, true);
+  cache.replace(now, ecs, QType(QType::A), {makeA(ecs, "192.0.2.3", now + 3600)}, none, true, Netmask("192.0.2.0/24"));
+  cache.replace(now, expiring, QType(QType::A), {makeA(expiring, "192.0.2.4", now + 10)}, none, true);
+  BOOST_REQUIRE_EQUAL(cache.size(), 3);
+
+  // like a shared cache written by two threads, each taking half of the shards
+  SnapshotWriter out;
+  uint64_t written = cache.doSnapshot(out, now, 0, 2);
+  written += cache.doSnapshot(out, now, 1, 2);
+  BOOST_CHECK_EQUAL(written, 3);
+
+  // loaded a minute later, when one of them expired
+  time_t later = now + 60;
+  MemRecursorCache loaded;
+  SnapshotReader in(out.d_data);
+  uint64_t count = loaded.loadSnapshot(in, later);
+  count += loaded.loadSnapshot(in, later);
+  BOOST_CHECK_EQUAL(count, 2);
+  BOOST_CHECK_EQUAL(loaded.size(), 2);
+  BOOST_CHECK_THROW(in.getUInt8(), SnapshotError);
+
+  vector<DNSRecord> records;
+  vector<std::shared_ptr<RRSIGRecordContent>> sigs;
+  BOOST_CHECK_EQUAL(loaded.get(later, www, QType(QType::A), &records, inside, &sigs), 3600 - 60);
+  BOOST_REQUIRE_EQUAL(records.size(), 2);
+  BOOST_CHECK_EQUAL(records.at(0).d_content->getZoneRepresentation(), "192.0.2.1");
+  BOOST_CHECK_EQUAL(records.at(1).d_content->getZoneRepresentation(), "192.0.2.2");
+  BOOST_REQUIRE_EQUAL(sigs.size(), 1);
+  BOOST_CHECK_EQUAL(sigs.at(0)->getZoneRepresentation(), signatures.at(0)->getZoneRepresentation());
+
+  sigs.clear();
+  BOOST_CHECK_EQUAL(loaded.get(later, ecs, QType(QType::A), &records, inside, &sigs), 3600 - 60);
+  BOOST_REQUIRE_EQUAL(records.size(), 1);
+  BOOST_CHECK_EQUAL(records.at(0).d_content->getZoneRepresentation(), "192.0.2.3");
+  BOOST_CHECK(sigs.empty());
+  // the netmask survived
+  BOOST_CHECK_LE(loaded.get(later, ecs, QType(QType::A), &records, outside), 0);
+  BOOST_CHECK(records.empty());
+
+  BOOST_CHECK_LE(loaded.get(later, expiring, QType(QType::A), &records, inside), 0);
+
+  // running out of data in the middle of an entry is an error
+  std::string truncated = out.d_data.substr(0, out.d_data.size() - 1);
+  MemRecursorCache partial;
+  SnapshotReader partialIn(truncated);
+  partial.loadSnapshot(partialIn, later);
+  BOOST_CHECK_THROW(partial.loadSnapshot(partialIn, later), SnapshotError);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
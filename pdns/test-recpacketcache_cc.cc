@@ -0,0 +1,148 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include "recpacketcache.hh"
+#include "dnswriter.hh"
+#include "dnsname.hh"
+#include "dnsrecords.hh"
+#include "iputils.hh"
+#include <utility>
+
+BOOST_AUTO_TEST_SUITE(recpacketcache_cc)
+
+static string makeQuery(const DNSName& qname, uint16_t qtype, uint16_t id, bool rd, bool edns=false, bool dnssecOK=false, uint16_t bufsize=512)
+{
+  vector<uint8_t> packet;
+  DNSPacketWriter pw(packet, qname, qtype);
+  pw.getHeader()->rd=rd;
+  pw.getHeader()->id=id;
+  if(edns) {
+    DNSPacketWriter::optvect_t opts;
+    pw.addOpt(bufsize, 0, dnssecOK ? EDNSOpts::DNSSECOK : 0, opts);
+    pw.commit();
+  }
+  return string((const char*)&packet[0], packet.size());
+}
+
+static string makeResponse(const DNSName& qname, uint16_t qtype, uint16_t id, bool rd)
+{
+  vector<uint8_t> packet;
+  DNSPacketWriter pw(packet, qname, qtype);
+  pw.getHeader()->rd=rd;
+  pw.getHeader()->qr=1;
+  pw.getHeader()->id=id;
+  pw.startRecord(qname, QType::A, 3600);
+  ARecordContent ar(ComboAddress("127.0.0.1"));
+  ar.toPacket(pw);
+  pw.commit();
+  return string((const char*)&packet[0], packet.size());
+}
+
+BOOST_AUTO_TEST_CASE(test_recPacketCacheSimple) {
+  RecursorPacketCache rpc;
+  BOOST_CHECK_EQUAL(rpc.size(), 0);
+
+  const DNSName qname("www.powerdns.com.");
+  string query = makeQuery(qname, QType::A, 42, true);
+  string response = makeResponse(qname, QType::A, 42, true);
+  time_t now = time(nullptr);
+  string fetched;
+  uint32_t age = 0;
+  uint32_t qhash = 0;
+  string ednsKey;
+
+  BOOST_CHECK(!rpc.getResponsePacket(query, now, &fetched, &age, &qhash, &ednsKey));
+  BOOST_CHECK_EQUAL(qhash, RecursorPacketCache::canHashPacket(query));
+  BOOST_CHECK(ednsKey.empty());
+  rpc.insertResponsePacket(qhash, ednsKey, qname, QType::A, response, now, 3600);
+  BOOST_CHECK_EQUAL(rpc.size(), 1);
+
+  /* a different ID and case still hits, and gets the ID and case of the query */
+  string other = makeQuery(DNSName("WWW.PowerDNS.com."), QType::A, 4242, true);
+  BOOST_CHECK_EQUAL(RecursorPacketCache::canHashPacket(other), qhash);
+  BOOST_REQUIRE(rpc.getResponsePacket(other, now, &fetched, &age, &qhash, &ednsKey));
+  BOOST_CHECK_EQUAL(fetched.size(), response.size());
+  BOOST_CHECK(fetched.compare(0, 2, other, 0, 2) == 0);
+  BOOST_CHECK(fetched.compare(sizeof(dnsheader), other.size() - sizeof(dnsheader), other, sizeof(dnsheader), other.size() - sizeof(dnsheader)) == 0);
+
+  /* inserting the same question again replaces the entry */
+  rpc.insertResponsePacket(qhash, ednsKey, qname, QType::A, response, now, 3600);
+  BOOST_CHECK_EQUAL(rpc.size(), 1);
+
+  /* expired */
+  BOOST_CHECK(!rpc.getResponsePacket(query, now + 3601, &fetched, &age, &qhash, &ednsKey));
+
+  /* different qtype or RD bit: miss */
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery(qname, QType::AAAA, 42, true), now, &fetched, &age, &qhash, &ednsKey));
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery(qname, QType::A, 42, false), now, &fetched, &age, &qhash, &ednsKey));
+
+  BOOST_CHECK_EQUAL(rpc.doWipePacketCache(DNSName("powerdns.com."), 0xffff, false), 0);
+  BOOST_CHECK_EQUAL(rpc.doWipePacketCache(DNSName("powerdns.com."), 0xffff, true), 1);
+  BOOST_CHECK_EQUAL(rpc.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_recPacketCacheEDNS) {
+  const DNSName qname("www.powerdns.com.");
+  const uint32_t plain = RecursorPacketCache::canHashPacket(makeQuery(qname, QType::A, 42, true));
+  const uint32_t edns = RecursorPacketCache::canHashPacket(makeQuery(qname, QType::A, 42, true, true, false, 512));
+  const uint32_t do512 = RecursorPacketCache::canHashPacket(makeQuery(qname, QType::A, 42, true, true, true, 512));
+  const uint32_t do4096 = RecursorPacketCache::canHashPacket(makeQuery(qname, QType::A, 42, true, true, true, 4096));
+
+  BOOST_CHECK_NE(plain, edns);
+  BOOST_CHECK_NE(edns, do512);
+  BOOST_CHECK_NE(do512, do4096);
+  BOOST_CHECK_EQUAL(do4096, RecursorPacketCache::canHashPacket(makeQuery(qname, QType::A, 1234, true, true, true, 4096)));
+
+  string plainKey, doKey;
+  RecursorPacketCache::canHashPacket(makeQuery(qname, QType::A, 42, true), &plainKey);
+  RecursorPacketCache::canHashPacket(makeQuery(qname, QType::A, 1234, true, true, true, 4096), &doKey);
+  BOOST_CHECK(plainKey.empty());
+  BOOST_CHECK(!doKey.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_recPacketCacheEDNSCollision) {
+  RecursorPacketCache rpc;
+  const DNSName qname("www.powerdns.com.");
+  const string plainQuery = makeQuery(qname, QType::A, 42, true);
+  const string doQuery = makeQuery(qname, QType::A, 42, true, true, true, 4096);
+  const string response = makeResponse(qname, QType::A, 42, true);
+  time_t now = time(nullptr);
+  string fetched, plainKey, doKey;
+  uint32_t age = 0;
+  uint32_t qhash = 0;
+  RecursorPacketCache::canHashPacket(plainQuery, &plainKey);
+  const uint32_t doHash = RecursorPacketCache::canHashPacket(doQuery, &doKey);
+
+  /* the answer to a query without EDNS, stored under the hash of a DO one as if they collided */
+  rpc.insertResponsePacket(doHash, plainKey, qname, QType::A, response, now, 3600);
+  BOOST_CHECK(!rpc.getResponsePacket(doQuery, now, &fetched, &age, &qhash, &doKey));
+  BOOST_CHECK_EQUAL(qhash, doHash);
+
+  /* nor does the answer to the DO query replace it */
+  rpc.insertResponsePacket(doHash, doKey, qname, QType::A, response, now, 3600);
+  BOOST_CHECK_EQUAL(rpc.size(), 2);
+  BOOST_CHECK(rpc.getResponsePacket(doQuery, now, &fetched, &age, &qhash, &doKey));
+}
+
+BOOST_AUTO_TEST_CASE(test_recPacketCacheSubtreeWipe) {
+  RecursorPacketCache rpc;
+  time_t now = time(nullptr);
+  for(unsigned int counter = 0; counter < 100; counter++) {
+    DNSName qname = DNSName(std::to_string(counter)) + DNSName(counter % 2 ? "odd.powerdns.com." : "even.powerdns.com.");
+    string query = makeQuery(qname, QType::A, counter, true);
+    string ednsKey;
+    uint32_t qhash = RecursorPacketCache::canHashPacket(query, &ednsKey);
+    rpc.insertResponsePacket(qhash, ednsKey, qname, QType::A, makeResponse(qname, QType::A, counter, true), now, 3600);
+  }
+  BOOST_CHECK_EQUAL(rpc.size(), 100);
+  BOOST_CHECK_EQUAL(rpc.doWipePacketCache(DNSName("odd.powerdns.com."), QType::AAAA, true), 0);
+  BOOST_CHECK_EQUAL(rpc.doWipePacketCache(DNSName("odd.powerdns.com."), QType::A, true), 50);
+  BOOST_CHECK_EQUAL(rpc.doWipePacketCache(DNSName("42.even.powerdns.com."), 0xffff, false), 1);
+  BOOST_CHECK_EQUAL(rpc.size(), 49);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
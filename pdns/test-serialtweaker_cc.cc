@@ -0,0 +1,59 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include "arguments.hh"
+#include "dnssecinfra.hh"
+#include "dnsseckeeper.hh"
+#include "dnspacket.hh"
+#include "dnsparser.hh"
+#include "dnsrecords.hh"
+
+BOOST_AUTO_TEST_SUITE(serialtweaker_cc)
+
+static uint32_t getSerialOnTheWire(const DNSResourceRecord& rr)
+{
+  DNSPacket q;
+  q.setQuestion(Opcode::Query, rr.qname, QType::SOA);
+  std::unique_ptr<DNSPacket> r(q.replyPacket());
+  r->setMaxReplyLen(512);
+  r->addRecord(rr);
+  r->wrapup();
+
+  MOADNSParser mdp(r->getString());
+  for(const auto& answer : mdp.d_answers) {
+    if(answer.first.d_type == QType::SOA)
+      return std::dynamic_pointer_cast<SOARecordContent>(answer.first.d_content)->d_st.serial;
+  }
+  BOOST_FAIL("no SOA in the answer");
+  return 0;
+}
+
+BOOST_AUTO_TEST_CASE(test_editSOARecord) {
+  reportAllTypes();
+  ::arg().setSwitch("no-shuffle","Set this to prevent random shuffling of answers - for regression testing")="off";
+
+  DNSResourceRecord rr;
+  rr.qname=DNSName("example.com.");
+  rr.qtype=QType::SOA;
+  rr.ttl=3600;
+  rr.content="ns1.example.com. hostmaster.example.com. 1 10800 3600 604800 3600";
+  // like the bind backend and the query cache hand it out
+  BOOST_REQUIRE(rr.parseContent());
+  BOOST_CHECK_EQUAL(getSerialOnTheWire(rr), 1);
+
+  BOOST_CHECK(!editSOARecord(rr, ""));
+  BOOST_CHECK_EQUAL(getSerialOnTheWire(rr), 1);
+
+  BOOST_REQUIRE(editSOARecord(rr, "INCEPTION-EPOCH"));
+  BOOST_CHECK_EQUAL(getSerialOnTheWire(rr), getStartOfWeek());
+
+  BOOST_REQUIRE(rr.parseContent());
+  BOOST_REQUIRE(increaseSOARecord(rr, "INCREASE", ""));
+  BOOST_CHECK_EQUAL(getSerialOnTheWire(rr), getStartOfWeek() + 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -12,6 +12,7 @@
 #include "misc.hh"
 #include "dns.hh"
 #include "statbag.hh"
+#include "qtype.hh"
 
 using std::string;
 
@@ -31,6 +32,16 @@ static void *threadMangler2(void* a)
   return 0;
 }
 
+static void *ringMangler(void* a)
+{
+  StatBag* S = (StatBag*)a;
+  for(unsigned int n=0; n < 100000; ++n) {
+    S->ringAccount("questions", DNSName("www.example.com."), QType::A);
+    S->ringAccount("questions", DNSName(std::to_string(n % 10) + ".example.net."), QType::AAAA);
+  }
+  return 0;
+}
+
 
 
 BOOST_AUTO_TEST_SUITE(misc_hh)
@@ -104,6 +115,59 @@ BOOST_AUTO_TEST_CASE(test_StatBagBasic) {
 #endif
 }
 
+BOOST_AUTO_TEST_CASE(test_StatBagQuestionRing) {
+  StatBag s;
+  s.declareQuestionRing("questions", "Questions", 1000);
+  s.declareComboRing("remotes", "Remotes", 10);
+  BOOST_CHECK(s.ringExists("questions"));
+  BOOST_CHECK(s.ringExists("remotes"));
+  BOOST_CHECK_EQUAL(s.getRingTitle("questions"), "Questions");
+
+  // nothing is accounted until rings are enabled
+  s.ringAccount("questions", DNSName("www.example.com."), QType::A);
+  BOOST_CHECK(s.getRing("questions").empty());
+  s.doRings();
+
+  pthread_t tid[4];
+  for(int i=0; i < 4; ++i)
+    pthread_create(&tid[i], 0, ringMangler, (void*)&s);
+  void* res;
+  for(int i=0; i < 4 ; ++i)
+    pthread_join(tid[i], &res);
+
+  // each thread keeps its own last 1000
+  auto ring = s.getRing("questions");
+  BOOST_REQUIRE_EQUAL(ring.size(), 11);
+  BOOST_CHECK_EQUAL(ring.at(0).first, "www.example.com./A");
+  BOOST_CHECK_EQUAL(ring.at(0).second, 4*500);
+  unsigned int total = 0;
+  for(const auto& entry : ring)
+    total += entry.second;
+  BOOST_CHECK_EQUAL(total, 4*1000);
+
+  s.ringAccount("questions", DNSName("servfail.example.org."));
+  for(unsigned int n=0; n < 20; ++n)
+    s.ringAccount("remotes", ComboAddress("192.0.2." + std::to_string(n % 2 + 1)));
+  ring = s.getRing("remotes");
+  BOOST_REQUIRE_EQUAL(ring.size(), 2);
+  BOOST_CHECK_EQUAL(ring.at(0).second + ring.at(1).second, 10);
+
+  s.resetRing("questions");
+  BOOST_CHECK(s.getRing("questions").empty());
+  s.ringAccount("questions", DNSName("servfail.example.org."));
+  ring = s.getRing("questions");
+  BOOST_REQUIRE_EQUAL(ring.size(), 1);
+  BOOST_CHECK_EQUAL(ring.at(0).first, "servfail.example.org.");
+
+  s.resizeRing("questions", 5);
+  BOOST_CHECK_EQUAL(s.getRingSize("questions"), 5);
+  for(unsigned int n=0; n < 20; ++n)
+    s.ringAccount("questions", DNSName("www.example.com."), QType::MX);
+  ring = s.getRing("questions");
+  BOOST_REQUIRE_EQUAL(ring.size(), 1);
+  BOOST_CHECK_EQUAL(ring.at(0).first, "www.example.com./MX");
+  BOOST_CHECK_EQUAL(ring.at(0).second, 5);
+}
 
 BOOST_AUTO_TEST_SUITE_END()
 
@@ -491,7 +491,14 @@ void UeberBackend::addCache(const Question &q, const vector<DNSResourceRecord> &
      return;
   }
 
-  PC.insert(q.qname, q.qtype, PacketCache::QUERYCACHE, rrs, store_ttl, q.zoneId);
+  // parse the content once here, so answers coming from the query cache can skip it
+  vector<DNSResourceRecord> parsed(rrs);
+  for(DNSResourceRecord& rr : parsed) {
+    if(!rr.getParsedContent())
+      rr.parseContent();
+  }
+
+  PC.insert(q.qname, q.qtype, PacketCache::QUERYCACHE, parsed, store_ttl, q.zoneId);
 }
 
 void UeberBackend::alsoNotifies(const DNSName &domain, set<string> *ips)
@@ -640,6 +647,7 @@ bool UeberBackend::handle::get(DNSResourceRecord &r)
 {
   DLOG(L << "Ueber get() was called for a "<<qtype.getName()<<" record" << endl);
   bool isMore=false;
+  r.parsed.reset(); // backends that don't fill this in must not leave a previous one around
   while(d_hinterBackend && !(isMore=d_hinterBackend->get(r))) { // this backend out of answers
     if(i<parent->backends.size()) {
       DLOG(L<<"Backend #"<<i<<" of "<<parent->backends.size()
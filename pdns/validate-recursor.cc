@@ -1,6 +1,7 @@
 #include "validate.hh"
 #include "validate-recursor.hh"
 #include "syncres.hh"
+#include <boost/functional/hash.hpp>
 
 DNSSECMode g_dnssecmode{DNSSECMode::Process};
 
@@ -17,11 +18,102 @@ public:
     sr.d_doDNSSEC=true;
     sr.beginResolve(qname, QType(qtype), 1, ret);
     d_queries += sr.d_outqueries;
+    if(ret.empty())
+      d_failed=true;
+    for(const auto& rec : ret) {
+      d_minTTL = std::min(d_minTTL, rec.d_ttl);
+      if(rec.d_type == QType::RRSIG)
+        d_minSigExpire = std::min(d_minSigExpire, getRR<RRSIGRecordContent>(rec)->d_sigexpire);
+    }
     return ret;
   }
   int d_queries{0};
+  /* what the outcome of a chain walk can be trusted for: the lowest TTL and signature expiration seen */
+  uint32_t d_minTTL{std::numeric_limits<uint32_t>::max()};
+  uint32_t d_minSigExpire{std::numeric_limits<uint32_t>::max()};
+  bool d_failed{false};
+};
+
+/* The result of walking the DS/DNSKEY chain down to a zone, so that the next response signed by that zone
+   only costs a lookup. A Secure entry is kept no longer than the lowest TTL and signature expiration of
+   the DNSKEY, DS and RRSIG records it was derived from, other states at most s_failedKeysetTTL seconds
+   if the walk ran into a resolution failure, as that might be transient. */
+struct KeysetCacheEntry
+{
+  keyset_t keys;
+  vState state;
+  time_t expires;
 };
+typedef std::unordered_map<DNSName, KeysetCacheEntry, boost::hash<DNSName>> keysetcache_t;
 
+static const uint32_t s_failedKeysetTTL = 60;
+static const size_t s_maxKeysetCacheEntries = 10000;
+static __thread keysetcache_t* t_keysetCache;
+static __thread SignatureVerificationCache* t_sigCache;
+
+static vState getCachedKeysFor(const DNSName& zone, keyset_t& keyset)
+{
+  const time_t now = time(0);
+  if(!t_keysetCache)
+    t_keysetCache = new keysetcache_t();
+
+  auto it = t_keysetCache->find(zone);
+  if(it != t_keysetCache->end() && it->second.expires > now) {
+    g_stats.dnssecKeysetCacheHits++;
+    keyset.insert(it->second.keys.cbegin(), it->second.keys.cend());
+    return it->second.state;
+  }
+  g_stats.dnssecKeysetCacheMisses++;
+
+  SRRecordOracle sro;
+  keyset_t keys;
+  vState state = getKeysFor(sro, zone, keys);
+
+  uint32_t ttl = std::min(sro.d_minTTL, SyncRes::s_maxcachettl);
+  if(sro.d_failed || state == Bogus || state == Indeterminate)
+    ttl = std::min(ttl, s_failedKeysetTTL);
+  time_t expires = std::min(now + ttl, (time_t) sro.d_minSigExpire);
+
+  if(expires > now) {
+    if(t_keysetCache->size() >= s_maxKeysetCacheEntries) {
+      for(auto iter = t_keysetCache->begin(); iter != t_keysetCache->end(); ) {
+        if(iter->second.expires <= now)
+          iter = t_keysetCache->erase(iter);
+        else
+          ++iter;
+      }
+      if(t_keysetCache->size() >= s_maxKeysetCacheEntries)
+        t_keysetCache->clear();
+    }
+    KeysetCacheEntry& entry = (*t_keysetCache)[zone];
+    entry.keys = keys;
+    entry.state = state;
+    entry.expires = expires;
+  }
+
+  keyset.insert(keys.cbegin(), keys.cend());
+  return state;
+}
+
+uint64_t wipeValidationCaches(const DNSName& canon)
+{
+  uint64_t count = 0;
+  /* the chain of trust of a zone goes through all of its parents, so wiping a name also invalidates the keysets below it */
+  if(t_keysetCache) {
+    for(auto iter = t_keysetCache->begin(); iter != t_keysetCache->end(); ) {
+      if(iter->first.isPartOf(canon)) {
+        iter = t_keysetCache->erase(iter);
+        count++;
+      }
+      else
+        ++iter;
+    }
+  }
+  /* verified signatures are only known by a hash of the data, the signature and the key, not by name */
+  if(t_sigCache)
+    t_sigCache->clear();
+  return count;
+}
 
 vState validateRecords(const vector<DNSRecord>& recs)
 {
@@ -33,24 +125,29 @@ vState validateRecords(const vector<DNSRecord>& recs)
     numsigs+= csp.second.signatures.size();
   }
    
-  set<DNSKEYRecordContent> keys;
+  keyset_t keys;
   cspmap_t validrrsets;
 
-  SRRecordOracle sro;
-
   if(numsigs) {
+    set<DNSName> signers;
     for(const auto& csp : cspmap) {
       for(const auto& sig : csp.second.signatures) {
-	getKeysFor(sro, sig->d_signer, keys); // XXX check validity here
+        if(signers.insert(sig->d_signer).second)
+	  getCachedKeysFor(sig->d_signer, keys); // XXX check validity here
 	//	cerr<<"! state = "<<vStates[state]<<", now have "<<keys.size()<<" keys"<<endl;
       }
     }
 
-    validateWithKeySet(cspmap, validrrsets, keys);
+    if(!t_sigCache)
+      t_sigCache = new SignatureVerificationCache();
+    const uint64_t hits = t_sigCache->d_hits, misses = t_sigCache->d_misses;
+    validateWithKeySet(cspmap, validrrsets, keys, t_sigCache);
+    g_stats.dnssecSignatureCacheHits += t_sigCache->d_hits - hits;
+    g_stats.dnssecSignatureCacheMisses += t_sigCache->d_misses - misses;
   }
   else {
     //    cerr<<"no sigs, hoping for Insecure"<<endl;
-    vState state = getKeysFor(sro, recs.begin()->d_name, keys); // um WHAT DOES THIS MEAN - try first qname??
+    vState state = getCachedKeysFor(recs.begin()->d_name, keys); // um WHAT DOES THIS MEAN - try first qname??
     //    cerr<<"! state = "<<vStates[state]<<", now have "<<keys.size()<<" keys "<<endl;
     return state;
   }
@@ -64,7 +161,6 @@ vState validateRecords(const vector<DNSRecord>& recs)
       //      cerr<<"\t% > "<<(*j)->getZoneRepresentation()<<endl;
     }
   }
-  //  cerr<<"Took "<<sro.d_queries<<" queries"<<endl;
   if(validrrsets.size() == cspmap.size())
     return Secure;
   return Insecure;
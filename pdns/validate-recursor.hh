@@ -4,6 +4,8 @@
 #include "validate.hh"
 
 vState validateRecords(const vector<DNSRecord>& recs);
+/* for the calling thread, has validation forget what it learned about the chain of trust of canon and the zones below it */
+uint64_t wipeValidationCaches(const DNSName& canon);
 
 /* Off: 3.x behaviour, we do no DNSSEC, no EDNS
    Process: we gather DNSSEC records on all queries, of you do do=1, we'll validate for you (unless you set cd=1)
@@ -3,6 +3,7 @@
 #include "dnssecinfra.hh"
 #include "rec-lua-conf.hh"
 #include "base32.hh"
+#include "sha.hh"
 
 void dotEdge(DNSName zone, string type1, DNSName name1, string tag1, string type2, DNSName name2, string tag2, string color="");
 void dotNode(string type, DNSName name, string tag, string content);
@@ -12,7 +13,6 @@ string dotEscape(string name);
 const char *dStates[]={"nodata", "nxdomain", "empty non-terminal", "insecure (no-DS proof)"};
 const char *vStates[]={"Indeterminate", "Bogus", "Insecure", "Secure"};
 
-typedef set<DNSKEYRecordContent> keyset_t;
 vector<DNSKEYRecordContent> getByTag(const keyset_t& keys, uint16_t tag)
 {
   vector<DNSKEYRecordContent> ret;
@@ -73,7 +73,45 @@ static dState getDenial(cspmap_t &validrrsets, DNSName qname, uint16_t qtype)
   return ret;
 }
 
-void validateWithKeySet(const cspmap_t& rrsets, cspmap_t& validated, const keyset_t& keys)
+string SignatureVerificationCache::getKey(const string& msg, const RRSIGRecordContent& signature, const DNSKEYRecordContent& key)
+{
+  SHA256Summer summer;
+  summer.feed(msg);
+  summer.feed(signature.d_signature);
+  const char algorithm = key.d_algorithm;
+  summer.feed(&algorithm, 1);
+  summer.feed(key.d_key);
+  return summer.get();
+}
+
+bool SignatureVerificationCache::isValid(const string& key, uint32_t now)
+{
+  auto it = d_entries.find(key);
+  if(it == d_entries.end() || it->second <= now) {
+    d_misses++;
+    return false;
+  }
+  d_hits++;
+  return true;
+}
+
+void SignatureVerificationCache::insert(const string& key, uint32_t expire, uint32_t now)
+{
+  if(d_entries.size() >= d_maxEntries) {
+    for(auto it = d_entries.begin(); it != d_entries.end(); ) {
+      if(it->second <= now)
+        it = d_entries.erase(it);
+      else
+        ++it;
+    }
+    // nothing expired, start over rather than spend time picking victims
+    if(d_entries.size() >= d_maxEntries)
+      d_entries.clear();
+  }
+  d_entries[key] = expire;
+}
+
+void validateWithKeySet(const cspmap_t& rrsets, cspmap_t& validated, const keyset_t& keys, SignatureVerificationCache* sigCache)
 {
   validated.clear();
   /*  cerr<<"Validating an rrset with following keys: "<<endl;
@@ -97,8 +135,18 @@ void validateWithKeySet(const cspmap_t& rrsets, cspmap_t& validated, const keyse
 	bool isValid = false;
 	try {
 	  unsigned int now=time(0);
-	  if(signature->d_siginception < now && signature->d_sigexpire > now)
-	    isValid = DNSCryptoKeyEngine::makeFromPublicKeyString(l.d_algorithm, l.d_key)->verify(msg, signature->d_signature);
+	  if(signature->d_siginception < now && signature->d_sigexpire > now) {
+	    string cacheKey;
+	    if(sigCache) {
+	      cacheKey = SignatureVerificationCache::getKey(msg, *signature, l);
+	      isValid = sigCache->isValid(cacheKey, now);
+	    }
+	    if(!isValid) {
+	      isValid = DNSCryptoKeyEngine::makeFromPublicKeyString(l.d_algorithm, l.d_key)->verify(msg, signature->d_signature);
+	      if(isValid && sigCache)
+	        sigCache->insert(cacheKey, signature->d_sigexpire, now);
+	    }
+	  }
 	  else
 	    ; // cerr<<"signature is expired/not yet valid ";
 	}
@@ -3,6 +3,7 @@
 #include "dnsparser.hh"
 #include "dnsname.hh"
 #include <vector>
+#include <unordered_map>
 #include "namespaces.hh"
 #include "dnsrecords.hh"
  
@@ -29,7 +30,34 @@ struct ContentSigPair
   // ponder adding a validate method that accepts a key
 };
 typedef map<pair<DNSName,uint16_t>, ContentSigPair> cspmap_t;
-void validateWithKeySet(const cspmap_t& rrsets, cspmap_t& validated, const std::set<DNSKEYRecordContent>& keys);
+typedef std::set<DNSKEYRecordContent> keyset_t;
+
+/* Remembers which (RRset, RRSIG, DNSKEY) combinations verified fine, so that the same signature is not
+   checked over and over again. Entries are keyed on a SHA-256 of the signed data, the signature and the
+   key, and kept until the signature expires. Not thread safe. */
+class SignatureVerificationCache
+{
+public:
+  SignatureVerificationCache(size_t maxEntries=100000) : d_maxEntries(maxEntries)
+  {}
+  static std::string getKey(const std::string& msg, const RRSIGRecordContent& signature, const DNSKEYRecordContent& key);
+  bool isValid(const std::string& key, uint32_t now);
+  void insert(const std::string& key, uint32_t expire, uint32_t now);
+  size_t size() const
+  {
+    return d_entries.size();
+  }
+  void clear()
+  {
+    d_entries.clear();
+  }
+  uint64_t d_hits{0}, d_misses{0};
+private:
+  std::unordered_map<std::string, uint32_t> d_entries;
+  size_t d_maxEntries;
+};
+
+void validateWithKeySet(const cspmap_t& rrsets, cspmap_t& validated, const std::set<DNSKEYRecordContent>& keys, SignatureVerificationCache* sigCache=nullptr);
 cspmap_t harvestCSPFromRecs(const vector<DNSRecord>& recs);
 vState getKeysFor(DNSRecordOracle& dro, const DNSName& zone, std::set<DNSKEYRecordContent> &keyset);
 